@@ -12,6 +12,7 @@
 #include "nix/expr/eval-gc.hh"
 #include "nix/expr/eval-inline.hh"
 #include "nix/expr/eval-settings.hh"
+#include "nix/util/environment-variables.hh"
 
 #include "nix/store/tests/libstore.hh"
 
@@ -37,6 +38,7 @@ protected:
         : LibExprTest(openStore("dummy://"), [](bool & readOnlyMode) {
             EvalSettings settings{readOnlyMode};
             settings.nixPath = {};
+            settings.evalBytecode = getEnv("_NIX_TEST_EVAL_BYTECODE") == "1";
             return settings;
         })
     {
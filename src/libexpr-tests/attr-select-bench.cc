@@ -0,0 +1,107 @@
+#include <benchmark/benchmark.h>
+#include "nix/expr/eval.hh"
+#include "nix/expr/eval-settings.hh"
+#include "nix/fetchers/fetch-settings.hh"
+#include "nix/store/store-open.hh"
+
+using namespace nix;
+
+/**
+ * Look up a few attributes in a nixpkgs-sized attribute set, either
+ * with a plain binary search (`range(0) == 0`) or through the inline
+ * cache of a selection site (`range(0) == 1`).
+ */
+static void BM_AttrLookup(benchmark::State & bstate)
+{
+    bool readOnlyMode = true;
+    fetchers::Settings fetchSettings{};
+    EvalSettings evalSettings{readOnlyMode};
+    evalSettings.nixPath = {};
+
+    auto state = std::make_shared<EvalState>(LookupPath{}, openStore("dummy://"), fetchSettings, evalSettings);
+
+    constexpr int nrAttrs = 20000;
+
+    auto attrs = state->buildBindings(nrAttrs);
+    for (int i = 0; i < nrAttrs; ++i)
+        attrs.alloc(fmt("p%d", i)).mkInt(i);
+    auto bindings = attrs.finish();
+
+    std::vector<Symbol> names;
+    for (int i = 0; i < nrAttrs; i += nrAttrs / 16)
+        names.push_back(state->symbols.create(fmt("p%d", i)));
+    std::vector<uint32_t> caches(names.size(), UINT32_MAX);
+
+    bool cached = bstate.range(0);
+
+    for (auto _ : bstate) {
+        for (size_t i = 0; i < names.size(); ++i) {
+            bool hit;
+            auto attr = cached ? bindings->get(names[i], caches[i], hit) : bindings->get(names[i]);
+            benchmark::DoNotOptimize(attr);
+        }
+    }
+
+    bstate.SetItemsProcessed(bstate.iterations() * names.size());
+}
+
+/**
+ * Repeatedly select attributes from a nixpkgs-like package set, in
+ * the style of `pkgs.stdenv.cc` in package definitions. Reports the
+ * hit rate of the inline caches.
+ */
+static void BM_EvalSelectNixpkgs(benchmark::State & bstate)
+{
+    bool readOnlyMode = true;
+    fetchers::Settings fetchSettings{};
+    EvalSettings evalSettings{readOnlyMode};
+    evalSettings.nixPath = {};
+
+    auto state = std::make_shared<EvalState>(LookupPath{}, openStore("dummy://"), fetchSettings, evalSettings);
+
+    constexpr int nrSelects = 100000;
+
+    auto expr = state->parseExprFromString(
+        fmt(R"(
+            let
+              lib = { versions = { major = v: v; }; optional = c: x: if c then [ x ] else [ ]; };
+              pkgs = builtins.listToAttrs (builtins.genList (i: { name = "p${toString i}"; value = { inherit i; }; }) 20000)
+                // {
+                  inherit lib;
+                  stdenv = { cc = { version = 13; }; hostPlatform = { isLinux = true; }; };
+                  zlib = { i = 1; };
+                };
+            in
+            builtins.foldl' (acc: i:
+              acc
+              + pkgs.stdenv.cc.version
+              + pkgs.zlib.i
+              + pkgs.p1234.i
+              + (if pkgs.stdenv.hostPlatform.isLinux then pkgs.lib.versions.major 1 else 0)
+              + (if pkgs ? zlib then 1 else 0)
+            ) 0 (builtins.genList (i: i) %d)
+        )",
+            nrSelects),
+        state->rootPath(CanonPath::root));
+
+    bool statsEnabled = Counter::enabled;
+    Counter::enabled = true;
+    auto hits = state->nrInlineCacheHits.load();
+    auto misses = state->nrInlineCacheMisses.load();
+
+    for (auto _ : bstate) {
+        Value v;
+        state->eval(expr, v);
+        benchmark::DoNotOptimize(v);
+    }
+
+    hits = state->nrInlineCacheHits.load() - hits;
+    misses = state->nrInlineCacheMisses.load() - misses;
+    Counter::enabled = statsEnabled;
+
+    bstate.counters["hitRate"] = hits + misses ? (double) hits / (hits + misses) : 0;
+    bstate.SetItemsProcessed(bstate.iterations() * nrSelects);
+}
+
+BENCHMARK(BM_AttrLookup)->Arg(0)->Arg(1);
+BENCHMARK(BM_EvalSelectNixpkgs)->Unit(benchmark::kMillisecond);
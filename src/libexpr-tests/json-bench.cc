@@ -0,0 +1,131 @@
+#include <benchmark/benchmark.h>
+#include "nix/expr/eval.hh"
+#include "nix/expr/eval-settings.hh"
+#include "nix/expr/json-to-value.hh"
+#include "nix/expr/value-to-json.hh"
+#include "nix/fetchers/fetch-settings.hh"
+#include "nix/store/store-open.hh"
+#include "nix/util/serialise.hh"
+
+#include <nlohmann/json.hpp>
+
+#include <thread>
+
+using namespace nix;
+
+static const int64_t maxCores = std::max(1u, std::thread::hardware_concurrency());
+
+/**
+ * Generate a document of about `size` bytes shaped like an npm
+ * `package-lock.json`, the kind of file that `builtins.fromJSON`
+ * reads when importing lock files.
+ */
+static std::string makeLockFile(size_t size)
+{
+    std::string s = "{\n  \"name\": \"bench\",\n  \"lockfileVersion\": 3,\n  \"packages\": {\n";
+    for (size_t i = 0; s.size() < size; ++i) {
+        if (i)
+            s += ",\n";
+        s += fmt(
+            R"(    "node_modules/pkg-%1%": {
+      "version": "1.%2%.%3%",
+      "resolved": "https://registry.npmjs.org/pkg-%1%/-/pkg-%1%-1.%2%.%3%.tgz",
+      "integrity": "sha512-%4%==",
+      "dev": %5%,
+      "license": "MIT",
+      "engines": { "node": ">=14.17" },
+      "dependencies": { "dep-%2%": "^2.0.0", "dep-%3%": "~1.%3%.0", "unicode-é→": "1.0.0" }
+    })",
+            i,
+            i % 17,
+            i % 101,
+            std::string(84, 'A' + i % 26),
+            i % 2 ? "true" : "false");
+    }
+    s += "\n  }\n}\n";
+    return s;
+}
+
+/**
+ * Parse a lock file of `range(0)` MiB into Nix values with
+ * `parseJSON()` (`range(1) == 0`), or into an `nlohmann::json` with the
+ * parser that `builtins.fromJSON` used before (`range(1) == 1`), which
+ * doesn't include building the values.
+ */
+static void BM_ParseJSON(benchmark::State & bstate)
+{
+    bool readOnlyMode = true;
+    fetchers::Settings fetchSettings{};
+    EvalSettings evalSettings{readOnlyMode};
+    evalSettings.nixPath = {};
+
+    auto state = std::make_shared<EvalState>(LookupPath{}, openStore("dummy://"), fetchSettings, evalSettings);
+
+    auto doc = makeLockFile(bstate.range(0) << 20);
+
+    for (auto _ : bstate) {
+        if (bstate.range(1) == 0) {
+            Value v;
+            parseJSON(*state, doc, v);
+            benchmark::DoNotOptimize(v);
+        } else {
+            auto json = nlohmann::json::parse(doc);
+            benchmark::DoNotOptimize(json);
+        }
+    }
+
+    bstate.SetBytesProcessed(bstate.iterations() * doc.size());
+}
+
+/**
+ * Serialize a package-set-like attrset with `range(0)` evaluator
+ * threads, streaming to a sink (`range(1) == 0`) or through an
+ * `nlohmann::json` as `builtins.toJSON` did before (`range(1) == 1`).
+ */
+static void BM_PrintValueAsJSON(benchmark::State & bstate)
+{
+    bool readOnlyMode = true;
+    fetchers::Settings fetchSettings{};
+    EvalSettings evalSettings{readOnlyMode};
+    evalSettings.nixPath = {};
+    evalSettings.evalCores = bstate.range(0);
+
+    auto state = std::make_shared<EvalState>(LookupPath{}, openStore("dummy://"), fetchSettings, evalSettings);
+
+    auto expr = state->parseExprFromString(
+        R"(
+            builtins.listToAttrs (builtins.genList (i: {
+              name = "pkg-${toString i}";
+              value = {
+                pname = "pkg-${toString i}";
+                version = "1.${toString i}.0";
+                meta = { description = "Package number ${toString i}"; licenses = [ "mit" "asl20" ]; priority = i; };
+              };
+            }) 100000)
+        )",
+        state->rootPath(CanonPath::root));
+
+    size_t bytes = 0;
+
+    for (auto _ : bstate) {
+        Value v;
+        state->eval(expr, v);
+        NixStringContext context;
+        if (bstate.range(1) == 0) {
+            StringSink sink;
+            printValueAsJSON(*state, true, v, noPos, sink, context, false);
+            bytes = sink.s.size();
+        } else {
+            auto json = printValueAsJSON(*state, true, v, noPos, context, false).dump();
+            bytes = json.size();
+        }
+    }
+
+    bstate.SetBytesProcessed(bstate.iterations() * bytes);
+}
+
+BENCHMARK(BM_ParseJSON)->ArgsProduct({{1, 10, 100}, {0, 1}})->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_PrintValueAsJSON)
+    ->ArgsProduct({{1, maxCores}, {0, 1}})
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
@@ -1,6 +1,13 @@
 #include "nix/expr/tests/libexpr.hh"
 #include "nix/expr/value-to-json.hh"
+#include "nix/expr/json-to-value.hh"
 #include "nix/expr/static-string-data.hh"
+#include "nix/util/serialise.hh"
+
+#include <bit>
+#include <random>
+
+#include <nlohmann/json.hpp>
 
 namespace nix {
 // Testing the conversion to JSON
@@ -67,6 +74,115 @@ TEST_F(JSONValueTest, StringQuotes)
     ASSERT_EQ(getJSONValue(v), "\"test\\\"\"");
 }
 
+TEST_F(JSONValueTest, StringEscapes)
+{
+    Value v;
+    v.mkStringNoCopy("\b\f\n\r\t\x01\x1f\x7f\\ caf\u00e9"_sds);
+    ASSERT_EQ(getJSONValue(v), "\"\\b\\f\\n\\r\\t\\u0001\\u001f\x7f\\\\ caf\u00e9\"");
+}
+
+TEST_F(JSONValueTest, StringInvalidUTF8)
+{
+    Value v;
+    v.mkStringNoCopy("ab\xe2\x28"_sds);
+    ASSERT_THROW(getJSONValue(v), JSONSerializationError);
+    v.mkStringNoCopy("ab\xe2\x82"_sds);
+    ASSERT_THROW(getJSONValue(v), JSONSerializationError);
+}
+
+TEST_F(JSONValueTest, Float)
+{
+    Value v;
+    v.mkFloat(1.5);
+    ASSERT_EQ(getJSONValue(v), "1.5");
+    v.mkFloat(100.0);
+    ASSERT_EQ(getJSONValue(v), "100.0");
+    v.mkFloat(1e100);
+    ASSERT_EQ(getJSONValue(v), "1e+100");
+    v.mkFloat(-0.0001);
+    ASSERT_EQ(getJSONValue(v), "-0.0001");
+    v.mkFloat(std::numeric_limits<NixFloat>::infinity());
+    ASSERT_EQ(getJSONValue(v), "null");
+}
+
+TEST_F(JSONValueTest, FloatSameAsNlohmann)
+{
+    std::vector<NixFloat> fs = {
+        0.0,
+        -0.0,
+        0.1,
+        1.0 / 3,
+        123456789012345678.0,
+        std::numeric_limits<NixFloat>::min(),
+        std::numeric_limits<NixFloat>::max(),
+        std::numeric_limits<NixFloat>::denorm_min(),
+        std::numeric_limits<NixFloat>::epsilon(),
+    };
+    std::mt19937_64 gen(42);
+    for (int i = 0; i < 10000; ++i) {
+        auto f = std::bit_cast<NixFloat>(gen());
+        if (std::isfinite(f))
+            fs.push_back(f);
+    }
+    Value v;
+    for (auto f : fs) {
+        v.mkFloat(f);
+        ASSERT_EQ(getJSONValue(v), nlohmann::json(f).dump()) << f;
+    }
+}
+
+TEST_F(JSONValueTest, Nested)
+{
+    auto v = eval(R"({ b = [ 1 null { } [ ] ]; a = { y = true; x = "s"; }; })");
+    ASSERT_EQ(getJSONValue(v), R"({"a":{"x":"s","y":true},"b":[1,null,{},[]]})");
+}
+
+/**
+ * Serializing with several evaluator threads splits large values into
+ * chunks, which must be stitched together in order.
+ */
+class ParallelJSONValueTest : public LibExprTest
+{
+protected:
+    ParallelJSONValueTest()
+        : LibExprTest(openStore("dummy://"), [](bool & readOnlyMode) {
+            EvalSettings settings{readOnlyMode};
+            settings.nixPath = {};
+            settings.evalCores = 4;
+            return settings;
+        })
+    {
+    }
+};
+
+TEST_F(ParallelJSONValueTest, SameAsSequential)
+{
+    auto v = eval(R"(
+        builtins.listToAttrs (builtins.genList (i: {
+          name = "a${toString i}";
+          value = builtins.genList (j: { x = i * j; s = "${toString i}-${toString j}"; }) (i - i / 10 * 10);
+        }) 1000)
+    )");
+    NixStringContext context;
+    auto expected = printValueAsJSON(state, true, v, noPos, context).dump();
+    StringSink sink;
+    printValueAsJSON(state, true, v, noPos, sink, context);
+    ASSERT_EQ(sink.s, expected);
+}
+
+TEST_F(ParallelJSONValueTest, Error)
+{
+    auto v = eval(R"(builtins.genList (i: if i == 567 then throw "bad element" else i) 1000)");
+    NixStringContext context;
+    StringSink sink;
+    try {
+        printValueAsJSON(state, true, v, noPos, sink, context);
+        FAIL() << "expected an error";
+    } catch (Error & e) {
+        ASSERT_THAT(e.msg(), testing::HasSubstr("bad element"));
+    }
+}
+
 // The dummy store doesn't support writing files. Fails with this exception message:
 // C++ exception with description "error: operation 'addToStoreFromDump' is
 // not supported by store 'dummy'" thrown in the test body.
@@ -76,4 +192,69 @@ TEST_F(JSONValueTest, DISABLED_Path)
     v.mkPath(state.rootPath(CanonPath("/test")), state.mem);
     ASSERT_EQ(getJSONValue(v), "\"/nix/store/g1w7hy3qg1w7hy3qg1w7hy3qg1w7hy3q-x\"");
 }
+
+// Testing the conversion from JSON
+
+class JSONParseTest : public LibExprTest
+{
+protected:
+    Value parse(std::string_view s)
+    {
+        Value v;
+        parseJSON(state, s, v);
+        return v;
+    }
+};
+
+TEST_F(JSONParseTest, DuplicateKeys)
+{
+    auto v = parse(R"({"b": 1, "a": 2, "b": 3})");
+    ASSERT_THAT(v, IsAttrsOfSize(2));
+    ASSERT_THAT(*v.attrs()->get(state.symbols.create("a"))->value, IsIntEq(2));
+    ASSERT_THAT(*v.attrs()->get(state.symbols.create("b"))->value, IsIntEq(3));
+}
+
+TEST_F(JSONParseTest, Numbers)
+{
+    ASSERT_THAT(parse("-9223372036854775808"), IsIntEq(std::numeric_limits<NixInt::Inner>::min()));
+    ASSERT_THAT(parse("9223372036854775807"), IsIntEq(std::numeric_limits<NixInt::Inner>::max()));
+    // Integers that don't fit in 64 bits become floats.
+    ASSERT_THAT(parse("-9223372036854775809"), IsFloatEq(-9223372036854775809.0));
+    ASSERT_THAT(parse("1.5e3"), IsFloatEq(1500.0));
+    ASSERT_THROW(parse("18446744073709551615"), Error);
+    ASSERT_THROW(parse("01"), JSONParseError);
+    ASSERT_THROW(parse("1."), JSONParseError);
+}
+
+TEST_F(JSONParseTest, Strings)
+{
+    ASSERT_THAT(parse(R"("plain")"), IsStringEq("plain"));
+    ASSERT_THAT(parse(R"("tab\tquote\"")"), IsStringEq("tab\tquote\""));
+    ASSERT_THAT(parse(R"("\u00e9\ud83d\ude00")"), IsStringEq("\u00e9\U0001F600"));
+    ASSERT_THAT(parse("\"caf\u00e9 \xe2\x86\x92\""), IsStringEq("caf\u00e9 \u2192"));
+    ASSERT_THROW(parse(R"("\ud83d")"), JSONParseError);
+    ASSERT_THROW(parse("\"\xc3\x28\""), JSONParseError);
+    ASSERT_THROW(parse("\"a\nb\""), JSONParseError);
+}
+
+TEST_F(JSONParseTest, Invalid)
+{
+    ASSERT_THROW(parse(""), JSONParseError);
+    ASSERT_THROW(parse("[1, 2"), JSONParseError);
+    ASSERT_THROW(parse("[1, 2,]"), JSONParseError);
+    ASSERT_THROW(parse(R"({"a" 1})"), JSONParseError);
+    ASSERT_THROW(parse("true false"), JSONParseError);
+}
+
+TEST_F(JSONParseTest, DeeplyNested)
+{
+    constexpr size_t depth = 100000;
+    auto v = parse(std::string(depth, '[') + std::string(depth, ']'));
+    for (size_t i = 1; i < depth; ++i) {
+        ASSERT_THAT(v, IsListOfSize(1));
+        v = *v.listView()[0];
+    }
+    ASSERT_THAT(v, IsListOfSize(0));
+}
+
 } /* namespace nix */
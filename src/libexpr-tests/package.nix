@@ -10,12 +10,15 @@
 
   rapidcheck,
   gtest,
+  gbenchmark,
+  wasmtime,
   runCommand,
 
   # Configuration Options
 
   version,
   resolvePath,
+  withBenchmarks ? false,
 }:
 
 let
@@ -33,7 +36,7 @@ mkMesonExecutable (finalAttrs: {
     ../../.version
     ./.version
     ./meson.build
-    # ./meson.options
+    ./meson.options
     (fileset.fileFilter (file: file.hasExt "cc") ./.)
     (fileset.fileFilter (file: file.hasExt "hh") ./.)
   ];
@@ -44,9 +47,14 @@ mkMesonExecutable (finalAttrs: {
     nix-expr-test-support
     rapidcheck
     gtest
+    wasmtime
+  ]
+  ++ lib.optionals withBenchmarks [
+    gbenchmark
   ];
 
   mesonFlags = [
+    (lib.mesonBool "benchmarks" withBenchmarks)
   ];
 
   passthru = {
@@ -64,6 +72,11 @@ mkMesonExecutable (finalAttrs: {
             + ''
               export _NIX_TEST_UNIT_DATA=${resolvePath ./data}
               ${stdenv.hostPlatform.emulator buildPackages} ${lib.getExe finalAttrs.finalPackage}
+            ''
+            + lib.optionalString withBenchmarks ''
+              ${stdenv.hostPlatform.emulator buildPackages} ${lib.getExe' finalAttrs.finalPackage "nix-expr-benchmarks"}
+            ''
+            + ''
               touch $out
             ''
           );
@@ -0,0 +1,88 @@
+#include <benchmark/benchmark.h>
+#include "nix/expr/eval.hh"
+#include "nix/expr/eval-settings.hh"
+#include "nix/expr/parallel-eval.hh"
+#include "nix/expr/value-to-json.hh"
+#include "nix/fetchers/fetch-settings.hh"
+#include "nix/store/store-open.hh"
+
+#include <thread>
+
+using namespace nix;
+
+static const int64_t maxCores = std::max(1u, std::thread::hardware_concurrency());
+
+/**
+ * Spawn a binary tree of small work items from within the executor,
+ * which mostly measures the overhead of spawning and stealing.
+ */
+static void BM_ExecutorSpawnTree(benchmark::State & bstate)
+{
+    bool readOnlyMode = true;
+    EvalSettings evalSettings{readOnlyMode};
+    evalSettings.evalCores = bstate.range(0);
+
+    Executor executor(evalSettings);
+
+    constexpr int depth = 14;
+
+    for (auto _ : bstate) {
+        FutureVector futures(executor);
+        std::atomic<uint64_t> sum{0};
+
+        std::function<void(int, uint64_t)> node = [&](int level, uint64_t n) {
+            uint64_t x = n;
+            for (int i = 0; i < 1000; ++i)
+                x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+            sum += x;
+            if (level < depth)
+                futures.spawn({
+                    {[&, level, n]() { node(level + 1, 2 * n); }, 0},
+                    {[&, level, n]() { node(level + 1, 2 * n + 1); }, 0},
+                });
+        };
+
+        futures.spawn(0, [&]() { node(0, 1); });
+        futures.finishAll();
+
+        benchmark::DoNotOptimize(sum.load());
+    }
+
+    bstate.SetItemsProcessed(bstate.iterations() * ((2 << depth) - 1));
+}
+
+/**
+ * Force the attributes of a large attribute set in parallel, as
+ * `nix eval --json` does.
+ */
+static void BM_ParallelForceDeep(benchmark::State & bstate)
+{
+    bool readOnlyMode = true;
+    fetchers::Settings fetchSettings{};
+    EvalSettings evalSettings{readOnlyMode};
+    evalSettings.nixPath = {};
+    evalSettings.evalCores = bstate.range(0);
+
+    auto state = std::make_shared<EvalState>(LookupPath{}, openStore("dummy://"), fetchSettings, evalSettings);
+
+    constexpr int nrAttrs = 5000;
+
+    auto expr = state->parseExprFromString(
+        fmt("builtins.listToAttrs (builtins.genList (i: { name = \"a${toString i}\"; "
+            "value = builtins.foldl' builtins.add 0 (builtins.genList (j: i * j) 200); }) %d)",
+            nrAttrs),
+        state->rootPath(CanonPath::root));
+
+    for (auto _ : bstate) {
+        Value v;
+        state->eval(expr, v);
+        NixStringContext context;
+        auto json = printValueAsJSON(*state, true, v, noPos, context, false);
+        benchmark::DoNotOptimize(json);
+    }
+
+    bstate.SetItemsProcessed(bstate.iterations() * nrAttrs);
+}
+
+BENCHMARK(BM_ExecutorSpawnTree)->RangeMultiplier(2)->Range(1, maxCores)->UseRealTime();
+BENCHMARK(BM_ParallelForceDeep)->RangeMultiplier(2)->Range(1, maxCores)->UseRealTime()->Unit(benchmark::kMillisecond);
@@ -987,6 +987,46 @@ TEST_F(PrimOpTest, match5)
     ASSERT_THAT(v, IsListOfSize(0));
 }
 
+TEST_F(PrimOpTest, matchLongString)
+{
+    // Used to overflow the stack of the backtracking std::regex matcher.
+    auto v = eval("builtins.match \"(a|b)*\" (builtins.concatStringsSep \"\" (builtins.genList (x: \"a\") 100000))");
+    ASSERT_THAT(v, IsListOfSize(1));
+    ASSERT_THAT(*v.listView()[0], IsStringEq("a"));
+}
+
+TEST_F(PrimOpTest, splitLongString)
+{
+    // v = [ "" [ "b" ] "" [ "b" ] ... "" ], split at every "ab"
+    auto v = eval(
+        "builtins.split \"a(b|c)\" (builtins.concatStringsSep \"\" (builtins.genList (x: \"ab\") 50000))");
+    ASSERT_THAT(v, IsListOfSize(100001));
+    ASSERT_THAT(*v.listView()[0], IsStringEq(""));
+    ASSERT_THAT(*v.listView()[1], IsListOfSize(1));
+    ASSERT_THAT(*v.listView()[1]->listView()[0], IsStringEq("b"));
+    ASSERT_THAT(*v.listView()[99999], IsListOfSize(1));
+    ASSERT_THAT(*v.listView()[100000], IsStringEq(""));
+}
+
+TEST_F(PrimOpTest, matchInvalid)
+{
+    ASSERT_THROW(eval("builtins.match \"(a\" \"a\""), EvalError);
+    ASSERT_THROW(eval("builtins.match \"[[:foo:]]\" \"a\""), EvalError);
+    ASSERT_THROW(eval("builtins.split \"*\" \"a\""), EvalError);
+}
+
+TEST_F(PrimOpTest, splitEmptyMatches)
+{
+    // v = [ "" [ ] "a" [ ] "b" [ ] "" ]
+    auto v = eval("builtins.split \"x*\" \"ab\"");
+    ASSERT_THAT(v, IsListOfSize(7));
+    ASSERT_THAT(*v.listView()[0], IsStringEq(""));
+    ASSERT_THAT(*v.listView()[1], IsListOfSize(0));
+    ASSERT_THAT(*v.listView()[2], IsStringEq("a"));
+    ASSERT_THAT(*v.listView()[4], IsStringEq("b"));
+    ASSERT_THAT(*v.listView()[6], IsStringEq(""));
+}
+
 TEST_F(PrimOpTest, attrNames)
 {
     auto v = eval("builtins.attrNames { x = 1; y = 2; z = 3; a = 2; }");
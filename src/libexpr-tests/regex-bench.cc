@@ -0,0 +1,123 @@
+#include <benchmark/benchmark.h>
+#include "nix/expr/eval.hh"
+#include "nix/expr/eval-settings.hh"
+#include "nix/expr/posix-regex.hh"
+#include "nix/fetchers/fetch-settings.hh"
+#include "nix/store/store-open.hh"
+
+#include <regex>
+
+using namespace nix;
+
+/**
+ * Regexes used by `builtins.match` in nixpkgs, with a string that
+ * matches and one that doesn't.
+ */
+static const struct
+{
+    const char * regex;
+    const char * matching;
+    const char * nonMatching;
+} matchCases[] = {
+    {".*-rc.*", "linux-6.12-rc3", "bootstrap-stage0-glibc-bootstrapFiles"},
+    {"[[:alnum:]+_?=-][[:alnum:]+._?=-]*", "bootstrap-stage0-glibc-bootstrapFiles", ".hidden"},
+    {"mirror://([a-z]+)/(.*)", "mirror://gnu/hello/hello-2.12.1.tar.gz", "https://ftp.gnu.org/gnu/hello"},
+    {"^([0-9][0-9\\.]*)(.*)$", "2.12.1pre20240101", "unstable-2024-01-01"},
+    {"(.*)e?abi.*", "gnueabihf", "x86_64-unknown-linux-gnu"},
+    {"(.+)+(.+)", "17.0.14+7", "1"},
+};
+
+/**
+ * Match with `PosixRegex` (`range(1) == 0`) or `std::regex`
+ * (`range(1) == 1`), which `builtins.match` used before, to compare.
+ */
+static void BM_RegexMatch(benchmark::State & bstate)
+{
+    auto & c = matchCases[bstate.range(0)];
+    bstate.SetLabel(c.regex);
+
+    if (bstate.range(1) == 0) {
+        PosixRegex regex(c.regex);
+        PosixRegex::Submatches match;
+        for (auto _ : bstate) {
+            benchmark::DoNotOptimize(regex.match(c.matching, &match));
+            benchmark::DoNotOptimize(regex.match(c.nonMatching, &match));
+        }
+    } else {
+        std::regex regex(c.regex, std::regex::extended);
+        std::cmatch match;
+        for (auto _ : bstate) {
+            benchmark::DoNotOptimize(std::regex_match(c.matching, match, regex));
+            benchmark::DoNotOptimize(std::regex_match(c.nonMatching, match, regex));
+        }
+    }
+
+    bstate.SetItemsProcessed(bstate.iterations() * 2);
+}
+
+static void matchArgs(benchmark::internal::Benchmark * b)
+{
+    for (int64_t i = 0; i < (int64_t) std::size(matchCases); ++i)
+        for (int64_t useStd = 0; useStd <= 1; ++useStd)
+            b->Args({i, useStd});
+}
+
+/**
+ * Find all the matches in a large string like `builtins.split`, which
+ * recursed once per character with `std::regex`.
+ */
+static void BM_RegexSearch(benchmark::State & bstate)
+{
+    std::string s;
+    for (int i = 0; i < 10000; ++i)
+        s += "  foo-bar = \"baz.qux\";\n";
+
+    PosixRegex regex("[[:space:]]+|([=;\"])");
+    PosixRegex::Submatches match;
+
+    for (auto _ : bstate) {
+        size_t n = 0;
+        for (size_t start = 0; regex.search(s, start, match); start = match[0].end)
+            ++n;
+        benchmark::DoNotOptimize(n);
+    }
+
+    bstate.SetBytesProcessed(bstate.iterations() * s.size());
+}
+
+/**
+ * `builtins.split` and `builtins.match` through the evaluator, as
+ * `lib.splitString` and version parsing use them.
+ */
+static void BM_EvalSplitMatch(benchmark::State & bstate)
+{
+    bool readOnlyMode = true;
+    fetchers::Settings fetchSettings{};
+    EvalSettings evalSettings{readOnlyMode};
+    evalSettings.nixPath = {};
+
+    auto state = std::make_shared<EvalState>(LookupPath{}, openStore("dummy://"), fetchSettings, evalSettings);
+
+    auto expr = state->parseExprFromString(
+        R"(
+            let
+              lines = builtins.concatStringsSep "\n" (builtins.genList (i: "pkg-${toString i}-1.${toString i}") 5000);
+            in
+            builtins.length (
+              builtins.filter (l: builtins.isString l && builtins.match "([a-z]+)-([0-9]+)-(.*)" l != null) (
+                builtins.split "\n" lines
+              )
+            )
+        )",
+        state->rootPath(CanonPath::root));
+
+    for (auto _ : bstate) {
+        Value v;
+        state->eval(expr, v);
+        benchmark::DoNotOptimize(v);
+    }
+}
+
+BENCHMARK(BM_RegexMatch)->Apply(matchArgs);
+BENCHMARK(BM_RegexSearch)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_EvalSplitMatch)->Unit(benchmark::kMillisecond);
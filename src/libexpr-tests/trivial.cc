@@ -85,6 +85,27 @@ TEST_F(TrivialExpressionTest, updateAttrs)
     ASSERT_THAT(*b->value, IsIntEq(2));
 }
 
+TEST_F(TrivialExpressionTest, updateAttrsFlattened)
+{
+    auto v = eval("{ a = 1; b = 2; } // { b = 3; } // { c = 4; } // { a = 5; d = 6; }");
+    ASSERT_THAT(v, IsAttrsOfSize(4));
+
+    /* Read the layered set often enough for it to be flattened, and
+       check that it still reads the same. */
+    for (int i = 0; i < 100; ++i) {
+        auto a = v.attrs()->get(createSymbol("a"));
+        ASSERT_NE(a, nullptr);
+        ASSERT_THAT(*a->value, IsIntEq(5));
+        ASSERT_EQ(v.attrs()->get(createSymbol("e")), nullptr);
+
+        std::vector<int64_t> values;
+        for (auto & attr : *v.attrs())
+            values.push_back(attr.value->integer().value);
+        std::ranges::sort(values);
+        ASSERT_EQ(values, (std::vector<int64_t>{3, 4, 5, 6}));
+    }
+}
+
 TEST_F(TrivialExpressionTest, hasAttrOpFalse)
 {
     auto v = eval("{} ? a");
@@ -0,0 +1,176 @@
+#include <benchmark/benchmark.h>
+#include "nix/expr/eval.hh"
+#include "nix/expr/eval-settings.hh"
+#include "nix/fetchers/fetch-settings.hh"
+#include "nix/store/store-open.hh"
+#include "nix/store/wasm.hh"
+#include "nix/util/file-system.hh"
+
+using namespace nix;
+
+/**
+ * A module that implements the same operations on top of the
+ * per-element FFI (v1) and the bulk marshalling ABI (v2).
+ */
+static constexpr std::string_view benchWat = R"(
+(module
+  (import "env" "get_attrs_len" (func $get_attrs_len (param i32) (result i32)))
+  (import "env" "copy_attrset" (func $copy_attrset (param i32 i32 i32) (result i32)))
+  (import "env" "get_int" (func $get_int (param i32) (result i64)))
+  (import "env" "make_int" (func $make_int (param i64) (result i32)))
+  (import "env" "make_list" (func $make_list (param i32 i32) (result i32)))
+  (import "env" "serialize_value" (func $serialize_value (param i32 i32 i32) (result i32)))
+  (import "env" "deserialize_value" (func $deserialize_value (param i32 i32) (result i32)))
+
+  (memory (export "memory") 32)
+
+  (func (export "_initialize"))
+  (func (export "nix_wasm_init_v2"))
+
+  ;; Sum the values of an attrset of integers, one host call per attribute.
+  (func (export "sum_attrs_v1") (param $arg i32) (result i32)
+    (local $n i32) (local $i i32) (local $acc i64)
+    (local.set $n (call $get_attrs_len (local.get $arg)))
+    (drop (call $copy_attrset (local.get $arg) (i32.const 0) (local.get $n)))
+    (block $done
+      (loop $next
+        (br_if $done (i32.ge_u (local.get $i) (local.get $n)))
+        (local.set $acc
+          (i64.add (local.get $acc)
+            (call $get_int (i32.load (i32.shl (local.get $i) (i32.const 3))))))
+        (local.set $i (i32.add (local.get $i) (i32.const 1)))
+        (br $next)))
+    (call $make_int (local.get $acc)))
+
+  ;; Same, with the attrset serialized into memory in a single call.
+  (func (export "sum_attrs_v2") (param $arg i32) (result i32)
+    (local $n i32) (local $i i32) (local $p i32) (local $acc i64)
+    (if (i32.gt_u
+          (call $serialize_value (local.get $arg) (i32.const 0) (i32.const 2097152))
+          (i32.const 2097152))
+      (then (unreachable)))
+    (local.set $n (i32.load (i32.const 1)))
+    (local.set $p (i32.const 5))
+    (block $done
+      (loop $next
+        (br_if $done (i32.ge_u (local.get $i) (local.get $n)))
+        ;; Skip the attribute name and the value's tag.
+        (local.set $p (i32.add (local.get $p) (i32.add (i32.load (local.get $p)) (i32.const 5))))
+        (local.set $acc (i64.add (local.get $acc) (i64.load (local.get $p))))
+        (local.set $p (i32.add (local.get $p) (i32.const 8)))
+        (local.set $i (i32.add (local.get $i) (i32.const 1)))
+        (br $next)))
+    (call $make_int (local.get $acc)))
+
+  ;; Return the list [0 .. n-1], one host call per element.
+  (func (export "build_list_v1") (param $arg i32) (result i32)
+    (local $n i32) (local $i i32)
+    (local.set $n (i32.wrap_i64 (call $get_int (local.get $arg))))
+    (block $done
+      (loop $next
+        (br_if $done (i32.ge_u (local.get $i) (local.get $n)))
+        (i32.store (i32.shl (local.get $i) (i32.const 2))
+          (call $make_int (i64.extend_i32_u (local.get $i))))
+        (local.set $i (i32.add (local.get $i) (i32.const 1)))
+        (br $next)))
+    (call $make_list (i32.const 0) (local.get $n)))
+
+  ;; Same, with the list built from its encoding in a single call.
+  (func (export "build_list_v2") (param $arg i32) (result i32)
+    (local $n i32) (local $i i32) (local $p i32)
+    (local.set $n (i32.wrap_i64 (call $get_int (local.get $arg))))
+    (i32.store8 (i32.const 0) (i32.const 8))
+    (i32.store (i32.const 1) (local.get $n))
+    (local.set $p (i32.const 5))
+    (block $done
+      (loop $next
+        (br_if $done (i32.ge_u (local.get $i) (local.get $n)))
+        (i32.store8 (local.get $p) (i32.const 1))
+        (i64.store (i32.add (local.get $p) (i32.const 1)) (i64.extend_i32_u (local.get $i)))
+        (local.set $p (i32.add (local.get $p) (i32.const 9)))
+        (local.set $i (i32.add (local.get $i) (i32.const 1)))
+        (br $next)))
+    (call $deserialize_value (i32.const 0) (local.get $p)))
+)
+)";
+
+namespace {
+
+struct WasmBench
+{
+    bool readOnlyMode = true;
+    fetchers::Settings fetchSettings{};
+    EvalSettings evalSettings{readOnlyMode};
+    std::shared_ptr<EvalState> state;
+    std::filesystem::path tmpDir;
+    AutoDelete delTmpDir;
+    Value vPath, vEntry;
+
+    WasmBench(std::string_view entry)
+        : tmpDir(createTempDir())
+        , delTmpDir(tmpDir)
+    {
+        evalSettings.nixPath = {};
+        state = std::make_shared<EvalState>(LookupPath{}, openStore("dummy://"), fetchSettings, evalSettings);
+
+        auto wasm = unwrap(wasmtime::wat2wasm(benchWat));
+        auto wasmPath = tmpDir / "bench.wasm";
+        writeFile(wasmPath, std::string_view((const char *) wasm.data(), wasm.size()));
+
+        vPath.mkPath(state->rootPath(CanonPath(wasmPath.string())), state->mem);
+        vEntry.mkString(entry, state->mem);
+    }
+
+    Value call(Value & arg)
+    {
+        Value * args[] = {&vPath, &vEntry, &arg};
+        Value res;
+        state->callFunction(state->getBuiltin("wasm"), args, res, noPos);
+        state->forceValueDeep(res);
+        return res;
+    }
+};
+
+} // namespace
+
+static void BM_WasmSumAttrs(benchmark::State & bstate, std::string_view entry)
+{
+    WasmBench bench(entry);
+    auto & state = *bench.state;
+
+    auto n = bstate.range(0);
+    auto builder = state.buildBindings(n);
+    for (int64_t i = 0; i < n; ++i) {
+        auto v = state.allocValue();
+        v->mkInt(i);
+        builder.insert(state.symbols.create(fmt("attr%d", i)), v);
+    }
+    Value arg;
+    arg.mkAttrs(builder);
+
+    for (auto _ : bstate) {
+        auto res = bench.call(arg);
+        benchmark::DoNotOptimize(res);
+    }
+    bstate.SetItemsProcessed(bstate.iterations() * n);
+}
+
+static void BM_WasmBuildList(benchmark::State & bstate, std::string_view entry)
+{
+    WasmBench bench(entry);
+
+    auto n = bstate.range(0);
+    Value arg;
+    arg.mkInt(n);
+
+    for (auto _ : bstate) {
+        auto res = bench.call(arg);
+        benchmark::DoNotOptimize(res);
+    }
+    bstate.SetItemsProcessed(bstate.iterations() * n);
+}
+
+BENCHMARK_CAPTURE(BM_WasmSumAttrs, v1, "sum_attrs_v1")->Arg(1000)->Arg(50000);
+BENCHMARK_CAPTURE(BM_WasmSumAttrs, v2, "sum_attrs_v2")->Arg(1000)->Arg(50000);
+BENCHMARK_CAPTURE(BM_WasmBuildList, v1, "build_list_v1")->Arg(1000)->Arg(50000);
+BENCHMARK_CAPTURE(BM_WasmBuildList, v2, "build_list_v2")->Arg(1000)->Arg(50000);
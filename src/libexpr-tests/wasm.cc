@@ -0,0 +1,83 @@
+#include <gtest/gtest.h>
+
+#include "nix/expr/tests/libexpr.hh"
+#include "nix/store/wasm.hh"
+#include "nix/util/file-system.hh"
+
+namespace nix {
+
+/**
+ * A module whose functions pass malformed buffers to the host.
+ */
+static constexpr std::string_view malformedWat = R"(
+(module
+  (import "env" "make_list" (func $make_list (param i32 i32) (result i32)))
+  (import "env" "deserialize_value" (func $deserialize_value (param i32 i32) (result i32)))
+
+  (memory (export "memory") 1)
+
+  (func (export "_initialize"))
+  (func (export "nix_wasm_init_v2"))
+
+  ;; A list that claims 2^32 - 1 elements in a 5-byte buffer.
+  (func (export "huge_list") (param $arg i32) (result i32)
+    (i32.store8 (i32.const 0) (i32.const 8))
+    (i32.store (i32.const 1) (i32.const -1))
+    (call $deserialize_value (i32.const 0) (i32.const 5)))
+
+  ;; An attrset that claims 2^28 attributes, followed by one attribute.
+  (func (export "huge_attrs") (param $arg i32) (result i32)
+    (i32.store8 (i32.const 0) (i32.const 7))
+    (i32.store (i32.const 1) (i32.const 0x10000000))
+    (i32.store (i32.const 5) (i32.const 0))
+    (i32.store8 (i32.const 9) (i32.const 6))
+    (call $deserialize_value (i32.const 0) (i32.const 10)))
+
+  ;; A list whose elements extend past the end of memory.
+  (func (export "list_out_of_bounds") (param $arg i32) (result i32)
+    (call $make_list (i32.const 65532) (i32.const 2)))
+)
+)";
+
+class WasmTest : public LibExprTest
+{
+protected:
+    std::filesystem::path tmpDir = createTempDir();
+    AutoDelete delTmpDir{tmpDir};
+    Value vPath;
+
+    WasmTest()
+    {
+        auto wasm = unwrap(wasmtime::wat2wasm(malformedWat));
+        auto wasmPath = tmpDir / "malformed.wasm";
+        writeFile(wasmPath, std::string_view((const char *) wasm.data(), wasm.size()));
+        vPath.mkPath(state.rootPath(CanonPath(wasmPath.string())), state.mem);
+    }
+
+    void call(std::string_view entry)
+    {
+        Value vEntry, arg, res;
+        vEntry.mkString(entry, state.mem);
+        arg.mkNull();
+        Value * args[] = {&vPath, &vEntry, &arg};
+        state.callFunction(state.getBuiltin("wasm"), args, res, noPos);
+        state.forceValueDeep(res);
+    }
+};
+
+TEST_F(WasmTest, rejectsOversizedListCount)
+{
+    ASSERT_THROW(call("huge_list"), Error);
+}
+
+TEST_F(WasmTest, rejectsOversizedAttrsCount)
+{
+    ASSERT_THROW(call("huge_attrs"), Error);
+}
+
+TEST_F(WasmTest, rejectsOutOfBoundsGuestPointer)
+{
+    ASSERT_THROW(call("list_out_of_bounds"), EvalError);
+}
+
+} // namespace nix
@@ -1,12 +1,19 @@
 #include "nix/expr/attr-set.hh"
 #include "nix/expr/eval-inline.hh"
 
+#include <boost/container_hash/hash.hpp>
+#include <boost/unordered/concurrent_flat_set.hpp>
+
 #include <algorithm>
 
 namespace nix {
 
 Bindings Bindings::emptyBindings;
 
+Counter Bindings::nrMergedReads;
+Counter Bindings::nrFlattened;
+Counter Bindings::nrFlattenedAttrs;
+
 /* Allocate a new array of attributes for an attribute set with a specific
    capacity. The space is implicitly reserved after the Bindings
    structure. */
@@ -18,9 +25,34 @@ Bindings * EvalMemory::allocBindings(size_t capacity)
         throw Error("attribute set of size %d is too big", capacity);
     stats.nrAttrsets++;
     stats.nrAttrsInAttrsets += capacity;
+    countAllocation(allocatedBindings, sizeof(Bindings) + sizeof(Attr) * capacity);
     return new (allocBytes(sizeof(Bindings) + sizeof(Attr) * capacity)) Bindings();
 }
 
+void EvalMemory::recordShape(const Bindings & bindings)
+{
+    if (bindings.isLayered() || bindings.empty())
+        return;
+
+    /* Only the hash of the shape is kept. Collisions make the
+       statistics slightly optimistic, which is fine. */
+    size_t hash = bindings.size();
+    for (auto & attr : bindings) {
+        boost::hash_combine(hash, attr.name.getId());
+        boost::hash_combine(hash, std::hash<PosIdx>{}(attr.pos));
+    }
+
+    if (shapes->insert(hash)) {
+        stats.nrAttrsetShapes++;
+        stats.nrAttrsInShapes += bindings.size();
+    }
+}
+
+void BindingsBuilder::recordShape()
+{
+    mem.get().recordShape(*bindings);
+}
+
 Value & BindingsBuilder::alloc(Symbol name, PosIdx pos)
 {
     auto value = mem.get().allocValue();
@@ -38,6 +70,35 @@ void Bindings::sort()
     std::sort(attrs, attrs + numAttrs);
 }
 
+void Bindings::flatten() const noexcept
+{
+    Bindings * flat;
+    try {
+        flat = new (EvalMemory::allocBytes(sizeof(Bindings) + sizeof(Attr) * numAttrsInChain)) Bindings();
+    } catch (std::bad_alloc &) {
+        /* Keep reading through the layers. */
+        return;
+    }
+
+    /* Bypass begin() to merge the layers themselves. The base layers
+       may be flattened concurrently, but a chain ending in a flat copy
+       merges to the same result. */
+    for (auto i = iterator(*this); i != end(); ++i)
+        flat->attrs[flat->numAttrs++] = *i;
+    assert(flat->numAttrs == numAttrsInChain);
+    flat->numAttrsInChain = flat->numAttrs;
+    flat->pos = pos;
+
+    /* The flat copy is a valid base layer for this layer, so readers
+       that see the new base layer but not the flag still get the
+       right result. */
+    baseLayer.store(flat, std::memory_order_release);
+    flattened.store(true, std::memory_order_release);
+
+    nrFlattened++;
+    nrFlattenedAttrs += flat->numAttrs;
+}
+
 Value & Value::mkAttrs(BindingsBuilder & bindings)
 {
     mkAttrs(bindings.finish());
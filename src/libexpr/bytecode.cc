@@ -0,0 +1,627 @@
+#include "nix/expr/bytecode.hh"
+#include "nix/expr/eval.hh"
+#include "nix/expr/eval-inline.hh"
+#include "nix/expr/print.hh"
+
+/* Use computed gotos for dispatch where the compiler supports them, so
+   that every instruction ends in its own indirect branch. */
+#if defined(__GNUC__)
+#  define NIX_BYTECODE_THREADED 1
+#else
+#  define NIX_BYTECODE_THREADED 0
+#endif
+
+namespace nix {
+
+/* The bytecode covers the part of a function body that is evaluated
+   strictly when the function is called: conditionals, boolean
+   operators, comparisons, variable references, attribute selection and
+   the `let` and `with` environments around them. Everything else (such
+   as attribute sets, lists, calls and nested functions) is handed to
+   the tree-walking evaluator by an `Eval` instruction, so both engines
+   produce the same values, errors and traces. */
+
+enum class Op : uint8_t {
+    /** `dst = constants[x]` */
+    Const,
+    /** `dst = ` the forced value of the variable `e` at level `x`, displacement `y` */
+    Var,
+    /** `dst = a.<path>`, where `e` is the `ExprSelect` */
+    Select,
+    /** `dst = <var>.<path>`, with the variable at level `x`, displacement `y` */
+    SelectVar,
+    /** `dst = a ? <path>`, where `e` is the `ExprOpHasAttr` */
+    HasAttr,
+    /** `dst = ` the value of `e`, computed by the tree-walking evaluator */
+    Eval,
+    /** Check that `a` (the value of `e`) is a Boolean, reporting errors at `sites[x]` */
+    CheckBool,
+    /** `dst = !a` */
+    Not,
+    /** `dst = a == b`, with the position and error context `sites[x]` */
+    Eq,
+    /** `dst = a != b`, with the position and error context `sites[x]` */
+    NEq,
+    /** Continue at `x`. */
+    Jump,
+    /** Continue at `x` if `a` is false. */
+    JumpIfFalse,
+    /** Continue at `x` if `a` is true. */
+    JumpIfTrue,
+    /** Throw the error of the failed `ExprAssert` `e`. */
+    AssertFail,
+    /** Enter the environment of the `ExprLet` `e`. */
+    EnterLet,
+    /** Enter the environment of the `ExprWith` `e`. */
+    EnterWith,
+    /** Return to the parent environment. */
+    LeaveEnv,
+    /** Store `a` in the result. */
+    Return,
+};
+
+struct Instr
+{
+    Op op;
+    /**
+     * Registers.
+     */
+    uint8_t dst = 0, a = 0, b = 0;
+    /**
+     * Operands whose meaning depends on the opcode.
+     */
+    uint32_t x = 0, y = 0;
+    Expr * e = nullptr;
+};
+
+/**
+ * A position and context to report for errors, as in `evalBool()` or
+ * `eqValues()`.
+ */
+struct Site
+{
+    PosIdx pos;
+    std::string_view errorCtx;
+};
+
+/**
+ * The instructions in `[begin, end)` evaluate a subexpression whose
+ * errors get the trace of `sites[site]`. Regions are ordered from the
+ * inside out.
+ */
+struct Region
+{
+    uint32_t begin, end, site;
+};
+
+/* Registers are kept on the C stack, which the garbage collector
+   scans. Function bodies that need more are not compiled. */
+static constexpr size_t maxRegisters = 16;
+
+/**
+ * Constants only ever hold values that don't point into the garbage
+ * collected heap (literals and scalars), so the bytecode can live in
+ * the same arena as the syntax tree.
+ */
+struct Bytecode
+{
+    std::pmr::vector<Instr> code;
+    std::pmr::vector<Value> constants;
+    std::pmr::vector<Site> sites;
+    std::pmr::vector<Region> regions;
+    size_t nrRegisters = 0;
+
+    Bytecode() = default;
+
+    Bytecode(std::pmr::polymorphic_allocator<char> & alloc)
+        : code(alloc)
+        , constants(alloc)
+        , sites(alloc)
+        , regions(alloc)
+    {
+    }
+};
+
+namespace {
+
+struct Compiler
+{
+    EvalState & state;
+    Bytecode & code;
+
+    /**
+     * The environment of the call that triggered compilation.
+     */
+    Env & env;
+
+    /**
+     * The number of environments entered by the enclosing `let` and
+     * `with` expressions.
+     */
+    Level nrEnvs = 0;
+
+    uint32_t emit(Instr instr)
+    {
+        code.code.push_back(instr);
+        return code.code.size() - 1;
+    }
+
+    uint32_t here() const
+    {
+        return code.code.size();
+    }
+
+    uint8_t reg(size_t r)
+    {
+        code.nrRegisters = std::max(code.nrRegisters, r + 1);
+        return r;
+    }
+
+    uint32_t site(PosIdx pos, std::string_view errorCtx)
+    {
+        code.sites.push_back({pos, errorCtx});
+        return code.sites.size() - 1;
+    }
+
+    std::optional<Value> constant(Expr * e);
+    std::optional<bool> constantBool(Expr * e);
+    void compile(Expr * e, size_t dst);
+    void compileBool(Expr * e, size_t dst, PosIdx pos, std::string_view errorCtx);
+};
+
+std::optional<bool> Compiler::constantBool(Expr * e)
+{
+    if (auto v = constant(e); v && v->type() == nBool)
+        return v->boolean();
+    return std::nullopt;
+}
+
+/**
+ * Return the value of `e` if it can be computed at compile time
+ * without allocating or failing.
+ */
+std::optional<Value> Compiler::constant(Expr * e)
+{
+    if (auto e2 = dynamic_cast<ExprInt *>(e))
+        return e2->v;
+    if (auto e2 = dynamic_cast<ExprFloat *>(e))
+        return e2->v;
+    if (auto e2 = dynamic_cast<ExprString *>(e))
+        return e2->v;
+    if (auto e2 = dynamic_cast<ExprPath *>(e))
+        return e2->v;
+
+    /* Variables that refer to scalars in the base environment, such as
+       `true`, `false` and `null`. The static nesting of environments
+       is the same for every call, so what's found through the
+       environment of this call holds for all of them. */
+    if (auto var = dynamic_cast<ExprVar *>(e)) {
+        if (var->fromWith || var->level < nrEnvs)
+            return std::nullopt;
+        Env * env2 = &env;
+        for (auto l = var->level - nrEnvs; l; --l)
+            env2 = env2->up;
+        if (env2 != &state.baseEnv)
+            return std::nullopt;
+        auto v = env2->values[var->displ];
+        if (!v || !v->isFinished())
+            return std::nullopt;
+        switch (v->type()) {
+        case nBool:
+        case nNull:
+        case nInt:
+        case nFloat:
+            return *v;
+        case nThunk:
+        case nFailed:
+        case nString:
+        case nPath:
+        case nAttrs:
+        case nList:
+        case nFunction:
+        case nExternal:
+            return std::nullopt;
+        }
+    }
+
+    auto mkBool = [](bool b) {
+        Value v;
+        v.mkBool(b);
+        return v;
+    };
+
+    if (auto e2 = dynamic_cast<ExprOpNot *>(e)) {
+        if (auto b = constantBool(e2->e))
+            return mkBool(!*b);
+    } else if (auto e2 = dynamic_cast<ExprOpAnd *>(e)) {
+        if (auto b1 = constantBool(e2->e1)) {
+            if (!*b1)
+                return mkBool(false);
+            if (auto b2 = constantBool(e2->e2))
+                return mkBool(*b2);
+        }
+    } else if (auto e2 = dynamic_cast<ExprOpOr *>(e)) {
+        if (auto b1 = constantBool(e2->e1)) {
+            if (*b1)
+                return mkBool(true);
+            if (auto b2 = constantBool(e2->e2))
+                return mkBool(*b2);
+        }
+    } else if (auto e2 = dynamic_cast<ExprOpImpl *>(e)) {
+        if (auto b1 = constantBool(e2->e1)) {
+            if (!*b1)
+                return mkBool(true);
+            if (auto b2 = constantBool(e2->e2))
+                return mkBool(*b2);
+        }
+    } else if (dynamic_cast<ExprOpEq *>(e) || dynamic_cast<ExprOpNEq *>(e)) {
+        /* Comparing scalars and literal strings and paths cannot fail. */
+        auto [lhs, rhs, neq] = [&]() {
+            if (auto eq = dynamic_cast<ExprOpEq *>(e))
+                return std::tuple{eq->e1, eq->e2, false};
+            auto ne = dynamic_cast<ExprOpNEq *>(e);
+            return std::tuple{ne->e1, ne->e2, true};
+        }();
+        auto v1 = constant(lhs);
+        auto v2 = v1 ? constant(rhs) : std::nullopt;
+        if (v1 && v2)
+            return mkBool(state.eqValues(*v1, *v2, noPos, "") != neq);
+    }
+
+    return std::nullopt;
+}
+
+void Compiler::compileBool(Expr * e, size_t dst, PosIdx pos, std::string_view errorCtx)
+{
+    auto begin = here();
+    auto s = site(pos, errorCtx);
+    compile(e, dst);
+    emit({.op = Op::CheckBool, .a = reg(dst), .x = s, .e = e});
+    code.regions.push_back({begin, here(), s});
+}
+
+void Compiler::compile(Expr * e, size_t dst)
+{
+    if (auto v = constant(e)) {
+        code.constants.push_back(*v);
+        emit({.op = Op::Const, .dst = reg(dst), .x = (uint32_t) code.constants.size() - 1});
+        return;
+    }
+
+    if (auto var = dynamic_cast<ExprVar *>(e); var && !var->fromWith) {
+        emit({.op = Op::Var, .dst = reg(dst), .x = var->level, .y = var->displ, .e = var});
+    }
+
+    else if (auto select = dynamic_cast<ExprSelect *>(e)) {
+        /* Selecting from a variable reads the attribute set in place
+           rather than copying it into a register. */
+        if (auto var = dynamic_cast<ExprVar *>(select->e); var && !var->fromWith && !constant(var))
+            emit({.op = Op::SelectVar, .dst = reg(dst), .x = var->level, .y = var->displ, .e = select});
+        else {
+            compile(select->e, dst + 1);
+            emit({.op = Op::Select, .dst = reg(dst), .a = reg(dst + 1), .e = select});
+        }
+    }
+
+    else if (auto hasAttr = dynamic_cast<ExprOpHasAttr *>(e)) {
+        compile(hasAttr->e, dst + 1);
+        emit({.op = Op::HasAttr, .dst = reg(dst), .a = reg(dst + 1), .e = hasAttr});
+    }
+
+    else if (auto if_ = dynamic_cast<ExprIf *>(e)) {
+        if (auto b = constantBool(if_->cond))
+            compile(*b ? if_->then : if_->else_, dst);
+        else {
+            compileBool(if_->cond, dst, if_->pos, "while evaluating a branch condition");
+            auto jumpElse = emit({.op = Op::JumpIfFalse, .a = reg(dst)});
+            compile(if_->then, dst);
+            auto jumpEnd = emit({.op = Op::Jump});
+            code.code[jumpElse].x = here();
+            compile(if_->else_, dst);
+            code.code[jumpEnd].x = here();
+        }
+    }
+
+    else if (auto assert = dynamic_cast<ExprAssert *>(e)) {
+        compileBool(assert->cond, dst, assert->pos, "in the condition of the assert statement");
+        auto jumpBody = emit({.op = Op::JumpIfTrue, .a = reg(dst)});
+        emit({.op = Op::AssertFail, .e = assert});
+        code.code[jumpBody].x = here();
+        compile(assert->body, dst);
+    }
+
+    else if (auto not_ = dynamic_cast<ExprOpNot *>(e)) {
+        compileBool(not_->e, dst, not_->getPos(), "in the argument of the not operator");
+        emit({.op = Op::Not, .dst = reg(dst), .a = reg(dst)});
+    }
+
+    else if (auto and_ = dynamic_cast<ExprOpAnd *>(e)) {
+        compileBool(and_->e1, dst, and_->pos, "in the left operand of the AND (&&) operator");
+        auto jumpEnd = emit({.op = Op::JumpIfFalse, .a = reg(dst)});
+        compileBool(and_->e2, dst, and_->pos, "in the right operand of the AND (&&) operator");
+        code.code[jumpEnd].x = here();
+    }
+
+    else if (auto or_ = dynamic_cast<ExprOpOr *>(e)) {
+        compileBool(or_->e1, dst, or_->pos, "in the left operand of the OR (||) operator");
+        auto jumpEnd = emit({.op = Op::JumpIfTrue, .a = reg(dst)});
+        compileBool(or_->e2, dst, or_->pos, "in the right operand of the OR (||) operator");
+        code.code[jumpEnd].x = here();
+    }
+
+    else if (auto impl = dynamic_cast<ExprOpImpl *>(e)) {
+        compileBool(impl->e1, dst, impl->pos, "in the left operand of the IMPL (->) operator");
+        emit({.op = Op::Not, .dst = reg(dst), .a = reg(dst)});
+        auto jumpEnd = emit({.op = Op::JumpIfTrue, .a = reg(dst)});
+        compileBool(impl->e2, dst, impl->pos, "in the right operand of the IMPL (->) operator");
+        code.code[jumpEnd].x = here();
+    }
+
+    else if (auto eq = dynamic_cast<ExprOpEq *>(e)) {
+        compile(eq->e1, dst);
+        compile(eq->e2, dst + 1);
+        emit(
+            {.op = Op::Eq,
+             .dst = reg(dst),
+             .a = reg(dst),
+             .b = reg(dst + 1),
+             .x = site(eq->pos, "while testing two values for equality")});
+    }
+
+    else if (auto neq = dynamic_cast<ExprOpNEq *>(e)) {
+        compile(neq->e1, dst);
+        compile(neq->e2, dst + 1);
+        emit(
+            {.op = Op::NEq,
+             .dst = reg(dst),
+             .a = reg(dst),
+             .b = reg(dst + 1),
+             .x = site(neq->pos, "while testing two values for inequality")});
+    }
+
+    else if (auto let = dynamic_cast<ExprLet *>(e)) {
+        emit({.op = Op::EnterLet, .e = let});
+        nrEnvs++;
+        compile(let->body, dst);
+        nrEnvs--;
+        emit({.op = Op::LeaveEnv});
+    }
+
+    else if (auto with = dynamic_cast<ExprWith *>(e)) {
+        emit({.op = Op::EnterWith, .e = with});
+        nrEnvs++;
+        compile(with->body, dst);
+        nrEnvs--;
+        emit({.op = Op::LeaveEnv});
+    }
+
+    else
+        emit({.op = Op::Eval, .dst = reg(dst), .e = e});
+}
+
+} // namespace
+
+/**
+ * Marks functions whose body is not worth compiling.
+ */
+static const Bytecode notCompiledMarker;
+static const Bytecode * const notCompiled = &notCompiledMarker;
+
+const Bytecode * getBytecode(EvalState & state, ExprLambda & lambda, Env & env)
+{
+    auto code = lambda.bytecode.load(std::memory_order_acquire);
+
+    if (!code) {
+        auto & alloc = state.mem.exprs.alloc;
+        auto compiled = alloc.new_object<Bytecode>(alloc);
+        Compiler compiler{.state = state, .code = *compiled, .env = env};
+        compiler.compile(lambda.body, 0);
+        compiler.emit({.op = Op::Return, .a = 0});
+
+        const Bytecode * newCode = compiled;
+        if (compiled->nrRegisters > maxRegisters
+            || (compiled->code.size() == 2 && compiled->code.front().op == Op::Eval))
+            newCode = notCompiled;
+
+        /* Another thread may have compiled the function concurrently;
+           if so, use its result. */
+        if (lambda.bytecode.compare_exchange_strong(code, newCode, std::memory_order_acq_rel)) {
+            code = newCode;
+            if (code != notCompiled) {
+                state.nrBytecodeFunctions++;
+                state.nrBytecodeInstructions += compiled->code.size();
+            }
+        }
+    }
+
+    return code == notCompiled ? nullptr : code;
+}
+
+void evalBytecode(EvalState & state, const Bytecode & code, Env & env_, Value & v)
+{
+    Value regs[maxRegisters];
+    Env * env = &env_;
+    const Instr * ip = code.code.data();
+
+#if NIX_BYTECODE_THREADED
+    /* Must be in the same order as `Op`. */
+    static void * const labels[] = {
+        &&op_Const,
+        &&op_Var,
+        &&op_Select,
+        &&op_SelectVar,
+        &&op_HasAttr,
+        &&op_Eval,
+        &&op_CheckBool,
+        &&op_Not,
+        &&op_Eq,
+        &&op_NEq,
+        &&op_Jump,
+        &&op_JumpIfFalse,
+        &&op_JumpIfTrue,
+        &&op_AssertFail,
+        &&op_EnterLet,
+        &&op_EnterWith,
+        &&op_LeaveEnv,
+        &&op_Return,
+    };
+#  define DISPATCH() goto * labels[(size_t) ip->op]
+#else
+#  define DISPATCH() goto dispatch
+#endif
+#define NEXT() \
+    do {       \
+        ++ip;  \
+        DISPATCH(); \
+    } while (0)
+#define JUMP(target)                         \
+    do {                                     \
+        ip = code.code.data() + (target);    \
+        DISPATCH();                          \
+    } while (0)
+
+    auto lookup = [&](const Instr & instr) {
+        Env * env2 = env;
+        for (auto l = instr.x; l; --l)
+            env2 = env2->up;
+        return env2->values[instr.y];
+    };
+
+    try {
+        DISPATCH();
+
+#if !NIX_BYTECODE_THREADED
+    dispatch:
+#endif
+        switch (ip->op) {
+
+        case Op::Const:
+        op_Const:
+            regs[ip->dst] = code.constants[ip->x];
+            NEXT();
+
+        case Op::Var:
+        op_Var: {
+            auto v2 = lookup(*ip);
+            state.forceValue(*v2, static_cast<ExprVar *>(ip->e)->pos);
+            regs[ip->dst] = *v2;
+            NEXT();
+        }
+
+        case Op::Select:
+        op_Select:
+            static_cast<ExprSelect *>(ip->e)->selectFrom(state, *env, regs[ip->a], regs[ip->dst]);
+            NEXT();
+
+        case Op::SelectVar:
+        op_SelectVar: {
+            auto select = static_cast<ExprSelect *>(ip->e);
+            auto vBase = lookup(*ip);
+            state.forceValue(*vBase, static_cast<ExprVar *>(select->e)->pos);
+            select->selectFrom(state, *env, *vBase, regs[ip->dst]);
+            NEXT();
+        }
+
+        case Op::HasAttr:
+        op_HasAttr:
+            regs[ip->dst].mkBool(static_cast<ExprOpHasAttr *>(ip->e)->hasAttrIn(state, *env, regs[ip->a]));
+            NEXT();
+
+        case Op::Eval:
+        op_Eval:
+            ip->e->eval(state, *env, regs[ip->dst]);
+            NEXT();
+
+        case Op::CheckBool:
+        op_CheckBool: {
+            auto & v2 = regs[ip->a];
+            if (v2.type() != nBool)
+                state
+                    .error<TypeError>(
+                        "expected a Boolean but found %1%: %2%",
+                        showType(v2),
+                        ValuePrinter(state, v2, errorPrintOptions))
+                    .atPos(code.sites[ip->x].pos)
+                    .withFrame(*env, *ip->e)
+                    .debugThrow();
+            NEXT();
+        }
+
+        case Op::Not:
+        op_Not:
+            regs[ip->dst].mkBool(!regs[ip->a].boolean());
+            NEXT();
+
+        case Op::Eq:
+        op_Eq: {
+            auto & site = code.sites[ip->x];
+            regs[ip->dst].mkBool(state.eqValues(regs[ip->a], regs[ip->b], site.pos, site.errorCtx));
+            NEXT();
+        }
+
+        case Op::NEq:
+        op_NEq: {
+            auto & site = code.sites[ip->x];
+            regs[ip->dst].mkBool(!state.eqValues(regs[ip->a], regs[ip->b], site.pos, site.errorCtx));
+            NEXT();
+        }
+
+        case Op::Jump:
+        op_Jump:
+            JUMP(ip->x);
+
+        case Op::JumpIfFalse:
+        op_JumpIfFalse:
+            if (!regs[ip->a].boolean())
+                JUMP(ip->x);
+            NEXT();
+
+        case Op::JumpIfTrue:
+        op_JumpIfTrue:
+            if (regs[ip->a].boolean())
+                JUMP(ip->x);
+            NEXT();
+
+        case Op::AssertFail:
+        op_AssertFail:
+            static_cast<ExprAssert *>(ip->e)->fail(state, *env);
+
+        case Op::EnterLet:
+        op_EnterLet:
+            env = &static_cast<ExprLet *>(ip->e)->buildEnv(state, *env);
+            NEXT();
+
+        case Op::EnterWith:
+        op_EnterWith:
+            env = &static_cast<ExprWith *>(ip->e)->buildEnv(state, *env);
+            NEXT();
+
+        case Op::LeaveEnv:
+        op_LeaveEnv:
+            env = env->up;
+            NEXT();
+
+        case Op::Return:
+        op_Return:
+            v = regs[ip->a];
+            return;
+        }
+
+        unreachable();
+
+    } catch (Error & e) {
+        uint32_t pc = ip - code.code.data();
+        for (auto & region : code.regions)
+            if (pc >= region.begin && pc < region.end) {
+                auto & site = code.sites[region.site];
+                e.addTrace(state.positions[site.pos], site.errorCtx);
+            }
+        throw;
+    }
+
+#undef JUMP
+#undef NEXT
+#undef DISPATCH
+}
+
+} // namespace nix
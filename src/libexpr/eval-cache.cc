@@ -3,8 +3,11 @@
 #include "nix/store/sqlite.hh"
 #include "nix/expr/eval.hh"
 #include "nix/expr/eval-inline.hh"
+#include "nix/expr/eval-dependencies.hh"
 #include "nix/store/store-api.hh"
 #include "nix/store/globals.hh"
+#include "nix/util/pool.hh"
+#include "nix/util/mounted-source-accessor.hh"
 // Need specialization involving `SymbolStr` just in this one module.
 #include "nix/util/strings-inline.hh"
 
@@ -43,6 +46,423 @@ create table if not exists Attributes (
 );
 )sql";
 
+static const char * dependenciesSchema = R"sql(
+create table if not exists DependencySets (
+    id          integer primary key autoincrement not null,
+    parent      integer
+);
+
+create table if not exists Dependencies (
+    depSet      integer not null,
+    key         text not null,
+    value       text not null
+);
+
+create index if not exists IndexDependencies on Dependencies(depSet);
+
+create table if not exists DependentAttributes (
+    path        text not null,
+    depSet      integer not null,
+    type        integer not null,
+    value       text,
+    context     text,
+    primary key (path, depSet)
+);
+
+create table if not exists LastPurge (
+    dummy       text primary key,
+    value       integer
+);
+)sql";
+
+/**
+ * A cache of attributes of a flake that is shared between versions
+ * of the flake. Every attribute is stored together with the
+ * dependencies (files and metadata of the flake) that the evaluation
+ * had observed when it was cached, and is only reused if all of them
+ * still have the same value.
+ *
+ * Since values are shared and evaluated lazily, an attribute can
+ * depend on anything that was evaluated before it, so the
+ * dependencies are stored as a chain of dependency sets: every
+ * dependency set contains the dependencies observed since its
+ * parent.
+ *
+ * This is best effort: values derived from the flake's store path
+ * after its string context was dropped (e.g. by
+ * `builtins.unsafeDiscardStringContext`, or by `toString` on a path
+ * in the flake) don't record a dependency on the flake, and can be
+ * reused after the flake has changed.
+ */
+struct DepDb
+{
+    /**
+     * How many versions of an attribute to keep.
+     */
+    static constexpr size_t maxVersionsPerAttribute = 8;
+
+    static constexpr time_t purgeInterval = 24 * 3600;
+
+    std::atomic_bool failed{false};
+
+    EvalState & evalState;
+
+    DependencyRoot root;
+
+    /**
+     * The printed store path of `root.sourcePath`.
+     */
+    std::string rootPath;
+
+    struct State
+    {
+        SQLite db;
+        SQLiteStmt insertDepSet;
+        SQLiteStmt insertDependency;
+        SQLiteStmt insertAttribute;
+        SQLiteStmt queryAttribute;
+        SQLiteStmt queryDepSet;
+        SQLiteStmt queryDependencies;
+        std::unique_ptr<SQLiteTxn> txn;
+
+        /**
+         * The number of entries of `EvalDependencies` that have been
+         * stored.
+         */
+        size_t nrStored = 0;
+
+        /**
+         * The dependency set that contains everything observed so far.
+         */
+        std::optional<uint64_t> depSet;
+
+        /**
+         * Whether a dependency set (including its parents) is valid
+         * for the current version of the flake.
+         */
+        std::map<uint64_t, bool> valid;
+
+        /**
+         * The current value of every dependency checked so far, or
+         * `std::nullopt` if it can't be observed.
+         */
+        std::map<std::string, std::optional<std::string>> observed;
+
+        /**
+         * Attribute paths that were taken from this cache rather than
+         * evaluated.
+         */
+        std::set<std::string> imported;
+    };
+
+    std::unique_ptr<Sync<State>> _state;
+
+    DepDb(EvalState & evalState, DependencyRoot && root_)
+        : evalState(evalState)
+        , root(std::move(root_))
+        , rootPath(evalState.store->printStorePath(root.sourcePath))
+        , _state(std::make_unique<Sync<State>>())
+    {
+        auto state(_state->lock());
+
+        auto cacheDir = std::filesystem::path(getCacheDir()) / "eval-cache-v6";
+        createDirs(cacheDir);
+
+        auto dbPath = cacheDir / ("deps-" + root.identity + ".sqlite");
+
+        state->db = SQLite(dbPath);
+        state->db.isCache();
+        state->db.exec(dependenciesSchema);
+
+        state->insertDepSet.create(state->db, "insert into DependencySets(parent) values (?)");
+
+        state->insertDependency.create(state->db, "insert into Dependencies(depSet, key, value) values (?, ?, ?)");
+
+        state->insertAttribute.create(
+            state->db,
+            "insert or replace into DependentAttributes(path, depSet, type, value, context) values (?, ?, ?, ?, ?)");
+
+        state->queryAttribute.create(
+            state->db,
+            "select depSet, type, value, context from DependentAttributes where path = ? order by depSet desc");
+
+        state->queryDepSet.create(state->db, "select parent from DependencySets where id = ?");
+
+        state->queryDependencies.create(state->db, "select key, value from Dependencies where depSet = ?");
+
+        /* Periodically drop old versions of attributes and the
+           dependency sets that only they referred to. */
+        retrySQLite<void>([&]() {
+            auto now = time(0);
+
+            SQLiteStmt queryLastPurge(state->db, "select value from LastPurge");
+            auto queryLastPurge_(queryLastPurge.use());
+
+            if (!queryLastPurge_.next() || queryLastPurge_.getInt(0) < now - purgeInterval) {
+                SQLiteTxn txn(state->db);
+
+                SQLiteStmt(state->db, R"(
+                    delete from DependentAttributes where rowid in (
+                        select rowid from (
+                            select rowid, row_number() over (partition by path order by depSet desc) as n
+                            from DependentAttributes)
+                        where n > ?)
+                )")
+                    .use()((int64_t) maxVersionsPerAttribute)
+                    .exec();
+
+                SQLiteStmt(state->db, R"(
+                    with recursive Live(id) as (
+                        select depSet from DependentAttributes
+                        union
+                        select parent from DependencySets join Live using (id) where parent is not null)
+                    delete from DependencySets where id not in Live
+                )")
+                    .use()
+                    .exec();
+
+                SQLiteStmt(state->db, "delete from Dependencies where depSet not in (select id from DependencySets)")
+                    .use()
+                    .exec();
+
+                SQLiteStmt(state->db, "insert or replace into LastPurge(dummy, value) values ('', ?)")
+                    .use()(now)
+                    .exec();
+
+                txn.commit();
+            }
+        });
+
+        state->txn = std::make_unique<SQLiteTxn>(state->db);
+    }
+
+    ~DepDb()
+    {
+        try {
+            auto state(_state->lock());
+            if (!failed && state->txn->active)
+                state->txn->commit();
+            state->txn.reset();
+        } catch (...) {
+            ignoreExceptionInDestructor();
+        }
+    }
+
+    /**
+     * Map a dependency as recorded by `EvalDependencies` to how it is
+     * stored: files in the flake are stored relative to the flake, and
+     * metadata of the flake without its identity. Dependencies on
+     * other flakes never match anything, and files outside of flakes
+     * are content-addressed or locked, so they are not stored.
+     */
+    std::optional<std::string> storedKey(const std::string & key)
+    {
+        auto colon = key.find(':');
+        assert(colon != key.npos);
+
+        if (key.starts_with("flake:")) {
+            auto rest = std::string_view(key).substr(colon + 1);
+            if (rest.starts_with(root.identity + ":"))
+                return std::string(rest.substr(root.identity.size() + 1));
+            return "foreign:" + key;
+        }
+
+        auto path = std::string_view(key).substr(colon + 1);
+        if (path == rootPath)
+            return key.substr(0, colon + 1);
+        if (path.starts_with(rootPath) && path[rootPath.size()] == '/')
+            return key.substr(0, colon + 1) + std::string(path.substr(rootPath.size() + 1));
+        if (evalState.dependencies->findRoot(path))
+            return "foreign:" + key;
+
+        return std::nullopt;
+    }
+
+    /**
+     * Return the dependency set containing everything observed so
+     * far, storing the dependencies observed since the previous call.
+     */
+    uint64_t currentDepSet(State & state)
+    {
+        auto deps = evalState.dependencies->since(state.nrStored);
+        state.nrStored += deps.size();
+
+        std::vector<std::pair<std::string, std::string>> stored;
+        for (auto & dep : deps)
+            if (auto key = storedKey(dep.key))
+                stored.emplace_back(std::move(*key), std::move(dep.value));
+
+        if (state.depSet && stored.empty())
+            return *state.depSet;
+
+        state.insertDepSet.use()(state.depSet.value_or(0), state.depSet.has_value()).exec();
+        uint64_t depSet = state.db.getLastInsertedRowId();
+
+        for (auto & [key, value] : stored)
+            state.insertDependency.use()(depSet)(key)(value).exec();
+
+        state.depSet = depSet;
+        state.valid.insert_or_assign(depSet, true);
+        return depSet;
+    }
+
+    bool isValid(State & state, const std::string & key, const std::string & value)
+    {
+        if (auto i = root.constants.find(key); i != root.constants.end())
+            return i->second == value;
+        auto i = state.observed.find(key);
+        if (i == state.observed.end())
+            i = state.observed.emplace(key, observeDependency(*evalState.storeFS, CanonPath(rootPath), key)).first;
+        return i->second && *i->second == value;
+    }
+
+    bool isValid(State & state, uint64_t depSet)
+    {
+        std::vector<uint64_t> chain;
+        std::optional<uint64_t> id = depSet;
+        bool valid = true;
+
+        while (id) {
+            if (auto i = state.valid.find(*id); i != state.valid.end()) {
+                valid = i->second;
+                break;
+            }
+            chain.push_back(*id);
+            auto queryDepSet(state.queryDepSet.use()(*id));
+            if (!queryDepSet.next()) {
+                valid = false;
+                break;
+            }
+            id = queryDepSet.isNull(0) ? std::nullopt : std::optional<uint64_t>(queryDepSet.getInt(0));
+        }
+
+        for (auto i = chain.rbegin(); i != chain.rend(); ++i) {
+            if (valid) {
+                auto queryDependencies(state.queryDependencies.use()(*i));
+                while (valid && queryDependencies.next())
+                    valid = isValid(state, queryDependencies.getStr(0), queryDependencies.getStr(1));
+            }
+            state.valid.emplace(*i, valid);
+        }
+
+        return valid;
+    }
+
+    void record(const std::string & path, AttrType type, std::string_view value, std::string_view context = "")
+    {
+        if (failed)
+            return;
+
+        try {
+            /* Values that refer to the flake itself (e.g. derivations
+               that use `self` as their source) are only valid for
+               this version of the flake. */
+            if (!context.empty()) {
+                NixStringContext ctx;
+                for (auto & s : tokenizeString<std::vector<std::string>>(context, " "))
+                    ctx.insert(NixStringContextElem::parse(s));
+                if (evalState.dependencies->refersTo(ctx, root.sourcePath))
+                    return;
+            }
+
+            auto state(_state->lock());
+
+            if (state->imported.contains(path))
+                return;
+
+            auto depSet = currentDepSet(*state);
+
+            state->insertAttribute.use()(path)(depSet)(type)(value)(context, !context.empty()).exec();
+        } catch (SQLiteError &) {
+            ignoreExceptionExceptInterrupt();
+            failed = true;
+        }
+    }
+
+    std::optional<AttrValue> lookup(const std::string & path)
+    {
+        if (failed)
+            return std::nullopt;
+
+        try {
+            auto state(_state->lock());
+
+            struct Candidate
+            {
+                uint64_t depSet;
+                AttrType type;
+                std::string value, context;
+            };
+
+            std::vector<Candidate> candidates;
+            {
+                auto queryAttribute(state->queryAttribute.use()(path));
+                while (queryAttribute.next())
+                    candidates.push_back({
+                        (uint64_t) queryAttribute.getInt(0),
+                        (AttrType) queryAttribute.getInt(1),
+                        queryAttribute.isNull(2) ? "" : queryAttribute.getStr(2),
+                        queryAttribute.isNull(3) ? "" : queryAttribute.getStr(3),
+                    });
+            }
+
+            for (auto & c : candidates) {
+                if (!isValid(*state, c.depSet))
+                    continue;
+
+                debug("reusing cached attribute '%s' of a previous version of the flake", path);
+                state->imported.insert(path);
+
+                switch (c.type) {
+                case AttrType::FullAttrs: {
+                    std::vector<Symbol> attrs;
+                    for (auto & name : tokenizeString<std::vector<std::string>>(c.value, "\t"))
+                        attrs.push_back(evalState.symbols.create(name));
+                    return attrs;
+                }
+                case AttrType::String: {
+                    NixStringContext context;
+                    for (auto & s : tokenizeString<std::vector<std::string>>(c.context, " "))
+                        context.insert(NixStringContextElem::parse(s));
+                    return string_t{c.value, context};
+                }
+                case AttrType::Bool:
+                    return c.value != "0";
+                case AttrType::Int:
+                    return int_t{NixInt{string2Int<NixInt::Inner>(c.value).value()}};
+                case AttrType::ListOfStrings:
+                    return tokenizeString<std::vector<std::string>>(c.value, "\t");
+                case AttrType::Missing:
+                    return missing_t();
+                case AttrType::Misc:
+                    return misc_t();
+                case AttrType::Placeholder:
+                case AttrType::Failed:
+                    /* Never recorded with their dependencies. */
+                    throw Error("unexpected type in evaluation cache");
+                default:
+                    throw Error("unexpected type in evaluation cache");
+                }
+            }
+        } catch (SQLiteError &) {
+            ignoreExceptionExceptInterrupt();
+            failed = true;
+        }
+
+        return std::nullopt;
+    }
+};
+
+static std::shared_ptr<DepDb> makeDepDb(EvalState & state, DependencyRoot && root)
+{
+    try {
+        return std::make_shared<DepDb>(state, std::move(root));
+    } catch (SQLiteError &) {
+        ignoreExceptionExceptInterrupt();
+        return nullptr;
+    }
+}
+
 struct AttrDb
 {
     std::atomic_bool failed{false};
@@ -54,26 +474,87 @@ struct AttrDb
         SQLite db;
         SQLiteStmt insertAttribute;
         SQLiteStmt insertAttributeWithContext;
-        SQLiteStmt queryAttribute;
-        SQLiteStmt queryAttributes;
         std::unique_ptr<SQLiteTxn> txn;
+
+        /**
+         * The attribute paths of the rows seen so far, if `depDb` is
+         * set.
+         */
+        std::map<AttrId, std::string> paths;
     };
 
     std::unique_ptr<Sync<State>> _state;
 
     SymbolTable & symbols;
 
+    /**
+     * Attributes cached for previous versions of the flake, if
+     * `eval-cache-dependencies` is enabled.
+     */
+    std::shared_ptr<DepDb> depDb;
+
+    std::filesystem::path dbPath;
+
+    /**
+     * The largest row ID in the database when it was opened. Later
+     * rows were written by us, and are not visible to the read-only
+     * connections until the write transaction is committed.
+     */
+    AttrId lastCommittedRow = 0;
+
+    struct ReadConnection
+    {
+        SQLite db;
+        SQLiteStmt queryChildren;
+    };
+
+    /**
+     * Read-only connections, one per thread reading the cache at the
+     * same time, so that readers don't wait for each other or for
+     * writers.
+     */
+    Pool<ReadConnection> readConnections;
+
+    /**
+     * The children of a row that have been read or written so far.
+     */
+    struct Children
+    {
+        /**
+         * Whether `attrs` contains all children of the row, rather
+         * than just those written by us.
+         */
+        bool complete = false;
+
+        /**
+         * The children by name. The attribute names of `FullAttrs`
+         * children are not stored, since they are the children of
+         * those children.
+         */
+        boost::unordered_flat_map<Symbol, std::pair<AttrId, AttrValue>, std::hash<Symbol>> attrs;
+    };
+
+    SharedSync<boost::unordered_flat_map<AttrId, Children>> children;
+
     AttrDb(const StoreDirConfig & cfg, const Hash & fingerprint, SymbolTable & symbols)
         : cfg(cfg)
         , _state(std::make_unique<Sync<State>>())
         , symbols(symbols)
+        , readConnections(std::numeric_limits<size_t>::max(), [this]() {
+            auto conn = make_ref<ReadConnection>();
+            conn->db = SQLite(dbPath, SQLiteOpenMode::NoCreate);
+            conn->db.exec("pragma query_only = 1");
+            conn->queryChildren.create(
+                conn->db, "select name, rowid, type, value, context from Attributes where parent = ?");
+            return conn;
+        })
     {
         auto state(_state->lock());
 
         auto cacheDir = std::filesystem::path(getCacheDir()) / "eval-cache-v6";
         createDirs(cacheDir);
 
-        auto dbPath = cacheDir / (fingerprint.to_string(HashFormat::Base16, false) + ".sqlite");
+        dbPath = cacheDir / (fingerprint.to_string(HashFormat::Base16, false) + ".sqlite");
 
         state->db = SQLite(dbPath);
         state->db.isCache();
@@ -85,10 +566,12 @@ struct AttrDb
         state->insertAttributeWithContext.create(
             state->db, "insert or replace into Attributes(parent, name, type, value, context) values (?, ?, ?, ?, ?)");
 
-        state->queryAttribute.create(
-            state->db, "select rowid, type, value, context from Attributes where parent = ? and name = ?");
-
-        state->queryAttributes.create(state->db, "select name from Attributes where parent = ?");
+        {
+            SQLiteStmt queryLastRow(state->db, "select max(rowid) from Attributes");
+            auto use(queryLastRow.use());
+            if (use.next() && !use.isNull(0))
+                lastCommittedRow = use.getInt(0);
+        }
 
         state->txn = std::make_unique<SQLiteTxn>(state->db);
     }
@@ -119,6 +602,64 @@ struct AttrDb
         }
     }
 
+    /**
+     * Return the attribute path of `key` as used by `depDb`, with every
+     * attribute name prefixed by its length.
+     */
+    std::optional<std::string> getPath(State & state, AttrKey key)
+    {
+        if (!key.first)
+            return "";
+        auto i = state.paths.find(key.first);
+        if (i == state.paths.end())
+            return std::nullopt;
+        std::string_view name = symbols[key.second];
+        return fmt("%s%d:%s", i->second, name.size(), name);
+    }
+
+    /**
+     * Remember the attribute path of a new row, and store its value in
+     * `depDb`.
+     */
+    void remember(
+        State & state,
+        AttrKey key,
+        AttrId rowId,
+        std::optional<AttrType> type,
+        std::string_view value = "",
+        std::string_view context = "")
+    {
+        if (!depDb)
+            return;
+        auto path = getPath(state, key);
+        if (!path)
+            return;
+        state.paths.insert_or_assign(rowId, *path);
+        if (type)
+            depDb->record(*path, *type, value, context);
+    }
+
+    /**
+     * Record a row written by us in `children`.
+     */
+    void addChild(AttrKey key, AttrId rowId, AttrValue && value)
+    {
+        auto children_(children.lock());
+        (*children_)[key.first].attrs.insert_or_assign(key.second, std::pair{rowId, std::move(value)});
+    }
+
+    /**
+     * Record the children of a new `FullAttrs` row in `children`.
+     */
+    void addChildren(AttrId rowId, const std::vector<std::pair<Symbol, AttrId>> & placeholders)
+    {
+        auto children_(children.lock());
+        auto & c = (*children_)[rowId];
+        for (auto & [attr, childId] : placeholders)
+            c.attrs.insert_or_assign(attr, std::pair{childId, AttrValue(placeholder_t())});
+        c.complete = true;
+    }
+
     AttrId setAttrs(AttrKey key, const std::vector<Symbol> & attrs)
     {
         return doSQLite([&]() {
@@ -129,8 +670,25 @@ struct AttrDb
             AttrId rowId = state->db.getLastInsertedRowId();
             assert(rowId);
 
-            for (auto & attr : attrs)
+            std::vector<std::pair<Symbol, AttrId>> placeholders;
+            placeholders.reserve(attrs.size());
+            for (auto & attr : attrs) {
                 state->insertAttribute.use()(rowId)(symbols[attr])(AttrType::Placeholder) (0, false).exec();
+                placeholders.emplace_back(attr, state->db.getLastInsertedRowId());
+            }
+
+            addChild(key, rowId, std::vector<Symbol>());
+            addChildren(rowId, placeholders);
+
+            if (depDb) {
+                std::string names;
+                for (auto & attr : attrs) {
+                    if (!names.empty())
+                        names.push_back('\t');
+                    names.append(symbols[attr]);
+                }
+                remember(*state, key, rowId, AttrType::FullAttrs, names);
+            }
 
             return rowId;
         });
@@ -152,11 +710,21 @@ struct AttrDb
                 }
                 state->insertAttributeWithContext.use()(key.first)(symbols[key.second])(AttrType::String) (s) (ctx)
                     .exec();
+                AttrId rowId = state->db.getLastInsertedRowId();
+                NixStringContext context2;
+                for (auto * elem : *context)
+                    context2.insert(NixStringContextElem::parse(elem->view()));
+                addChild(key, rowId, string_t{std::string(s), std::move(context2)});
+                remember(*state, key, rowId, AttrType::String, s, ctx);
+                return rowId;
             } else {
                 state->insertAttribute.use()(key.first)(symbols[key.second])(AttrType::String) (s).exec();
             }
 
-            return state->db.getLastInsertedRowId();
+            AttrId rowId = state->db.getLastInsertedRowId();
+            addChild(key, rowId, string_t{std::string(s), {}});
+            remember(*state, key, rowId, AttrType::String, s);
+            return rowId;
         });
     }
 
@@ -167,7 +735,10 @@ struct AttrDb
 
             state->insertAttribute.use()(key.first)(symbols[key.second])(AttrType::Bool) (b ? 1 : 0).exec();
 
-            return state->db.getLastInsertedRowId();
+            AttrId rowId = state->db.getLastInsertedRowId();
+            addChild(key, rowId, b);
+            remember(*state, key, rowId, AttrType::Bool, b ? "1" : "0");
+            return rowId;
         });
     }
 
@@ -178,7 +749,10 @@ struct AttrDb
 
             state->insertAttribute.use()(key.first)(symbols[key.second])(AttrType::Int) (n).exec();
 
-            return state->db.getLastInsertedRowId();
+            AttrId rowId = state->db.getLastInsertedRowId();
+            addChild(key, rowId, int_t{NixInt{n}});
+            remember(*state, key, rowId, AttrType::Int, std::to_string(n));
+            return rowId;
         });
     }
 
@@ -192,7 +766,10 @@ struct AttrDb
                     AttrType::ListOfStrings) (dropEmptyInitThenConcatStringsSep("\t", l))
                 .exec();
 
-            return state->db.getLastInsertedRowId();
+            AttrId rowId = state->db.getLastInsertedRowId();
+            addChild(key, rowId, std::vector<std::string>(l));
+            remember(*state, key, rowId, AttrType::ListOfStrings, dropEmptyInitThenConcatStringsSep("\t", l));
+            return rowId;
         });
     }
 
@@ -203,7 +780,10 @@ struct AttrDb
 
             state->insertAttribute.use()(key.first)(symbols[key.second])(AttrType::Placeholder) (0, false).exec();
 
-            return state->db.getLastInsertedRowId();
+            AttrId rowId = state->db.getLastInsertedRowId();
+            addChild(key, rowId, placeholder_t());
+            remember(*state, key, rowId, std::nullopt);
+            return rowId;
         });
     }
 
@@ -214,7 +794,10 @@ struct AttrDb
 
             state->insertAttribute.use()(key.first)(symbols[key.second])(AttrType::Missing) (0, false).exec();
 
-            return state->db.getLastInsertedRowId();
+            AttrId rowId = state->db.getLastInsertedRowId();
+            addChild(key, rowId, missing_t());
+            remember(*state, key, rowId, AttrType::Missing);
+            return rowId;
         });
     }
 
@@ -225,7 +808,10 @@ struct AttrDb
 
             state->insertAttribute.use()(key.first)(symbols[key.second])(AttrType::Misc) (0, false).exec();
 
-            return state->db.getLastInsertedRowId();
+            AttrId rowId = state->db.getLastInsertedRowId();
+            addChild(key, rowId, misc_t());
+            remember(*state, key, rowId, AttrType::Misc);
+            return rowId;
         });
     }
 
@@ -236,55 +822,218 @@ struct AttrDb
 
             state->insertAttribute.use()(key.first)(symbols[key.second])(AttrType::Failed) (0, false).exec();
 
-            return state->db.getLastInsertedRowId();
+            AttrId rowId = state->db.getLastInsertedRowId();
+            addChild(key, rowId, failed_t());
+            remember(*state, key, rowId, std::nullopt);
+            return rowId;
         });
     }
 
-    std::optional<std::pair<AttrId, AttrValue>> getAttr(AttrKey key)
+    /**
+     * Look up `key` in `depDb`, and if it's there, copy it into this
+     * cache.
+     */
+    std::optional<std::pair<AttrId, AttrValue>> importAttr(State & state, AttrKey key)
     {
-        auto state(_state->lock());
+        if (!depDb || failed)
+            return {};
+
+        auto path = getPath(state, key);
+        if (!path)
+            return {};
 
-        auto queryAttribute(state->queryAttribute.use()(key.first)(symbols[key.second]));
-        if (!queryAttribute.next())
+        auto value = depDb->lookup(*path);
+        if (!value)
             return {};
 
-        auto rowId = (AttrId) queryAttribute.getInt(0);
-        auto type = (AttrType) queryAttribute.getInt(1);
+        AttrId rowId = 0;
 
+        try {
+            auto insert = [&](AttrType type, std::string_view s, bool notNull = true) {
+                state.insertAttribute.use()(key.first)(symbols[key.second])(type)(s, notNull).exec();
+                rowId = state.db.getLastInsertedRowId();
+            };
+
+            std::visit(
+                overloaded{
+                    [&](const std::vector<Symbol> & attrs) {
+                        insert(AttrType::FullAttrs, "", false);
+                        std::vector<std::pair<Symbol, AttrId>> placeholders;
+                        for (auto & attr : attrs) {
+                            state.insertAttribute.use()(rowId)(symbols[attr])(AttrType::Placeholder) (0, false).exec();
+                            placeholders.emplace_back(attr, state.db.getLastInsertedRowId());
+                        }
+                        addChildren(rowId, placeholders);
+                    },
+                    [&](const string_t & s) {
+                        if (s.second.empty())
+                            insert(AttrType::String, s.first);
+                        else {
+                            std::string ctx;
+                            for (auto & elem : s.second) {
+                                if (!ctx.empty())
+                                    ctx.push_back(' ');
+                                ctx.append(elem.to_string());
+                            }
+                            state.insertAttributeWithContext.use()(key.first)(symbols[key.second])(AttrType::String) (
+                                s.first) (ctx)
+                                .exec();
+                            rowId = state.db.getLastInsertedRowId();
+                        }
+                    },
+                    [&](const missing_t &) { insert(AttrType::Missing, "", false); },
+                    [&](const misc_t &) { insert(AttrType::Misc, "", false); },
+                    [&](bool b) { insert(AttrType::Bool, b ? "1" : "0"); },
+                    [&](const int_t & n) { insert(AttrType::Int, std::to_string(n.x.value)); },
+                    [&](const std::vector<std::string> & l) {
+                        insert(AttrType::ListOfStrings, dropEmptyInitThenConcatStringsSep("\t", l));
+                    },
+                    [&](const auto &) { unreachable(); },
+                },
+                *value);
+        } catch (SQLiteError &) {
+            ignoreExceptionExceptInterrupt();
+            failed = true;
+            return {};
+        }
+
+        remember(state, key, rowId, std::nullopt);
+        addChild(key, rowId, AttrValue(*value));
+        return {{rowId, std::move(*value)}};
+    }
+
+    /**
+     * Decode the value and context in columns 3 and 4 of a row.
+     */
+    AttrValue readValue(SQLiteStmt::Use & query, AttrType type)
+    {
         switch (type) {
         case AttrType::Placeholder:
-            return {{rowId, placeholder_t()}};
-        case AttrType::FullAttrs: {
-            // FIXME: expensive, should separate this out.
-            std::vector<Symbol> attrs;
-            auto queryAttributes(state->queryAttributes.use()(rowId));
-            while (queryAttributes.next())
-                attrs.emplace_back(symbols.create(queryAttributes.getStr(0)));
-            return {{rowId, attrs}};
-        }
+            return placeholder_t();
+        case AttrType::FullAttrs:
+            return std::vector<Symbol>();
         case AttrType::String: {
             NixStringContext context;
-            if (!queryAttribute.isNull(3))
-                for (auto & s : tokenizeString<std::vector<std::string>>(queryAttribute.getStr(3), ";"))
+            if (!query.isNull(4))
+                for (auto & s : tokenizeString<std::vector<std::string>>(query.getStr(4), ";"))
                     context.insert(NixStringContextElem::parse(s));
-            return {{rowId, string_t{queryAttribute.getStr(2), context}}};
+            return string_t{query.getStr(3), context};
         }
         case AttrType::Bool:
-            return {{rowId, queryAttribute.getInt(2) != 0}};
+            return query.getInt(3) != 0;
         case AttrType::Int:
-            return {{rowId, int_t{NixInt{queryAttribute.getInt(2)}}}};
+            return int_t{NixInt{query.getInt(3)}};
         case AttrType::ListOfStrings:
-            return {{rowId, tokenizeString<std::vector<std::string>>(queryAttribute.getStr(2), "\t")}};
+            return tokenizeString<std::vector<std::string>>(query.getStr(3), "\t");
         case AttrType::Missing:
-            return {{rowId, missing_t()}};
+            return missing_t();
         case AttrType::Misc:
-            return {{rowId, misc_t()}};
+            return misc_t();
         case AttrType::Failed:
-            return {{rowId, failed_t()}};
+            return failed_t();
         default:
             throw Error("unexpected type in evaluation cache");
         }
     }
+
+    /**
+     * Make sure that `children` contains all children of `parent`,
+     * reading them in one query if necessary.
+     */
+    void loadChildren(AttrId parent)
+    {
+        /* We wrote all children of our own rows. */
+        if (parent > lastCommittedRow || failed)
+            return;
+
+        {
+            auto children_(children.readLock());
+            auto i = children_->find(parent);
+            if (i != children_->end() && i->second.complete)
+                return;
+        }
+
+        std::vector<std::pair<Symbol, std::pair<AttrId, AttrValue>>> attrs;
+
+        try {
+            auto conn(readConnections.get());
+            auto queryChildren(conn->queryChildren.use()(parent));
+            while (queryChildren.next()) {
+                auto name = symbols.create(queryChildren.getStr(0));
+                auto rowId = (AttrId) queryChildren.getInt(1);
+                auto type = (AttrType) queryChildren.getInt(2);
+                attrs.emplace_back(name, std::pair{rowId, readValue(queryChildren, type)});
+            }
+        } catch (SQLiteError &) {
+            ignoreExceptionExceptInterrupt();
+            failed = true;
+            return;
+        }
+
+        auto children_(children.lock());
+        auto & c = (*children_)[parent];
+        /* Rows that we wrote in the meantime take precedence. */
+        for (auto & [name, attr] : attrs)
+            c.attrs.emplace(name, std::move(attr));
+        c.complete = true;
+    }
+
+    std::optional<std::pair<AttrId, AttrValue>> getChild(AttrKey key)
+    {
+        loadChildren(key.first);
+
+        std::optional<std::pair<AttrId, AttrValue>> attr;
+
+        {
+            auto children_(children.readLock());
+            auto i = children_->find(key.first);
+            if (i == children_->end())
+                return {};
+            auto j = i->second.attrs.find(key.second);
+            if (j == i->second.attrs.end())
+                return {};
+            attr = j->second;
+        }
+
+        if (auto names = std::get_if<std::vector<Symbol>>(&attr->second)) {
+            /* The names of an attribute set are its children, which
+               the cursor is likely to look at next. */
+            loadChildren(attr->first);
+            auto children_(children.readLock());
+            names->clear();
+            if (auto i = children_->find(attr->first); i != children_->end())
+                for (auto & [name, _] : i->second.attrs)
+                    names->push_back(name);
+            std::sort(names->begin(), names->end(), [&](Symbol a, Symbol b) {
+                return std::string_view(symbols[a]) < std::string_view(symbols[b]);
+            });
+        }
+
+        return attr;
+    }
+
+    std::optional<std::pair<AttrId, AttrValue>> getAttr(AttrKey key)
+    {
+        auto attr = getChild(key);
+
+        if (!depDb)
+            return attr;
+
+        auto state(_state->lock());
+
+        if (!attr)
+            return importAttr(*state, key);
+
+        remember(*state, key, attr->first, std::nullopt);
+
+        /* Not evaluated yet in this version of the flake, but maybe in
+           a previous one. */
+        if (std::get_if<placeholder_t>(&attr->second))
+            if (auto imported = importAttr(*state, key))
+                return imported;
+
+        return attr;
+    }
 };
 
 static std::shared_ptr<AttrDb> makeAttrDb(const StoreDirConfig & cfg, const Hash & fingerprint, SymbolTable & symbols)
@@ -298,11 +1047,16 @@ static std::shared_ptr<AttrDb> makeAttrDb(const StoreDirConfig & cfg, const Hash
 }
 
 EvalCache::EvalCache(
-    std::optional<std::reference_wrapper<const Hash>> useCache, EvalState & state, RootLoader rootLoader)
+    std::optional<std::reference_wrapper<const Hash>> useCache,
+    EvalState & state,
+    RootLoader rootLoader,
+    std::optional<DependencyRoot> dependencyRoot)
     : db(useCache ? makeAttrDb(*state.store, *useCache, state.symbols) : nullptr)
     , state(state)
     , rootLoader(rootLoader)
 {
+    if (db && dependencyRoot && state.dependencies)
+        db->depDb = makeDepDb(state, std::move(*dependencyRoot));
 }
 
 Value * EvalCache::getRootValue()
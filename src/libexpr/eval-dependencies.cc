@@ -0,0 +1,247 @@
+#include "nix/expr/eval-dependencies.hh"
+#include "nix/expr/eval.hh"
+#include "nix/expr/eval-inline.hh"
+#include "nix/util/forwarding-source-accessor.hh"
+#include "nix/util/serialise.hh"
+
+namespace nix {
+
+void EvalDependencies::add(std::string key, std::string value)
+{
+    auto state(state_.lock());
+    if (state->keys.insert(key).second)
+        state->deps.push_back({std::move(key), std::move(value)});
+}
+
+size_t EvalDependencies::size()
+{
+    return state_.lock()->deps.size();
+}
+
+std::vector<EvalDependencies::Dependency> EvalDependencies::since(size_t start)
+{
+    auto state(state_.lock());
+    assert(start <= state->deps.size());
+    return {state->deps.begin() + start, state->deps.end()};
+}
+
+void EvalDependencies::addRoot(const std::string & identity, const std::string & path)
+{
+    state_.lock()->roots.insert_or_assign(path, identity);
+}
+
+std::optional<std::pair<std::string, std::string>> EvalDependencies::findRoot(std::string_view path)
+{
+    auto state(state_.lock());
+
+    /* Roots are store paths, so they don't nest. */
+    auto i = state->roots.upper_bound(std::string(path));
+    if (i == state->roots.begin())
+        return std::nullopt;
+    --i;
+
+    if (path == i->first)
+        return {{i->second, ""}};
+    if (path.starts_with(i->first) && path[i->first.size()] == '/')
+        return {{i->second, std::string(path.substr(i->first.size() + 1))}};
+
+    return std::nullopt;
+}
+
+void EvalDependencies::addDerivation(const StorePath & drvPath, StorePathSet inputs)
+{
+    state_.lock()->derivations.insert_or_assign(drvPath, std::move(inputs));
+}
+
+bool EvalDependencies::refersTo(const NixStringContext & context, const StorePath & path)
+{
+    auto state(state_.lock());
+
+    boost::unordered_flat_set<StorePath> done;
+    std::vector<StorePath> todo;
+
+    for (auto & elem : context) {
+        auto refersTo = std::visit(
+            overloaded{
+                [&](const NixStringContextElem::Opaque & o) {
+                    todo.push_back(o.path);
+                    return false;
+                },
+                [&](const NixStringContextElem::DrvDeep & d) {
+                    todo.push_back(d.drvPath);
+                    return false;
+                },
+                [&](const NixStringContextElem::Built & b) {
+                    todo.push_back(b.drvPath->getBaseStorePath());
+                    return false;
+                },
+                /* We can't tell where a lazy path comes from. */
+                [&](const NixStringContextElem::Path & p) { return true; },
+            },
+            elem.raw);
+        if (refersTo)
+            return true;
+    }
+
+    while (!todo.empty()) {
+        auto p = std::move(todo.back());
+        todo.pop_back();
+        if (p == path)
+            return true;
+        if (!done.insert(p).second || !p.isDerivation())
+            continue;
+        auto i = state->derivations.find(p);
+        /* A derivation that this evaluation didn't write may refer to
+           anything. */
+        if (i == state->derivations.end())
+            return true;
+        todo.insert(todo.end(), i->second.begin(), i->second.end());
+    }
+
+    return false;
+}
+
+static std::string showStat(std::optional<SourceAccessor::Stat> st)
+{
+    if (!st)
+        return "missing";
+    return st->type == SourceAccessor::tRegular && st->isExecutable ? "executable" : st->typeString();
+}
+
+static std::string showFingerprint(const std::pair<CanonPath, std::optional<std::string>> & fingerprint)
+{
+    return fingerprint.second ? *fingerprint.second + ":" + fingerprint.first.abs() : "";
+}
+
+static std::string hashDirectory(const SourceAccessor::DirEntries & entries)
+{
+    HashSink sink(HashAlgorithm::SHA256);
+    for (auto & [name, type] : entries)
+        sink(fmt("%s\t%d\n", name, type ? (int) *type : -1));
+    return sink.finish().hash.to_string(HashFormat::Base16, false);
+}
+
+struct DependencyTrackingAccessor : ForwardingSourceAccessor
+{
+    ref<EvalDependencies> deps;
+
+    DependencyTrackingAccessor(ref<SourceAccessor> next, ref<EvalDependencies> deps)
+        : ForwardingSourceAccessor(next)
+        , deps(deps)
+    {
+    }
+
+    std::string readFile(const CanonPath & path) override
+    {
+        auto s = next->readFile(path);
+        deps->add("read:" + path.abs(), hashString(HashAlgorithm::SHA256, s).to_string(HashFormat::Base16, false));
+        return s;
+    }
+
+    void readFile(const CanonPath & path, Sink & sink, std::function<void(uint64_t)> sizeCallback) override
+    {
+        HashSink hashSink(HashAlgorithm::SHA256);
+        TeeSink tee(sink, hashSink);
+        next->readFile(path, tee, sizeCallback);
+        deps->add("read:" + path.abs(), hashSink.finish().hash.to_string(HashFormat::Base16, false));
+    }
+
+    std::optional<Stat> maybeLstat(const CanonPath & path) override
+    {
+        auto st = next->maybeLstat(path);
+        deps->add("stat:" + path.abs(), showStat(st));
+        return st;
+    }
+
+    DirEntries readDirectory(const CanonPath & path) override
+    {
+        auto entries = next->readDirectory(path);
+        deps->add("dir:" + path.abs(), hashDirectory(entries));
+        return entries;
+    }
+
+    std::string readLink(const CanonPath & path) override
+    {
+        auto target = next->readLink(path);
+        deps->add("link:" + path.abs(), target);
+        return target;
+    }
+
+    std::pair<CanonPath, std::optional<std::string>> getFingerprint(const CanonPath & path) override
+    {
+        /* Callers with a fingerprint (such as `fetchToStore()`) may
+           skip reading the files below `path`, so the fingerprint
+           stands in for them. */
+        auto res = next->getFingerprint(path);
+        if (res.second)
+            deps->add("tree:" + path.abs(), showFingerprint(res));
+        return res;
+    }
+};
+
+ref<SourceAccessor> makeDependencyTrackingAccessor(ref<SourceAccessor> next, ref<EvalDependencies> deps)
+{
+    return make_ref<DependencyTrackingAccessor>(next, deps);
+}
+
+std::optional<std::string>
+observeDependency(SourceAccessor & accessor, const CanonPath & root, const std::string & key)
+{
+    auto colon = key.find(':');
+    if (colon == key.npos)
+        return std::nullopt;
+    auto kind = std::string_view(key).substr(0, colon);
+    auto path = root / CanonPath(key.substr(colon + 1));
+
+    try {
+        if (kind == "read")
+            return hashString(HashAlgorithm::SHA256, accessor.readFile(path)).to_string(HashFormat::Base16, false);
+        if (kind == "stat")
+            return showStat(accessor.maybeLstat(path));
+        if (kind == "dir")
+            return hashDirectory(accessor.readDirectory(path));
+        if (kind == "link")
+            return accessor.readLink(path);
+        if (kind == "tree")
+            return showFingerprint(accessor.getFingerprint(path));
+    } catch (Error &) {
+        /* The file disappeared or changed type. */
+        return "";
+    }
+
+    return std::nullopt;
+}
+
+void mkDependentValue(EvalState & state, Value & v, Value * target, std::string key, std::string value)
+{
+    /* Shared by all dependent values, which pass the dependency as
+       the first two arguments. */
+    static PrimOp primOp{
+        .name = "«dependency»",
+        .arity = 3,
+        .fun =
+            [](EvalState & state, const PosIdx pos, Value ** args, Value & v) {
+                state.dependencies->add(std::string(args[0]->string_view()), std::string(args[1]->string_view()));
+                state.forceValue(*args[2], pos);
+                v = *args[2];
+            },
+        .internal = true,
+    };
+
+    auto vPrimOp = state.allocValue();
+    vPrimOp->mkPrimOp(&primOp);
+
+    auto vKey = state.allocValue();
+    vKey->mkString(key, state.mem);
+    auto vValue = state.allocValue();
+    vValue->mkString(value, state.mem);
+
+    auto vApp1 = state.allocValue();
+    vApp1->mkPrimOpApp(vPrimOp, vKey);
+    auto vApp2 = state.allocValue();
+    vApp2->mkPrimOpApp(vApp1, vValue);
+
+    v.mkApp(vApp2, target);
+}
+
+} // namespace nix
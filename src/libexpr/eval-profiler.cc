@@ -1,6 +1,7 @@
 #include "nix/expr/eval-profiler.hh"
 #include "nix/expr/nixexpr.hh"
 #include "nix/expr/eval.hh"
+#include "nix/expr/parallel-eval.hh"
 #include "nix/util/lru-cache.hh"
 
 namespace nix {
@@ -11,6 +12,10 @@ void EvalProfiler::postFunctionCallHook(EvalState & state, const Value & v, std:
 {
 }
 
+void EvalProfiler::wasmCallHook(EvalState & state, const SourcePath & module, std::string_view function, uint64_t fuel)
+{
+}
+
 void MultiEvalProfiler::preFunctionCallHook(
     EvalState & state, const Value & v, std::span<Value *> args, const PosIdx pos)
 {
@@ -29,6 +34,15 @@ void MultiEvalProfiler::postFunctionCallHook(
     }
 }
 
+void MultiEvalProfiler::wasmCallHook(
+    EvalState & state, const SourcePath & module, std::string_view function, uint64_t fuel)
+{
+    for (auto & profiler : profilers) {
+        if (profiler->getNeededHooks().test(Hook::wasmCall))
+            profiler->wasmCallHook(state, module, function, fuel);
+    }
+}
+
 EvalProfiler::Hooks MultiEvalProfiler::getNeededHooksImpl() const
 {
     Hooks hooks;
@@ -115,10 +129,38 @@ using FrameInfo =
     std::variant<LambdaFrameInfo, PrimOpFrameInfo, FunctorFrameInfo, DerivationStrictFrameInfo, GenericFrameInfo>;
 using FrameStack = std::vector<FrameInfo>;
 
+static AutoCloseFD openProfileFile(const std::filesystem::path & path)
+{
+    AutoCloseFD fd = toDescriptor(open(path.string().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0660));
+    if (!fd)
+        throw SysError("opening file %s", path);
+    return fd;
+}
+
+/**
+ * Base class for profilers that keep track of the function call stack.
+ */
+class CallStackProfiler : public EvalProfiler
+{
+protected:
+    /** Hold on to an instance of EvalState for symbolizing positions. */
+    EvalState & state;
+    PosCache posCache;
+
+    CallStackProfiler(EvalState & state)
+        : state(state)
+        , posCache(state)
+    {
+    }
+
+    FrameInfo getPrimOpFrameInfo(const PrimOp & primOp, std::span<Value *> args, PosIdx pos);
+    FrameInfo getFrameInfoFromValueAndPos(const Value & v, std::span<Value *> args, PosIdx pos);
+};
+
 /**
  * Stack sampling profiler.
  */
-class SampleStack : public EvalProfiler
+class SampleStack : public CallStackProfiler
 {
     /* How often stack profiles should be flushed to file. This avoids the need
        to persist stack samples across the whole evaluation at the cost
@@ -127,22 +169,15 @@ class SampleStack : public EvalProfiler
 
     Hooks getNeededHooksImpl() const override
     {
-        return Hooks().set(preFunctionCall).set(postFunctionCall);
+        return Hooks().set(preFunctionCall).set(postFunctionCall).set(wasmCall);
     }
 
-    FrameInfo getPrimOpFrameInfo(const PrimOp & primOp, std::span<Value *> args, PosIdx pos);
-
 public:
     SampleStack(EvalState & state, std::filesystem::path profileFile, std::chrono::nanoseconds period)
-        : state(state)
+        : CallStackProfiler(state)
         , sampleInterval(period)
-        , profileFd([&]() {
-            AutoCloseFD fd = toDescriptor(open(profileFile.string().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0660));
-            if (!fd)
-                throw SysError("opening file %s", profileFile);
-            return fd;
-        }())
-        , posCache(state)
+        , profileFile(profileFile)
+        , profileFd(openProfileFile(profileFile))
     {
     }
 
@@ -150,10 +185,11 @@ public:
     preFunctionCallHook(EvalState & state, const Value & v, std::span<Value *> args, const PosIdx pos) override;
     [[gnu::noinline]] void
     postFunctionCallHook(EvalState & state, const Value & v, std::span<Value *> args, const PosIdx pos) override;
+    [[gnu::noinline]] void
+    wasmCallHook(EvalState & state, const SourcePath & module, std::string_view function, uint64_t fuel) override;
 
     void maybeSaveProfile(std::chrono::time_point<std::chrono::high_resolution_clock> now);
     void saveProfile();
-    FrameInfo getFrameInfoFromValueAndPos(const Value & v, std::span<Value *> args, PosIdx pos);
 
     SampleStack(SampleStack &&) = default;
     SampleStack & operator=(SampleStack &&) = delete;
@@ -161,19 +197,25 @@ public:
     SampleStack & operator=(const SampleStack &) = delete;
     ~SampleStack();
 private:
-    /** Hold on to an instance of EvalState for symbolizing positions. */
-    EvalState & state;
     std::chrono::nanoseconds sampleInterval;
+    std::filesystem::path profileFile;
     AutoCloseFD profileFd;
     FrameStack stack;
     std::map<FrameStack, uint32_t> callCount;
+    /**
+     * Fuel consumed by `builtins.wasm` calls, keyed by the call stack
+     * and the called WASM function. This is written in the same
+     * collapsed-stack format as the samples, but to a separate file
+     * (`<profile>.wasm-fuel`) since the unit differs.
+     */
+    std::map<std::pair<FrameStack, std::string>, uint64_t> wasmFuel;
+    AutoCloseFD wasmFuelFd;
     std::chrono::time_point<std::chrono::high_resolution_clock> lastStackSample =
         std::chrono::high_resolution_clock::now();
     std::chrono::time_point<std::chrono::high_resolution_clock> lastDump = std::chrono::high_resolution_clock::now();
-    PosCache posCache;
 };
 
-FrameInfo SampleStack::getPrimOpFrameInfo(const PrimOp & primOp, std::span<Value *> args, PosIdx pos)
+FrameInfo CallStackProfiler::getPrimOpFrameInfo(const PrimOp & primOp, std::span<Value *> args, PosIdx pos)
 {
     auto derivationInfo = [&]() -> std::optional<FrameInfo> {
         /* Here we rely a bit on the implementation details of libexpr/primops/derivation.nix
@@ -199,7 +241,7 @@ FrameInfo SampleStack::getPrimOpFrameInfo(const PrimOp & primOp, std::span<Value
     return derivationInfo.value_or(PrimOpFrameInfo{.expr = &primOp, .callPos = pos});
 }
 
-FrameInfo SampleStack::getFrameInfoFromValueAndPos(const Value & v, std::span<Value *> args, PosIdx pos)
+FrameInfo CallStackProfiler::getFrameInfoFromValueAndPos(const Value & v, std::span<Value *> args, PosIdx pos)
 {
     /* NOTE: No actual references to garbage collected values are not held in
        the profiler. */
@@ -246,6 +288,12 @@ SampleStack::postFunctionCallHook(EvalState & state, const Value & v, std::span<
         stack.pop_back();
 }
 
+[[gnu::noinline]] void
+SampleStack::wasmCallHook(EvalState & state, const SourcePath & module, std::string_view function, uint64_t fuel)
+{
+    wasmFuel[{stack, fmt("wasm %s:%s", module, function)}] += fuel;
+}
+
 std::ostream & LambdaFrameInfo::symbolize(const EvalState & state, std::ostream & os, PosCache & posCache) const
 {
     if (auto pos = posCache.lookup(callPos); std::holds_alternative<std::monostate>(pos.origin))
@@ -308,6 +356,7 @@ void SampleStack::maybeSaveProfile(std::chrono::time_point<std::chrono::high_res
     /* Free up memory used for stack sampling. This might be very significant for
        long-running evaluations, so we shouldn't hog too much memory. */
     callCount.clear();
+    wasmFuel.clear();
 }
 
 void SampleStack::saveProfile()
@@ -329,6 +378,26 @@ void SampleStack::saveProfile()
         os.str("");
         os.clear();
     }
+
+    if (wasmFuel.empty())
+        return;
+
+    if (!wasmFuelFd) {
+        auto fuelFile = profileFile.string() + ".wasm-fuel";
+        wasmFuelFd = openProfileFile(fuelFile);
+    }
+
+    for (auto & [key, fuel] : wasmFuel) {
+        auto & [stack, function] = key;
+        for (auto & pos : stack) {
+            std::visit([&](auto && info) { info.symbolize(state, os, posCache); }, pos);
+            os << ";";
+        }
+        os << function << " " << fuel;
+        writeLine(wasmFuelFd.get(), os.str());
+        os.str("");
+        os.clear();
+    }
 }
 
 SampleStack::~SampleStack()
@@ -341,6 +410,214 @@ SampleStack::~SampleStack()
     }
 }
 
+/**
+ * Tracing profiler. Unlike `SampleStack`, this measures every function
+ * call, and attributes the memory allocated by the evaluator to the
+ * function that allocated it.
+ *
+ * Call stacks are interned in a tree, so that the cost of a call
+ * doesn't depend on the depth of the stack.
+ */
+class TracingProfiler : public CallStackProfiler
+{
+    static constexpr std::chrono::microseconds profileDumpInterval = std::chrono::milliseconds(2000);
+
+    using Clock = std::chrono::steady_clock;
+
+    Hooks getNeededHooksImpl() const override
+    {
+        return Hooks().set(preFunctionCall).set(postFunctionCall);
+    }
+
+    /**
+     * A call stack, as a node in the tree of all call stacks seen so
+     * far. Node 0 is the empty stack.
+     */
+    struct Node
+    {
+        uint32_t parent;
+        FrameInfo frame;
+        /** Time spent in this stack, excluding callees. */
+        Clock::duration selfTime{0};
+        /** Bytes allocated in this stack, excluding callees. */
+        EvalMemory::AllocatedBytes allocated{};
+    };
+
+    std::vector<Node> nodes;
+    std::map<std::pair<uint32_t, FrameInfo>, uint32_t> children;
+
+    struct Call
+    {
+        uint32_t node;
+        Clock::time_point start;
+        /** Time spent in the callees of this call. */
+        Clock::duration callees{0};
+    };
+
+    std::vector<Call> calls;
+
+    /** The allocation counters at the previous hook. */
+    EvalMemory::AllocatedBytes lastAllocated;
+
+    std::filesystem::path profileFile;
+    AutoCloseFD profileFd;
+    AutoCloseFD allocFd;
+    Clock::time_point lastDump = Clock::now();
+
+    uint32_t currentNode() const
+    {
+        return calls.empty() ? 0 : calls.back().node;
+    }
+
+    /**
+     * Attribute the memory allocated since the previous hook to the
+     * current call.
+     */
+    void attributeAllocations()
+    {
+        auto & allocated = nodes[currentNode()].allocated;
+        for (size_t i = 0; i < EvalMemory::nrAllocationKinds; ++i)
+            allocated[i] += EvalMemory::allocatedBytes[i] - lastAllocated[i];
+        lastAllocated = EvalMemory::allocatedBytes;
+    }
+
+    std::string showStack(uint32_t node);
+
+    void saveProfile();
+
+public:
+    TracingProfiler(EvalState & state, std::filesystem::path profileFile)
+        : CallStackProfiler(state)
+        , lastAllocated(EvalMemory::allocatedBytes)
+        , profileFile(profileFile)
+        , profileFd(openProfileFile(profileFile))
+        , allocFd(openProfileFile(profileFile.string() + ".alloc"))
+    {
+        /* The call stacks and the allocation counters are per
+           evaluation, so calls from different threads would be
+           attributed to each other. */
+        if (state.executor->evalCores > 1)
+            throw Error("the 'tracing' evaluation profiler requires 'eval-cores' to be set to 1");
+        nodes.push_back({.parent = 0, .frame = GenericFrameInfo{.pos = noPos}});
+        EvalMemory::trackAllocations = true;
+    }
+
+    TracingProfiler(const TracingProfiler &) = delete;
+    TracingProfiler & operator=(const TracingProfiler &) = delete;
+
+    [[gnu::noinline]] void
+    preFunctionCallHook(EvalState & state, const Value & v, std::span<Value *> args, const PosIdx pos) override;
+    [[gnu::noinline]] void
+    postFunctionCallHook(EvalState & state, const Value & v, std::span<Value *> args, const PosIdx pos) override;
+
+    ~TracingProfiler();
+};
+
+[[gnu::noinline]] void
+TracingProfiler::preFunctionCallHook(EvalState & state, const Value & v, std::span<Value *> args, const PosIdx pos)
+{
+    attributeAllocations();
+
+    auto parent = currentNode();
+    auto [i, inserted] =
+        children.try_emplace({parent, getFrameInfoFromValueAndPos(v, args, pos)}, (uint32_t) nodes.size());
+    if (inserted)
+        nodes.push_back({.parent = parent, .frame = i->first.second});
+
+    auto now = Clock::now();
+
+    /* Do this in preFunctionCallHook because we might throw an exception, but
+       callFunction uses Finally, which doesn't play well with exceptions. */
+    if (now - lastDump >= profileDumpInterval) {
+        saveProfile();
+        /* Don't account the time spent flushing to disk to the calls
+           in progress. */
+        lastDump = Clock::now();
+        for (auto & call : calls)
+            call.start += lastDump - now;
+        now = lastDump;
+    }
+
+    calls.push_back({.node = i->second, .start = now});
+}
+
+[[gnu::noinline]] void
+TracingProfiler::postFunctionCallHook(EvalState & state, const Value & v, std::span<Value *> args, const PosIdx pos)
+{
+    if (calls.empty())
+        return;
+
+    auto now = Clock::now();
+
+    attributeAllocations();
+
+    auto call = calls.back();
+    calls.pop_back();
+
+    auto elapsed = now - call.start;
+    nodes[call.node].selfTime += elapsed - call.callees;
+    if (!calls.empty())
+        calls.back().callees += elapsed;
+}
+
+std::string TracingProfiler::showStack(uint32_t node)
+{
+    std::vector<uint32_t> path;
+    for (; node; node = nodes[node].parent)
+        path.push_back(node);
+
+    std::ostringstream os;
+    for (auto i = path.rbegin(); i != path.rend(); ++i) {
+        if (i != path.rbegin())
+            os << ";";
+        std::visit([&](auto && info) { info.symbolize(state, os, posCache); }, nodes[*i].frame);
+    }
+    return os.str();
+}
+
+void TracingProfiler::saveProfile()
+{
+    static constexpr std::array<std::string_view, EvalMemory::nrAllocationKinds> kindNames{
+        "«values»", "«environments»", "«arena environments»", "«attrsets»", "«lists»", "«strings»"};
+
+    for (uint32_t node = 0; node < nodes.size(); ++node) {
+        auto & n = nodes[node];
+
+        auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(n.selfTime).count();
+        bool allocated = std::ranges::any_of(n.allocated, [](uint64_t bytes) { return bytes != 0; });
+        if (!nanoseconds && !allocated)
+            continue;
+
+        auto stack = showStack(node);
+
+        if (nanoseconds && node)
+            writeLine(profileFd.get(), fmt("%s %d", stack, nanoseconds));
+
+        for (size_t kind = 0; kind < EvalMemory::nrAllocationKinds; ++kind)
+            if (n.allocated[kind])
+                writeLine(
+                    allocFd.get(),
+                    fmt("%s%s%s %d", stack, stack.empty() ? "" : ";", kindNames[kind], n.allocated[kind]));
+
+        /* The stacks are kept, since they'll likely be seen again. */
+        n.selfTime = Clock::duration{0};
+        n.allocated = {};
+    }
+}
+
+TracingProfiler::~TracingProfiler()
+{
+    EvalMemory::trackAllocations = false;
+
+    /* Guard against cases when we are already unwinding the stack. */
+    try {
+        attributeAllocations();
+        saveProfile();
+    } catch (...) {
+        ignoreExceptionInDestructor();
+    }
+}
+
 } // namespace
 
 ref<EvalProfiler> makeSampleStackProfiler(EvalState & state, std::filesystem::path profileFile, uint64_t frequency)
@@ -352,4 +629,9 @@ ref<EvalProfiler> makeSampleStackProfiler(EvalState & state, std::filesystem::pa
     return make_ref<SampleStack>(state, profileFile, period);
 }
 
+ref<EvalProfiler> makeTracingProfiler(EvalState & state, std::filesystem::path profileFile)
+{
+    return make_ref<TracingProfiler>(state, profileFile);
+}
+
 } // namespace nix
@@ -10,6 +10,7 @@
 #include "nix/util/environment-variables.hh"
 #include "nix/store/store-api.hh"
 #include "nix/store/derivations.hh"
+#include "nix/store/drv-hash-disk-cache.hh"
 #include "nix/store/downstream-placeholder.hh"
 #include "nix/expr/eval-inline.hh"
 #include "nix/store/filetransfer.hh"
@@ -25,8 +26,13 @@
 #include "nix/fetchers/tarball.hh"
 #include "nix/fetchers/input-cache.hh"
 #include "nix/util/current-process.hh"
+#include "nix/util/trace-events.hh"
 #include "nix/store/async-path-writer.hh"
+#include "nix/store/wasm.hh"
 #include "nix/expr/parallel-eval.hh"
+#include "nix/expr/parse-cache.hh"
+#include "nix/expr/eval-dependencies.hh"
+#include "nix/expr/bytecode.hh"
 
 #include "parser-tab.hh"
 
@@ -46,6 +52,7 @@
 #include <nlohmann/json.hpp>
 #include <boost/container/small_vector.hpp>
 #include <boost/unordered/concurrent_flat_map.hpp>
+#include <boost/unordered/concurrent_flat_set.hpp>
 #include <boost/unordered/unordered_flat_set.hpp>
 
 #ifndef _WIN32 // TODO use portable implementation
@@ -90,6 +97,7 @@ static const char * makeImmutableString(std::string_view s)
 
 StringData & StringData::alloc(EvalMemory & mem, size_t size)
 {
+    EvalMemory::countAllocation(EvalMemory::allocatedStrings, sizeof(StringData) + size + 1);
     void * t = mem.allocBytes(sizeof(StringData) + size + 1);
     if (!t)
         throw std::bad_alloc();
@@ -248,15 +256,67 @@ static Symbol getName(const AttrName & name, EvalState & state, Env & env)
 
 static constexpr size_t BASE_ENV_SIZE = 128;
 
+std::atomic<bool> EvalMemory::trackAllocations{false};
+
+thread_local EvalMemory::AllocatedBytes EvalMemory::allocatedBytes{};
+
 EvalMemory::EvalMemory()
 #if NIX_USE_BOEHMGC
     : valueAllocCache(std::allocate_shared<void *>(traceable_allocator<void *>(), nullptr))
     , env1AllocCache(std::allocate_shared<void *>(traceable_allocator<void *>(), nullptr))
+    , shapes(make_ref<decltype(shapes)::element_type>())
+#else
+    : shapes(make_ref<decltype(shapes)::element_type>())
 #endif
 {
     assertGCInitialized();
 }
 
+Env & EnvArena::allocSlow(size_t n)
+{
+    if (current < chunks.size()) {
+        chunks[current].used = offset;
+        current++;
+    }
+
+    /* Chunks after the current one are unused, so one that is too
+       small can be replaced. */
+    if (current < chunks.size() && chunks[current].size < n) {
+#if NIX_USE_BOEHMGC
+        GC_FREE(chunks[current].data);
+#else
+        free(chunks[current].data);
+#endif
+        chunks.erase(chunks.begin() + current);
+    }
+
+    if (current == chunks.size()) {
+        auto size = std::max(n, chunkSize);
+#if NIX_USE_BOEHMGC
+        auto data = (char *) GC_MALLOC_UNCOLLECTABLE(size);
+#else
+        auto data = (char *) malloc(size);
+#endif
+        if (!data)
+            throw std::bad_alloc();
+        std::memset(data, 0, size);
+        chunks.insert(chunks.begin() + current, Chunk{.data = data, .size = size});
+    }
+
+    offset = n;
+    return *(Env *) chunks[current].data;
+}
+
+EnvArena::~EnvArena()
+{
+    for (auto & chunk : chunks)
+#if NIX_USE_BOEHMGC
+        GC_FREE(chunk.data);
+#else
+        free(chunk.data);
+#endif
+}
+
 EvalState::EvalState(
     const LookupPath & lookupPathFromArguments,
     ref<Store> store,
@@ -267,6 +327,10 @@ EvalState::EvalState(
     , settings{settings}
     , symbols(StaticEvalSymbols::staticSymbolTable())
     , repair(NoRepair)
+    , dependencies(
+          settings.evalCacheDependencies && settings.pureEval && !settings.lazyTrees
+              ? std::make_shared<EvalDependencies>()
+              : nullptr)
     , storeFS(makeMountedSourceAccessor({
           {CanonPath::root, makeEmptySourceAccessor()},
           /* In the pure eval case, we can simply require
@@ -302,6 +366,10 @@ EvalState::EvalState(
         auto accessor = settings.pureEval ? storeFS.cast<SourceAccessor>()
                                           : makeUnionSourceAccessor({getFSSourceAccessor(), storeFS});
 
+        /* Record what the evaluation reads for the evaluation cache. */
+        if (dependencies)
+            accessor = makeDependencyTrackingAccessor(accessor, ref(dependencies));
+
         /* Apply access control if needed. */
         if (settings.restrictEval || settings.pureEval)
             accessor = AllowListSourceAccessor::create(
@@ -330,6 +398,7 @@ EvalState::EvalState(
     , importResolutionCache(make_ref<decltype(importResolutionCache)::element_type>())
     , fileEvalCache(make_ref<decltype(fileEvalCache)::element_type>())
     , regexCache(makeRegexCache())
+    , wasmModuleCache(makeWasmModuleCache())
 #if NIX_USE_BOEHMGC
     , baseEnvP(std::allocate_shared<Env *>(traceable_allocator<Env *>(), &mem.allocEnv(BASE_ENV_SIZE)))
     , baseEnv(**baseEnvP)
@@ -385,12 +454,24 @@ EvalState::EvalState(
         profiler.addProfiler(
             makeSampleStackProfiler(*this, settings.evalProfileFile.get(), settings.evalProfilerFrequency));
         break;
+    case EvalProfilerMode::tracing:
+        profiler.addProfiler(makeTracingProfiler(*this, settings.evalProfileFile.get()));
+        break;
     case EvalProfilerMode::disabled:
         break;
     }
 }
 
-EvalState::~EvalState() {}
+EvalState::~EvalState()
+{
+    /* Write the derivation hashes computed by this evaluation while
+       the logger is still around. */
+    try {
+        flushDrvHashDiskCache();
+    } catch (...) {
+        ignoreExceptionInDestructor();
+    }
+}
 
 void EvalState::allowPathLegacy(const Path & path)
 {
@@ -890,6 +971,7 @@ Value::StringWithContext::Context::fromBuilder(const NixStringContext & context,
     if (context.empty())
         return nullptr;
 
+    EvalMemory::countAllocation(EvalMemory::allocatedStrings, sizeof(Context) + context.size() * sizeof(value_type));
     auto ctx = new (mem.allocBytes(sizeof(Context) + context.size() * sizeof(value_type))) Context(context.size());
     std::ranges::transform(
         context, ctx->elems, [&](const NixStringContextElem & elt) { return &StringData::make(mem, elt.to_string()); });
@@ -948,6 +1030,8 @@ ListBuilder::ListBuilder(EvalMemory & mem, size_t size)
     : size(size)
     , elems(size <= 2 ? inlineElems : (Value **) mem.allocBytes(size * sizeof(Value *)))
 {
+    if (size > 2)
+        EvalMemory::countAllocation(EvalMemory::allocatedLists, size * sizeof(Value *));
 }
 
 Value * EvalState::getBool(bool b)
@@ -1119,7 +1203,15 @@ struct ExprParseFile : Expr
     {
         printTalkative("evaluating file '%s'", path);
 
-        auto e = state.parseExprFromFile(path);
+        auto name = path.to_string();
+
+        Expr * e;
+        {
+            TraceSpan span("parse", name);
+            e = state.parseExprFromFile(path);
+        }
+
+        TraceSpan span("eval", name);
 
         try {
             auto dts =
@@ -1354,7 +1446,7 @@ void ExprAttrs::eval(EvalState & state, Env & env, Value & v)
     v.mkAttrs(sort ? bindings.finish() : bindings.alreadySorted());
 }
 
-void ExprLet::eval(EvalState & state, Env & env, Value & v)
+Env & ExprLet::buildEnv(EvalState & state, Env & env)
 {
     /* Create a new environment that contains the attributes in this
        `let'. */
@@ -1371,6 +1463,13 @@ void ExprLet::eval(EvalState & state, Env & env, Value & v)
         env2.values[displ++] = i.second.e->maybeThunk(state, *i.second.chooseByKind(&env2, &env, inheritEnv));
     }
 
+    return env2;
+}
+
+void ExprLet::eval(EvalState & state, Env & env, Value & v)
+{
+    Env & env2 = buildEnv(state, env);
+
     auto dts = state.debugRepl
                    ? makeDebugTraceStacker(state, *this, env2, getPos(), "while evaluating a '%1%' expression", "let")
                    : nullptr;
@@ -1425,10 +1524,26 @@ static std::string showAttrSelectionPath(EvalState & state, Env & env, std::span
 void ExprSelect::eval(EvalState & state, Env & env, Value & v)
 {
     Value vTmp;
-    PosIdx pos2;
-    Value * vAttrs = &vTmp;
-
     e->eval(state, env, vTmp);
+    selectFrom(state, env, vTmp, v);
+}
+
+/**
+ * Look up the attribute selected by `i` in `attrs`, using the inline
+ * cache of the selection site.
+ */
+static inline const Attr * getCached(EvalState & state, const Bindings & attrs, Symbol name, const AttrName & i)
+{
+    bool hit;
+    auto attr = attrs.get(name, i.cache, hit);
+    (hit ? state.nrInlineCacheHits : state.nrInlineCacheMisses)++;
+    return attr;
+}
+
+void ExprSelect::selectFrom(EvalState & state, Env & env, Value & vBase, Value & v)
+{
+    PosIdx pos2;
+    Value * vAttrs = &vBase;
 
     try {
         auto dts = state.debugRepl ? makeDebugTraceStacker(
@@ -1446,13 +1561,13 @@ void ExprSelect::eval(EvalState & state, Env & env, Value & v)
             auto name = getName(i, state, env);
             if (def) {
                 state.forceValue(*vAttrs, pos);
-                if (vAttrs->type() != nAttrs || !(j = vAttrs->attrs()->get(name))) {
+                if (vAttrs->type() != nAttrs || !(j = getCached(state, *vAttrs->attrs(), name, i))) {
                     def->eval(state, env, v);
                     return;
                 }
             } else {
                 state.forceAttrs(*vAttrs, pos, "while selecting an attribute");
-                if (!(j = vAttrs->attrs()->get(name))) {
+                if (!(j = getCached(state, *vAttrs->attrs(), name, i))) {
                     StringSet allAttrNames;
                     for (auto & attr : *vAttrs->attrs())
                         allAttrNames.insert(std::string(state.symbols[attr.name]));
@@ -1505,23 +1620,25 @@ Symbol ExprSelect::evalExceptFinalSelect(EvalState & state, Env & env, Value & a
 void ExprOpHasAttr::eval(EvalState & state, Env & env, Value & v)
 {
     Value vTmp;
-    Value * vAttrs = &vTmp;
-
     e->eval(state, env, vTmp);
+    v.mkBool(hasAttrIn(state, env, vTmp));
+}
+
+bool ExprOpHasAttr::hasAttrIn(EvalState & state, Env & env, Value & vBase)
+{
+    Value * vAttrs = &vBase;
 
     for (auto & i : attrPath) {
         state.forceValue(*vAttrs, getPos());
         const Attr * j;
         auto name = getName(i, state, env);
-        if (vAttrs->type() == nAttrs && (j = vAttrs->attrs()->get(name))) {
+        if (vAttrs->type() == nAttrs && (j = getCached(state, *vAttrs->attrs(), name, i)))
             vAttrs = j->value;
-        } else {
-            v.mkBool(false);
-            return;
-        }
+        else
+            return false;
     }
 
-    v.mkBool(true);
+    return true;
 }
 
 void ExprLambda::eval(EvalState & state, Env & env, Value & v)
@@ -1567,7 +1684,13 @@ void EvalState::callFunction(Value & fun, std::span<Value *> args, Value & vRes,
             ExprLambda & lambda(*vCur.lambda().fun);
 
             auto size = (!lambda.arg ? 0 : 1) + (lambda.getFormals() ? lambda.getFormals()->formals.size() : 0);
-            Env & env2(mem.allocEnv(size));
+
+            /* If nothing can refer to the environment after the body
+               has been evaluated, free it right away. */
+            EnvArena::Frame envFrame;
+            Env & env2(
+                !lambda.envMayEscape && settings.evalEnvArena && !debugRepl ? mem.allocScopedEnv(size, envFrame)
+                                                                             : mem.allocEnv(size));
             env2.up = vCur.lambda().env;
 
             Displacement displ = 0;
@@ -1652,7 +1775,12 @@ void EvalState::callFunction(Value & fun, std::span<Value *> args, Value & vRes,
                                : nullptr;
 
                 vCur.reset();
-                lambda.body->eval(*this, env2, vCur);
+                /* The bytecode interpreter doesn't maintain the debugger's
+                   stack of frames. */
+                if (auto code = settings.evalBytecode && !debugRepl ? getBytecode(*this, lambda, env2) : nullptr)
+                    evalBytecode(*this, *code, env2, vCur);
+                else
+                    lambda.body->eval(*this, env2, vCur);
             } catch (Error & e) {
                 if (loggerSettings.showTrace.get()) {
                     addErrorTrace(
@@ -1862,13 +1990,17 @@ https://nix.dev/manual/nix/stable/language/syntax.html#functions.)",
     callFunction(fun, allocValue()->mkAttrs(attrs), res, pos);
 }
 
-void ExprWith::eval(EvalState & state, Env & env, Value & v)
+Env & ExprWith::buildEnv(EvalState & state, Env & env)
 {
     Env & env2(state.mem.allocEnv(1));
     env2.up = &env;
     env2.values[0] = attrs->maybeThunk(state, env);
+    return env2;
+}
 
-    body->eval(state, env2, v);
+void ExprWith::eval(EvalState & state, Env & env, Value & v)
+{
+    body->eval(state, buildEnv(state, env), v);
 }
 
 void ExprIf::eval(EvalState & state, Env & env, Value & v)
@@ -1879,27 +2011,31 @@ void ExprIf::eval(EvalState & state, Env & env, Value & v)
 
 void ExprAssert::eval(EvalState & state, Env & env, Value & v)
 {
-    if (!state.evalBool(env, cond, pos, "in the condition of the assert statement")) {
-        std::ostringstream out;
-        cond->show(state.symbols, out);
-        auto exprStr = out.view();
+    if (!state.evalBool(env, cond, pos, "in the condition of the assert statement"))
+        fail(state, env);
+    body->eval(state, env, v);
+}
 
-        if (auto eq = dynamic_cast<ExprOpEq *>(cond)) {
-            try {
-                Value v1;
-                eq->e1->eval(state, env, v1);
-                Value v2;
-                eq->e2->eval(state, env, v2);
-                state.assertEqValues(v1, v2, eq->pos, "in an equality assertion");
-            } catch (AssertionError & e) {
-                e.addTrace(state.positions[pos], "while evaluating the condition of the assertion '%s'", exprStr);
-                throw;
-            }
-        }
+void ExprAssert::fail(EvalState & state, Env & env)
+{
+    std::ostringstream out;
+    cond->show(state.symbols, out);
+    auto exprStr = out.view();
 
-        state.error<AssertionError>("assertion '%1%' failed", exprStr).atPos(pos).withFrame(env, *this).debugThrow();
+    if (auto eq = dynamic_cast<ExprOpEq *>(cond)) {
+        try {
+            Value v1;
+            eq->e1->eval(state, env, v1);
+            Value v2;
+            eq->e2->eval(state, env, v2);
+            state.assertEqValues(v1, v2, eq->pos, "in an equality assertion");
+        } catch (AssertionError & e) {
+            e.addTrace(state.positions[pos], "while evaluating the condition of the assertion '%s'", exprStr);
+            throw;
+        }
     }
-    body->eval(state, env, v);
+
+    state.error<AssertionError>("assertion '%1%' failed", exprStr).atPos(pos).withFrame(env, *this).debugThrow();
 }
 
 void ExprOpNot::eval(EvalState & state, Env & env, Value & v)
@@ -2980,9 +3116,15 @@ void EvalState::printStatistics()
     auto & memstats = mem.getStats();
 
     uint64_t bEnvs = memstats.nrEnvs * sizeof(Env) + memstats.nrValuesInEnvs * sizeof(Value *);
+    uint64_t bArenaEnvs = memstats.nrArenaEnvs * sizeof(Env) + memstats.nrValuesInArenaEnvs * sizeof(Value *);
     uint64_t bLists = memstats.nrListElems * sizeof(Value *);
     uint64_t bValues = memstats.nrValues * sizeof(Value);
     uint64_t bAttrsets = memstats.nrAttrsets * sizeof(Bindings) + memstats.nrAttrsInAttrsets * sizeof(Attr);
+    /* What attribute sets would take if every set only stored a
+       pointer to its shared shape and its values. */
+    uint64_t bAttrsetsShared = memstats.nrAttrsets * (sizeof(Bindings) + sizeof(void *))
+                               + memstats.nrAttrsInAttrsets * sizeof(Value *)
+                               + memstats.nrAttrsInShapes * (sizeof(Symbol) + sizeof(PosIdx));
 
 #if NIX_USE_BOEHMGC
     GC_word heapSize, totalBytes;
@@ -3011,6 +3153,9 @@ void EvalState::printStatistics()
         {"number", memstats.nrEnvs.load()},
         {"elements", memstats.nrValuesInEnvs.load()},
         {"bytes", bEnvs},
+        {"arena", memstats.nrArenaEnvs.load()},
+        {"arenaElements", memstats.nrValuesInArenaEnvs.load()},
+        {"arenaBytes", bArenaEnvs},
     };
     topObj["nrExprs"] = Expr::nrExprs.load();
     topObj["list"] = {
@@ -3030,6 +3175,14 @@ void EvalState::printStatistics()
         {"number", memstats.nrAttrsets.load()},
         {"bytes", bAttrsets},
         {"elements", memstats.nrAttrsInAttrsets.load()},
+        {"shapes", memstats.nrAttrsetShapes.load()},
+        {"shapeElements", memstats.nrAttrsInShapes.load()},
+        {"bytesWithSharedShapes", bAttrsetsShared},
+    };
+    topObj["layeredSets"] = {
+        {"mergedReads", Bindings::nrMergedReads.load()},
+        {"flattened", Bindings::nrFlattened.load()},
+        {"flattenedAttrs", Bindings::nrFlattenedAttrs.load()},
     };
     topObj["sizes"] = {
         {"Env", sizeof(Env)},
@@ -3045,10 +3198,53 @@ void EvalState::printStatistics()
     topObj["nrSpuriousWakeups"] = nrSpuriousWakeups.load();
     topObj["maxWaiting"] = maxWaiting.load();
     topObj["waitingTime"] = microsecondsWaiting / (double) 1000000;
+    topObj["executor"] = {
+        {"threads", executor->evalCores},
+        {"spawned", executor->nrSpawned.load()},
+        {"steals", executor->nrSteals.load()},
+        {"lockContentions", executor->nrLockContentions.load()},
+        {"sleeps", executor->nrSleeps.load()},
+        {"spareWorkers", executor->nrSpareWorkers.load()},
+    };
     topObj["nrAvoided"] = nrAvoided.load();
     topObj["nrLookups"] = nrLookups.load();
     topObj["nrPrimOpCalls"] = nrPrimOpCalls.load();
     topObj["nrFunctionCalls"] = nrFunctionCalls.load();
+    topObj["inlineCaches"] = {
+        {"hits", nrInlineCacheHits.load()},
+        {"misses", nrInlineCacheMisses.load()},
+    };
+    topObj["bytecode"] = {
+        {"functions", nrBytecodeFunctions.load()},
+        {"instructions", nrBytecodeInstructions.load()},
+    };
+    topObj["parser"] = {
+        {"filesParsed", nrFilesParsed.load()},
+        {"parseTime", microsecondsParsing / (double) 1000000},
+        {"filesLoaded", nrFilesLoaded.load()},
+        {"loadTime", microsecondsLoading / (double) 1000000},
+    };
+    topObj["drvHashCache"] = {
+        {"hits", drvHashDiskCacheStats.hits.load()},
+        {"misses", drvHashDiskCacheStats.misses.load()},
+    };
+    topObj["wasm"] = {
+        {"calls", nrWasmCalls.load()},
+        {"fuelConsumed", wasmFuelConsumed.load()},
+        {"compileCacheHits", wasmCompileCacheStats.hits.load()},
+        {"compileCacheMisses", wasmCompileCacheStats.misses.load()},
+        {"callCacheHits", nrWasmCallCacheHits.load()},
+        {"callCacheMisses", nrWasmCallCacheMisses.load()},
+        {"instancesCreated", nrWasmInstancesCreated.load()},
+        {"instancesReused", nrWasmInstancesReused.load()},
+        {"poolRefusals",
+         {
+             {"invalidModule", nrWasmPoolRefusedInvalid.load()},
+             {"multipleMemories", nrWasmPoolRefusedMemories.load()},
+             {"passiveSegments", nrWasmPoolRefusedSegments.load()},
+             {"grown", nrWasmPoolRefusedGrown.load()},
+         }},
+    };
 #if NIX_USE_BOEHMGC
     topObj["gc"] = {
         {"heapSize", heapSize},
@@ -3293,11 +3489,38 @@ Expr * EvalState::parse(
         docComments = &*it->second;
     }
 
-    auto result =
-        parseExprFromBuf(text, length, origin, basePath, mem.exprs, symbols, settings, positions, *docComments, rootFS);
+    auto posOrigin = positions.addOrigin(origin, length);
+
+    auto start = std::chrono::steady_clock::now();
+    auto elapsed = [&]() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    };
+
+    /* Files can be loaded from the parse cache. The key has to be
+       computed up front because the parser overwrites its input. */
+    std::optional<Hash> cacheKey;
+    if (auto sourcePath = std::get_if<SourcePath>(&origin); sourcePath && settings.parseCache)
+        cacheKey = parseCacheKey(*this, *sourcePath, {text, length});
+
+    if (cacheKey)
+        if (auto result = loadParsedExpr(*this, *cacheKey, posOrigin, basePath, *docComments)) {
+            result->bindVars(*this, staticEnv);
+            nrFilesLoaded++;
+            microsecondsLoading += elapsed();
+            return result;
+        }
+
+    auto result = parseExprFromBuf(
+        text, length, posOrigin, basePath, mem.exprs, symbols, settings, positions, *docComments, rootFS);
 
     result->bindVars(*this, staticEnv);
 
+    nrFilesParsed++;
+    microsecondsParsing += elapsed();
+
+    if (cacheKey)
+        storeParsedExpr(*this, *cacheKey, result, posOrigin, *docComments);
+
     return result;
 }
 
@@ -2,12 +2,14 @@
 ///@file
 
 #include "nix/expr/nixexpr.hh"
+#include "nix/expr/counter.hh"
 #include "nix/expr/symbol-table.hh"
 
 #include <boost/container/static_vector.hpp>
 #include <boost/iterator/function_output_iterator.hpp>
 
 #include <algorithm>
+#include <atomic>
 #include <functional>
 #include <ranges>
 #include <optional>
@@ -58,6 +60,11 @@ static_assert(
  * this linked list until a matching attribute is found (thus overlays earlier in
  * the list take precedence). For iteration over the whole Bindings, an on-the-fly
  * k-way merge is performed by Bindings::iterator class.
+ *
+ * Layered Bindings that are read often are transparently flattened (@see
+ * Bindings::flatten): a flat copy of the whole chain is made once and all
+ * subsequent reads go to that copy, so that lookups and iteration no longer
+ * pay for the layers.
  */
 class Bindings
 {
@@ -89,12 +96,27 @@ private:
     /**
      * Length of the layers list.
      */
-    uint32_t numLayers = 1;
+    uint16_t numLayers = 1;
+
+    /**
+     * Weighted number of reads of a layered attrset, saturating at
+     * @ref flattenThreshold. Concurrent updates may lose reads, which
+     * only delays flattening.
+     */
+    mutable std::atomic<uint8_t> nrReads = 0;
+
+    /**
+     * Whether @ref baseLayer points to a flat copy of the whole layer
+     * chain, including the attributes of this layer.
+     */
+    mutable std::atomic<bool> flattened = false;
 
     /**
-     * Bindings that this attrset is "layered" on top of.
+     * Bindings that this attrset is "layered" on top of. Once the
+     * attrset is flattened, this is replaced by the flat copy, which
+     * is also a valid base layer for the attributes of this layer.
      */
-    const Bindings * baseLayer = nullptr;
+    mutable std::atomic<const Bindings *> baseLayer = nullptr;
 
     /**
      * Flexible array member of attributes.
@@ -114,7 +136,56 @@ private:
      */
     static constexpr unsigned maxLayers = 8;
 
+    /**
+     * Weight of reads after which a layered attrset is flattened. A
+     * lookup counts as 1, an iteration (which merges the whole chain)
+     * as @ref iterationWeight.
+     */
+    static constexpr uint8_t flattenThreshold = 64;
+    static constexpr uint8_t iterationWeight = 8;
+
+    /**
+     * Return the flat copy of this attrset, if it has been flattened.
+     */
+    const Bindings * flatLayer() const noexcept
+    {
+        return flattened.load(std::memory_order_acquire) ? baseLayer.load(std::memory_order_relaxed) : nullptr;
+    }
+
+    /**
+     * Record a read of a layered attrset, and flatten it once it has
+     * been read often enough.
+     */
+    void countRead(uint8_t weight) const noexcept
+    {
+        nrMergedReads++;
+        auto n = nrReads.load(std::memory_order_relaxed);
+        if (n < flattenThreshold - weight)
+            nrReads.store(uint8_t(n + weight), std::memory_order_relaxed);
+        else
+            flatten();
+    }
+
+    /**
+     * Replace the layer chain by a flat, sorted copy of all attributes.
+     * Pointers to attributes in the old layers remain valid.
+     */
+    void flatten() const noexcept;
+
 public:
+    /**
+     * Number of lookups and iterations that had to go through more
+     * than one layer.
+     */
+    static Counter nrMergedReads;
+
+    /**
+     * Number of layered attrsets that were flattened, and the number
+     * of attributes copied to do so.
+     */
+    static Counter nrFlattened;
+    static Counter nrFlattenedAttrs;
+
     size_type size() const
     {
         return numAttrsInChain;
@@ -256,7 +327,7 @@ public:
         }
 
         explicit iterator(const Bindings & attrs) noexcept
-            : doMerge(attrs.baseLayer)
+            : doMerge(attrs.baseLayer.load(std::memory_order_relaxed))
         {
             auto pushBindings = [this, priority = unsigned{0}](const Bindings & layer) mutable {
                 auto first = layer.attrs;
@@ -282,7 +353,7 @@ public:
             while (layer) {
                 if (layer->numAttrs != 0)
                     pushBindings(*layer);
-                layer = layer->baseLayer;
+                layer = layer->baseLayer.load(std::memory_order_acquire);
             }
 
             if (cursorHeap.empty())
@@ -359,23 +430,68 @@ public:
             return nullptr;
         };
 
+        if (!isLayered())
+            return getInChunk(*this);
+
+        if (auto flat = flatLayer())
+            return getInChunk(*flat);
+
+        countRead(1);
+
         const Bindings * currentChunk = this;
         while (currentChunk) {
             const Attr * maybeAttr = getInChunk(*currentChunk);
             if (maybeAttr)
                 return maybeAttr;
-            currentChunk = currentChunk->baseLayer;
+            currentChunk = currentChunk->baseLayer.load(std::memory_order_acquire);
         }
 
         return nullptr;
     }
 
+    /**
+     * Like `get(Symbol)`, but first try the positions remembered by
+     * the inline cache `cache` of a selection site (see
+     * `AttrName::cache`). An attribute with the right name in the top
+     * layer is always the right one, so a cache entry is valid for
+     * every attribute set with the same layout, and a cache that is
+     * concurrently updated by another thread at worst misses. `hit` is
+     * set if the attribute was found through the cache.
+     */
+    const Attr * get(Symbol name, uint32_t & cache, bool & hit) const noexcept
+    {
+        /* A flattened attrset is cached like a flat one. */
+        auto flat = flatLayer();
+        auto & top = flat ? *flat : *this;
+
+        std::atomic_ref<uint32_t> cacheRef(cache);
+        auto entries = cacheRef.load(std::memory_order_relaxed);
+
+        for (uint32_t i : {entries & 0xffff, entries >> 16})
+            if (i < top.numAttrs && top.attrs[i].name == name) {
+                hit = true;
+                return &top.attrs[i];
+            }
+
+        hit = false;
+
+        auto attr = top.get(name);
+
+        /* Only remember attributes from the top layer, since those in
+           lower layers may be shadowed in other attribute sets. The
+           most recent position goes first. */
+        if (attr && attr >= top.attrs && attr < top.attrs + top.numAttrs && attr - top.attrs < 0xffff)
+            cacheRef.store((entries << 16) | (uint32_t) (attr - top.attrs), std::memory_order_relaxed);
+
+        return attr;
+    }
+
     /**
      * Check if the layer chain is full.
      */
     bool isLayerListFull() const noexcept
     {
-        return numLayers == Bindings::maxLayers;
+        return numLayers == Bindings::maxLayers && !flatLayer();
     }
 
     /**
@@ -388,6 +504,11 @@ public:
 
     const_iterator begin() const
     {
+        if (isLayered()) {
+            if (auto flat = flatLayer())
+                return const_iterator(*flat);
+            countRead(iterationWeight);
+        }
         return const_iterator(*this);
     }
 
@@ -405,8 +526,11 @@ public:
 
     const Attr & operator[](size_type pos) const
     {
-        if (isLayered()) [[unlikely]]
+        if (isLayered()) [[unlikely]] {
+            if (auto flat = flatLayer())
+                return flat->attrs[pos];
             unreachable();
+        }
         return attrs[pos];
     }
 
@@ -461,7 +585,7 @@ private:
 
     bool hasBaseLayer() const noexcept
     {
-        return bindings->baseLayer;
+        return bindings->baseLayer.load(std::memory_order_relaxed);
     }
 
     /**
@@ -478,7 +602,7 @@ private:
         if (!hasBaseLayer())
             return;
 
-        auto & base = *bindings->baseLayer;
+        auto & base = *bindings->baseLayer.load(std::memory_order_relaxed);
         auto attrs = std::span(bindings->attrs, bindings->numAttrs);
 
         Bindings::size_type duplicates = 0;
@@ -508,6 +632,8 @@ private:
         bindings->numAttrsInChain = base.numAttrsInChain + attrs.size() - duplicates;
     }
 
+    void recordShape();
+
 public:
     std::reference_wrapper<EvalMemory> mem;
     std::reference_wrapper<SymbolTable> symbols;
@@ -540,8 +666,10 @@ public:
      */
     void layerOnTopOf(const Bindings & base) noexcept
     {
-        bindings->baseLayer = &base;
-        bindings->numLayers = base.numLayers + 1;
+        auto flat = base.flatLayer();
+        auto & layer = flat ? *flat : base;
+        bindings->baseLayer = &layer;
+        bindings->numLayers = layer.numLayers + 1;
     }
 
     Value & alloc(Symbol name, PosIdx pos = noPos);
@@ -552,12 +680,16 @@ public:
     {
         bindings->sort();
         finishSizeIfNecessary();
+        if (Counter::enabled) [[unlikely]]
+            recordShape();
         return bindings;
     }
 
     Bindings * alreadySorted()
     {
         finishSizeIfNecessary();
+        if (Counter::enabled) [[unlikely]]
+            recordShape();
         return bindings;
     }
 
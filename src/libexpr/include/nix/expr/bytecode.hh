@@ -0,0 +1,24 @@
+#pragma once
+///@file
+
+#include "nix/expr/nixexpr.hh"
+
+namespace nix {
+
+/**
+ * Return the bytecode for the body of `lambda`, compiling it on the
+ * first call. `env` is the environment of the call; it is used to
+ * fold references to constants of the base environment such as
+ * `true` and `null`.
+ *
+ * @return `nullptr` if the body is not worth compiling, i.e. if the
+ * bytecode would hand it to the tree-walking evaluator as a whole.
+ */
+const Bytecode * getBytecode(EvalState & state, ExprLambda & lambda, Env & env);
+
+/**
+ * Run `code` in `env` and store the result in `v`.
+ */
+void evalBytecode(EvalState & state, const Bytecode & code, Env & env, Value & v);
+
+} // namespace nix
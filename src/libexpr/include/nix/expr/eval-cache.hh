@@ -3,6 +3,7 @@
 
 #include "nix/util/sync.hh"
 #include "nix/util/hash.hh"
+#include "nix/store/path.hh"
 #include "nix/expr/eval.hh"
 #include "nix/expr/attr-path.hh"
 
@@ -14,6 +15,30 @@ namespace nix::eval_cache {
 struct AttrDb;
 class AttrCursor;
 
+/**
+ * What the evaluation cache needs to reuse cached attributes of a
+ * flake across versions of that flake (see the
+ * `eval-cache-dependencies` setting).
+ */
+struct DependencyRoot
+{
+    /**
+     * Identifies the flake independently of its version.
+     */
+    std::string identity;
+
+    /**
+     * The source tree of the current version of the flake.
+     */
+    StorePath sourcePath;
+
+    /**
+     * The current values of the dependencies that are not files in
+     * `sourcePath`, e.g. `lock`.
+     */
+    std::map<std::string, std::string> constants;
+};
+
 struct CachedEvalError : EvalError
 {
     const ref<AttrCursor> cursor;
@@ -44,7 +69,11 @@ class EvalCache : public std::enable_shared_from_this<EvalCache>
 
 public:
 
-    EvalCache(std::optional<std::reference_wrapper<const Hash>> useCache, EvalState & state, RootLoader rootLoader);
+    EvalCache(
+        std::optional<std::reference_wrapper<const Hash>> useCache,
+        EvalState & state,
+        RootLoader rootLoader,
+        std::optional<DependencyRoot> dependencyRoot = std::nullopt);
 
     ref<AttrCursor> getRoot();
 };
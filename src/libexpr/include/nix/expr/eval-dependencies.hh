@@ -0,0 +1,115 @@
+#pragma once
+///@file
+
+#include "nix/util/source-accessor.hh"
+#include "nix/util/sync.hh"
+#include "nix/store/path.hh"
+#include "nix/expr/value/context.hh"
+
+#include <boost/unordered/unordered_flat_map.hpp>
+#include <boost/unordered/unordered_flat_set.hpp>
+
+namespace nix {
+
+class EvalState;
+struct Value;
+
+/**
+ * A record of everything outside of the evaluator that an evaluation
+ * has observed: the files it read from flake source trees, and the
+ * flake inputs and source tree attributes it used. This is used by
+ * the evaluation cache to reuse cached attributes after the flake
+ * has changed, as long as nothing they may depend on has changed.
+ *
+ * Dependencies are accumulated over the whole evaluation rather
+ * than per attribute: since values are shared and lazily evaluated,
+ * an attribute can depend on anything evaluated before it.
+ */
+struct EvalDependencies
+{
+    /**
+     * A dependency, e.g. `read:/nix/store/...-source/foo.nix` with
+     * the hash of the contents of that file as its value.
+     */
+    struct Dependency
+    {
+        std::string key;
+        std::string value;
+    };
+
+    /**
+     * Record a dependency. Only the first observation of a key is
+     * kept.
+     */
+    void add(std::string key, std::string value);
+
+    /**
+     * Return the number of dependencies recorded so far.
+     */
+    size_t size();
+
+    /**
+     * Return the dependencies recorded after the first `start`.
+     */
+    std::vector<Dependency> since(size_t start);
+
+    /**
+     * Record a flake source tree whose identity is `identity`
+     * (i.e. independent of its contents). Reads below `path` are
+     * recorded relative to the tree.
+     */
+    void addRoot(const std::string & identity, const std::string & path);
+
+    /**
+     * Return the source tree that `path` (as recorded in a
+     * dependency) is in, and the path relative to that tree.
+     */
+    std::optional<std::pair<std::string, std::string>> findRoot(std::string_view path);
+
+    /**
+     * Record the inputs of a derivation written by this evaluation.
+     */
+    void addDerivation(const StorePath & drvPath, StorePathSet inputs);
+
+    /**
+     * Return whether a string with context `context` may refer to
+     * `path`, either directly or through derivations.
+     */
+    bool refersTo(const NixStringContext & context, const StorePath & path);
+
+private:
+
+    struct State
+    {
+        std::vector<Dependency> deps;
+        boost::unordered_flat_set<std::string> keys;
+        std::map<std::string, std::string> roots;
+        boost::unordered_flat_map<StorePath, StorePathSet> derivations;
+    };
+
+    Sync<State> state_;
+};
+
+/**
+ * Return a source accessor that records the files read through it
+ * in `deps`. Fingerprints handed out by `getFingerprint()` are
+ * recorded as well, since callers like `fetchToStore()` use them
+ * instead of reading the files.
+ */
+ref<SourceAccessor> makeDependencyTrackingAccessor(ref<SourceAccessor> next, ref<EvalDependencies> deps);
+
+/**
+ * Return the value of a dependency `key` (e.g. `read:foo.nix`) on
+ * the file system `accessor` below `root`, or `std::nullopt` if
+ * `key` is not a file system dependency.
+ */
+std::optional<std::string>
+observeDependency(SourceAccessor & accessor, const CanonPath & root, const std::string & key);
+
+/**
+ * Make `v` a thunk that records the dependency `key` = `value` when
+ * forced, and then evaluates to `target`.
+ */
+void mkDependentValue(EvalState & state, Value & v, Value * target, std::string key, std::string value);
+
+} // namespace nix
@@ -6,6 +6,8 @@
 #include "nix/expr/eval-error.hh"
 #include "nix/expr/eval-settings.hh"
 
+#include <cstring>
+
 namespace nix {
 
 /**
@@ -52,6 +54,7 @@ Value * EvalMemory::allocValue()
 #endif
 
     stats.nrValues++;
+    countAllocation(allocatedValues, sizeof(Value));
     return (Value *) p;
 }
 
@@ -60,6 +63,7 @@ Env & EvalMemory::allocEnv(size_t size)
 {
     stats.nrEnvs++;
     stats.nrValuesInEnvs += size;
+    countAllocation(allocatedEnvs, sizeof(Env) + size * sizeof(Value *));
 
     Env * env;
 
@@ -88,6 +92,52 @@ Env & EvalMemory::allocEnv(size_t size)
     return *env;
 }
 
+[[gnu::always_inline]]
+Env & EnvArena::alloc(size_t size, Frame & frame)
+{
+    frame.chunk = current;
+    frame.offset = offset;
+
+    auto n = sizeof(Env) + size * sizeof(Value *);
+
+    Env * env;
+    if (current < chunks.size() && offset + n <= chunks[current].size) [[likely]] {
+        env = (Env *) (chunks[current].data + offset);
+        offset += n;
+    } else
+        env = &allocSlow(n);
+
+    frame.arena = this;
+    return *env;
+}
+
+[[gnu::always_inline]]
+void EnvArena::release(const Frame & frame)
+{
+    /* Clear the freed environments, since allocEnv() callers expect
+       zeroed memory, and so that the garbage collector doesn't see
+       stale pointers to values. */
+    assert(frame.chunk < current || (frame.chunk == current && frame.offset <= offset));
+    while (current > frame.chunk) {
+        std::memset(chunks[current].data, 0, offset);
+        offset = chunks[--current].used;
+    }
+    std::memset(chunks[current].data + frame.offset, 0, offset - frame.offset);
+    offset = frame.offset;
+}
+
+[[gnu::always_inline]]
+Env & EvalMemory::allocScopedEnv(size_t size, EnvArena::Frame & frame)
+{
+    thread_local static EnvArena arena;
+
+    stats.nrArenaEnvs++;
+    stats.nrValuesInArenaEnvs += size;
+    countAllocation(allocatedArenaEnvs, sizeof(Env) + size * sizeof(Value *));
+
+    return arena.alloc(size, frame);
+}
+
 /**
  * An identifier of the current thread for deadlock detection, stored
  * in p0 of pending/awaited thunks. We're not using std::thread::id
@@ -9,6 +9,7 @@
 
 #include <vector>
 #include <span>
+#include <string_view>
 #include <bitset>
 #include <optional>
 #include <filesystem>
@@ -18,6 +19,7 @@ namespace nix {
 class EvalState;
 class PosIdx;
 struct Value;
+struct SourcePath;
 
 class EvalProfiler
 {
@@ -25,9 +27,10 @@ public:
     enum Hook {
         preFunctionCall,
         postFunctionCall,
+        wasmCall,
     };
 
-    static constexpr std::size_t numHooks = Hook::postFunctionCall + 1;
+    static constexpr std::size_t numHooks = Hook::wasmCall + 1;
     using Hooks = std::bitset<numHooks>;
 
 private:
@@ -75,6 +78,19 @@ public:
      */
     virtual void postFunctionCallHook(EvalState & state, const Value & v, std::span<Value *> args, const PosIdx pos);
 
+    /**
+     * Hook called after a successful `builtins.wasm` call, while the
+     * corresponding primop call is still on the stack.
+     * Gets called only if (getNeededHooks().test(Hook::wasmCall)) is true.
+     *
+     * @param state Evaluator state.
+     * @param module Path of the WASM module.
+     * @param function Name of the function that was called.
+     * @param fuel Fuel consumed by the call.
+     */
+    virtual void
+    wasmCallHook(EvalState & state, const SourcePath & module, std::string_view function, uint64_t fuel);
+
     virtual ~EvalProfiler() = default;
 
     /**
@@ -107,8 +123,18 @@ public:
     preFunctionCallHook(EvalState & state, const Value & v, std::span<Value *> args, const PosIdx pos) override;
     [[gnu::noinline]] void
     postFunctionCallHook(EvalState & state, const Value & v, std::span<Value *> args, const PosIdx pos) override;
+    [[gnu::noinline]] void
+    wasmCallHook(EvalState & state, const SourcePath & module, std::string_view function, uint64_t fuel) override;
 };
 
 ref<EvalProfiler> makeSampleStackProfiler(EvalState & state, std::filesystem::path profileFile, uint64_t frequency);
 
+/**
+ * Create a profiler that records the exact time spent in, and the
+ * memory allocated by, every function call. The time is saved to
+ * `profileFile` and the allocations to `<profileFile>.alloc`, both
+ * in folded stack format.
+ */
+ref<EvalProfiler> makeTracingProfiler(EvalState & state, std::filesystem::path profileFile);
+
 } // namespace nix
@@ -231,6 +231,7 @@ struct EvalSettings : Config
           Enables evaluation profiling. The following modes are supported:
 
           * `flamegraph` stack sampling profiler. Outputs folded format, one line per stack (suitable for `flamegraph.pl` and compatible tools).
+          * `tracing` tracing profiler. Measures the exact time spent in every function call and the memory allocated by it, at a higher overhead than `flamegraph`. Outputs the time in nanoseconds in folded format, and the allocated bytes in the same format to a file with the suffix `.alloc`. It cannot be combined with [`eval-cores`](#conf-eval-cores) greater than 1.
 
           Use [`eval-profile-file`](#conf-eval-profile-file) to specify where the profile is saved.
 
@@ -243,6 +244,10 @@ struct EvalSettings : Config
         "eval-profile-file",
         R"(
           Specifies the file where [evaluation profile](#conf-eval-profiler) is saved.
+
+          If the evaluation calls [`builtins.wasm`](@docroot@/language/builtins.md#builtins-wasm),
+          the fuel consumed by WebAssembly code is saved in the same format to a file with the
+          suffix `.wasm-fuel`.
         )"};
 
     Setting<uint32_t> evalProfilerFrequency{
@@ -265,6 +270,32 @@ struct EvalSettings : Config
             Intermediate results are not cached.
         )"};
 
+    Setting<bool> evalCacheDependencies{
+        this,
+        false,
+        "eval-cache-dependencies",
+        R"(
+          If set to `true`, the flake evaluation cache records, for every cached
+          attribute, the files of the flake that the evaluation had read when the
+          attribute was cached. When the flake changes, cached attributes are reused
+          as long as none of the files they may depend on has changed, instead of
+          evaluating everything again. Changes to the lock file invalidate all
+          cached attributes.
+
+          Attributes whose values refer to the source tree of the flake itself (for
+          instance derivations that use `self` as their source) and attributes that
+          use the revision or other metadata of the flake are only reused for the
+          same version of the flake.
+
+          This is not sound in all cases: values derived from the store path of the
+          flake after its string context was dropped (for instance by
+          `builtins.unsafeDiscardStringContext`, or by applying `toString` to a
+          path in the flake) are not tracked, so they may be reused even though
+          the flake has changed.
+
+          This has no effect if [`lazy-trees`](#conf-lazy-trees) is enabled.
+        )"};
+
     Setting<bool> ignoreExceptionsDuringTry{
         this,
         false,
@@ -399,6 +430,112 @@ struct EvalSettings : Config
 
           Note that enabling the debugger (`--debugger`) disables multi-threaded evaluation.
         )"};
+
+    Setting<uint64_t> wasmFuel{
+        this,
+        0,
+        "wasm-fuel",
+        R"(
+          The maximum amount of fuel that a single call to
+          [`builtins.wasm`](@docroot@/language/builtins.md#builtins-wasm) may consume.
+          Fuel roughly corresponds to the number of WebAssembly instructions executed.
+          A call that runs out of fuel fails with an evaluation error.
+          Setting a limit enables fuel metering, which makes WebAssembly code run slower.
+
+          The value `0` means that there is no limit.
+        )"};
+
+    Setting<unsigned int> wasmTimeout{
+        this,
+        0,
+        "wasm-timeout",
+        R"(
+          The maximum wall-clock time in milliseconds that a single call to
+          [`builtins.wasm`](@docroot@/language/builtins.md#builtins-wasm) may take.
+          A call that exceeds this limit fails with an evaluation error.
+
+          The value `0` means that there is no limit.
+        )"};
+
+    Setting<uint64_t> wasmMaxMemory{
+        this,
+        0,
+        "wasm-max-memory",
+        R"(
+          The maximum size in bytes of the linear memory of a WebAssembly module
+          instantiated by [`builtins.wasm`](@docroot@/language/builtins.md#builtins-wasm).
+          Attempts by the module to grow its memory beyond this size fail.
+
+          The value `0` means that only the limits of the WebAssembly runtime apply.
+        )"};
+
+    Setting<bool> wasmMemoize{
+        this,
+        false,
+        "wasm-memoize",
+        R"(
+          If set to `true`, the results of calls to
+          [`builtins.wasm`](@docroot@/language/builtins.md#builtins-wasm) are cached
+          persistently in `~/.cache/nix/wasm-calls-v2.sqlite`, keyed by the contents of
+          the module, the function name, the value of the argument and the limits set by
+          [`wasm-fuel`](#conf-wasm-fuel), [`wasm-timeout`](#conf-wasm-timeout) and
+          [`wasm-max-memory`](#conf-wasm-max-memory). Subsequent calls with equal inputs
+          return the cached result without running the module.
+
+          Only calls whose argument and result are already fully evaluated are cached;
+          they are never evaluated just for the cache. Calls whose argument or result
+          contain functions or strings with context, and calls that fetch sources, add
+          paths to the Nix store, or read the clock or random numbers, are not cached.
+          Warnings emitted by a cached call are not repeated.
+        )"};
+
+    Setting<bool> evalBytecode{
+        this,
+        false,
+        "eval-bytecode",
+        R"(
+          If set to `true`, the body of a function is compiled to bytecode when the
+          function is first called, and subsequent calls run the bytecode instead of
+          walking the syntax tree. Conditionals, Boolean operators, comparisons,
+          variable references and attribute selections are compiled; other
+          expressions are still evaluated by walking the syntax tree. The result of
+          evaluation, including errors and their traces, is the same either way.
+
+          The bytecode interpreter is not used while the debugger is enabled.
+        )"};
+
+    Setting<bool> evalEnvArena{
+        this,
+        false,
+        "eval-env-arena",
+        R"(
+          If set to `true`, the environment of a function call is freed as soon as
+          the call returns if the body of the function cannot refer to it afterwards,
+          i.e. if it doesn't create thunks, functions, `let` or `with` environments,
+          or recursive attribute sets that could capture the function's arguments.
+          Such environments are allocated from a per-thread stack instead of the
+          garbage collected heap. The number of environments allocated this way and
+          their size are shown as `envs.arena` and `envs.arenaBytes` by
+          [`NIX_SHOW_STATS`](@docroot@/command-ref/env-common.md#env-NIX_SHOW_STATS), and
+          profiles of memory allocations attribute them to `«arena environments»`.
+
+          The environments are always allocated on the heap while the debugger is
+          enabled.
+        )"};
+
+    Setting<bool> parseCache{
+        this,
+        false,
+        "parse-cache",
+        R"(
+          If set to `true`, the syntax trees of Nix files are cached persistently in
+          `~/.cache/nix/ast-v1`, keyed by the contents and the path of the file and the
+          version of Nix. A file whose contents have not changed since it was last
+          parsed is loaded from the cache instead of being parsed again.
+
+          Warnings emitted by the parser are not repeated when a file is loaded from
+          the cache.
+        )"};
 };
 
 /**
@@ -23,7 +23,10 @@
 
 #include <boost/unordered/unordered_flat_map.hpp>
 #include <boost/unordered/concurrent_flat_map_fwd.hpp>
+#include <boost/unordered/concurrent_flat_set_fwd.hpp>
 
+#include <array>
+#include <atomic>
 #include <map>
 #include <optional>
 #include <functional>
@@ -52,6 +55,7 @@ enum RepairFlag : bool;
 struct MemorySourceAccessor;
 struct MountedSourceAccessor;
 struct AsyncPathWriter;
+struct EvalDependencies;
 
 namespace eval_cache {
 class EvalCache;
@@ -178,6 +182,81 @@ struct Env
     Value * values[0];
 };
 
+/**
+ * A per-thread stack of memory for the environments of function calls
+ * that cannot be referred to after the call returns (see
+ * `ExprLambda::envMayEscape`). Freeing such an environment is a
+ * pointer bump, and they don't add to the load of the garbage
+ * collector. The memory is scanned by the garbage collector, so the
+ * values that an environment refers to stay alive while it exists.
+ */
+class EnvArena
+{
+    struct Chunk
+    {
+        char * data;
+        size_t size;
+
+        /**
+         * The number of bytes in use when the next chunk was
+         * started.
+         */
+        size_t used = 0;
+    };
+
+    std::vector<Chunk> chunks;
+
+    /**
+     * Where the next environment is allocated.
+     */
+    size_t current = 0, offset = 0;
+
+    static constexpr size_t chunkSize = 64 * 1024;
+
+    [[gnu::noinline]] Env & allocSlow(size_t n);
+
+public:
+
+    /**
+     * A frame of the stack. The environment allocated in the frame is
+     * freed when the frame is destroyed.
+     */
+    class Frame
+    {
+        friend class EnvArena;
+        EnvArena * arena = nullptr;
+        size_t chunk = 0, offset = 0;
+
+    public:
+
+        Frame() = default;
+        Frame(const Frame &) = delete;
+        Frame & operator=(const Frame &) = delete;
+
+        ~Frame()
+        {
+            if (arena)
+                arena->release(*this);
+        }
+    };
+
+    EnvArena() = default;
+    EnvArena(const EnvArena &) = delete;
+    EnvArena & operator=(const EnvArena &) = delete;
+    ~EnvArena();
+
+    /**
+     * Allocate a zeroed environment with room for `size` values, to be
+     * freed when `frame` is destroyed. Frames must be destroyed in the
+     * reverse order of their allocation.
+     */
+    inline Env & alloc(size_t size, Frame & frame);
+
+private:
+
+    inline void release(const Frame & frame);
+};
+
 void printEnvBindings(const EvalState & es, const Expr & expr, const Env & env);
 void printEnvBindings(const SymbolTable & st, const StaticEnv & se, const Env & env, int lvl = 0);
 
@@ -195,6 +274,10 @@ struct RegexCache;
 
 ref<RegexCache> makeRegexCache();
 
+struct WasmModuleCache;
+
+ref<WasmModuleCache> makeWasmModuleCache();
+
 struct DebugTrace
 {
     /* WARNING: Converting PosIdx -> Pos should be done with extra care. This is
@@ -324,12 +407,61 @@ public:
     {
         Counter nrEnvs;
         Counter nrValuesInEnvs;
+
+        /**
+         * Environments allocated in an `EnvArena` rather than on the
+         * garbage collected heap, and their total number of values.
+         */
+        Counter nrArenaEnvs;
+        Counter nrValuesInArenaEnvs;
         Counter nrValues;
         Counter nrAttrsets;
         Counter nrAttrsInAttrsets;
         Counter nrListElems;
+
+        /**
+         * Number of distinct attribute set shapes (sorted lists of
+         * names and positions), and their total number of attributes.
+         * Only collected when statistics are enabled.
+         */
+        Counter nrAttrsetShapes;
+        Counter nrAttrsInShapes;
+    };
+
+    /**
+     * The kinds of objects whose allocations can be attributed to
+     * functions by a profiler.
+     */
+    enum AllocationKind {
+        allocatedValues,
+        allocatedEnvs,
+        allocatedArenaEnvs,
+        allocatedBindings,
+        allocatedLists,
+        allocatedStrings,
+        nrAllocationKinds,
     };
 
+    using AllocatedBytes = std::array<uint64_t, nrAllocationKinds>;
+
+    /**
+     * Whether allocations are counted in `allocatedBytes`.
+     */
+    static std::atomic<bool> trackAllocations;
+
+    /**
+     * Bytes allocated by the current thread while `trackAllocations`
+     * was set, by kind. Profilers attribute the difference between
+     * two function call hooks to the function being evaluated.
+     */
+    static thread_local AllocatedBytes allocatedBytes;
+
+    static void countAllocation(AllocationKind kind, size_t n)
+    {
+        if (trackAllocations.load(std::memory_order_relaxed)) [[unlikely]]
+            allocatedBytes[kind] += n;
+    }
+
     EvalMemory();
 
     EvalMemory(const EvalMemory &) = delete;
@@ -337,10 +469,17 @@ public:
     EvalMemory & operator=(const EvalMemory &) = delete;
     EvalMemory & operator=(EvalMemory &&) = delete;
 
-    inline void * allocBytes(size_t n);
+    static inline void * allocBytes(size_t n);
     inline Value * allocValue();
     inline Env & allocEnv(size_t size);
 
+    /**
+     * Allocate an environment in the current thread's `EnvArena`. It
+     * is freed when `frame` is destroyed, so it must not be
+     * referred to by anything that outlives `frame`.
+     */
+    inline Env & allocScopedEnv(size_t size, EnvArena::Frame & frame);
+
     Bindings * allocBindings(size_t capacity);
 
     BindingsBuilder buildBindings(SymbolTable & symbols, size_t capacity)
@@ -359,6 +498,14 @@ public:
         return stats;
     }
 
+    /**
+     * Record the shape of a newly built attribute set in the
+     * statistics, to measure how much memory could be saved by
+     * sharing the names and positions of attribute sets that have the
+     * same shape.
+     */
+    void recordShape(const Bindings & bindings);
+
     /**
      * Storage for the AST nodes
      */
@@ -366,6 +513,11 @@ public:
 
 private:
     Statistics stats;
+
+    /**
+     * Hashes of the attribute set shapes seen so far.
+     */
+    const ref<boost::concurrent_flat_set<uint64_t>> shapes;
 };
 
 class EvalState : public std::enable_shared_from_this<EvalState>
@@ -387,6 +539,12 @@ public:
      */
     RepairFlag repair;
 
+    /**
+     * Files and inputs observed by the evaluation, if
+     * `eval-cache-dependencies` is enabled.
+     */
+    const std::shared_ptr<EvalDependencies> dependencies;
+
     /**
      * The accessor corresponding to `store`.
      */
@@ -513,6 +671,11 @@ private:
      */
     const ref<RegexCache> regexCache;
 
+    /**
+     * Cache of compiled modules used by prim_wasm().
+     */
+    const ref<WasmModuleCache> wasmModuleCache;
+
 public:
 
     /**
@@ -1086,6 +1249,24 @@ public:
     Counter currentlyWaiting;
     Counter maxWaiting;
     Counter nrSpuriousWakeups;
+    Counter nrWasmCalls;
+    Counter wasmFuelConsumed;
+    Counter nrWasmCallCacheHits;
+    Counter nrWasmCallCacheMisses;
+    Counter nrWasmInstancesCreated;
+    Counter nrWasmInstancesReused;
+    Counter nrWasmPoolRefusedInvalid;
+    Counter nrWasmPoolRefusedMemories;
+    Counter nrWasmPoolRefusedSegments;
+    Counter nrWasmPoolRefusedGrown;
+    Counter nrInlineCacheHits;
+    Counter nrInlineCacheMisses;
+    Counter nrBytecodeFunctions;
+    Counter nrBytecodeInstructions;
+    Counter nrFilesParsed;
+    Counter microsecondsParsing;
+    Counter nrFilesLoaded;
+    Counter microsecondsLoading;
 
 private:
     bool countCalls;
@@ -1117,6 +1298,7 @@ private:
     friend void prim_getAttr(EvalState & state, const PosIdx pos, Value ** args, Value & v);
     friend void prim_match(EvalState & state, const PosIdx pos, Value ** args, Value & v);
     friend void prim_split(EvalState & state, const PosIdx pos, Value ** args, Value & v);
+    friend void prim_wasm(EvalState & state, const PosIdx pos, Value ** args, Value & v);
 
     friend struct Value;
     friend class ListBuilder;
@@ -1,6 +1,7 @@
 #pragma once
 ///@file
 
+#include <atomic>
 #include <map>
 #include <span>
 #include <memory>
@@ -21,6 +22,7 @@ namespace nix {
 
 class EvalState;
 class PosTable;
+struct Bytecode;
 struct Env;
 struct ExprWith;
 struct StaticEnv;
@@ -77,6 +79,16 @@ struct DocComment
 struct AttrName
 {
     Symbol symbol;
+
+    /**
+     * Inline cache of the selection site: the two positions in the
+     * top layer of `Bindings` at which this attribute was most
+     * recently found, as 16-bit indices. See `Bindings::get(Symbol,
+     * uint32_t &, bool &)`. This fills what would otherwise be
+     * padding.
+     */
+    mutable uint32_t cache = UINT32_MAX;
+
     Expr * expr = nullptr;
     AttrName(Symbol s)
         : symbol(s) {};
@@ -85,6 +97,7 @@ struct AttrName
 };
 
 static_assert(std::is_trivially_copy_constructible_v<AttrName>);
+static_assert(sizeof(AttrName) == sizeof(Expr *) * 2);
 
 typedef std::vector<AttrName> AttrSelectionPath;
 
@@ -320,6 +333,12 @@ struct ExprSelect : Expr
      */
     Symbol evalExceptFinalSelect(EvalState & state, Env & env, Value & attrs);
 
+    /**
+     * Select the attribute path from `vBase`, the already evaluated
+     * value of `e`, and store the result in `v`.
+     */
+    void selectFrom(EvalState & state, Env & env, Value & vBase, Value & v);
+
     COMMON_METHODS
 };
 
@@ -340,6 +359,12 @@ struct ExprOpHasAttr : Expr
         return e->getPos();
     }
 
+    /**
+     * Check whether `vBase`, the already evaluated value of `e`, has
+     * the attribute path.
+     */
+    bool hasAttrIn(EvalState & state, Env & env, Value & vBase);
+
     COMMON_METHODS
 };
 
@@ -524,6 +549,21 @@ public:
     Expr * body;
     DocComment docComment;
 
+    /**
+     * The body compiled to bytecode, created on the first call if
+     * `eval-bytecode` is enabled. See `getBytecode()`.
+     */
+    std::atomic<const Bytecode *> bytecode = nullptr;
+
+    /**
+     * Whether the environment of a call to this function may be
+     * referred to after the body has been evaluated, because the body
+     * may create a thunk, a function or an environment that points to
+     * it. Computed by `bindVars()`. If not, the environment is
+     * allocated in an `EnvArena`.
+     */
+    bool envMayEscape = false;
+
     ExprLambda(
         const PosTable & positions,
         std::pmr::polymorphic_allocator<char> & alloc,
@@ -623,6 +663,12 @@ struct ExprLet : Expr
     ExprLet(ExprAttrs * attrs, Expr * body)
         : attrs(attrs)
         , body(body) {};
+
+    /**
+     * Allocate the environment in which `body` is evaluated.
+     */
+    Env & buildEnv(EvalState & state, Env & env);
+
     COMMON_METHODS
 };
 
@@ -642,6 +688,11 @@ struct ExprWith : Expr
         return pos;
     }
 
+    /**
+     * Allocate the environment in which `body` is evaluated.
+     */
+    Env & buildEnv(EvalState & state, Env & env);
+
     COMMON_METHODS
 };
 
@@ -677,6 +728,11 @@ struct ExprAssert : Expr
         return pos;
     }
 
+    /**
+     * Throw the error for a failed assertion.
+     */
+    [[noreturn]] void fail(EvalState & state, Env & env);
+
     COMMON_METHODS
 };
 
@@ -858,6 +914,11 @@ struct StaticEnv
     ExprWith * isWith;
     std::shared_ptr<const StaticEnv> up;
 
+    /**
+     * The function whose arguments this environment binds, if any.
+     */
+    ExprLambda * lambda = nullptr;
+
     // Note: these must be in sorted order.
     typedef std::vector<std::pair<Symbol, Displacement>> Vars;
     Vars vars;
@@ -1,9 +1,7 @@
 #pragma once
 
 #include <functional>
-#include <queue>
 #include <future>
-#include <random>
 
 #include <boost/thread/thread.hpp>
 
@@ -12,6 +10,7 @@
 #include "nix/util/environment-variables.hh"
 #include "nix/util/util.hh"
 #include "nix/util/signals.hh"
+#include "nix/expr/counter.hh"
 
 #if NIX_USE_BOEHMGC
 #  include <gc.h>
@@ -19,6 +18,18 @@
 
 namespace nix {
 
+/**
+ * A pool of evaluator threads. Each worker has its own queue of
+ * pending work: work spawned by a worker goes onto that worker's
+ * queue, and idle workers steal from the queues of others. Within a
+ * queue, work with a lower priority prefix is always taken first.
+ *
+ * The pool tries to keep `evalCores` workers running. When a worker
+ * blocks waiting for a thunk that another thread is evaluating, a
+ * sleeping worker is woken up or a spare one is started to take over
+ * its core; once the blocked worker resumes, surplus workers go back
+ * to sleep.
+ */
 struct Executor
 {
     using work_t = std::function<void()>;
@@ -29,9 +40,10 @@ struct Executor
         work_t work;
     };
 
+    struct WorkerQueue;
+
     struct State
     {
-        std::multimap<uint64_t, Item> queue;
         std::vector<boost::thread> threads;
     };
 
@@ -43,23 +55,97 @@ struct Executor
 
     const std::unique_ptr<InterruptCallback> interruptCallback;
 
+    /**
+     * One queue per worker thread. Fixed after construction.
+     */
+    std::vector<std::unique_ptr<WorkerQueue>> queues;
+
+    /**
+     * Number of items in all queues.
+     */
+    std::atomic<size_t> nrQueued{0};
+
+    /**
+     * Number of workers that are waiting for work on `wakeup`.
+     */
+    std::atomic<size_t> nrSleeping{0};
+
+    /**
+     * Number of worker threads, including spare ones.
+     */
+    std::atomic<size_t> nrThreads{0};
+
+    /**
+     * Number of workers that are blocked waiting for a thunk.
+     */
+    std::atomic<size_t> nrBlocked{0};
+
+    /**
+     * The queue that work spawned by a non-worker thread goes to
+     * next.
+     */
+    std::atomic<size_t> nextQueue{0};
+
     Sync<State> state_;
 
     std::condition_variable wakeup;
 
+    Counter nrSpawned;
+    Counter nrSteals;
+    Counter nrLockContentions;
+    Counter nrSleeps;
+    Counter nrSpareWorkers;
+
     static unsigned int getEvalCores(const EvalSettings & evalSettings);
 
     Executor(const EvalSettings & evalSettings);
 
     ~Executor();
 
-    void createWorker(State & state);
+    void createWorker(State & state, size_t index);
 
-    void worker();
+    void worker(size_t index);
+
+    /**
+     * Take an item from the queue of worker `index`, or else steal
+     * one from another worker.
+     */
+    std::optional<Item> take(size_t index);
+
+    /**
+     * Fail all queued items with an `Interrupted` exception.
+     */
+    void cancelQueued();
+
+    /**
+     * Number of workers that are neither sleeping nor blocked.
+     */
+    int64_t nrActive() const
+    {
+        return (int64_t) nrThreads - (int64_t) nrSleeping - (int64_t) nrBlocked;
+    }
+
+    /**
+     * Called by a worker of this executor before it blocks waiting
+     * for a thunk, so that another worker can use its core.
+     */
+    void blocked();
+
+    /**
+     * Called by a worker when it stops waiting for a thunk.
+     */
+    void unblocked();
 
     std::vector<std::future<void>> spawn(std::vector<std::pair<work_t, uint8_t>> && items);
 
     static thread_local bool amWorkerThread;
+
+    /**
+     * The executor and queue index of the current worker thread, if
+     * any.
+     */
+    static thread_local Executor * currentExecutor;
+    static thread_local size_t currentWorker;
 };
 
 struct FutureVector
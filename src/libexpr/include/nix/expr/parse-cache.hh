@@ -0,0 +1,40 @@
+#pragma once
+///@file
+
+#include "nix/expr/eval.hh"
+#include "nix/util/hash.hh"
+
+namespace nix {
+
+/**
+ * Return the key under which the syntax tree of `path`, whose
+ * contents are `text`, is stored in the parse cache. Besides the
+ * contents, this covers everything else that the parser's output
+ * depends on.
+ */
+Hash parseCacheKey(const EvalState & state, const SourcePath & path, std::string_view text);
+
+/**
+ * Load the syntax tree stored under `key`, with its positions
+ * relative to `origin` and its symbols interned in `state.symbols`.
+ * The documentation comments of the file are added to
+ * `docComments`. Variables are not bound yet; the caller must call
+ * `bindVars()` on the result.
+ *
+ * @return `nullptr` if there is no (valid) cache entry.
+ */
+Expr * loadParsedExpr(
+    EvalState & state,
+    const Hash & key,
+    const PosTable::Origin & origin,
+    const SourcePath & basePath,
+    DocCommentMap & docComments);
+
+/**
+ * Store the syntax tree `e`, the result of parsing the file
+ * identified by `origin`, under `key`. Errors are ignored.
+ */
+void storeParsedExpr(
+    EvalState & state, const Hash & key, Expr * e, const PosTable::Origin & origin, const DocCommentMap & docComments);
+
+} // namespace nix
@@ -0,0 +1,98 @@
+#pragma once
+///@file
+
+#include "nix/util/error.hh"
+
+#include <memory>
+#include <string_view>
+#include <vector>
+
+namespace nix {
+
+MakeError(RegexError, Error);
+
+/**
+ * Thrown if a regular expression compiles to too many instructions.
+ */
+MakeError(RegexTooBigError, RegexError);
+
+/**
+ * A [POSIX extended regular
+ * expression](http://pubs.opengroup.org/onlinepubs/9699919799/basedefs/V1_chap09.html#tag_09_04),
+ * as used by `builtins.match` and `builtins.split`.
+ *
+ * Matching simulates the NFA of the expression (a Pike VM), so it takes
+ * time linear in the length of the input and doesn't recurse, unlike a
+ * backtracking matcher. Whether a string matches as a whole is first
+ * decided by a DFA built along with the NFA, if the DFA isn't too big.
+ *
+ * The submatches are those of the preferred way to match, where
+ * alternatives are preferred from left to right and repetitions are
+ * greedy, as with the backtracking `std::regex` matcher that this
+ * replaces. Searching finds the leftmost match, and the longest one
+ * at that position.
+ *
+ * A compiled expression is immutable, so it can be shared by threads.
+ */
+class PosixRegex
+{
+public:
+
+    /**
+     * The offsets in the input of the whole match or a group.
+     */
+    struct Submatch
+    {
+        static constexpr size_t npos = std::string_view::npos;
+
+        size_t begin = npos, end = npos;
+
+        /**
+         * Whether the group participated in the match.
+         */
+        bool matched() const
+        {
+            return begin != npos;
+        }
+    };
+
+    /**
+     * The whole match followed by the groups.
+     */
+    using Submatches = std::vector<Submatch>;
+
+    /**
+     * @throws RegexError if `pattern` is invalid.
+     */
+    explicit PosixRegex(std::string_view pattern);
+
+    ~PosixRegex();
+
+    PosixRegex(const PosixRegex &) = delete;
+    PosixRegex & operator=(const PosixRegex &) = delete;
+
+    size_t nrGroups() const;
+
+    /**
+     * Whether `s` matches as a whole. If so, and `submatches` is not
+     * null, store the submatches in it.
+     */
+    bool match(std::string_view s, Submatches * submatches = nullptr) const;
+
+    /**
+     * Find the leftmost-longest match in `s` that begins at or after
+     * `start`. If `anchored`, the match must begin at `start`; if
+     * `notEmpty`, it must not be empty. `^` only matches at the
+     * beginning of `s`, not at `start`.
+     */
+    bool search(
+        std::string_view s, size_t start, Submatches & submatches, bool anchored = false, bool notEmpty = false) const;
+
+private:
+
+    struct Program;
+
+    std::unique_ptr<const Program> program;
+};
+
+} // namespace nix
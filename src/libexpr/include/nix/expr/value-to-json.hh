@@ -13,6 +13,23 @@ namespace nix {
 nlohmann::json printValueAsJSON(
     EvalState & state, bool strict, Value & v, const PosIdx pos, NixStringContext & context, bool copyToStore = true);
 
+struct Sink;
+
+/**
+ * Write the JSON representation of `v` to `sink` as it is produced,
+ * without building an intermediate `nlohmann::json`. If `strict` is
+ * set and parallel evaluation is enabled, large lists and attrsets are
+ * forced and serialized by the evaluator threads.
+ */
+void printValueAsJSON(
+    EvalState & state,
+    bool strict,
+    Value & v,
+    const PosIdx pos,
+    Sink & sink,
+    NixStringContext & context,
+    bool copyToStore = true);
+
 void printValueAsJSON(
     EvalState & state,
     bool strict,
@@ -0,0 +1,63 @@
+#pragma once
+/**
+ * @file
+ *
+ * Word-at-a-time scanning of JSON string bodies, shared by the JSON
+ * parser and serializer.
+ */
+
+#include <bit>
+#include <cstdint>
+#include <cstring>
+
+namespace nix::json_scan {
+
+/* Each function sets the high bit of the bytes of `x` that match; bits
+   above the first match may be spurious, so only the lowest one is
+   meaningful. */
+
+constexpr uint64_t ones = 0x0101010101010101ULL;
+constexpr uint64_t highBits = 0x8080808080808080ULL;
+
+inline uint64_t bytesEqual(uint64_t x, uint8_t b)
+{
+    uint64_t y = x ^ (ones * b);
+    return (y - ones) & ~y & highBits;
+}
+
+inline uint64_t bytesLess(uint64_t x, uint8_t n)
+{
+    return (x - ones * n) & ~x & highBits;
+}
+
+/**
+ * Whether `c` can't appear as is in a JSON string body, i.e. it's a
+ * quote, a backslash, a control character or (conservatively) part
+ * of a multi-byte UTF-8 sequence, which must be validated.
+ */
+inline bool isSpecial(unsigned char c)
+{
+    return c == '"' || c == '\\' || c < 0x20 || c >= 0x80;
+}
+
+/**
+ * Return the first byte in `[p, end)` for which `isSpecial()` holds,
+ * or `end`.
+ */
+inline const char * findSpecial(const char * p, const char * end)
+{
+    if constexpr (std::endian::native == std::endian::little) {
+        while (end - p >= 8) {
+            uint64_t x;
+            memcpy(&x, p, 8);
+            if (auto m = bytesEqual(x, '"') | bytesEqual(x, '\\') | bytesLess(x, 0x20) | (x & highBits))
+                return p + std::countr_zero(m) / 8;
+            p += 8;
+        }
+    }
+    while (p < end && !isSpecial(*p))
+        ++p;
+    return p;
+}
+
+} // namespace nix::json_scan
@@ -2,211 +2,449 @@
 #include "nix/expr/value.hh"
 #include "nix/expr/eval.hh"
 
-#include <limits>
-#include <variant>
-#include <nlohmann/json.hpp>
+#include "json-scan.hh"
 
-using json = nlohmann::json;
+#include <algorithm>
+#include <charconv>
+#include <limits>
+#include <numeric>
 
 namespace nix {
 
-// for more information, refer to
-// https://github.com/nlohmann/json/blob/master/include/nlohmann/detail/input/json_sax.hpp
-class JSONSax : nlohmann::json_sax<json>
-{
-    class JSONState
-    {
-    protected:
-        std::unique_ptr<JSONState> parent;
-        RootValue v;
-    public:
-        virtual std::unique_ptr<JSONState> resolve(EvalState &)
-        {
-            throw std::logic_error("tried to close toplevel json parser state");
-        }
-
-        explicit JSONState(std::unique_ptr<JSONState> && p)
-            : parent(std::move(p))
-        {
-        }
+namespace {
 
-        explicit JSONState(Value * v)
-            : v(allocRootValue(v))
-        {
-        }
+using json_scan::findSpecial;
 
-        JSONState(JSONState & p) = delete;
+/**
+ * A JSON parser that builds Nix values directly, in a single pass over
+ * the input. Nesting is tracked with an explicit stack, so deeply
+ * nested documents don't overflow the C++ stack.
+ *
+ * It accepts the same documents as `nlohmann::json`, which it replaced:
+ * strings must be valid UTF-8, integers that don't fit in 64 bits are
+ * parsed as floats, and for duplicate keys the last one wins.
+ */
+class JSONParser
+{
+    EvalState & state;
+    const std::string_view s;
+    const char * p;
+    const char * const end;
+
+    /**
+     * The elements of the lists and objects being parsed, innermost
+     * last, and the keys of the objects. These are shared by all
+     * levels of nesting to avoid allocating for every container.
+     */
+    ValueVector values;
+    std::vector<Symbol> keys;
+
+    struct Frame
+    {
+        bool object;
+        size_t valuesStart, keysStart;
+    };
 
-        Value & value(EvalState & state)
-        {
-            if (!v)
-                v = allocRootValue(state.allocValue());
-            return **v;
-        }
+    std::vector<Frame> frames;
 
-        virtual ~JSONState() {}
+    /**
+     * Buffer for strings with escapes.
+     */
+    std::string buf;
 
-        virtual void add() {}
-    };
+    std::vector<uint32_t> order;
 
-    class JSONObjectState : public JSONState
+    [[noreturn]] void fail(std::string_view msg)
     {
-        using JSONState::JSONState;
-        ValueMap attrs;
-
-        std::unique_ptr<JSONState> resolve(EvalState & state) override
-        {
-            auto attrs2 = state.buildBindings(attrs.size());
-            for (auto & i : attrs)
-                attrs2.insert(i.first, i.second);
-            parent->value(state).mkAttrs(attrs2);
-            return std::move(parent);
-        }
-
-        void add() override
-        {
-            v = nullptr;
-        }
-    public:
-        void key(string_t & name, EvalState & state)
-        {
-            forceNoNullByte(name);
-            attrs.insert_or_assign(state.symbols.create(name), &value(state));
+        size_t line = 1, column = 1;
+        for (auto q = s.data(); q < p; ++q) {
+            if (*q == '\n') {
+                line++;
+                column = 1;
+            } else
+                column++;
         }
-    };
+        throw JSONParseError("syntax error at line %d, column %d: %s", line, column, msg);
+    }
 
-    class JSONListState : public JSONState
+    void skipWhitespace()
     {
-        ValueVector values;
-
-        std::unique_ptr<JSONState> resolve(EvalState & state) override
-        {
-            auto list = state.buildList(values.size());
-            for (const auto & [n, v2] : enumerate(list))
-                v2 = values[n];
-            parent->value(state).mkList(list);
-            return std::move(parent);
-        }
+        while (p < end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t'))
+            ++p;
+    }
 
-        void add() override
-        {
-            values.push_back(*v);
-            v = nullptr;
-        }
-    public:
-        JSONListState(std::unique_ptr<JSONState> && p, std::size_t reserve)
-            : JSONState(std::move(p))
-        {
-            values.reserve(reserve);
+    bool consume(char c)
+    {
+        if (p < end && *p == c) {
+            ++p;
+            return true;
         }
-    };
-
-    EvalState & state;
-    std::unique_ptr<JSONState> rs;
+        return false;
+    }
 
-public:
-    JSONSax(EvalState & state, Value & v)
-        : state(state)
-        , rs(new JSONState(&v)) {};
+    void expect(char c, std::string_view msg)
+    {
+        skipWhitespace();
+        if (!consume(c))
+            fail(msg);
+    }
 
-    bool null() override
+    void expectLiteral(std::string_view literal)
     {
-        rs->value(state).mkNull();
-        rs->add();
-        return true;
+        if (!std::string_view(p, end).starts_with(literal))
+            fail("invalid literal");
+        p += literal.size();
     }
 
-    bool boolean(bool val) override
+    /**
+     * Return the length of the UTF-8 sequence at `p`.
+     */
+    size_t utf8Length()
     {
-        rs->value(state).mkBool(val);
-        rs->add();
-        return true;
+        auto c = (unsigned char) p[0];
+        auto at = [&](size_t i) -> unsigned char { return p + i < end ? p[i] : 0; };
+        auto cont = [&](size_t i, unsigned char lo = 0x80, unsigned char hi = 0xbf) {
+            return at(i) >= lo && at(i) <= hi;
+        };
+        if (c >= 0xc2 && c <= 0xdf && cont(1))
+            return 2;
+        if (((c == 0xe0 && cont(1, 0xa0)) || (c == 0xed && cont(1, 0x80, 0x9f))
+             || (c >= 0xe1 && c <= 0xef && c != 0xed && cont(1)))
+            && cont(2))
+            return 3;
+        if (((c == 0xf0 && cont(1, 0x90)) || (c == 0xf4 && cont(1, 0x80, 0x8f)) || (c >= 0xf1 && c <= 0xf3 && cont(1)))
+            && cont(2) && cont(3))
+            return 4;
+        fail("invalid UTF-8 in string");
     }
 
-    bool number_integer(number_integer_t val) override
+    unsigned int parseHex4()
     {
-        rs->value(state).mkInt(val);
-        rs->add();
-        return true;
+        if (end - p < 4)
+            fail("invalid \\u escape");
+        unsigned int n = 0;
+        auto [ptr, ec] = std::from_chars(p, p + 4, n, 16);
+        if (ec != std::errc() || ptr != p + 4)
+            fail("invalid \\u escape");
+        p += 4;
+        return n;
     }
 
-    bool number_unsigned(number_unsigned_t val_) override
+    void appendUtf8(unsigned int cp)
     {
-        if (val_ > std::numeric_limits<NixInt::Inner>::max()) {
-            throw Error("unsigned json number %1% outside of Nix integer range", val_);
+        if (cp < 0x80)
+            buf += (char) cp;
+        else if (cp < 0x800) {
+            buf += (char) (0xc0 | (cp >> 6));
+            buf += (char) (0x80 | (cp & 0x3f));
+        } else if (cp < 0x10000) {
+            buf += (char) (0xe0 | (cp >> 12));
+            buf += (char) (0x80 | ((cp >> 6) & 0x3f));
+            buf += (char) (0x80 | (cp & 0x3f));
+        } else {
+            buf += (char) (0xf0 | (cp >> 18));
+            buf += (char) (0x80 | ((cp >> 12) & 0x3f));
+            buf += (char) (0x80 | ((cp >> 6) & 0x3f));
+            buf += (char) (0x80 | (cp & 0x3f));
         }
-        NixInt::Inner val = val_;
-        rs->value(state).mkInt(val);
-        rs->add();
-        return true;
     }
 
-    bool number_float(number_float_t val, const string_t & s) override
+    void parseEscape()
     {
-        rs->value(state).mkFloat(val);
-        rs->add();
-        return true;
+        if (p == end)
+            fail("unterminated string");
+        switch (*p++) {
+        case '"':
+            buf += '"';
+            break;
+        case '\\':
+            buf += '\\';
+            break;
+        case '/':
+            buf += '/';
+            break;
+        case 'b':
+            buf += '\b';
+            break;
+        case 'f':
+            buf += '\f';
+            break;
+        case 'n':
+            buf += '\n';
+            break;
+        case 'r':
+            buf += '\r';
+            break;
+        case 't':
+            buf += '\t';
+            break;
+        case 'u': {
+            auto cp = parseHex4();
+            if (cp >= 0xd800 && cp <= 0xdbff) {
+                if (!std::string_view(p, end).starts_with("\\u"))
+                    fail("unpaired UTF-16 surrogate");
+                p += 2;
+                auto low = parseHex4();
+                if (low < 0xdc00 || low > 0xdfff)
+                    fail("unpaired UTF-16 surrogate");
+                cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+            } else if (cp >= 0xdc00 && cp <= 0xdfff)
+                fail("unpaired UTF-16 surrogate");
+            appendUtf8(cp);
+            break;
+        }
+        default:
+            p--;
+            fail("invalid escape in string");
+        }
     }
 
-    bool string(string_t & val) override
+    /**
+     * Parse a string whose opening quote has been consumed. If it has
+     * no escapes, return a view of the input rather than copying it.
+     */
+    std::string_view parseString()
     {
-        forceNoNullByte(val);
-        rs->value(state).mkString(val, state.mem);
-        rs->add();
-        return true;
+        auto start = p;
+        bool escaped = false;
+        while (true) {
+            auto q = findSpecial(p, end);
+            if (escaped)
+                buf.append(p, q);
+            p = q;
+            if (p == end)
+                fail("unterminated string");
+            auto c = (unsigned char) *p;
+            if (c == '"') {
+                auto res = escaped ? std::string_view(buf) : std::string_view(start, p);
+                p++;
+                if (escaped)
+                    forceNoNullByte(res);
+                return res;
+            } else if (c == '\\') {
+                if (!escaped) {
+                    buf.assign(start, p);
+                    escaped = true;
+                }
+                p++;
+                parseEscape();
+            } else if (c < 0x20)
+                fail("control character in string must be escaped");
+            else {
+                auto len = utf8Length();
+                if (escaped)
+                    buf.append(p, len);
+                p += len;
+            }
+        }
     }
 
-#if NLOHMANN_JSON_VERSION_MAJOR >= 3 && NLOHMANN_JSON_VERSION_MINOR >= 8
-    bool binary(binary_t &) override
+    Value * parseNumber()
     {
-        // This function ought to be unreachable
-        assert(false);
-        return true;
+        auto start = p;
+        bool negative = consume('-');
+        auto isDigit = [&]() { return p < end && *p >= '0' && *p <= '9'; };
+        auto digits = [&]() {
+            if (!isDigit())
+                fail("invalid number");
+            while (isDigit())
+                ++p;
+        };
+        if (consume('0')) {
+            if (isDigit())
+                fail("invalid number");
+        } else
+            digits();
+        bool isFloat = false;
+        if (consume('.')) {
+            digits();
+            isFloat = true;
+        }
+        if (consume('e') || consume('E')) {
+            if (!consume('+'))
+                consume('-');
+            digits();
+            isFloat = true;
+        }
+
+        auto v = state.allocValue();
+
+        if (!isFloat) {
+            uint64_t n;
+            auto [ptr, ec] = std::from_chars(start + negative, p, n);
+            if (ec == std::errc()) {
+                constexpr uint64_t max = std::numeric_limits<NixInt::Inner>::max();
+                if (!negative) {
+                    if (n > max)
+                        throw Error("unsigned json number %1% outside of Nix integer range", n);
+                    v->mkInt((NixInt::Inner) n);
+                    return v;
+                }
+                if (n <= max + 1) {
+                    v->mkInt(n == max + 1 ? std::numeric_limits<NixInt::Inner>::min() : -(NixInt::Inner) n);
+                    return v;
+                }
+            }
+            /* Integers that don't fit in 64 bits are parsed as
+               floats. */
+        }
+
+        double d;
+        auto [ptr, ec] = std::from_chars(start, p, d);
+        if (ec == std::errc::result_out_of_range)
+            /* Overflow to infinity or underflow to zero like strtod(). */
+            d = std::strtod(std::string(start, p).c_str(), nullptr);
+        v->mkFloat(d);
+        return v;
     }
-#endif
 
-    bool start_object(std::size_t len) override
+    void parseKey()
     {
-        rs = std::make_unique<JSONObjectState>(std::move(rs));
-        return true;
+        expect('"', "expected a string as an object key");
+        keys.push_back(state.symbols.create(parseString()));
+        expect(':', "expected ':' after an object key");
     }
 
-    bool key(string_t & name) override
+    /**
+     * Parse a value. If it's a non-empty list or object, push a frame
+     * for it, consume its first key if it's an object and return null.
+     */
+    Value * parseValue()
     {
-        dynamic_cast<JSONObjectState *>(rs.get())->key(name, state);
-        return true;
+        skipWhitespace();
+        if (p == end)
+            fail("unexpected end of input");
+        switch (*p) {
+        case '{':
+            p++;
+            skipWhitespace();
+            if (consume('}')) {
+                auto v = state.allocValue();
+                v->mkAttrs(&Bindings::emptyBindings);
+                return v;
+            }
+            frames.push_back({true, values.size(), keys.size()});
+            parseKey();
+            return nullptr;
+        case '[':
+            p++;
+            skipWhitespace();
+            if (consume(']'))
+                return &Value::vEmptyList;
+            frames.push_back({false, values.size(), keys.size()});
+            return nullptr;
+        case '"': {
+            p++;
+            auto v = state.allocValue();
+            v->mkString(parseString(), state.mem);
+            return v;
+        }
+        case 't':
+            expectLiteral("true");
+            return &Value::vTrue;
+        case 'f':
+            expectLiteral("false");
+            return &Value::vFalse;
+        case 'n':
+            expectLiteral("null");
+            return &Value::vNull;
+        default:
+            if (*p == '-' || (*p >= '0' && *p <= '9'))
+                return parseNumber();
+            fail("unexpected character");
+        }
     }
 
-    bool end_object() override
+    Value * finishList(const Frame & frame)
     {
-        rs = rs->resolve(state);
-        rs->add();
-        return true;
+        auto list = state.buildList(values.size() - frame.valuesStart);
+        for (const auto & [n, v2] : enumerate(list))
+            v2 = values[frame.valuesStart + n];
+        values.resize(frame.valuesStart);
+        auto v = state.allocValue();
+        v->mkList(list);
+        return v;
     }
 
-    bool end_array() override
+    Value * finishObject(const Frame & frame)
     {
-        return end_object();
+        auto size = values.size() - frame.valuesStart;
+        auto key = [&](uint32_t i) { return keys[frame.keysStart + i]; };
+
+        /* Sort the attributes by name, keeping the last of duplicate
+           keys. */
+        order.resize(size);
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return key(a) < key(b); });
+        size_t unique = 0;
+        for (size_t i = 0; i < size; ++i)
+            if (i + 1 == size || key(order[i]) != key(order[i + 1]))
+                order[unique++] = order[i];
+
+        auto attrs = state.buildBindings(unique);
+        for (size_t i = 0; i < unique; ++i)
+            attrs.insert(key(order[i]), values[frame.valuesStart + order[i]]);
+
+        values.resize(frame.valuesStart);
+        keys.resize(frame.keysStart);
+        auto v = state.allocValue();
+        v->mkAttrs(attrs.alreadySorted());
+        return v;
     }
 
-    bool start_array(size_t len) override
+public:
+
+    JSONParser(EvalState & state, std::string_view s)
+        : state(state)
+        , s(s)
+        , p(s.data())
+        , end(s.data() + s.size())
     {
-        rs = std::make_unique<JSONListState>(std::move(rs), len != std::numeric_limits<size_t>::max() ? len : 128);
-        return true;
     }
 
-    bool parse_error(std::size_t, const std::string &, const nlohmann::detail::exception & ex) override
+    void parse(Value & v)
     {
-        throw JSONParseError("%s", ex.what());
+        /* Skip a UTF-8 byte order mark. */
+        if (s.starts_with("\xef\xbb\xbf"))
+            p += 3;
+
+        while (true) {
+            auto value = parseValue();
+            if (!value)
+                continue;
+
+            /* Add the value to the enclosing containers, finishing
+               those that end here. */
+            while (true) {
+                if (frames.empty()) {
+                    skipWhitespace();
+                    if (p != end)
+                        fail("unexpected trailing characters");
+                    v = *value;
+                    return;
+                }
+                values.push_back(value);
+                auto frame = frames.back();
+                skipWhitespace();
+                if (consume(',')) {
+                    if (frame.object)
+                        parseKey();
+                    break;
+                }
+                if (!consume(frame.object ? '}' : ']'))
+                    fail(frame.object ? "expected ',' or '}'" : "expected ',' or ']'");
+                frames.pop_back();
+                value = frame.object ? finishObject(frame) : finishList(frame);
+            }
+        }
     }
 };
 
+} // namespace
+
 void parseJSON(EvalState & state, const std::string_view & s_, Value & v)
 {
-    JSONSax parser(state, v);
-    bool res = json::sax_parse(s_, &parser);
-    if (!res)
-        throw JSONParseError("Invalid JSON Value");
+    JSONParser(state, s_).parse(v);
 }
 
 } // namespace nix
@@ -281,6 +281,38 @@ std::string showAttrSelectionPath(const SymbolTable & symbols, std::span<const A
 
 /* Computing levels/displacements for variables. */
 
+/* Escape analysis for the environments of function calls: evaluating
+   an expression captures its environment if it stores a pointer to it
+   in a thunk, a function or a nested environment. A captured
+   environment keeps its parents alive, so this captures the
+   environment of the innermost function around it, which then can't
+   be freed when the call returns. */
+static void captureEnv(const StaticEnv & env)
+{
+    for (auto * e = &env; e; e = e->up.get())
+        if (e->lambda) {
+            e->lambda->envMayEscape = true;
+            return;
+        }
+}
+
+/* Capture `env` if `e->maybeThunk()` in `env` may create a thunk.
+   `e` must have been bound already. */
+static void captureEnvByThunk(const Expr & e, const StaticEnv & env)
+{
+    if (auto var = dynamic_cast<const ExprVar *>(&e)) {
+        if (!var->fromWith)
+            return;
+    } else if (auto list = dynamic_cast<const ExprList *>(&e)) {
+        if (list->elems.empty())
+            return;
+    } else if (
+        dynamic_cast<const ExprInt *>(&e) || dynamic_cast<const ExprFloat *>(&e)
+        || dynamic_cast<const ExprString *>(&e) || dynamic_cast<const ExprPath *>(&e))
+        return;
+    captureEnv(env);
+}
+
 void Expr::bindVars(EvalState & es, const std::shared_ptr<const StaticEnv> & env)
 {
     unreachable();
@@ -394,6 +426,8 @@ ExprAttrs::bindInheritSources(EvalState & es, const std::shared_ptr<const Static
     for (auto from : *inheritFromExprs)
         from->bindVars(es, env);
 
+    captureEnv(*env);
+
     return inner;
 }
 
@@ -415,6 +449,8 @@ void ExprAttrs::bindVars(EvalState & es, const std::shared_ptr<const StaticEnv>
         es.exprEnvs.insert(std::make_pair(this, env));
 
     if (recursive) {
+        captureEnv(*env);
+
         auto newEnv = [&]() -> std::shared_ptr<const StaticEnv> {
             auto newEnv = std::make_shared<StaticEnv>(nullptr, env, attrs->size());
 
@@ -437,12 +473,16 @@ void ExprAttrs::bindVars(EvalState & es, const std::shared_ptr<const StaticEnv>
     } else {
         auto inheritFromEnv = bindInheritSources(es, env);
 
-        for (auto & i : *attrs)
-            i.second.e->bindVars(es, i.second.chooseByKind(env, env, inheritFromEnv));
+        for (auto & i : *attrs) {
+            auto & env2 = i.second.chooseByKind(env, env, inheritFromEnv);
+            i.second.e->bindVars(es, env2);
+            captureEnvByThunk(*i.second.e, *env2);
+        }
 
         for (auto & i : *dynamicAttrs) {
             i.nameExpr->bindVars(es, env);
             i.valueExpr->bindVars(es, env);
+            captureEnvByThunk(*i.valueExpr, *env);
         }
     }
 }
@@ -452,8 +492,10 @@ void ExprList::bindVars(EvalState & es, const std::shared_ptr<const StaticEnv> &
     if (es.debugRepl)
         es.exprEnvs.insert(std::make_pair(this, env));
 
-    for (auto & i : elems)
+    for (auto & i : elems) {
         i->bindVars(es, env);
+        captureEnvByThunk(*i, *env);
+    }
 }
 
 void ExprLambda::bindVars(EvalState & es, const std::shared_ptr<const StaticEnv> & env)
@@ -461,8 +503,12 @@ void ExprLambda::bindVars(EvalState & es, const std::shared_ptr<const StaticEnv>
     if (es.debugRepl)
         es.exprEnvs.insert(std::make_pair(this, env));
 
+    /* The function closes over its environment. */
+    captureEnv(*env);
+
     auto newEnv =
         std::make_shared<StaticEnv>(nullptr, env, (getFormals() ? getFormals()->formals.size() : 0) + (!arg ? 0 : 1));
+    newEnv->lambda = this;
 
     Displacement displ = 0;
 
@@ -475,9 +521,20 @@ void ExprLambda::bindVars(EvalState & es, const std::shared_ptr<const StaticEnv>
 
         newEnv->sort();
 
-        for (auto & i : formals->formals)
-            if (i.def)
+        displ = arg ? 1 : 0;
+        for (auto & i : formals->formals) {
+            if (i.def) {
                 i.def->bindVars(es, newEnv);
+                captureEnvByThunk(*i.def, *newEnv);
+                /* Defaults are evaluated in the order of the formals, so
+                   a default that refers to this or a later formal sees
+                   an uninitialised slot and gets a thunk over the call
+                   environment (e.g. `{ a ? b, b ? 1 }`). */
+                if (auto var = dynamic_cast<const ExprVar *>(i.def); var && var->level == 0 && var->displ >= displ)
+                    captureEnv(*newEnv);
+            }
+            displ++;
+        }
     }
 
     body->bindVars(es, newEnv);
@@ -496,12 +553,16 @@ void ExprCall::bindVars(EvalState & es, const std::shared_ptr<const StaticEnv> &
         es.exprEnvs.insert(std::make_pair(this, env));
 
     fun->bindVars(es, env);
-    for (auto e : *args)
+    for (auto e : *args) {
         e->bindVars(es, env);
+        captureEnvByThunk(*e, *env);
+    }
 }
 
 void ExprLet::bindVars(EvalState & es, const std::shared_ptr<const StaticEnv> & env)
 {
+    captureEnv(*env);
+
     attrs->moveDataToAllocator(es.mem.exprs.alloc);
     auto newEnv = [&]() -> std::shared_ptr<const StaticEnv> {
         auto newEnv = std::make_shared<StaticEnv>(nullptr, env, attrs->attrs->size());
@@ -547,6 +608,7 @@ void ExprWith::bindVars(EvalState & es, const std::shared_ptr<const StaticEnv> &
         }
 
     attrs->bindVars(es, env);
+    captureEnv(*env);
     auto newEnv = std::make_shared<StaticEnv>(this, env);
     body->bindVars(es, newEnv);
 }
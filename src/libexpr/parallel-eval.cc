@@ -2,9 +2,21 @@
 #include "nix/expr/parallel-eval.hh"
 #include "nix/store/globals.hh"
 #include "nix/expr/primops.hh"
+#include "nix/util/finally.hh"
+#include "nix/util/trace-events.hh"
+
+#include <climits>
+#include <map>
+#include <random>
+
+#ifdef __linux__
+#  include <linux/futex.h>
+#  include <sys/syscall.h>
+#endif
 
 namespace nix {
 
+#ifndef __linux__
 // cache line alignment to prevent false sharing
 struct alignas(64) WaiterDomain
 {
@@ -12,9 +24,76 @@ struct alignas(64) WaiterDomain
 };
 
 static std::array<Sync<WaiterDomain>, 128> waiterDomains;
+#endif
 
 thread_local bool Executor::amWorkerThread{false};
 
+thread_local Executor * Executor::currentExecutor{nullptr};
+
+thread_local size_t Executor::currentWorker{0};
+
+// cache line alignment to prevent false sharing
+struct alignas(64) Executor::WorkerQueue
+{
+    std::mutex mutex;
+
+    /**
+     * The pending items, by priority prefix. Empty levels are kept
+     * to avoid reallocating their deques. (This is a map rather than
+     * a sorted vector because `Item` is move-only and `std::deque`'s
+     * move constructor isn't `noexcept`, so a vector of deques can't
+     * be relocated.)
+     */
+    std::map<uint8_t, std::deque<Item>> levels;
+
+    /**
+     * Number of items in `levels`, so that thieves can skip empty
+     * queues without taking the lock.
+     */
+    std::atomic<size_t> size{0};
+
+    std::unique_lock<std::mutex> lock(Executor & executor)
+    {
+        std::unique_lock lock(mutex, std::try_to_lock);
+        if (!lock.owns_lock()) {
+            executor.nrLockContentions++;
+            lock.lock();
+        }
+        return lock;
+    }
+
+    void push(Item && item, uint8_t prio)
+    {
+        levels[prio].push_back(std::move(item));
+        size++;
+    }
+
+    /**
+     * Take an item with the lowest priority prefix. The owner of the
+     * queue takes the most recently pushed one, since its inputs are
+     * most likely to still be in the cache; thieves take the oldest
+     * one, which tends to represent the largest amount of work.
+     */
+    std::optional<Item> pop(bool owner)
+    {
+        for (auto & [prio, items] : levels) {
+            if (items.empty())
+                continue;
+            std::optional<Item> item;
+            if (owner) {
+                item = std::move(items.back());
+                items.pop_back();
+            } else {
+                item = std::move(items.front());
+                items.pop_front();
+            }
+            size--;
+            return item;
+        }
+        return std::nullopt;
+    }
+};
+
 unsigned int Executor::getEvalCores(const EvalSettings & evalSettings)
 {
     return evalSettings.evalCores == 0UL ? Settings::getDefaultCores() : evalSettings.evalCores;
@@ -24,14 +103,18 @@ Executor::Executor(const EvalSettings & evalSettings)
     : evalCores(getEvalCores(evalSettings))
     , enabled(evalCores > 1)
     , interruptCallback(createInterruptCallback([&]() {
+#ifndef __linux__
         for (auto & domain : waiterDomains)
             domain.lock()->cv.notify_all();
+#endif
     }))
 {
     debug("executor using %d threads", evalCores);
+    for (size_t n = 0; n < evalCores; ++n)
+        queues.push_back(std::make_unique<WorkerQueue>());
     auto state(state_.lock());
     for (size_t n = 0; n < evalCores; ++n)
-        createWorker(*state);
+        createWorker(*state, n);
 }
 
 Executor::~Executor()
@@ -41,7 +124,7 @@ Executor::~Executor()
         auto state(state_.lock());
         quit = true;
         std::swap(threads, state->threads);
-        debug("executor shutting down with %d items left", state->queue.size());
+        debug("executor shutting down with %d items left", nrQueued.load());
     }
 
     wakeup.notify_all();
@@ -50,66 +133,150 @@ Executor::~Executor()
         thr.join();
 }
 
-void Executor::createWorker(State & state)
+void Executor::createWorker(State & state, size_t index)
 {
     boost::thread::attributes attrs;
     attrs.set_stack_size(evalStackSize);
-    state.threads.push_back(boost::thread(attrs, [&]() {
+    nrThreads++;
+    state.threads.push_back(boost::thread(attrs, [this, index]() {
 #if NIX_USE_BOEHMGC
         GC_stack_base sb;
         GC_get_stack_base(&sb);
         GC_register_my_thread(&sb);
 #endif
-        worker();
+        worker(index);
 #if NIX_USE_BOEHMGC
         GC_unregister_my_thread();
 #endif
     }));
 }
 
-void Executor::worker()
+std::optional<Executor::Item> Executor::take(size_t index)
+{
+    auto & own = *queues[index];
+    if (own.size) {
+        auto lock(own.lock(*this));
+        if (auto item = own.pop(true)) {
+            nrQueued--;
+            return item;
+        }
+    }
+
+    /* Start at a random victim so that thieves don't all go after
+       the same queue. */
+    thread_local std::minstd_rand rng(index + 1);
+    auto nrQueues = queues.size();
+    auto start = rng();
+    for (size_t n = 0; n < nrQueues; ++n) {
+        auto victimIndex = (start + n) % nrQueues;
+        if (victimIndex == index)
+            continue;
+        auto & victim = *queues[victimIndex];
+        if (!victim.size)
+            continue;
+        auto lock(victim.lock(*this));
+        if (auto item = victim.pop(false)) {
+            nrQueued--;
+            nrSteals++;
+            return item;
+        }
+    }
+
+    return std::nullopt;
+}
+
+void Executor::cancelQueued()
+{
+    // Set an `Interrupted` exception on all promises so we get a
+    // nicer error than "std::future_error: Broken promise".
+    auto ex = std::make_exception_ptr(Interrupted("interrupted by the user"));
+    for (auto & queue : queues) {
+        auto lock(queue->lock(*this));
+        while (auto item = queue->pop(true)) {
+            nrQueued--;
+            item->promise.set_exception(ex);
+        }
+    }
+}
+
+void Executor::worker(size_t index)
 {
     ReceiveInterrupts receiveInterrupts;
 
     unix::interruptCheck = [&]() { return (bool) quit; };
 
     amWorkerThread = true;
+    currentExecutor = this;
+    currentWorker = index;
+
+    setTraceThreadName(fmt("eval worker %d", index));
 
     while (true) {
-        Item item;
+        if (quit) {
+            cancelQueued();
+            return;
+        }
+
+        /* If a blocked worker has resumed while a spare worker was
+           running in its place, one of them has to go to sleep. */
+        auto item = nrActive() > evalCores ? std::nullopt : take(index);
 
-        while (true) {
+        if (!item) {
             auto state(state_.lock());
-            if (quit) {
-                // Set an `Interrupted` exception on all promises so
-                // we get a nicer error than "std::future_error:
-                // Broken promise".
-                auto ex = std::make_exception_ptr(Interrupted("interrupted by the user"));
-                for (auto & item : state->queue)
-                    item.second.promise.set_exception(ex);
-                state->queue.clear();
-                return;
+            /* Announce that we're going to sleep before checking for
+               work, so that spawn() and blocked() either see us
+               sleeping or we see their work. */
+            nrSleeping++;
+            if (!quit && (!nrQueued || nrActive() >= evalCores)) {
+                nrSleeps++;
+                state.wait(wakeup);
             }
-            if (!state->queue.empty()) {
-                item = std::move(state->queue.begin()->second);
-                state->queue.erase(state->queue.begin());
-                break;
-            }
-            state.wait(wakeup);
+            nrSleeping--;
+            continue;
         }
 
         try {
-            item.work();
-            item.promise.set_value();
+            {
+                TraceSpan span("executor", "work item");
+                item->work();
+            }
+            item->promise.set_value();
         } catch (const Interrupted &) {
             quit = true;
-            item.promise.set_exception(std::current_exception());
+            item->promise.set_exception(std::current_exception());
         } catch (...) {
-            item.promise.set_exception(std::current_exception());
+            item->promise.set_exception(std::current_exception());
         }
     }
 }
 
+void Executor::blocked()
+{
+    nrBlocked++;
+
+    if (!nrQueued)
+        return;
+
+    auto state(state_.lock());
+
+    if (quit || nrActive() >= evalCores)
+        return;
+
+    if (nrSleeping)
+        wakeup.notify_one();
+    else if (nrThreads < 2 * evalCores) {
+        nrSpareWorkers++;
+        /* Spare workers share a queue with one of the regular
+           workers. */
+        createWorker(*state, nrThreads % evalCores);
+    }
+}
+
+void Executor::unblocked()
+{
+    nrBlocked--;
+}
+
 std::vector<std::future<void>> Executor::spawn(std::vector<std::pair<work_t, uint8_t>> && items)
 {
     if (items.empty())
@@ -117,22 +284,40 @@ std::vector<std::future<void>> Executor::spawn(std::vector<std::pair<work_t, uin
 
     std::vector<std::future<void>> futures;
 
-    {
-        auto state(state_.lock());
+    nrSpawned += items.size();
+
+    auto makeItem = [&](work_t && work) {
+        std::promise<void> promise;
+        futures.push_back(promise.get_future());
+        return Item{.promise = std::move(promise), .work = std::move(work)};
+    };
+
+    /* Count the items before publishing them, since a worker may pop
+       one (and decrement the count) as soon as it is pushed. */
+    nrQueued += items.size();
+
+    if (currentExecutor == this) {
+        /* Keep work spawned by a worker local to that worker; idle
+           workers will steal it. */
+        auto & queue = *queues[currentWorker];
+        auto lock(queue.lock(*this));
+        for (auto & item : items)
+            queue.push(makeItem(std::move(item.first)), item.second);
+    } else {
         for (auto & item : items) {
-            std::promise<void> promise;
-            futures.push_back(promise.get_future());
-            thread_local std::random_device rd;
-            thread_local std::uniform_int_distribution<uint64_t> dist(0, 1ULL << 48);
-            auto key = (uint64_t(item.second) << 48) | dist(rd);
-            state->queue.emplace(key, Item{.promise = std::move(promise), .work = std::move(item.first)});
+            auto & queue = *queues[nextQueue++ % queues.size()];
+            auto lock(queue.lock(*this));
+            queue.push(makeItem(std::move(item.first)), item.second);
         }
     }
 
-    if (items.size() == 1)
-        wakeup.notify_one();
-    else
-        wakeup.notify_all();
+    if (nrSleeping) {
+        auto state(state_.lock());
+        if (items.size() == 1)
+            wakeup.notify_one();
+        else
+            wakeup.notify_all();
+    }
 
     return futures;
 }
@@ -181,11 +366,30 @@ void FutureVector::finishAll()
         std::rethrow_exception(ex);
 }
 
+#ifdef __linux__
+/**
+ * The half of `p0` that contains the primary discriminator. Waiters
+ * sleep on it with `futex()`; it changes when the value is finished,
+ * since finished values never have the `pdAwaited` discriminator.
+ */
+template<typename PackedPointer>
+static uint32_t * getFutexWord(std::atomic<PackedPointer> & p0)
+{
+    static_assert(sizeof(PackedPointer) == 8);
+    return reinterpret_cast<uint32_t *>(&p0) + (std::endian::native == std::endian::big ? 1 : 0);
+}
+
+/**
+ * How often threads waiting on a thunk check for interrupts.
+ */
+static constexpr long futexTimeoutNs = 100'000'000;
+#else
 static Sync<WaiterDomain> & getWaiterDomain(detail::ValueBase & v)
 {
     auto domain = (((size_t) &v) >> 5) % waiterDomains.size();
     return waiterDomains[domain];
 }
+#endif
 
 static std::atomic<uint32_t> nextEvalThreadId{1};
 thread_local uint32_t myEvalThreadId(nextEvalThreadId++);
@@ -196,13 +400,14 @@ ValueStorage<sizeof(void *)>::waitOnThunk(EvalState & state, PackedPointer expec
 {
     state.nrThunksAwaited++;
 
+#ifndef __linux__
     auto domain = getWaiterDomain(*this).lock();
+#endif
 
     auto threadId = expectedP0 >> discriminatorBits;
 
     if (static_cast<PrimaryDiscriminator>(expectedP0 & discriminatorMask) == pdAwaited) {
-        /* Make sure that the value is still awaited, now that we're
-           holding the domain lock. */
+        /* Make sure that the value is still awaited. */
         auto p0_ = p0.load(std::memory_order_acquire);
         auto pd = static_cast<PrimaryDiscriminator>(p0_ & discriminatorMask);
 
@@ -244,8 +449,35 @@ ValueStorage<sizeof(void *)>::waitOnThunk(EvalState & state, PackedPointer expec
 
     auto now1 = std::chrono::steady_clock::now();
 
+    TraceSpan span("eval", "wait on thunk");
+
+    /* Let another worker use our core while we're blocked. We don't
+       run queued work on this thread ourselves: that work could need
+       a thunk that a frame further up this thread's stack is
+       evaluating, which would deadlock. */
+    Executor * executor = Executor::currentExecutor == &*state.executor ? &*state.executor : nullptr;
+    if (executor)
+        executor->blocked();
+    Finally unblock([&]() {
+        if (executor)
+            executor->unblocked();
+    });
+
+#ifdef __linux__
+    auto awaitedP0 = pdAwaited | (threadId << discriminatorBits);
+    auto futexWord = getFutexWord(p0);
+#endif
+
     while (true) {
+#ifdef __linux__
+        struct timespec timeout{0, futexTimeoutNs};
+        bool timedOut =
+            syscall(SYS_futex, futexWord, FUTEX_WAIT_PRIVATE, (uint32_t) awaitedP0, &timeout, nullptr, 0) == -1
+            && errno == ETIMEDOUT;
+#else
         domain.wait(domain->cv);
+        bool timedOut = false;
+#endif
         auto p0_ = p0.load(std::memory_order_acquire);
         auto pd = static_cast<PrimaryDiscriminator>(p0_ & discriminatorMask);
         if (pd != pdAwaited) {
@@ -255,7 +487,8 @@ ValueStorage<sizeof(void *)>::waitOnThunk(EvalState & state, PackedPointer expec
             state.currentlyWaiting--;
             return p0_;
         }
-        state.nrSpuriousWakeups++;
+        if (!timedOut)
+            state.nrSpuriousWakeups++;
         checkInterrupt();
     }
 }
@@ -263,9 +496,13 @@ ValueStorage<sizeof(void *)>::waitOnThunk(EvalState & state, PackedPointer expec
 template<>
 void ValueStorage<sizeof(void *)>::notifyWaiters()
 {
+#ifdef __linux__
+    syscall(SYS_futex, getFutexWord(p0), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+#else
     auto domain = getWaiterDomain(*this).lock();
 
     domain->cv.notify_all();
+#endif
 }
 
 static void prim_parallel(EvalState & state, const PosIdx pos, Value ** args, Value & v)
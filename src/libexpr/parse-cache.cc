@@ -0,0 +1,768 @@
+#include "nix/expr/parse-cache.hh"
+#include "nix/store/globals.hh"
+#include "nix/util/file-descriptor.hh"
+#include "nix/util/file-system.hh"
+#include "nix/util/strings.hh"
+#include "nix/util/users.hh"
+
+#include <boost/unordered/unordered_flat_map.hpp>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace nix {
+
+/* The format of a cache entry is a header (the magic string, the size
+   of the source, the symbol table and the documentation comments of
+   the file) followed by the syntax tree. Every node is written after
+   its children and is numbered in that order, so nodes that occur
+   more than once in the tree (such as the `ExprInheritFrom`s shared by
+   the attributes of an `inherit (expr) ...`) are written once and then
+   referred to by number.
+
+   Positions are stored as offsets into the source, plus one so that 0
+   can denote `noPos`. Symbols are stored as indices into the symbol
+   table, plus one so that 0 can denote the empty symbol.
+
+   Variables are not bound in the cache: displacements depend on the
+   order of symbols, which differs between evaluator instances, so the
+   caller re-runs `bindVars()` on the loaded tree. */
+
+static constexpr std::string_view magic{"NIXAST\0\1", 8};
+
+enum class Tag : uint8_t {
+    Null,
+    Ref,
+    Int,
+    Float,
+    String,
+    Path,
+    Var,
+    InheritFrom,
+    Select,
+    OpHasAttr,
+    Attrs,
+    List,
+    Lambda,
+    Call,
+    Let,
+    With,
+    If,
+    Assert,
+    OpNot,
+    OpEq,
+    OpNEq,
+    OpAnd,
+    OpOr,
+    OpImpl,
+    OpConcatLists,
+    OpUpdate,
+    ConcatStrings,
+    Pos,
+};
+
+static std::filesystem::path getParseCacheDir()
+{
+    return getCacheDir() / "ast-v1";
+}
+
+Hash parseCacheKey(const EvalState & state, const SourcePath & path, std::string_view text)
+{
+    /* Besides the text, the result of the parser depends on the
+       location of the file (relative paths are resolved against it),
+       on the settings checked by the parser and on the home directory
+       (for `~/...` paths). */
+    return hashString(
+        HashAlgorithm::SHA256,
+        fmt("nix-%s\n%s\n%s\n%d\n%s\n%s",
+            nixVersion,
+            path.to_string(),
+            hashString(HashAlgorithm::SHA256, text).to_string(HashFormat::Nix32, false),
+            state.settings.pureEval.get(),
+            concatMapStringsSep(
+                ",",
+                experimentalFeatureSettings.experimentalFeatures.get(),
+                [](auto feature) { return std::string(showExperimentalFeature(feature)); }),
+            getHome().string()));
+}
+
+namespace {
+
+struct AstWriter
+{
+    const PosTable::Origin & origin;
+    const ref<SourceAccessor> rootFS;
+
+    std::string out;
+
+    boost::unordered_flat_map<Symbol, uint32_t, std::hash<Symbol>> symbolIds;
+    std::vector<Symbol> symbols;
+
+    boost::unordered_flat_map<const Expr *, uint32_t> exprIds;
+
+    template<typename T>
+    void put(T t)
+    {
+        out.append((const char *) &t, sizeof(t));
+    }
+
+    void putString(std::string_view s)
+    {
+        put<uint32_t>(s.size());
+        out.append(s);
+    }
+
+    void putSymbol(Symbol s)
+    {
+        if (!s) {
+            put<uint32_t>(0);
+            return;
+        }
+        auto [i, inserted] = symbolIds.try_emplace(s, symbols.size() + 1);
+        if (inserted)
+            symbols.push_back(s);
+        put<uint32_t>(i->second);
+    }
+
+    void putPos(PosIdx pos)
+    {
+        if (!pos) {
+            put<uint32_t>(0);
+            return;
+        }
+        auto offset = origin.offsetOf(pos);
+        if (offset > origin.size)
+            throw Error("position is outside of the file being cached");
+        put<uint32_t>(offset + 1);
+    }
+
+    void putAttrPath(std::span<const AttrName> attrPath)
+    {
+        put<uint32_t>(attrPath.size());
+        for (auto & i : attrPath) {
+            putSymbol(i.symbol);
+            if (!i.symbol)
+                putExpr(i.expr);
+        }
+    }
+
+    template<class E>
+    bool putBinOp(Tag tag, const Expr * e)
+    {
+        auto e2 = dynamic_cast<const E *>(e);
+        if (!e2)
+            return false;
+        put(tag);
+        putPos(e2->pos);
+        putExpr(e2->e1);
+        putExpr(e2->e2);
+        return true;
+    }
+
+    void putExpr(const Expr * e);
+};
+
+void AstWriter::putExpr(const Expr * e)
+{
+    if (!e) {
+        put(Tag::Null);
+        return;
+    }
+
+    if (auto i = exprIds.find(e); i != exprIds.end()) {
+        put(Tag::Ref);
+        put<uint32_t>(i->second);
+        return;
+    }
+
+    if (auto e2 = dynamic_cast<const ExprInt *>(e)) {
+        put(Tag::Int);
+        put<NixInt::Inner>(e2->v.integer().value);
+    } else if (auto e2 = dynamic_cast<const ExprFloat *>(e)) {
+        put(Tag::Float);
+        put<NixFloat>(e2->v.fpoint());
+    } else if (auto e2 = dynamic_cast<const ExprString *>(e)) {
+        put(Tag::String);
+        putString(e2->v.string_view());
+    } else if (auto e2 = dynamic_cast<const ExprPath *>(e)) {
+        put(Tag::Path);
+        put<uint8_t>(e2->accessor == rootFS);
+        putString(e2->v.pathStrView());
+    } else if (auto e2 = dynamic_cast<const ExprInheritFrom *>(e)) {
+        put(Tag::InheritFrom);
+        putPos(e2->pos);
+        put<uint32_t>(e2->displ);
+    } else if (auto e2 = dynamic_cast<const ExprVar *>(e)) {
+        put(Tag::Var);
+        putPos(e2->pos);
+        putSymbol(e2->name);
+    } else if (auto e2 = dynamic_cast<const ExprSelect *>(e)) {
+        put(Tag::Select);
+        putPos(e2->pos);
+        putExpr(e2->e);
+        putAttrPath(e2->getAttrPath());
+        putExpr(e2->def);
+    } else if (auto e2 = dynamic_cast<const ExprOpHasAttr *>(e)) {
+        put(Tag::OpHasAttr);
+        putExpr(e2->e);
+        putAttrPath(e2->attrPath);
+    } else if (auto e2 = dynamic_cast<const ExprAttrs *>(e)) {
+        put(Tag::Attrs);
+        put<uint8_t>(e2->recursive);
+        putPos(e2->pos);
+        put<uint32_t>(e2->attrs->size());
+        for (auto & [name, def] : *e2->attrs) {
+            putSymbol(name);
+            put<uint8_t>((uint8_t) def.kind);
+            putPos(def.pos);
+            putExpr(def.e);
+        }
+        put<uint32_t>(e2->dynamicAttrs->size());
+        for (auto & def : *e2->dynamicAttrs) {
+            putPos(def.pos);
+            putExpr(def.nameExpr);
+            putExpr(def.valueExpr);
+        }
+        put<uint8_t>((bool) e2->inheritFromExprs);
+        if (e2->inheritFromExprs) {
+            put<uint32_t>(e2->inheritFromExprs->size());
+            for (auto from : *e2->inheritFromExprs)
+                putExpr(from);
+        }
+    } else if (auto e2 = dynamic_cast<const ExprList *>(e)) {
+        put(Tag::List);
+        put<uint32_t>(e2->elems.size());
+        for (auto elem : e2->elems)
+            putExpr(elem);
+    } else if (auto e2 = dynamic_cast<const ExprLambda *>(e)) {
+        put(Tag::Lambda);
+        putPos(e2->pos);
+        putSymbol(e2->name);
+        putSymbol(e2->arg);
+        putPos(e2->docComment.begin);
+        putPos(e2->docComment.end);
+        auto formals = e2->getFormals();
+        put<uint8_t>((bool) formals);
+        if (formals) {
+            put<uint8_t>(formals->ellipsis);
+            put<uint32_t>(formals->formals.size());
+            for (auto & formal : formals->formals) {
+                putPos(formal.pos);
+                putSymbol(formal.name);
+                putExpr(formal.def);
+            }
+        }
+        putExpr(e2->body);
+    } else if (auto e2 = dynamic_cast<const ExprCall *>(e)) {
+        put(Tag::Call);
+        putPos(e2->pos);
+        putExpr(e2->fun);
+        put<uint32_t>(e2->args->size());
+        for (auto arg : *e2->args)
+            putExpr(arg);
+    } else if (auto e2 = dynamic_cast<const ExprLet *>(e)) {
+        put(Tag::Let);
+        putExpr(e2->attrs);
+        putExpr(e2->body);
+    } else if (auto e2 = dynamic_cast<const ExprWith *>(e)) {
+        put(Tag::With);
+        putPos(e2->pos);
+        putExpr(e2->attrs);
+        putExpr(e2->body);
+    } else if (auto e2 = dynamic_cast<const ExprIf *>(e)) {
+        put(Tag::If);
+        putPos(e2->pos);
+        putExpr(e2->cond);
+        putExpr(e2->then);
+        putExpr(e2->else_);
+    } else if (auto e2 = dynamic_cast<const ExprAssert *>(e)) {
+        put(Tag::Assert);
+        putPos(e2->pos);
+        putExpr(e2->cond);
+        putExpr(e2->body);
+    } else if (auto e2 = dynamic_cast<const ExprOpNot *>(e)) {
+        put(Tag::OpNot);
+        putExpr(e2->e);
+    } else if (
+        putBinOp<ExprOpEq>(Tag::OpEq, e) || putBinOp<ExprOpNEq>(Tag::OpNEq, e) || putBinOp<ExprOpAnd>(Tag::OpAnd, e)
+        || putBinOp<ExprOpOr>(Tag::OpOr, e) || putBinOp<ExprOpImpl>(Tag::OpImpl, e)
+        || putBinOp<ExprOpConcatLists>(Tag::OpConcatLists, e) || putBinOp<ExprOpUpdate>(Tag::OpUpdate, e)) {
+    } else if (auto e2 = dynamic_cast<const ExprConcatStrings *>(e)) {
+        put(Tag::ConcatStrings);
+        putPos(e2->pos);
+        put<uint8_t>(e2->forceString);
+        put<uint32_t>(e2->es.size());
+        for (auto & [pos, part] : e2->es) {
+            putPos(pos);
+            putExpr(part);
+        }
+    } else if (auto e2 = dynamic_cast<const ExprPos *>(e)) {
+        put(Tag::Pos);
+        putPos(e2->pos);
+    } else
+        throw Error("cannot cache expression of type '%s'", typeid(*e).name());
+
+    exprIds.emplace(e, exprIds.size());
+}
+
+struct AstReader
+{
+    EvalState & state;
+    const PosTable::Origin & origin;
+    const SourcePath & basePath;
+
+    std::string_view in;
+
+    std::vector<Symbol> symbols;
+    std::vector<Expr *> exprs;
+
+    [[noreturn]] static void corrupt()
+    {
+        throw Error("parse cache entry is corrupt");
+    }
+
+    template<typename T>
+    T get()
+    {
+        if (in.size() < sizeof(T))
+            corrupt();
+        T t;
+        memcpy(&t, in.data(), sizeof(T));
+        in.remove_prefix(sizeof(T));
+        return t;
+    }
+
+    std::string_view getString()
+    {
+        auto len = get<uint32_t>();
+        if (in.size() < len)
+            corrupt();
+        auto s = in.substr(0, len);
+        in.remove_prefix(len);
+        return s;
+    }
+
+    Symbol getSymbol()
+    {
+        auto i = get<uint32_t>();
+        if (i > symbols.size())
+            corrupt();
+        return i ? symbols[i - 1] : Symbol();
+    }
+
+    PosIdx getPos()
+    {
+        auto offset = get<uint32_t>();
+        if (offset > origin.size + 1)
+            corrupt();
+        return offset ? state.positions.add(origin, offset - 1) : noPos;
+    }
+
+    Expr * getNonNullExpr()
+    {
+        auto e = getExpr();
+        if (!e)
+            corrupt();
+        return e;
+    }
+
+    std::vector<AttrName> getAttrPath()
+    {
+        std::vector<AttrName> attrPath;
+        auto n = get<uint32_t>();
+        for (uint32_t i = 0; i < n; ++i) {
+            auto symbol = getSymbol();
+            attrPath.push_back(symbol ? AttrName(symbol) : AttrName(getNonNullExpr()));
+        }
+        return attrPath;
+    }
+
+    template<class E>
+    Expr * getBinOp()
+    {
+        auto pos = getPos();
+        auto e1 = getNonNullExpr();
+        auto e2 = getNonNullExpr();
+        return state.mem.exprs.add<E>(pos, e1, e2);
+    }
+
+    Expr * getExpr();
+};
+
+Expr * AstReader::getExpr()
+{
+    auto & alloc = state.mem.exprs.alloc;
+
+    Expr * e;
+
+    switch (get<Tag>()) {
+
+    case Tag::Null:
+        return nullptr;
+
+    case Tag::Ref: {
+        auto i = get<uint32_t>();
+        if (i >= exprs.size())
+            corrupt();
+        return exprs[i];
+    }
+
+    case Tag::Int:
+        e = state.mem.exprs.add<ExprInt>(get<NixInt::Inner>());
+        break;
+
+    case Tag::Float:
+        e = state.mem.exprs.add<ExprFloat>(get<NixFloat>());
+        break;
+
+    case Tag::String:
+        e = state.mem.exprs.add<ExprString>(alloc, getString());
+        break;
+
+    case Tag::Path: {
+        auto accessor = get<uint8_t>() ? state.rootFS : basePath.accessor;
+        e = state.mem.exprs.add<ExprPath>(alloc, accessor, getString());
+        break;
+    }
+
+    case Tag::Var: {
+        auto pos = getPos();
+        e = state.mem.exprs.add<ExprVar>(pos, getSymbol());
+        break;
+    }
+
+    case Tag::InheritFrom: {
+        auto pos = getPos();
+        e = state.mem.exprs.add<ExprInheritFrom>(pos, get<uint32_t>());
+        break;
+    }
+
+    case Tag::Select: {
+        auto pos = getPos();
+        auto e2 = getNonNullExpr();
+        auto attrPath = getAttrPath();
+        auto def = getExpr();
+        e = state.mem.exprs.add<ExprSelect>(alloc, pos, e2, attrPath, def);
+        break;
+    }
+
+    case Tag::OpHasAttr: {
+        auto e2 = getNonNullExpr();
+        auto attrPath = getAttrPath();
+        e = state.mem.exprs.add<ExprOpHasAttr>(alloc, e2, attrPath);
+        break;
+    }
+
+    case Tag::Attrs: {
+        auto recursive = get<uint8_t>();
+        auto attrs = state.mem.exprs.add<ExprAttrs>(getPos());
+        attrs->recursive = recursive;
+        auto nrAttrs = get<uint32_t>();
+        for (uint32_t i = 0; i < nrAttrs; ++i) {
+            auto name = getSymbol();
+            auto kind = get<uint8_t>();
+            if (kind > (uint8_t) ExprAttrs::AttrDef::Kind::InheritedFrom)
+                corrupt();
+            auto pos = getPos();
+            attrs->attrs->emplace(
+                name, ExprAttrs::AttrDef(getNonNullExpr(), pos, (ExprAttrs::AttrDef::Kind) kind));
+        }
+        auto nrDynamicAttrs = get<uint32_t>();
+        for (uint32_t i = 0; i < nrDynamicAttrs; ++i) {
+            auto pos = getPos();
+            auto nameExpr = getNonNullExpr();
+            attrs->dynamicAttrs->emplace_back(nameExpr, getNonNullExpr(), pos);
+        }
+        if (get<uint8_t>()) {
+            attrs->inheritFromExprs = std::make_unique<std::pmr::vector<Expr *>>();
+            auto n = get<uint32_t>();
+            for (uint32_t i = 0; i < n; ++i)
+                attrs->inheritFromExprs->push_back(getNonNullExpr());
+        }
+        e = attrs;
+        break;
+    }
+
+    case Tag::List: {
+        std::vector<Expr *> elems;
+        auto n = get<uint32_t>();
+        for (uint32_t i = 0; i < n; ++i)
+            elems.push_back(getNonNullExpr());
+        e = state.mem.exprs.add<ExprList>(alloc, elems);
+        break;
+    }
+
+    case Tag::Lambda: {
+        auto pos = getPos();
+        auto name = getSymbol();
+        auto arg = getSymbol();
+        DocComment docComment;
+        docComment.begin = getPos();
+        docComment.end = getPos();
+        std::optional<FormalsBuilder> formals;
+        if (get<uint8_t>()) {
+            formals.emplace();
+            formals->ellipsis = get<uint8_t>();
+            auto n = get<uint32_t>();
+            for (uint32_t i = 0; i < n; ++i) {
+                auto formalPos = getPos();
+                auto formalName = getSymbol();
+                formals->formals.push_back({.pos = formalPos, .name = formalName, .def = getExpr()});
+            }
+            /* The parser sorts formals by symbol, so they have to be
+               sorted again for the symbols of this evaluator. */
+            std::sort(formals->formals.begin(), formals->formals.end(), [](const Formal & a, const Formal & b) {
+                return std::tie(a.name, a.pos) < std::tie(b.name, b.pos);
+            });
+        }
+        auto body = getNonNullExpr();
+        auto lambda = formals ? state.mem.exprs.add<ExprLambda>(state.positions, alloc, pos, arg, *formals, body)
+                              : state.mem.exprs.add<ExprLambda>(pos, arg, body);
+        lambda->name = name;
+        lambda->docComment = docComment;
+        e = lambda;
+        break;
+    }
+
+    case Tag::Call: {
+        auto pos = getPos();
+        auto fun = getNonNullExpr();
+        std::pmr::vector<Expr *> args;
+        auto n = get<uint32_t>();
+        for (uint32_t i = 0; i < n; ++i)
+            args.push_back(getNonNullExpr());
+        e = state.mem.exprs.add<ExprCall>(pos, fun, std::move(args));
+        break;
+    }
+
+    case Tag::Let: {
+        auto attrs = dynamic_cast<ExprAttrs *>(getNonNullExpr());
+        if (!attrs)
+            corrupt();
+        e = state.mem.exprs.add<ExprLet>(attrs, getNonNullExpr());
+        break;
+    }
+
+    case Tag::With: {
+        auto pos = getPos();
+        auto attrs = getNonNullExpr();
+        e = state.mem.exprs.add<ExprWith>(pos, attrs, getNonNullExpr());
+        break;
+    }
+
+    case Tag::If: {
+        auto pos = getPos();
+        auto cond = getNonNullExpr();
+        auto then = getNonNullExpr();
+        e = state.mem.exprs.add<ExprIf>(pos, cond, then, getNonNullExpr());
+        break;
+    }
+
+    case Tag::Assert: {
+        auto pos = getPos();
+        auto cond = getNonNullExpr();
+        e = state.mem.exprs.add<ExprAssert>(pos, cond, getNonNullExpr());
+        break;
+    }
+
+    case Tag::OpNot:
+        e = state.mem.exprs.add<ExprOpNot>(getNonNullExpr());
+        break;
+
+    case Tag::OpEq:
+        e = getBinOp<ExprOpEq>();
+        break;
+
+    case Tag::OpNEq:
+        e = getBinOp<ExprOpNEq>();
+        break;
+
+    case Tag::OpAnd:
+        e = getBinOp<ExprOpAnd>();
+        break;
+
+    case Tag::OpOr:
+        e = getBinOp<ExprOpOr>();
+        break;
+
+    case Tag::OpImpl:
+        e = getBinOp<ExprOpImpl>();
+        break;
+
+    case Tag::OpConcatLists:
+        e = getBinOp<ExprOpConcatLists>();
+        break;
+
+    case Tag::OpUpdate:
+        e = getBinOp<ExprOpUpdate>();
+        break;
+
+    case Tag::ConcatStrings: {
+        auto pos = getPos();
+        bool forceString = get<uint8_t>();
+        std::vector<std::pair<PosIdx, Expr *>> parts;
+        auto n = get<uint32_t>();
+        for (uint32_t i = 0; i < n; ++i) {
+            auto partPos = getPos();
+            parts.emplace_back(partPos, getNonNullExpr());
+        }
+        e = state.mem.exprs.add<ExprConcatStrings>(alloc, pos, forceString, std::span(parts));
+        break;
+    }
+
+    case Tag::Pos:
+        e = state.mem.exprs.add<ExprPos>(getPos());
+        break;
+
+    default:
+        corrupt();
+    }
+
+    exprs.push_back(e);
+    return e;
+}
+
+/**
+ * A read-only memory mapping of a file.
+ */
+struct MappedFile
+{
+    void * data = MAP_FAILED;
+    size_t size = 0;
+
+    /**
+     * Map `path`, or leave `data` at `MAP_FAILED` if it does not exist.
+     */
+    MappedFile(const std::filesystem::path & path)
+    {
+        AutoCloseFD fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (!fd) {
+            if (errno == ENOENT)
+                return;
+            throw SysError("opening file '%s'", path.string());
+        }
+        struct stat st;
+        if (fstat(fd.get(), &st))
+            throw SysError("getting status of '%s'", path.string());
+        if (st.st_size == 0)
+            return;
+        size = st.st_size;
+        data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd.get(), 0);
+        if (data == MAP_FAILED)
+            throw SysError("mapping '%s'", path.string());
+    }
+
+    MappedFile(const MappedFile &) = delete;
+
+    ~MappedFile()
+    {
+        if (data != MAP_FAILED)
+            munmap(data, size);
+    }
+
+    explicit operator bool() const
+    {
+        return data != MAP_FAILED;
+    }
+
+    operator std::string_view() const
+    {
+        return {(const char *) data, size};
+    }
+};
+
+} // namespace
+
+Expr * loadParsedExpr(
+    EvalState & state,
+    const Hash & key,
+    const PosTable::Origin & origin,
+    const SourcePath & basePath,
+    DocCommentMap & docComments)
+{
+    auto cacheFile = getParseCacheDir() / key.to_string(HashFormat::Nix32, false);
+
+    try {
+        MappedFile file(cacheFile);
+        if (!file)
+            return nullptr;
+
+        AstReader reader{.state = state, .origin = origin, .basePath = basePath, .in = file};
+
+        if (!reader.in.starts_with(magic))
+            reader.corrupt();
+        reader.in.remove_prefix(magic.size());
+
+        if (reader.get<uint64_t>() != origin.size)
+            reader.corrupt();
+
+        auto nrSymbols = reader.get<uint32_t>();
+        reader.symbols.reserve(nrSymbols);
+        for (uint32_t i = 0; i < nrSymbols; ++i)
+            reader.symbols.push_back(state.symbols.create(reader.getString()));
+
+        std::vector<std::pair<PosIdx, DocComment>> fileDocComments;
+        auto nrDocComments = reader.get<uint32_t>();
+        for (uint32_t i = 0; i < nrDocComments; ++i) {
+            auto pos = reader.getPos();
+            DocComment docComment;
+            docComment.begin = reader.getPos();
+            docComment.end = reader.getPos();
+            fileDocComments.emplace_back(pos, docComment);
+        }
+
+        auto e = reader.getNonNullExpr();
+        if (!reader.in.empty())
+            reader.corrupt();
+
+        docComments.insert(fileDocComments.begin(), fileDocComments.end());
+
+        debug("loaded syntax tree from '%s'", cacheFile.string());
+
+        return e;
+    } catch (Error & e) {
+        debug("cannot load parse cache entry '%s': %s", cacheFile.string(), e.what());
+        return nullptr;
+    }
+}
+
+void storeParsedExpr(
+    EvalState & state, const Hash & key, Expr * e, const PosTable::Origin & origin, const DocCommentMap & docComments)
+{
+    auto cacheFile = getParseCacheDir() / key.to_string(HashFormat::Nix32, false);
+
+    try {
+        AstWriter body{.origin = origin, .rootFS = state.rootFS};
+        body.putExpr(e);
+
+        AstWriter header{.origin = origin, .rootFS = state.rootFS};
+        header.out = magic;
+        header.put<uint64_t>(origin.size);
+        header.put<uint32_t>(body.symbols.size());
+        for (auto & symbol : body.symbols)
+            header.putString(state.symbols[symbol]);
+
+        /* The map may also contain the comments of earlier parses of
+           the same file. */
+        std::vector<std::pair<PosIdx, DocComment>> fileDocComments;
+        for (auto & i : docComments)
+            if (i.first && origin.offsetOf(i.first) <= origin.size)
+                fileDocComments.push_back(i);
+        header.put<uint32_t>(fileDocComments.size());
+        for (auto & [pos, docComment] : fileDocComments) {
+            header.putPos(pos);
+            header.putPos(docComment.begin);
+            header.putPos(docComment.end);
+        }
+
+        createDirs(cacheFile.parent_path());
+        auto tmpFile = makeTempPath(cacheFile);
+        writeFile(tmpFile, header.out + body.out);
+        std::filesystem::rename(tmpFile, cacheFile);
+    } catch (std::exception & e) {
+        debug("cannot write parse cache entry '%s': %s", cacheFile.string(), e.what());
+    }
+}
+
+} // namespace nix
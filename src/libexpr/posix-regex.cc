@@ -0,0 +1,970 @@
+#include "nix/expr/posix-regex.hh"
+
+#include <algorithm>
+#include <array>
+#include <bitset>
+#include <cctype>
+#include <cstring>
+#include <limits>
+#include <map>
+
+namespace nix {
+
+namespace {
+
+using ByteSet = std::bitset<256>;
+
+constexpr size_t unbounded = std::numeric_limits<size_t>::max();
+
+/* Limits that keep compilation from exhausting the stack or memory. */
+constexpr size_t maxDepth = 1000;
+constexpr size_t maxRepeat = 100000;
+constexpr size_t maxInstructions = 100000;
+/* Bound the capture slots of the Pike VM's threads. */
+constexpr size_t maxThreadSlots = 1 << 22;
+
+/* Don't build a DFA for big programs, or if it gets too many states. */
+constexpr size_t maxDfaInstructions = 2000;
+constexpr size_t maxDfaStates = 1024;
+
+/* Use the backtracker if its visited set takes at most 32 KiB. */
+constexpr size_t maxBacktrackStates = 32 * 1024 * 8;
+
+struct Node
+{
+    enum Kind { Empty, Set, Begin, End, Group, Concat, Alt, Repeat };
+
+    Kind kind = Empty;
+    ByteSet set;
+    size_t group = 0;
+    size_t min = 0, max = 0;
+    std::vector<Node> children;
+};
+
+bool inClass(std::string_view name, unsigned char c)
+{
+    bool upper = c >= 'A' && c <= 'Z';
+    bool lower = c >= 'a' && c <= 'z';
+    bool digit = c >= '0' && c <= '9';
+    bool alnum = upper || lower || digit;
+    bool graph = c >= 33 && c <= 126;
+    bool space = c == ' ' || (c >= '\t' && c <= '\r');
+    if (name == "alnum")
+        return alnum;
+    if (name == "alpha")
+        return upper || lower;
+    if (name == "blank")
+        return c == ' ' || c == '\t';
+    if (name == "cntrl")
+        return c < 32 || c == 127;
+    if (name == "digit" || name == "d")
+        return digit;
+    if (name == "graph")
+        return graph;
+    if (name == "lower")
+        return lower;
+    if (name == "print")
+        return graph || c == ' ';
+    if (name == "punct")
+        return graph && !alnum;
+    if (name == "space" || name == "s")
+        return space;
+    if (name == "upper")
+        return upper;
+    if (name == "xdigit")
+        return digit || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+    if (name == "w")
+        return alnum || c == '_';
+    throw RegexError("unknown character class '%s'", name);
+}
+
+/**
+ * Parser for POSIX extended regular expressions. As with
+ * `std::regex::extended`, a backslash is literal inside a bracket
+ * expression, and `]` and `}` are ordinary characters.
+ */
+struct Parser
+{
+    std::string_view s;
+    size_t pos = 0;
+    size_t nrGroups = 0;
+    size_t depth = 0;
+
+    [[noreturn]] void fail(std::string_view msg)
+    {
+        throw RegexError("%s at offset %d", msg, pos);
+    }
+
+    bool atEnd() const
+    {
+        return pos == s.size();
+    }
+
+    bool next(std::string_view prefix) const
+    {
+        return s.substr(pos).starts_with(prefix);
+    }
+
+    Node parse()
+    {
+        auto root = parseAlt();
+        if (!atEnd())
+            fail("unmatched ')'");
+        return root;
+    }
+
+    Node parseAlt()
+    {
+        auto first = parseConcat();
+        if (!next("|"))
+            return first;
+        Node alt{.kind = Node::Alt};
+        alt.children.push_back(std::move(first));
+        while (next("|")) {
+            pos++;
+            alt.children.push_back(parseConcat());
+        }
+        return alt;
+    }
+
+    Node parseConcat()
+    {
+        Node concat{.kind = Node::Concat};
+        while (!atEnd() && s[pos] != '|' && s[pos] != ')')
+            concat.children.push_back(parsePiece());
+        return concat;
+    }
+
+    Node parsePiece()
+    {
+        auto atom = parseAtom();
+        for (size_t stacked = 0; !atEnd(); ++stacked) {
+            size_t min, max;
+            auto c = s[pos];
+            if (c == '*' || c == '+' || c == '?') {
+                min = c == '+' ? 1 : 0;
+                max = c == '?' ? 1 : unbounded;
+                pos++;
+            } else if (c == '{') {
+                pos++;
+                parseInterval(min, max);
+            } else
+                break;
+            if (atom.kind == Node::Begin || atom.kind == Node::End)
+                fail("repetition of an anchor");
+            if (depth + stacked >= maxDepth)
+                throw RegexTooBigError("regular expression is nested too deeply");
+            Node repeat{.kind = Node::Repeat, .min = min, .max = max};
+            repeat.children.push_back(std::move(atom));
+            atom = std::move(repeat);
+        }
+        return atom;
+    }
+
+    size_t parseNumber()
+    {
+        if (atEnd() || !isdigit((unsigned char) s[pos]))
+            fail("invalid repetition count");
+        size_t n = 0;
+        while (!atEnd() && isdigit((unsigned char) s[pos])) {
+            n = n * 10 + (s[pos++] - '0');
+            if (n > maxRepeat)
+                throw RegexTooBigError("repetition count in regular expression is too big");
+        }
+        return n;
+    }
+
+    void parseInterval(size_t & min, size_t & max)
+    {
+        min = parseNumber();
+        max = min;
+        if (next(",")) {
+            pos++;
+            max = next("}") ? unbounded : parseNumber();
+        }
+        if (!next("}"))
+            fail("unmatched '{'");
+        pos++;
+        if (max < min)
+            fail("invalid repetition");
+    }
+
+    Node literal(unsigned char c)
+    {
+        Node n{.kind = Node::Set};
+        n.set.set(c);
+        return n;
+    }
+
+    Node parseAtom()
+    {
+        auto c = s[pos++];
+        switch (c) {
+        case '(': {
+            if (++depth > maxDepth)
+                throw RegexTooBigError("regular expression is nested too deeply");
+            Node group{.kind = Node::Group, .group = ++nrGroups};
+            group.children.push_back(parseAlt());
+            if (!next(")"))
+                fail("unmatched '('");
+            pos++;
+            depth--;
+            return group;
+        }
+        case '.': {
+            /* Like std::regex, don't match NUL. */
+            Node any{.kind = Node::Set};
+            any.set.set();
+            any.set.reset(0);
+            return any;
+        }
+        case '^':
+            return Node{.kind = Node::Begin};
+        case '$':
+            return Node{.kind = Node::End};
+        case '[':
+            return parseBracket();
+        case '\\':
+            /* Like std::regex, only allow quoting special characters. */
+            if (atEnd() || !std::string_view(".[\\()*+?{|^$").contains(s[pos]))
+                fail("invalid escape");
+            return literal(s[pos++]);
+        case '*':
+        case '+':
+        case '?':
+        case '{':
+            pos--;
+            fail("repetition without an operand");
+        default:
+            return literal(c);
+        }
+    }
+
+    unsigned char parseBracketChar()
+    {
+        /* A collating symbol or equivalence class, which we only
+           support for single characters. */
+        if (next("[.") || next("[=")) {
+            char close[] = {s[pos + 1], ']'};
+            pos += 2;
+            if (pos + 3 > s.size() || s.substr(pos + 1, 2) != std::string_view(close, 2))
+                fail("unsupported collating element");
+            auto c = s[pos];
+            pos += 3;
+            return c;
+        }
+        return s[pos++];
+    }
+
+    Node parseBracket()
+    {
+        Node n{.kind = Node::Set};
+        bool negate = next("^");
+        if (negate)
+            pos++;
+        for (bool first = true;; first = false) {
+            if (atEnd())
+                fail("unmatched '['");
+            if (s[pos] == ']' && !first) {
+                pos++;
+                break;
+            }
+            if (next("[:")) {
+                auto end = s.find(":]", pos + 2);
+                if (end == s.npos)
+                    fail("unmatched '[:'");
+                auto name = s.substr(pos + 2, end - pos - 2);
+                for (unsigned c = 0; c < 256; ++c)
+                    if (inClass(name, c))
+                        n.set.set(c);
+                pos = end + 2;
+                continue;
+            }
+            auto lo = parseBracketChar();
+            if (next("-") && pos + 1 < s.size() && s[pos + 1] != ']') {
+                pos++;
+                if (next("[:"))
+                    fail("invalid range");
+                auto hi = parseBracketChar();
+                if (hi < lo)
+                    fail("invalid range");
+                for (unsigned c = lo; c <= hi; ++c)
+                    n.set.set(c);
+            } else
+                n.set.set(lo);
+        }
+        if (negate)
+            n.set.flip();
+        return n;
+    }
+};
+
+struct Instr
+{
+    enum Op : uint8_t {
+        Byte,
+        Set,
+        /* Continue at `x`, and with lower priority at `y`. */
+        Split,
+        /* Continue at `x`. If `y` is not 0, this is the end of a loop
+           starting at `x` and ending at `y`. */
+        Jmp,
+        /* Record the position in capture slot `x`. */
+        Save,
+        Begin,
+        End,
+        Match,
+    };
+
+    Op op;
+    unsigned char byte = 0;
+    uint32_t x = 0, y = 0;
+};
+
+/**
+ * The threads of the Pike VM at some position, in order of priority,
+ * with the capture slots of each thread. Adding a thread and checking
+ * whether one exists take constant time, and clearing doesn't require
+ * initialising `index`, so the memory can be reused between runs.
+ */
+struct Threads
+{
+    std::vector<uint32_t> index, pcs;
+    std::vector<size_t> slots;
+    size_t nrSlots = 0;
+
+    void reset(size_t nrInstrs, size_t nrSlots)
+    {
+        if (index.size() < nrInstrs)
+            index.resize(nrInstrs);
+        if (slots.size() < nrInstrs * nrSlots)
+            slots.resize(nrInstrs * nrSlots);
+        pcs.clear();
+        pcs.reserve(nrInstrs);
+        this->nrSlots = nrSlots;
+    }
+
+    bool contains(uint32_t pc) const
+    {
+        auto i = index[pc];
+        return i < pcs.size() && pcs[i] == pc;
+    }
+
+    void insert(uint32_t pc)
+    {
+        index[pc] = pcs.size();
+        pcs.push_back(pc);
+    }
+
+    size_t * slotsOf(uint32_t pc)
+    {
+        return slots.data() + pc * nrSlots;
+    }
+};
+
+struct Job
+{
+    uint32_t pc;
+    uint32_t slot;
+    size_t old;
+};
+
+} // namespace
+
+struct PosixRegex::Program
+{
+    std::vector<Instr> instrs;
+    std::vector<ByteSet> sets;
+    size_t nrGroups = 0;
+
+    /**
+     * The bytes that can begin a match, and whether the empty string
+     * can match (ignoring anchors).
+     */
+    ByteSet firstBytes;
+    bool canMatchEmpty = false;
+
+    /**
+     * The DFA deciding whether a string matches as a whole, if
+     * `hasDfa`. Its input is the class of each byte, where bytes of a
+     * class are indistinguishable by the program. State 0 is the
+     * start state.
+     */
+    bool hasDfa = false;
+    std::array<uint8_t, 256> byteClass;
+    size_t nrClasses = 0;
+    std::vector<uint32_t> transitions;
+    std::vector<bool> accepting;
+    uint32_t deadState = std::numeric_limits<uint32_t>::max();
+
+    uint32_t push(Instr::Op op, uint32_t x = 0, uint32_t y = 0, unsigned char byte = 0)
+    {
+        if (instrs.size() >= maxInstructions)
+            throw RegexTooBigError("regular expression is too big");
+        instrs.push_back({.op = op, .byte = byte, .x = x, .y = y});
+        return instrs.size() - 1;
+    }
+
+    void emit(const Node & n)
+    {
+        switch (n.kind) {
+        case Node::Empty:
+            break;
+
+        case Node::Set:
+            if (n.set.count() == 1) {
+                unsigned c = 0;
+                while (!n.set[c])
+                    ++c;
+                push(Instr::Byte, 0, 0, c);
+            } else {
+                sets.push_back(n.set);
+                push(Instr::Set, sets.size() - 1);
+            }
+            break;
+
+        case Node::Begin:
+            push(Instr::Begin);
+            break;
+
+        case Node::End:
+            push(Instr::End);
+            break;
+
+        case Node::Group:
+            push(Instr::Save, 2 * n.group);
+            emit(n.children[0]);
+            push(Instr::Save, 2 * n.group + 1);
+            break;
+
+        case Node::Concat:
+            for (auto & child : n.children)
+                emit(child);
+            break;
+
+        case Node::Alt: {
+            std::vector<uint32_t> jumps;
+            for (size_t i = 0; i < n.children.size(); ++i) {
+                auto last = i + 1 == n.children.size();
+                auto split = last ? 0 : push(Instr::Split);
+                if (!last)
+                    instrs[split].x = split + 1;
+                emit(n.children[i]);
+                if (!last) {
+                    jumps.push_back(push(Instr::Jmp));
+                    instrs[split].y = instrs.size();
+                }
+            }
+            for (auto jump : jumps)
+                instrs[jump].x = instrs.size();
+            break;
+        }
+
+        case Node::Repeat: {
+            auto & child = n.children[0];
+            if (n.max == unbounded) {
+                /* Like std::regex, compile `x{n,}` as `x{n}x*`. */
+                for (size_t i = 0; i < n.min; ++i)
+                    emit(child);
+                auto split = push(Instr::Split);
+                instrs[split].x = split + 1;
+                emit(child);
+                auto jump = push(Instr::Jmp, split);
+                instrs[split].y = instrs[jump].y = instrs.size();
+            } else {
+                for (size_t i = 0; i < n.min; ++i)
+                    emit(child);
+                std::vector<uint32_t> splits;
+                for (size_t i = n.min; i < n.max; ++i) {
+                    auto split = push(Instr::Split);
+                    instrs[split].x = split + 1;
+                    splits.push_back(split);
+                    emit(child);
+                }
+                for (auto split : splits)
+                    instrs[split].y = instrs.size();
+            }
+            break;
+        }
+        }
+    }
+
+    bool matches(const Instr & instr, unsigned char c) const
+    {
+        return instr.op == Instr::Byte ? instr.byte == c : sets[instr.x][c];
+    }
+
+    void computeFirstBytes()
+    {
+        std::vector<bool> visited(instrs.size());
+        std::vector<uint32_t> todo{0};
+        while (!todo.empty()) {
+            auto pc = todo.back();
+            todo.pop_back();
+            if (visited[pc])
+                continue;
+            visited[pc] = true;
+            auto & instr = instrs[pc];
+            switch (instr.op) {
+            case Instr::Byte:
+                firstBytes.set(instr.byte);
+                break;
+            case Instr::Set:
+                firstBytes |= sets[instr.x];
+                break;
+            case Instr::Split:
+                todo.push_back(instr.y);
+                todo.push_back(instr.x);
+                break;
+            case Instr::Jmp:
+                todo.push_back(instr.x);
+                break;
+            case Instr::Match:
+                canMatchEmpty = true;
+                break;
+            case Instr::Save:
+            case Instr::Begin:
+            case Instr::End:
+                todo.push_back(pc + 1);
+                break;
+            }
+        }
+    }
+
+    /**
+     * The consuming instructions reachable from `kernel` without
+     * consuming input, sorted, and whether `Match` is reachable.
+     */
+    std::pair<std::vector<uint32_t>, bool>
+    closure(const std::vector<uint32_t> & kernel, bool atBegin, bool atEnd) const
+    {
+        std::pair<std::vector<uint32_t>, bool> res{{}, false};
+        std::vector<bool> visited(instrs.size());
+        std::vector<uint32_t> todo(kernel);
+        while (!todo.empty()) {
+            auto pc = todo.back();
+            todo.pop_back();
+            if (visited[pc])
+                continue;
+            visited[pc] = true;
+            auto & instr = instrs[pc];
+            switch (instr.op) {
+            case Instr::Byte:
+            case Instr::Set:
+                res.first.push_back(pc);
+                break;
+            case Instr::Split:
+                todo.push_back(instr.y);
+                todo.push_back(instr.x);
+                break;
+            case Instr::Jmp:
+                todo.push_back(instr.x);
+                break;
+            case Instr::Save:
+                todo.push_back(pc + 1);
+                break;
+            case Instr::Begin:
+                if (atBegin)
+                    todo.push_back(pc + 1);
+                break;
+            case Instr::End:
+                if (atEnd)
+                    todo.push_back(pc + 1);
+                break;
+            case Instr::Match:
+                res.second = true;
+                break;
+            }
+        }
+        std::sort(res.first.begin(), res.first.end());
+        return res;
+    }
+
+    void buildDfa()
+    {
+        if (instrs.size() > maxDfaInstructions)
+            return;
+
+        /* Bytes that are distinguished by some instruction start a new
+           class. */
+        ByteSet boundaries;
+        boundaries.set(0);
+        for (auto & instr : instrs) {
+            if (instr.op == Instr::Byte) {
+                boundaries.set(instr.byte);
+                if (instr.byte < 255)
+                    boundaries.set(instr.byte + 1);
+            } else if (instr.op == Instr::Set)
+                for (unsigned c = 1; c < 256; ++c)
+                    if (sets[instr.x][c] != sets[instr.x][c - 1])
+                        boundaries.set(c);
+        }
+        std::vector<unsigned char> representatives;
+        for (unsigned c = 0; c < 256; ++c) {
+            if (boundaries[c])
+                representatives.push_back(c);
+            byteClass[c] = representatives.size() - 1;
+        }
+        nrClasses = representatives.size();
+
+        /* A state is identified by the instructions that can consume
+           the next byte, and whether the program accepts if there is
+           no next byte. */
+        using Key = std::pair<std::vector<uint32_t>, bool>;
+        std::map<Key, uint32_t> ids;
+        std::vector<const std::vector<uint32_t> *> states;
+
+        auto addState = [&](Key && key) {
+            auto [i, inserted] = ids.try_emplace(std::move(key), states.size());
+            if (inserted) {
+                states.push_back(&i->first.first);
+                accepting.push_back(i->first.second);
+            }
+            return i->second;
+        };
+
+        addState({closure({0}, true, false).first, closure({0}, true, true).second});
+
+        for (size_t state = 0; state < states.size(); ++state) {
+            if (states.size() > maxDfaStates) {
+                transitions.clear();
+                accepting.clear();
+                return;
+            }
+            for (auto c : representatives) {
+                std::vector<uint32_t> kernel;
+                for (auto pc : *states[state])
+                    if (matches(instrs[pc], c))
+                        kernel.push_back(pc + 1);
+                auto next = closure(kernel, false, false).first;
+                transitions.push_back(addState({std::move(next), closure(kernel, false, true).second}));
+            }
+        }
+
+        if (auto i = ids.find(Key{{}, false}); i != ids.end())
+            deadState = i->second;
+        hasDfa = true;
+    }
+
+    bool dfaMatch(std::string_view s) const
+    {
+        uint32_t state = 0;
+        for (unsigned char c : s) {
+            state = transitions[state * nrClasses + byteClass[c]];
+            if (state == deadState)
+                return false;
+        }
+        return accepting[state];
+    }
+
+    /**
+     * Run the Pike VM on `s` from `start`, storing the capture slots
+     * of the preferred match in `best`. Only the first `nrSlots`
+     * slots are tracked.
+     *
+     * If `fullMatch`, the match must extend to the end of `s` and the
+     * preferred one is the first in priority order. Otherwise, it's
+     * the leftmost one, and the longest at that position.
+     */
+    bool run(
+        std::string_view s,
+        size_t start,
+        bool anchored,
+        bool fullMatch,
+        bool notEmpty,
+        size_t nrSlots,
+        size_t * best) const
+    {
+        /* Reuse the memory of previous runs on this thread. */
+        thread_local Threads clist, nlist;
+        thread_local std::vector<size_t> slots;
+        thread_local std::vector<Job> stack;
+        clist.reset(instrs.size(), nrSlots);
+        nlist.reset(instrs.size(), nrSlots);
+        slots.resize(nrSlots);
+        stack.clear();
+
+        /* Follow the non-consuming instructions from `pc` without
+           recursing. Jobs with a slot restore it once the threads
+           through the corresponding `Save` have been added. */
+        constexpr uint32_t noSlot = std::numeric_limits<uint32_t>::max();
+
+        auto addThread = [&](Threads & threads, uint32_t pc0, size_t pos) {
+            stack.push_back({pc0, noSlot, 0});
+            while (!stack.empty()) {
+                auto job = stack.back();
+                stack.pop_back();
+                if (job.slot != noSlot) {
+                    slots[job.slot] = job.old;
+                    continue;
+                }
+                for (auto pc = job.pc; !threads.contains(pc);) {
+                    threads.insert(pc);
+                    auto & instr = instrs[pc];
+                    if (instr.op == Instr::Jmp)
+                        /* After an empty iteration of a loop, leave it
+                           rather than dropping the thread, so that the
+                           empty iteration's submatches are kept, as
+                           with std::regex. */
+                        pc = instr.y && threads.contains(instr.x) ? instr.y : instr.x;
+                    else if (instr.op == Instr::Split) {
+                        stack.push_back({instr.y, noSlot, 0});
+                        pc = instr.x;
+                    } else if (instr.op == Instr::Save) {
+                        if (instr.x < nrSlots) {
+                            stack.push_back({0, instr.x, slots[instr.x]});
+                            slots[instr.x] = pos;
+                        }
+                        pc++;
+                    } else if (instr.op == Instr::Begin) {
+                        if (pos != 0)
+                            break;
+                        pc++;
+                    } else if (instr.op == Instr::End) {
+                        if (pos != s.size())
+                            break;
+                        pc++;
+                    } else {
+                        std::copy_n(slots.begin(), nrSlots, threads.slotsOf(pc));
+                        break;
+                    }
+                }
+            }
+        };
+
+        bool matched = false;
+        size_t bestBegin = 0;
+
+        for (size_t pos = start;; ++pos) {
+            /* Start a new thread at every position until there is a
+               match, with lower priority than the existing ones. */
+            if (!matched && (!anchored || pos == start)) {
+                if (clist.pcs.empty() && !anchored && !canMatchEmpty) {
+                    if (firstBytes.count() == 1) {
+                        unsigned c = 0;
+                        while (!firstBytes[c])
+                            ++c;
+                        auto p = (const char *) memchr(s.data() + pos, c, s.size() - pos);
+                        pos = p ? p - s.data() : s.size();
+                    } else
+                        while (pos < s.size() && !firstBytes[(unsigned char) s[pos]])
+                            ++pos;
+                    if (pos == s.size())
+                        break;
+                }
+                std::fill(slots.begin(), slots.end(), Submatch::npos);
+                addThread(clist, 0, pos);
+            }
+
+            if (clist.pcs.empty())
+                break;
+
+            int c = pos < s.size() ? (unsigned char) s[pos] : -1;
+            nlist.pcs.clear();
+
+            for (auto pc : clist.pcs) {
+                auto & instr = instrs[pc];
+                auto threadSlots = clist.slotsOf(pc);
+
+                /* A thread that started after the best match can't
+                   improve on it. */
+                if (matched && threadSlots[0] > bestBegin)
+                    continue;
+
+                switch (instr.op) {
+                case Instr::Match:
+                    if (fullMatch) {
+                        if (pos == s.size()) {
+                            std::copy_n(threadSlots, nrSlots, best);
+                            return true;
+                        }
+                    } else if (!(notEmpty && threadSlots[0] == pos)) {
+                        if (!matched || threadSlots[0] < bestBegin || (threadSlots[0] == bestBegin && pos > best[1])) {
+                            std::copy_n(threadSlots, nrSlots, best);
+                            matched = true;
+                            bestBegin = threadSlots[0];
+                        }
+                    }
+                    break;
+                case Instr::Byte:
+                case Instr::Set:
+                    if (c >= 0 && matches(instr, c)) {
+                        std::copy_n(threadSlots, nrSlots, slots.begin());
+                        addThread(nlist, pc + 1, pos + 1);
+                    }
+                    break;
+                case Instr::Split:
+                case Instr::Jmp:
+                case Instr::Save:
+                case Instr::Begin:
+                case Instr::End:
+                    /* addThread() has already followed these. */
+                    break;
+                }
+            }
+
+            std::swap(clist, nlist);
+            if (pos >= s.size())
+                break;
+        }
+
+        return matched;
+    }
+
+    /**
+     * Decide whether `s` matches as a whole by backtracking in order of
+     * priority, like `run()` with `fullMatch`. Each instruction is run
+     * at most once per position, so this takes time proportional to
+     * the size of the program times the length of `s`, but it's
+     * faster than the Pike VM for short strings.
+     */
+    bool backtrack(std::string_view s, size_t nrSlots, size_t * best) const
+    {
+        auto width = s.size() + 1;
+        thread_local std::vector<uint64_t> visited;
+        thread_local std::vector<Job> stack;
+        visited.assign((instrs.size() * width + 63) / 64, 0);
+        stack.clear();
+
+        auto visit = [&](uint32_t pc, size_t pos) {
+            auto bit = pc * width + pos;
+            auto & word = visited[bit / 64];
+            auto mask = uint64_t(1) << (bit % 64);
+            if (word & mask)
+                return false;
+            word |= mask;
+            return true;
+        };
+
+        auto isVisited = [&](uint32_t pc, size_t pos) {
+            auto bit = pc * width + pos;
+            return visited[bit / 64] & (uint64_t(1) << (bit % 64));
+        };
+
+        constexpr uint32_t noSlot = std::numeric_limits<uint32_t>::max();
+
+        std::fill_n(best, nrSlots, Submatch::npos);
+        stack.push_back({0, noSlot, 0});
+
+        while (!stack.empty()) {
+            auto job = stack.back();
+            stack.pop_back();
+            if (job.slot != noSlot) {
+                best[job.slot] = job.old;
+                continue;
+            }
+            auto pc = job.pc;
+            auto pos = job.old;
+            while (visit(pc, pos)) {
+                auto & instr = instrs[pc];
+                if (instr.op == Instr::Byte || instr.op == Instr::Set) {
+                    if (pos == s.size() || !matches(instr, s[pos]))
+                        break;
+                    pc++;
+                    pos++;
+                } else if (instr.op == Instr::Split) {
+                    stack.push_back({instr.y, noSlot, pos});
+                    pc = instr.x;
+                } else if (instr.op == Instr::Jmp)
+                    pc = instr.y && isVisited(instr.x, pos) ? instr.y : instr.x;
+                else if (instr.op == Instr::Save) {
+                    if (instr.x < nrSlots) {
+                        stack.push_back({0, instr.x, best[instr.x]});
+                        best[instr.x] = pos;
+                    }
+                    pc++;
+                } else if (instr.op == Instr::Begin) {
+                    if (pos != 0)
+                        break;
+                    pc++;
+                } else if (instr.op == Instr::End) {
+                    if (pos != s.size())
+                        break;
+                    pc++;
+                } else {
+                    if (pos == s.size())
+                        return true;
+                    break;
+                }
+            }
+        }
+
+        return false;
+    }
+
+    void toSubmatches(const std::vector<size_t> & slots, Submatches & submatches) const
+    {
+        submatches.assign(nrGroups + 1, {});
+        for (size_t i = 0; i <= nrGroups; ++i)
+            if (slots[2 * i] != Submatch::npos && slots[2 * i + 1] != Submatch::npos)
+                submatches[i] = {slots[2 * i], slots[2 * i + 1]};
+    }
+};
+
+PosixRegex::PosixRegex(std::string_view pattern)
+{
+    Parser parser{.s = pattern};
+    auto root = parser.parse();
+
+    auto p = std::make_unique<Program>();
+    p->nrGroups = parser.nrGroups;
+    p->push(Instr::Save, 0);
+    p->emit(root);
+    p->push(Instr::Save, 1);
+    p->push(Instr::Match);
+    if (p->instrs.size() * 2 * (p->nrGroups + 1) > maxThreadSlots)
+        throw RegexTooBigError("regular expression has too many groups");
+    p->computeFirstBytes();
+    p->buildDfa();
+
+    program = std::move(p);
+}
+
+PosixRegex::~PosixRegex() = default;
+
+size_t PosixRegex::nrGroups() const
+{
+    return program->nrGroups;
+}
+
+bool PosixRegex::match(std::string_view s, Submatches * submatches) const
+{
+    auto & p = *program;
+
+    if (p.hasDfa) {
+        if (!p.dfaMatch(s))
+            return false;
+        if (!submatches)
+            return true;
+        if (p.nrGroups == 0) {
+            *submatches = {{0, s.size()}};
+            return true;
+        }
+    }
+
+    size_t nrSlots = submatches ? 2 * (p.nrGroups + 1) : 0;
+    std::vector<size_t> slots(nrSlots);
+    auto found = p.instrs.size() * (s.size() + 1) <= maxBacktrackStates
+                     ? p.backtrack(s, nrSlots, slots.data())
+                     : p.run(s, 0, true, true, false, nrSlots, slots.data());
+    if (!found)
+        return false;
+    if (submatches)
+        p.toSubmatches(slots, *submatches);
+    return true;
+}
+
+bool PosixRegex::search(
+    std::string_view s, size_t start, Submatches & submatches, bool anchored, bool notEmpty) const
+{
+    auto & p = *program;
+    if (start > s.size())
+        return false;
+    std::vector<size_t> slots(2 * (p.nrGroups + 1));
+    if (!p.run(s, start, anchored, false, notEmpty, slots.size(), slots.data()))
+        return false;
+    p.toSubmatches(slots, submatches);
+    return true;
+}
+
+} // namespace nix
@@ -1,10 +1,13 @@
 #include "nix/store/derivations.hh"
 #include "nix/store/downstream-placeholder.hh"
+#include "nix/store/drv-hash-disk-cache.hh"
 #include "nix/expr/eval-inline.hh"
 #include "nix/expr/eval.hh"
 #include "nix/expr/eval-settings.hh"
+#include "nix/expr/eval-dependencies.hh"
 #include "nix/expr/gc-small-vector.hh"
 #include "nix/expr/json-to-value.hh"
+#include "nix/expr/posix-regex.hh"
 #include "nix/expr/static-string-data.hh"
 #include "nix/store/globals.hh"
 #include "nix/store/names.hh"
@@ -12,6 +15,7 @@
 #include "nix/store/store-api.hh"
 #include "nix/util/util.hh"
 #include "nix/util/processes.hh"
+#include "nix/util/serialise.hh"
 #include "nix/expr/value-to-json.hh"
 #include "nix/expr/value-to-xml.hh"
 #include "nix/expr/primops.hh"
@@ -31,7 +35,6 @@
 #include <algorithm>
 #include <cstring>
 #include <sstream>
-#include <regex>
 
 #ifndef _WIN32
 #  include <dlfcn.h>
@@ -51,10 +54,10 @@ RegisterPrimOp::PrimOps & RegisterPrimOp::primOps()
  * Miscellaneous
  *************************************************************/
 
-static inline Value * mkString(EvalState & state, const std::csub_match & match)
+static inline Value * mkString(EvalState & state, std::string_view s)
 {
     Value * v = state.allocValue();
-    v->mkString({match.first, match.second}, state.mem);
+    v->mkString(s, state.mem);
     return v;
 }
 
@@ -1783,6 +1786,10 @@ static void derivationStrictInternal(EvalState & state, std::string_view drvName
             .debugThrow();
     }
 
+    /* Input derivations are hashed through the persistent cache,
+       which is only trusted for evaluation. */
+    auto drvHashDiskCache = settings.useDrvHashCache ? getDrvHashDiskCache().get_ptr() : nullptr;
+
     if (outputHash) {
         /* Handle fixed-output derivations.
 
@@ -1847,22 +1854,26 @@ static void derivationStrictInternal(EvalState & state, std::string_view drvName
             drv.outputs.insert_or_assign(i, DerivationOutput::Deferred{});
         }
 
-        drv.fillInOutputPaths(*state.store);
+        drv.fillInOutputPaths(*state.store, drvHashDiskCache.get());
     }
 
     /* Write the resulting term into the Nix store directory. */
     auto drvPath = writeDerivation(*state.store, *state.asyncPathWriter, drv, state.repair);
     auto drvPathS = state.store->printStorePath(drvPath);
 
+    if (state.dependencies) {
+        auto inputs = drv.inputSrcs;
+        for (auto & [inputDrv, _] : drv.inputDrvs.map)
+            inputs.insert(inputDrv);
+        state.dependencies->addDerivation(drvPath, std::move(inputs));
+    }
+
     printMsg(lvlChatty, "instantiated '%1%' -> '%2%'", drvName, drvPathS);
 
     /* Optimisation, but required in read-only mode! because in that
        case we don't actually write store derivations, so we can't
        read them later. */
-    {
-        auto h = hashDerivationModulo(*state.store, drv, false);
-        drvHashes.insert_or_assign(drvPath, std::move(h));
-    }
+    hashStoreDerivationModulo(*state.store, drvPath, drv, drvHashDiskCache.get());
 
     auto result = state.buildBindings(1 + drv.outputs.size());
     result.alloc(state.s.drvPath)
@@ -2638,10 +2649,10 @@ static RegisterPrimOp primop_toXML({
    represented (e.g., functions). */
 static void prim_toJSON(EvalState & state, const PosIdx pos, Value ** args, Value & v)
 {
-    std::ostringstream out;
+    StringSink out;
     NixStringContext context;
     printValueAsJSON(state, true, *args[0], pos, out, context);
-    v.mkString(out.view(), context, state.mem);
+    v.mkString(out.s, context, state.mem);
 }
 
 static RegisterPrimOp primop_toJSON({
@@ -4792,24 +4803,46 @@ static RegisterPrimOp primop_convertHash({
 
 struct RegexCache
 {
-    boost::concurrent_flat_map<std::string, std::regex, StringViewHash, std::equal_to<>> cache;
+    boost::concurrent_flat_map<std::string, ref<const PosixRegex>, StringViewHash, std::equal_to<>> cache;
 
-    std::regex get(std::string_view re)
+    /**
+     * Return the compiled form of `re`. Compiling happens outside of
+     * the map's locks, so a regex may occasionally be compiled twice.
+     */
+    ref<const PosixRegex> get(std::string_view re)
     {
-        std::regex regex;
-        /* No std::regex constructor overload from std::string_view, but can be constructed
-           from a pointer + size or an iterator range. */
-        cache.try_emplace_and_cvisit(
-            re,
-            /*s=*/re.data(),
-            /*count=*/re.size(),
-            std::regex::extended,
-            [&regex](const auto & kv) { regex = kv.second; },
-            [&regex](const auto & kv) { regex = kv.second; });
-        return regex;
+        std::shared_ptr<const PosixRegex> regex;
+        cache.cvisit(re, [&regex](const auto & kv) { regex = kv.second; });
+        if (!regex) {
+            auto compiled = ref<const PosixRegex>(std::make_shared<const PosixRegex>(re));
+            cache.try_emplace_and_cvisit(
+                re,
+                compiled,
+                [&regex](const auto & kv) { regex = kv.second; },
+                [&regex](const auto & kv) { regex = kv.second; });
+        }
+        return ref<const PosixRegex>(regex);
     }
 };
 
+/**
+ * Set `v` to the groups of a match in `s` as a list of strings, with
+ * `null` for groups that didn't participate in the match.
+ */
+static void mkGroupList(EvalState & state, Value & v, std::string_view s, const PosixRegex::Submatches & match)
+{
+    // the first match is the whole string
+    auto list = state.buildList(match.size() - 1);
+    for (const auto & [i, v2] : enumerate(list)) {
+        auto & group = match[i + 1];
+        if (!group.matched())
+            v2 = &Value::vNull;
+        else
+            v2 = mkString(state, s.substr(group.begin, group.end - group.begin));
+    }
+    v.mkList(list);
+}
+
 ref<RegexCache> makeRegexCache()
 {
     return make_ref<RegexCache>();
@@ -4827,27 +4860,18 @@ void prim_match(EvalState & state, const PosIdx pos, Value ** args, Value & v)
         const auto str =
             state.forceString(*args[1], context, pos, "while evaluating the second argument passed to builtins.match");
 
-        std::cmatch match;
-        if (!std::regex_match(str.begin(), str.end(), match, regex)) {
+        PosixRegex::Submatches match;
+        if (!regex->match(str, &match)) {
             v.mkNull();
             return;
         }
 
-        // the first match is the whole string
-        auto list = state.buildList(match.size() - 1);
-        for (const auto & [i, v2] : enumerate(list))
-            if (!match[i + 1].matched)
-                v2 = &Value::vNull;
-            else
-                v2 = mkString(state, match[i + 1]);
-        v.mkList(list);
+        mkGroupList(state, v, str, match);
 
-    } catch (std::regex_error & e) {
-        if (e.code() == std::regex_constants::error_space) {
-            // limit is _GLIBCXX_REGEX_STATE_LIMIT for libstdc++
-            state.error<EvalError>("memory limit exceeded by regular expression '%s'", re).atPos(pos).debugThrow();
-        } else
-            state.error<EvalError>("invalid regular expression '%s'", re).atPos(pos).debugThrow();
+    } catch (RegexTooBigError &) {
+        state.error<EvalError>("memory limit exceeded by regular expression '%s'", re).atPos(pos).debugThrow();
+    } catch (RegexError &) {
+        state.error<EvalError>("invalid regular expression '%s'", re).atPos(pos).debugThrow();
     }
 }
 
@@ -4901,11 +4925,27 @@ void prim_split(EvalState & state, const PosIdx pos, Value ** args, Value & v)
         const auto str =
             state.forceString(*args[1], context, pos, "while evaluating the second argument passed to builtins.split");
 
-        auto begin = std::cregex_iterator(str.begin(), str.end(), regex);
-        auto end = std::cregex_iterator();
+        /* Find the matches like std::regex_iterator: after an empty
+           match, look for a non-empty one at the same position before
+           moving on to the next position. */
+        std::vector<PosixRegex::Submatches> matches;
+        for (size_t start = 0;;) {
+            PosixRegex::Submatches match;
+            bool found;
+            if (!matches.empty() && matches.back()[0].begin == matches.back()[0].end) {
+                if (start == str.size())
+                    break;
+                found = regex->search(str, start, match, true, true) || regex->search(str, start + 1, match);
+            } else
+                found = regex->search(str, start, match);
+            if (!found)
+                break;
+            start = match[0].end;
+            matches.push_back(std::move(match));
+        }
 
         // Any matches results are surrounded by non-matching results.
-        const size_t len = std::distance(begin, end);
+        const size_t len = matches.size();
         auto list = state.buildList(2 * len + 1);
         size_t idx = 0;
 
@@ -4915,42 +4955,28 @@ void prim_split(EvalState & state, const PosIdx pos, Value ** args, Value & v)
             return;
         }
 
-        for (auto i = begin; i != end; ++i) {
-            assert(idx <= 2 * len + 1 - 3);
-            const auto & match = *i;
-
+        size_t prevEnd = 0;
+        for (const auto & match : matches) {
             // Add a string for non-matched characters.
-            list[idx++] = mkString(state, match.prefix());
+            list[idx++] = mkString(state, str.substr(prevEnd, match[0].begin - prevEnd));
 
             // Add a list for matched substrings.
-            const size_t slen = match.size() - 1;
-
-            // Start at 1, because the first match is the whole string.
-            auto list2 = state.buildList(slen);
-            for (const auto & [si, v2] : enumerate(list2)) {
-                if (!match[si + 1].matched)
-                    v2 = &Value::vNull;
-                else
-                    v2 = mkString(state, match[si + 1]);
-            }
+            mkGroupList(state, *(list[idx++] = state.allocValue()), str, match);
 
-            (list[idx++] = state.allocValue())->mkList(list2);
-
-            // Add a string for non-matched suffix characters.
-            if (idx == 2 * len)
-                list[idx++] = mkString(state, match.suffix());
+            prevEnd = match[0].end;
         }
 
+        // Add a string for non-matched suffix characters.
+        list[idx++] = mkString(state, str.substr(prevEnd));
+
         assert(idx == 2 * len + 1);
 
         v.mkList(list);
 
-    } catch (std::regex_error & e) {
-        if (e.code() == std::regex_constants::error_space) {
-            // limit is _GLIBCXX_REGEX_STATE_LIMIT for libstdc++
-            state.error<EvalError>("memory limit exceeded by regular expression '%s'", re).atPos(pos).debugThrow();
-        } else
-            state.error<EvalError>("invalid regular expression '%s'", re).atPos(pos).debugThrow();
+    } catch (RegexTooBigError &) {
+        state.error<EvalError>("memory limit exceeded by regular expression '%s'", re).atPos(pos).debugThrow();
+    } catch (RegexError &) {
+        state.error<EvalError>("invalid regular expression '%s'", re).atPos(pos).debugThrow();
     }
 }
 
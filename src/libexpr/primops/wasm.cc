@@ -2,15 +2,29 @@
 #include "nix/expr/eval-inline.hh"
 #include "nix/expr/eval-settings.hh"
 #include "nix/store/store-api.hh"
+#include "nix/store/sqlite.hh"
+#include "nix/store/wasm.hh"
 #include "nix/fetchers/fetchers.hh"
 #include "nix/fetchers/attrs.hh"
 #include "nix/fetchers/fetch-to-store.hh"
 #include "nix/fetchers/input-cache.hh"
 #include "nix/fetchers/registry.hh"
 #include "nix/fetchers/tarball.hh"
+#include "nix/expr/eval-gc.hh"
+#include "nix/util/sync.hh"
+#include "nix/util/users.hh"
 
-#include <wasmtime.hh>
 #include <wasi.h>
+#include <boost/unordered/concurrent_flat_map.hpp>
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <future>
+#include <limits>
+#include <map>
+#include <memory>
+#include <random>
+#include <set>
 #include <thread>
 
 using namespace wasmtime;
@@ -26,28 +40,55 @@ SourcePath realisePath(
 
 using ValueId = uint32_t;
 
-template<typename T, typename E = Error>
-T unwrap(Result<T, E> && res)
+/**
+ * Identifies the configuration of the engine returned by
+ * `getEngine(fuel)` in the persistent compilation cache.
+ */
+static std::string_view engineConfig(bool fuel)
 {
-    if (res)
-        return res.ok();
-    throw Error(res.err().message());
+    return fuel ? "builtins.wasm;pooling;cow;fuel;epoch" : "builtins.wasm;pooling;cow;epoch";
 }
 
-static Engine & getEngine()
+/**
+ * How often running WASM code checks for interrupts and timeouts.
+ */
+static constexpr auto epochTickInterval = std::chrono::milliseconds(10);
+
+/**
+ * Return the engine for `builtins.wasm` calls. Fuel metering slows
+ * down WASM code, so it is only enabled in the engine used if
+ * `wasm-fuel` sets a limit.
+ *
+ * Each engine comes with a thread that advances its epoch
+ * periodically, which makes WASM code call epochDeadlineCallback() at
+ * the next loop header or function entry. That thread runs until the
+ * process exits and shares ownership of the engine, so the engine is
+ * never destroyed while it may still be used.
+ */
+static std::shared_ptr<Engine> getEngine(bool fuel)
 {
-    static Engine engine = []() {
+    auto makeEngine = [](bool fuel) {
         wasmtime::Config config;
         config.pooling_allocation_strategy(PoolAllocationConfig());
         config.memory_init_cow(true);
-        return Engine(std::move(config));
-    }();
-    return engine;
-}
+        config.consume_fuel(fuel);
+        config.epoch_interruption(true);
+        auto engine = std::make_shared<Engine>(std::move(config));
+        std::thread([engine]() {
+            while (true) {
+                std::this_thread::sleep_for(epochTickInterval);
+                engine->increment_epoch();
+            }
+        }).detach();
+        return engine;
+    };
 
-static std::span<uint8_t> string2span(std::string_view s)
-{
-    return std::span<uint8_t>((uint8_t *) s.data(), s.size());
+    if (fuel) {
+        static auto engine = makeEngine(true);
+        return engine;
+    }
+    static auto engine = makeEngine(false);
+    return engine;
 }
 
 static std::string_view span2string(std::span<uint8_t> s)
@@ -55,47 +96,764 @@ static std::string_view span2string(std::span<uint8_t> s)
     return std::string_view((char *) s.data(), s.size());
 }
 
-template<typename T>
-static std::span<T> subspan(std::span<uint8_t> s, size_t len)
-{
-    assert(s.size() >= len * sizeof(T));
-    return std::span((T *) s.data(), len);
-}
-
 struct NixWasmInstance;
 
+/**
+ * Record an exception thrown on behalf of `instance` while WASM code
+ * was running, so that it can be rethrown once the WASM call has
+ * unwound.
+ */
+static void setPendingException(NixWasmInstance * instance, std::exception_ptr ex);
+
 template<typename R, typename... Args>
-static void regFun(Linker & linker, std::string_view name, R (NixWasmInstance::*f)(Args...))
+static void
+regFun(Linker & linker, std::string_view name, R (NixWasmInstance::*f)(Args...), std::string_view module = "env")
 {
-    unwrap(linker.func_wrap("env", name, [f](Caller caller, Args... args) -> Result<R, Trap> {
+    unwrap(linker.func_wrap(module, name, [f](Caller caller, Args... args) -> Result<R, Trap> {
+        auto instance = std::any_cast<NixWasmInstance *>(caller.context().get_data());
         try {
-            auto instance = std::any_cast<NixWasmInstance *>(caller.context().get_data());
             return (*instance.*f)(args...);
         } catch (Error & e) {
+            setPendingException(instance, std::current_exception());
             return Trap(e.what());
+        } catch (...) {
+            setPendingException(instance, std::current_exception());
+            return Trap("exception in host function");
         }
     }));
 }
 
+/**
+ * Bulk value marshalling (ABI v2).
+ *
+ * Modules that export `nix_wasm_init_v2` can transfer whole value
+ * trees with a single host call in each direction. A value is encoded
+ * as a one-byte tag (the type codes of `get_type`) followed by its
+ * payload, with all integers in little-endian byte order and no
+ * alignment:
+ *
+ *     1 int       i64
+ *     2 float     f64
+ *     3 bool      u8
+ *     4 string    u32 length, bytes
+ *     5 path      u32 length, bytes
+ *     6 null
+ *     7 attrset   u32 count, count * (u32 name length, name bytes, value)
+ *     8 list      u32 count, count * value
+ *     9 function  u32 ValueId
+ *    10 string    u32 length, bytes, u32 count, count * (u32 length, bytes)
+ *       with context (the elements as printed by `NixStringContextElem::to_string()`)
+ *
+ * Attributes are encoded in lexicographic order of their names.
+ * Functions cannot be serialized, so they are passed as handles that
+ * can be used with `call_function`.
+ */
+enum struct BulkTag : uint8_t {
+    Int = 1,
+    Float = 2,
+    Bool = 3,
+    String = 4,
+    Path = 5,
+    Null = 6,
+    Attrs = 7,
+    List = 8,
+    Function = 9,
+    StringWithContext = 10,
+};
+
+/**
+ * The smallest encodings of a value (a tag without payload) and of an
+ * attribute (an empty name and such a value).
+ */
+static constexpr size_t minEncodedValueSize = 1, minEncodedAttrSize = 4 + minEncodedValueSize;
+
+/**
+ * Convert `x` between host byte order and the little-endian byte
+ * order of the bulk encoding. This is its own inverse.
+ */
+template<typename T>
+static T swapLittleEndian(T x)
+{
+    if constexpr (std::endian::native == std::endian::big && sizeof(T) > 1) {
+        using U = std::conditional_t<sizeof(T) == 8, uint64_t, std::conditional_t<sizeof(T) == 4, uint32_t, uint16_t>>;
+        return std::bit_cast<T>(std::byteswap(std::bit_cast<U>(x)));
+    } else
+        return x;
+}
+
+struct BulkWriter
+{
+    std::span<uint8_t> buf;
+    size_t pos = 0;
+
+    /**
+     * Whether the encoding is meaningful outside of the current call,
+     * i.e. it contains no function handles, no strings with context
+     * and no paths outside the root filesystem.
+     */
+    bool selfContained = true;
+
+    /**
+     * If set, `BulkCodec::serializeValue()` doesn't force anything.
+     * It gives up, clearing `selfContained`, when it reaches a value
+     * that hasn't been evaluated yet or nests too deeply, or when the
+     * encoding exceeds this many bytes.
+     */
+    std::optional<size_t> evaluatedOnlyLimit;
+
+    /* Past the end of the buffer, only count the required size. */
+    void write(const void * data, size_t len)
+    {
+        if (pos + len <= buf.size())
+            memcpy(buf.data() + pos, data, len);
+        pos += len;
+    }
+
+    template<typename T>
+    void put(T x)
+    {
+        x = swapLittleEndian(x);
+        write(&x, sizeof(x));
+    }
+
+    void putString(std::string_view s)
+    {
+        put<uint32_t>(s.size());
+        write(s.data(), s.size());
+    }
+};
+
+struct BulkReader
+{
+    std::span<uint8_t> buf;
+    size_t pos = 0;
+
+    std::span<uint8_t> read(size_t len)
+    {
+        if (len > buf.size() - pos)
+            throw Error("truncated value buffer from WASM");
+        auto res = buf.subspan(pos, len);
+        pos += len;
+        return res;
+    }
+
+    template<typename T>
+    T get()
+    {
+        T x;
+        memcpy(&x, read(sizeof(T)).data(), sizeof(T));
+        return swapLittleEndian(x);
+    }
+
+    std::string_view getString()
+    {
+        return span2string(read(get<uint32_t>()));
+    }
+
+    /**
+     * Read the element count of an attrset or list, rejecting counts
+     * that the rest of the buffer cannot hold so that a bogus count
+     * doesn't make us allocate a huge attrset or list.
+     */
+    uint32_t getCount(size_t minEncodedEntrySize)
+    {
+        auto n = get<uint32_t>();
+        if (n > (buf.size() - pos) / minEncodedEntrySize)
+            throw Error("element count %d exceeds the size of the value buffer from WASM", n);
+        return n;
+    }
+};
+
+/**
+ * Conversion between Nix values and their bulk encoding. Function
+ * handles in the encoding refer to `values`.
+ */
+struct BulkCodec
+{
+    EvalState & state;
+    ValueVector & values;
+
+    void checkBulkDepth(size_t depth)
+    {
+        if (depth > state.settings.maxCallDepth)
+            throw Error(
+                "value exchanged with WASM is nested more than %d levels deep", state.settings.maxCallDepth.get());
+    }
+
+    void serializeValue(BulkWriter & out, Value & value, size_t depth)
+    {
+        if (out.evaluatedOnlyLimit) {
+            if (!out.selfContained)
+                return;
+            if (!value.isFinished() || depth > state.settings.maxCallDepth || out.pos > *out.evaluatedOnlyLimit) {
+                out.selfContained = false;
+                return;
+            }
+        } else {
+            checkBulkDepth(depth);
+            state.forceValue(value, noPos);
+        }
+
+        switch (value.type()) {
+        case nInt:
+            out.put(BulkTag::Int);
+            out.put<int64_t>(value.integer().value);
+            break;
+        case nFloat:
+            out.put(BulkTag::Float);
+            out.put<double>(value.fpoint());
+            break;
+        case nBool:
+            out.put(BulkTag::Bool);
+            out.put<uint8_t>(value.boolean());
+            break;
+        case nString:
+            if (auto context = value.context()) {
+                out.put(BulkTag::StringWithContext);
+                out.putString(value.string_view());
+                out.put<uint32_t>(context->size());
+                for (auto * elem : *context)
+                    out.putString(elem->view());
+                out.selfContained = false;
+            } else {
+                out.put(BulkTag::String);
+                out.putString(value.string_view());
+            }
+            break;
+        case nPath:
+            out.put(BulkTag::Path);
+            out.putString(value.path().path.abs());
+            if (value.pathAccessor() != &*state.rootFS)
+                out.selfContained = false;
+            break;
+        case nNull:
+            out.put(BulkTag::Null);
+            break;
+        case nAttrs:
+            out.put(BulkTag::Attrs);
+            out.put<uint32_t>(value.attrs()->size());
+            for (auto attr : value.attrs()->lexicographicOrder(state.symbols)) {
+                out.putString(state.symbols[attr->name]);
+                serializeValue(out, *attr->value, depth + 1);
+            }
+            break;
+        case nList:
+            out.put(BulkTag::List);
+            out.put<uint32_t>(value.listSize());
+            for (auto elem : value.listView())
+                serializeValue(out, *elem, depth + 1);
+            break;
+        case nFunction:
+            out.put(BulkTag::Function);
+            out.put<ValueId>(values.size());
+            values.emplace_back(&value);
+            out.selfContained = false;
+            break;
+        case nThunk:
+        case nExternal:
+        case nFailed:
+            if (out.evaluatedOnlyLimit) {
+                out.selfContained = false;
+                break;
+            }
+            throw Error("cannot pass %s to WASM", showType(value));
+        }
+    }
+
+    Value * deserializeValue(BulkReader & in, size_t depth)
+    {
+        checkBulkDepth(depth);
+
+        auto tag = in.get<BulkTag>();
+
+        switch (tag) {
+        case BulkTag::Bool:
+            return state.getBool(in.get<uint8_t>());
+        case BulkTag::Null:
+            return &Value::vNull;
+        case BulkTag::Function:
+            return values.at(in.get<ValueId>());
+        case BulkTag::Int:
+        case BulkTag::Float:
+        case BulkTag::String:
+        case BulkTag::StringWithContext:
+        case BulkTag::Path:
+        case BulkTag::Attrs:
+        case BulkTag::List:
+            break;
+        default:
+            throw Error("invalid value tag %d in buffer from WASM", (int) tag);
+        }
+
+        auto v = state.allocValue();
+
+        switch (tag) {
+        case BulkTag::Int:
+            v->mkInt(in.get<int64_t>());
+            break;
+        case BulkTag::Float:
+            v->mkFloat(in.get<double>());
+            break;
+        case BulkTag::String:
+            v->mkString(in.getString(), state.mem);
+            break;
+        case BulkTag::StringWithContext: {
+            auto str = in.getString();
+            NixStringContext context;
+            for (auto n = in.get<uint32_t>(); n--;)
+                context.insert(NixStringContextElem::parse(in.getString()));
+            v->mkString(str, context, state.mem);
+            break;
+        }
+        case BulkTag::Path:
+            v->mkPath(state.rootPath(CanonPath(in.getString())), state.mem);
+            break;
+        case BulkTag::Attrs: {
+            auto len = in.getCount(minEncodedAttrSize);
+            auto builder = state.buildBindings(len);
+            for (uint32_t n = 0; n < len; ++n) {
+                auto name = state.symbols.create(in.getString());
+                builder.insert(name, deserializeValue(in, depth + 1));
+            }
+            auto attrs = builder.finish();
+            /* Sorting puts duplicate names next to each other. */
+            for (size_t i = 1; i < attrs->size(); ++i)
+                if ((*attrs)[i - 1].name == (*attrs)[i].name)
+                    state
+                        .error<EvalError>(
+                            "duplicate attribute '%s' in value from WASM", state.symbols[(*attrs)[i].name])
+                        .debugThrow();
+            v->mkAttrs(attrs);
+            break;
+        }
+        case BulkTag::List: {
+            auto len = in.getCount(minEncodedValueSize);
+            auto list = state.buildList(len);
+            for (auto & elem : list)
+                elem = deserializeValue(in, depth + 1);
+            v->mkList(list);
+            break;
+        }
+        case BulkTag::Bool:
+        case BulkTag::Null:
+        case BulkTag::Function:
+        default:
+            unreachable();
+        }
+
+        return v;
+    }
+
+    /**
+     * Return the encoding of `value` if it is fully evaluated already,
+     * self-contained and at most `maxSize` bytes long, or
+     * `std::nullopt` otherwise. This never forces or throws, so it
+     * is cheap even for huge or self-referential values such as
+     * package sets.
+     */
+    std::optional<std::string> encodeEvaluated(Value & value, size_t maxSize)
+    {
+        BulkWriter sizer{.evaluatedOnlyLimit = maxSize};
+        serializeValue(sizer, value, 0);
+        if (!sizer.selfContained || sizer.pos > maxSize)
+            return std::nullopt;
+        std::string res(sizer.pos, 0);
+        BulkWriter out{.buf = string2span(res), .evaluatedOnlyLimit = maxSize};
+        serializeValue(out, value, 0);
+        return res;
+    }
+
+    Value * decode(std::string_view s)
+    {
+        BulkReader in{string2span(s)};
+        auto v = deserializeValue(in, 0);
+        if (in.pos != s.size())
+            throw Error("trailing data in value buffer from WASM");
+        return v;
+    }
+};
+
+/**
+ * A minimal reader for the sections of a WASM binary that determine
+ * its mutable state.
+ */
+struct WasmBinaryReader
+{
+    std::string_view s;
+    size_t pos = 0;
+
+    uint8_t byte()
+    {
+        if (pos >= s.size())
+            throw Error("truncated WASM module");
+        return s[pos++];
+    }
+
+    uint64_t leb()
+    {
+        uint64_t res = 0;
+        for (unsigned int shift = 0; shift < 64; shift += 7) {
+            auto b = byte();
+            res |= uint64_t(b & 0x7f) << shift;
+            if (!(b & 0x80))
+                return res;
+        }
+        throw Error("invalid LEB128 number in WASM module");
+    }
+
+    std::string_view bytes(size_t n)
+    {
+        if (n > s.size() - pos)
+            throw Error("truncated WASM module");
+        auto res = s.substr(pos, n);
+        pos += n;
+        return res;
+    }
+
+    void skipValType()
+    {
+        auto b = byte();
+        /* `(ref null ht)` and `(ref ht)` carry a heap type. */
+        if (b == 0x63 || b == 0x64)
+            leb();
+    }
+
+    void skipLimits()
+    {
+        auto flags = byte();
+        leb();
+        if (flags & 1)
+            leb();
+    }
+
+    void skipConstExpr()
+    {
+        while (true) {
+            switch (auto op = byte()) {
+            case 0x0b: // end
+                return;
+            case 0x23: // global.get
+            case 0x41: // i32.const
+            case 0x42: // i64.const
+            case 0xd0: // ref.null
+            case 0xd2: // ref.func
+                leb();
+                break;
+            case 0x43: // f32.const
+                bytes(4);
+                break;
+            case 0x44: // f64.const
+                bytes(8);
+                break;
+            case 0x6a: // i32.add
+            case 0x6b: // i32.sub
+            case 0x6c: // i32.mul
+            case 0x7c: // i64.add
+            case 0x7d: // i64.sub
+            case 0x7e: // i64.mul
+                break;
+            case 0xfd: // v128.const
+                if (leb() != 12)
+                    throw Error("unsupported constant expression in WASM module");
+                bytes(16);
+                break;
+            default:
+                throw Error("unsupported instruction 0x%02x in WASM constant expression", op);
+            }
+        }
+    }
+};
+
+/**
+ * Why the instances of a module cannot be returned to the pool after
+ * a call.
+ */
+enum struct WasmPoolRefusal {
+    /* The module could not be parsed. */
+    InvalidModule,
+    /* The module has more than one linear memory. */
+    MultipleMemories,
+    /* The module has passive data or element segments, whose
+       `data.drop`/`elem.drop` cannot be undone. */
+    PassiveSegments,
+    /* The call grew the memory or a table, which wasmtime cannot
+       shrink again. */
+    Grown,
+};
+
+static void putLeb(std::string & out, uint64_t n)
+{
+    do {
+        uint8_t b = n & 0x7f;
+        n >>= 7;
+        out.push_back(n ? b | 0x80 : b);
+    } while (n);
+}
+
+/**
+ * Prepare a module for instance pooling. Wasmtime only gives access to
+ * exported globals and tables, but compilers commonly keep globals
+ * like `__stack_pointer` private. So this returns the module with
+ * every mutable global and every table that it doesn't export already
+ * added to its export section, so that `NixWasmInstance::reset()` can
+ * restore them through the instance. Returns the original module and
+ * the reason if its instances cannot be pooled at all.
+ */
+static std::pair<std::string, std::optional<WasmPoolRefusal>> exportMutableState(std::string_view wasm)
+{
+    auto refuse = [&](WasmPoolRefusal refusal) { return std::pair{std::string(wasm), std::optional{refusal}}; };
+
+    try {
+        WasmBinaryReader in{wasm};
+        if (in.bytes(8) != std::string_view("\0asm\1\0\0\0", 8))
+            return refuse(WasmPoolRefusal::InvalidModule);
+
+        std::set<uint64_t> mutableGlobals, exportedGlobals, exportedTables;
+        std::set<std::string_view> exportNames;
+        uint64_t nrGlobals = 0, nrTables = 0, nrMemories = 0;
+
+        /* The position of the export section, and of its entries. */
+        std::optional<std::pair<size_t, size_t>> exportSection;
+        std::string_view exports;
+        uint64_t nrExports = 0;
+
+        while (in.pos < wasm.size()) {
+            auto sectionStart = in.pos;
+            auto id = in.byte();
+            WasmBinaryReader sec{in.bytes(in.leb())};
+            switch (id) {
+            case 2: // imports
+                for (auto n = sec.leb(); n--;) {
+                    sec.bytes(sec.leb());
+                    sec.bytes(sec.leb());
+                    switch (sec.byte()) {
+                    case 0: // function
+                        sec.leb();
+                        break;
+                    case 1: // table
+                        sec.skipValType();
+                        sec.skipLimits();
+                        nrTables++;
+                        break;
+                    case 2: // memory
+                        sec.skipLimits();
+                        nrMemories++;
+                        break;
+                    case 3: // global
+                        sec.skipValType();
+                        if (sec.byte())
+                            mutableGlobals.insert(nrGlobals);
+                        nrGlobals++;
+                        break;
+                    case 4: // tag
+                        sec.byte();
+                        sec.leb();
+                        break;
+                    default:
+                        return refuse(WasmPoolRefusal::InvalidModule);
+                    }
+                }
+                break;
+            case 4: // tables
+                for (auto n = sec.leb(); n--;) {
+                    bool hasInit = sec.s.substr(sec.pos).starts_with(std::string_view("\x40\0", 2));
+                    if (hasInit)
+                        sec.bytes(2);
+                    sec.skipValType();
+                    sec.skipLimits();
+                    if (hasInit)
+                        sec.skipConstExpr();
+                    nrTables++;
+                }
+                break;
+            case 5: // memories
+                nrMemories += sec.leb();
+                break;
+            case 6: // globals
+                for (auto n = sec.leb(); n--;) {
+                    sec.skipValType();
+                    if (sec.byte())
+                        mutableGlobals.insert(nrGlobals);
+                    sec.skipConstExpr();
+                    nrGlobals++;
+                }
+                break;
+            case 7: // exports
+                nrExports = sec.leb();
+                exports = sec.s.substr(sec.pos);
+                exportSection = {sectionStart, in.pos};
+                for (auto n = nrExports; n--;) {
+                    exportNames.insert(sec.bytes(sec.leb()));
+                    auto kind = sec.byte();
+                    auto idx = sec.leb();
+                    if (kind == 1)
+                        exportedTables.insert(idx);
+                    else if (kind == 3)
+                        exportedGlobals.insert(idx);
+                }
+                break;
+            case 9: // elements
+                for (auto n = sec.leb(); n--;) {
+                    auto flags = sec.leb();
+                    if (flags == 1 || flags == 5)
+                        return refuse(WasmPoolRefusal::PassiveSegments);
+                    if (!(flags & 1)) {
+                        if (flags & 2)
+                            sec.leb();
+                        sec.skipConstExpr();
+                    }
+                    if (flags & 3) {
+                        if (flags & 4)
+                            sec.skipValType();
+                        else
+                            sec.byte();
+                    }
+                    for (auto m = sec.leb(); m--;)
+                        if (flags & 4)
+                            sec.skipConstExpr();
+                        else
+                            sec.leb();
+                }
+                break;
+            case 11: // data
+                for (auto n = sec.leb(); n--;) {
+                    auto flags = sec.leb();
+                    if (flags == 1)
+                        return refuse(WasmPoolRefusal::PassiveSegments);
+                    if (flags == 2)
+                        sec.leb();
+                    sec.skipConstExpr();
+                    sec.bytes(sec.leb());
+                }
+                break;
+            }
+        }
+
+        if (nrMemories > 1)
+            return refuse(WasmPoolRefusal::MultipleMemories);
+
+        /* A module without exports has nothing to call. */
+        if (!exportSection)
+            return refuse(WasmPoolRefusal::InvalidModule);
+
+        std::string extra;
+        auto addExport = [&](std::string_view kind, uint8_t kindCode, uint64_t idx) {
+            auto name = fmt("nix-snapshot-%s-%d", kind, idx);
+            while (exportNames.contains(name))
+                name += "_";
+            putLeb(extra, name.size());
+            extra += name;
+            extra.push_back(kindCode);
+            putLeb(extra, idx);
+            nrExports++;
+        };
+        for (auto idx : mutableGlobals)
+            if (!exportedGlobals.contains(idx))
+                addExport("global", 3, idx);
+        for (uint64_t idx = 0; idx < nrTables; ++idx)
+            if (!exportedTables.contains(idx))
+                addExport("table", 1, idx);
+
+        if (extra.empty())
+            return {std::string(wasm), std::nullopt};
+
+        std::string body;
+        putLeb(body, nrExports);
+        body += exports;
+        body += extra;
+
+        std::string res(wasm.substr(0, exportSection->first));
+        res.push_back(7);
+        putLeb(res, body.size());
+        res += body;
+        res += wasm.substr(exportSection->second);
+        return {std::move(res), std::nullopt};
+    } catch (Error &) {
+        return refuse(WasmPoolRefusal::InvalidModule);
+    }
+}
+
+/**
+ * Maximum number of initialised instances kept per module for reuse
+ * by subsequent calls.
+ */
+static constexpr size_t maxIdleWasmInstances = 16;
+
 // Pre-compiled module with linker (no WASI yet - that's per-instance)
 struct NixWasmModule
 {
-    Engine & engine;
+    std::shared_ptr<Engine> engine;
+
+    /**
+     * Whether `engine` meters fuel, i.e. `wasm-fuel` set a limit when
+     * the module was loaded.
+     */
+    bool fuel;
+
     SourcePath wasmPath;
+
+    /**
+     * Hash of the module's contents.
+     */
+    Hash hash;
+
     Module module;
 
-    NixWasmModule(SourcePath _wasmPath)
-        : engine(getEngine())
-        , wasmPath(_wasmPath)
-        , module(unwrap(Module::compile(engine, string2span(wasmPath.readFile()))))
-    {
-    }
+    /**
+     * The module linked against WASI and the Nix host functions, so
+     * that creating an instance doesn't need to link it again.
+     */
+    wasmtime_instance_pre_t * pre = nullptr;
+
+    /**
+     * Why instances cannot be reset and reused across calls, see
+     * `exportMutableState()`. If set, every call gets a fresh
+     * instance.
+     */
+    std::optional<WasmPoolRefusal> poolRefusal;
+
+    /**
+     * Instances that have completed initialisation and are not
+     * currently executing a call. Each one has been reset to its
+     * post-initialisation snapshot.
+     */
+    Sync<std::vector<std::unique_ptr<NixWasmInstance>>> idleInstances;
+
+    NixWasmModule(SourcePath _wasmPath, const Hash & _hash, bool _fuel, std::string_view contents);
+
+    NixWasmModule(const NixWasmModule &) = delete;
+
+private:
+
+    NixWasmModule(
+        SourcePath _wasmPath,
+        const Hash & _hash,
+        bool _fuel,
+        std::pair<std::string, std::optional<WasmPoolRefusal>> prepared);
+
+public:
+
+    ~NixWasmModule();
+
+    Instance instantiate(wasmtime::Store::Context ctx);
+
+    /**
+     * Return an initialised instance for `state`, either from the
+     * idle pool or by instantiating and initialising a new one.
+     */
+    std::unique_ptr<NixWasmInstance> acquireInstance(EvalState & state);
+
+    /**
+     * Reset `instance` to its post-initialisation snapshot and return
+     * it to the idle pool. Instances that cannot be reset are dropped.
+     */
+    void releaseInstance(std::unique_ptr<NixWasmInstance> instance);
 };
 
 struct NixWasmInstance
 {
     EvalState & state;
-    ref<NixWasmModule> mod;
+    NixWasmModule & mod;
     wasmtime::Store wasmStore;
     wasmtime::Store::Context wasmCtx;
     std::optional<Instance> instance;
@@ -106,23 +864,67 @@ struct NixWasmInstance
 
     std::optional<std::string> functionName;
 
+    /**
+     * Whether the current call used a host function whose result does
+     * not only depend on its arguments (such as fetching or adding
+     * paths to the store, or reading the clock), which rules out
+     * memoizing the call.
+     */
+    bool impure = false;
+
+    /**
+     * Wall-clock time at which the current call is aborted, if
+     * `wasm-timeout` is set.
+     */
+    std::optional<std::chrono::steady_clock::time_point> deadline;
+
+    /**
+     * Fuel consumed by the most recent call to `runFunction()`.
+     */
+    uint64_t fuelConsumed = 0;
+
     // Context values for Aleph FFI (set via setContext)
     ValueId depRegistry = 0xFFFFFFFF;  // The dependency registry attrset
     ValueId outPath = 0xFFFFFFFF;      // The output path (if in build context)
 
-    NixWasmInstance(EvalState & _state, ref<NixWasmModule> _mod)
+    /**
+     * Contents of linear memory, mutable globals and tables right
+     * after initialisation, used to reset the instance between calls.
+     * Only recorded for poolable modules, whose mutable globals and
+     * tables have all been exported by `exportMutableState()`.
+     */
+    std::vector<uint8_t> memorySnapshot;
+    std::vector<std::pair<Global, Val>> globalsSnapshot;
+    std::vector<std::pair<Table, std::vector<Val>>> tablesSnapshot;
+
+    NixWasmInstance(EvalState & _state, NixWasmModule & _mod)
         : state(_state)
         , mod(_mod)
-        , wasmStore(mod->engine)
+        , wasmStore(*mod.engine)
         , wasmCtx(wasmStore)
     {
         // Set instance pointer BEFORE instantiation so FFI callbacks can find us
         wasmCtx.set_data(this);
 
-        // Create linker for this instance
-        Linker linker(mod->engine);
+        wasmtime_store_epoch_deadline_callback(wasmStore.capi(), epochDeadlineCallback, this, nullptr);
+
+        if (auto maxMemory = state.settings.wasmMaxMemory.get())
+            wasmStore.limiter(maxMemory, -1, -1, -1, -1);
+
+        setWasi();
 
-        // Set up WASI for GHC runtime support
+        // Instantiate the module (this may call _initialize which needs FFI)
+        instance = mod.instantiate(wasmCtx);
+        memory_ = std::get<Memory>(*instance->get(wasmCtx, "memory"));
+    }
+
+    /**
+     * Give the instance a fresh WASI context (needed by the GHC
+     * runtime). This also discards any WASI state (such as file
+     * descriptors) left by a previous call.
+     */
+    void setWasi()
+    {
         wasi_config_t * wasi_config = wasi_config_new();
         wasi_config_inherit_stdout(wasi_config);
         wasi_config_inherit_stderr(wasi_config);
@@ -132,59 +934,113 @@ struct NixWasmInstance
             auto msg = wasmtime::Error(error);
             throw nix::Error("failed to set WASI config: %s", msg.message());
         }
+    }
 
-        // Link WASI functions
-        error = wasmtime_linker_define_wasi(linker.capi());
-        if (error != nullptr) {
-            auto msg = wasmtime::Error(error);
-            throw nix::Error("failed to define WASI: %s", msg.message());
-        }
-
-        // Register Nix FFI functions - value marshalling
-        regFun(linker, "panic", &NixWasmInstance::panic);
-        regFun(linker, "warn", &NixWasmInstance::warn);
-        regFun(linker, "get_type", &NixWasmInstance::get_type);
-        regFun(linker, "make_int", &NixWasmInstance::make_int);
-        regFun(linker, "get_int", &NixWasmInstance::get_int);
-        regFun(linker, "make_float", &NixWasmInstance::make_float);
-        regFun(linker, "get_float", &NixWasmInstance::get_float);
-        regFun(linker, "make_string", &NixWasmInstance::make_string);
-        regFun(linker, "copy_string", &NixWasmInstance::copy_string);
-        regFun(linker, "get_string_len", &NixWasmInstance::get_string_len);
-        regFun(linker, "make_bool", &NixWasmInstance::make_bool);
-        regFun(linker, "get_bool", &NixWasmInstance::get_bool);
-        regFun(linker, "make_null", &NixWasmInstance::make_null);
-        regFun(linker, "make_path", &NixWasmInstance::make_path);
-        regFun(linker, "copy_path", &NixWasmInstance::copy_path);
-        regFun(linker, "make_list", &NixWasmInstance::make_list);
-        regFun(linker, "copy_list", &NixWasmInstance::copy_list);
-        regFun(linker, "get_list_len", &NixWasmInstance::get_list_len);
-        regFun(linker, "get_list_elem", &NixWasmInstance::get_list_elem);
-        regFun(linker, "make_attrset", &NixWasmInstance::make_attrset);
-        regFun(linker, "copy_attrset", &NixWasmInstance::copy_attrset);
-        regFun(linker, "copy_attrname", &NixWasmInstance::copy_attrname);
-        regFun(linker, "get_attrs_len", &NixWasmInstance::get_attrs_len);
-        regFun(linker, "has_attr", &NixWasmInstance::has_attr);
-        regFun(linker, "get_attr", &NixWasmInstance::get_attr);
-        regFun(linker, "call_function", &NixWasmInstance::call_function);
-
-        // Register Aleph FFI functions - fetch operations
-        regFun(linker, "nix_fetch_github", &NixWasmInstance::nix_fetch_github);
-        regFun(linker, "nix_fetch_url", &NixWasmInstance::nix_fetch_url);
-        regFun(linker, "nix_fetch_git", &NixWasmInstance::nix_fetch_git);
-
-        // Register Aleph FFI functions - store operations
-        regFun(linker, "nix_resolve_dep", &NixWasmInstance::nix_resolve_dep);
-        regFun(linker, "nix_add_to_store", &NixWasmInstance::nix_add_to_store);
-
-        // Register Aleph FFI functions - build context
-        regFun(linker, "nix_get_system", &NixWasmInstance::nix_get_system);
-        regFun(linker, "nix_get_cores", &NixWasmInstance::nix_get_cores);
-        regFun(linker, "nix_get_out_path", &NixWasmInstance::nix_get_out_path);
+    /**
+     * Run the module's initialisation functions (`_initialize`, the GHC
+     * RTS `hs_init` if exported, and `nix_wasm_init_v2` or
+     * `nix_wasm_init_v1`), then record
+     * the resulting state so that `reset()` can return to it.
+     */
+    void initialize()
+    {
+        // Initialize the WASM module (GHC RTS setup, etc.)
+        debug("calling _initialize");
+        auto initResult = runFunction("_initialize", {});
+        debug("_initialize returned with %d results", initResult.size());
 
-        // Instantiate the module (this may call _initialize which needs FFI)
-        instance = unwrap(linker.instantiate(wasmCtx, mod->module));
-        memory_ = std::get<Memory>(*instance->get(wasmCtx, "memory"));
+        // Check if hs_init is exported and call it (GHC WASM RTS init)
+        // hs_init(int *argc, char ***argv) - we pass NULL for both
+        auto hsInitExt = instance->get(wasmCtx, "hs_init");
+        if (hsInitExt && std::holds_alternative<Func>(*hsInitExt)) {
+            debug("calling hs_init");
+            runFunction("hs_init", {(int32_t) 0, (int32_t) 0});
+            debug("hs_init complete");
+        }
+
+        // Prefer the newest ABI version that the module supports.
+        auto initName = instance->get(wasmCtx, "nix_wasm_init_v2") ? "nix_wasm_init_v2" : "nix_wasm_init_v1";
+        debug("calling %s", initName);
+        runFunction(initName, {});
+        debug("initialization complete");
+
+        if (!mod.poolRefusal) {
+            auto mem = memory();
+            memorySnapshot.assign(mem.begin(), mem.end());
+
+            for (size_t i = 0;; ++i) {
+                auto exp = instance->get(wasmCtx, i);
+                if (!exp)
+                    break;
+                if (auto global = std::get_if<Global>(&exp->second)) {
+                    if (global->type(wasmCtx)->is_mutable())
+                        globalsSnapshot.emplace_back(*global, global->get(wasmCtx));
+                } else if (auto table = std::get_if<Table>(&exp->second)) {
+                    std::vector<Val> elems;
+                    for (uint64_t j = 0; j < table->size(wasmCtx); ++j)
+                        elems.push_back(*table->get(wasmCtx, j));
+                    tablesSnapshot.emplace_back(*table, std::move(elems));
+                }
+            }
+        }
+
+        clearValues();
+    }
+
+    /**
+     * Restore linear memory, mutable globals, tables and WASI state to
+     * the state captured by `initialize()`. If that is not possible,
+     * returns the reason, and the instance must be discarded.
+     *
+     * Memory is compared with the snapshot page by page, and only the
+     * pages that the call changed are copied back. This keeps pages
+     * that the call didn't write shared with the module's
+     * copy-on-write memory image. Instances whose memory grew are
+     * dropped because wasmtime cannot shrink a memory, so modules
+     * whose calls usually grow the heap gain little from pooling.
+     */
+    std::optional<WasmPoolRefusal> reset()
+    {
+        if (mod.poolRefusal)
+            return mod.poolRefusal;
+
+        auto mem = memory();
+        if (mem.size() != memorySnapshot.size())
+            return WasmPoolRefusal::Grown;
+        for (auto & [table, elems] : tablesSnapshot)
+            if (table.size(wasmCtx) != elems.size())
+                return WasmPoolRefusal::Grown;
+
+        static constexpr size_t pageSize = 4096;
+        for (size_t offset = 0; offset < mem.size(); offset += pageSize) {
+            auto len = std::min(pageSize, mem.size() - offset);
+            if (memcmp(mem.data() + offset, memorySnapshot.data() + offset, len))
+                memcpy(mem.data() + offset, memorySnapshot.data() + offset, len);
+        }
+
+        for (auto & [global, val] : globalsSnapshot)
+            unwrap(global.set(wasmCtx, val));
+
+        for (auto & [table, elems] : tablesSnapshot)
+            for (uint64_t j = 0; j < elems.size(); ++j)
+                unwrap(table.set(wasmCtx, j, elems[j]));
+
+        setWasi();
+
+        clearValues();
+        return std::nullopt;
+    }
+
+    /**
+     * Drop all references to Nix values from the previous call.
+     */
+    void clearValues()
+    {
+        values.clear();
+        functionName.reset();
+        impure = false;
+        depRegistry = 0xFFFFFFFF;
+        outPath = 0xFFFFFFFF;
     }
 
     // Set the context for Aleph FFI (depRegistry, outPath)
@@ -216,17 +1072,73 @@ struct NixWasmInstance
     {
         auto ext = instance->get(wasmCtx, name);
         if (!ext)
-            throw Error("WASM module '%s' does not export function '%s'", mod->wasmPath, name);
+            throw Error("WASM module '%s' does not export function '%s'", mod.wasmPath, name);
         auto fun = std::get_if<Func>(&*ext);
         if (!fun)
-            throw Error("export '%s' of WASM module '%s' is not a function", name, mod->wasmPath);
+            throw Error("export '%s' of WASM module '%s' is not a function", name, mod.wasmPath);
         return *fun;
     }
 
+    static wasmtime_error_t * epochDeadlineCallback(
+        wasmtime_context_t *, void * data, uint64_t * epochDeadlineDelta, wasmtime_update_deadline_kind_t * updateKind)
+    {
+        auto instance = static_cast<NixWasmInstance *>(data);
+        try {
+            checkInterrupt();
+            if (instance->deadline && std::chrono::steady_clock::now() > *instance->deadline)
+                throw Error(
+                    "WASM function '%s' exceeded the time limit of %d ms",
+                    instance->functionName.value_or("<unknown>"),
+                    instance->state.settings.wasmTimeout.get());
+        } catch (...) {
+            instance->ex = std::current_exception();
+            return wasmtime_error_new("interrupted");
+        }
+        *epochDeadlineDelta = 1;
+        *updateKind = WASMTIME_UPDATE_DEADLINE_CONTINUE;
+        return nullptr;
+    }
+
+    /**
+     * Call an exported function, subject to the fuel and time limits
+     * in `EvalSettings`. Exceptions thrown by host functions or by
+     * the interrupt check while the function was running are
+     * rethrown here.
+     */
     std::vector<Val> runFunction(std::string_view name, const std::vector<Val> & args)
     {
         functionName = name;
-        return unwrap(getFunction(name).call(wasmCtx, args));
+
+        /* Without a fuel limit, the module runs in an engine without
+           fuel metering. */
+        auto fuelLimit = mod.fuel ? state.settings.wasmFuel.get() : 0;
+        auto fuel = fuelLimit ? fuelLimit : std::numeric_limits<uint64_t>::max();
+        if (mod.fuel)
+            unwrap(wasmCtx.set_fuel(fuel));
+
+        if (auto timeout = state.settings.wasmTimeout.get())
+            deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+        else
+            deadline.reset();
+        wasmCtx.set_epoch_deadline(1);
+
+        ex = nullptr;
+
+        auto res = getFunction(name).call(wasmCtx, args);
+
+        auto remaining = mod.fuel ? unwrap(wasmCtx.get_fuel()) : fuel;
+        fuelConsumed = fuel - remaining;
+        state.wasmFuelConsumed += fuelConsumed;
+
+        if (!res) {
+            if (ex)
+                std::rethrow_exception(std::exchange(ex, nullptr));
+            if (fuelLimit && remaining == 0)
+                throw Error("WASM function '%s' ran out of fuel (limit is %d)", name, fuelLimit);
+            throw Error(res.err().message());
+        }
+
+        return res.ok();
     }
 
     auto memory()
@@ -234,18 +1146,46 @@ struct NixWasmInstance
         return memory_->data(wasmCtx);
     }
 
+    /**
+     * Return the `len` bytes of linear memory at `ptr`, checking that
+     * the guest-supplied range lies within the memory.
+     */
+    std::span<uint8_t> memory(uint32_t ptr, size_t len)
+    {
+        auto mem = memory();
+        if (len > mem.size() || ptr > mem.size() - len)
+            state
+                .error<EvalError>(
+                    "WASM module passed an out-of-bounds buffer (%d bytes at offset %d, memory size is %d)",
+                    len,
+                    ptr,
+                    mem.size())
+                .debugThrow();
+        return mem.subspan(ptr, len);
+    }
+
+    /**
+     * Return the array of `len` elements of type `T` at `ptr` in
+     * linear memory, checking it like `memory(ptr, len)`.
+     */
+    template<typename T>
+    std::span<T> memoryArray(uint32_t ptr, uint32_t len)
+    {
+        return std::span((T *) memory(ptr, (size_t) len * sizeof(T)).data(), len);
+    }
+
     std::monostate panic(uint32_t ptr, uint32_t len)
     {
-        throw Error("WASM panic: %s", Uncolored(span2string(memory().subspan(ptr, len))));
+        throw Error("WASM panic: %s", Uncolored(span2string(memory(ptr, len))));
     }
 
     std::monostate warn(uint32_t ptr, uint32_t len)
     {
         nix::warn(
             "'%s' function '%s': %s",
-            mod->wasmPath,
+            mod.wasmPath,
             functionName.value_or("<unknown>"),
-            span2string(memory().subspan(ptr, len)));
+            span2string(memory(ptr, len)));
         return {};
     }
 
@@ -293,7 +1233,7 @@ struct NixWasmInstance
     ValueId make_string(uint32_t ptr, uint32_t len)
     {
         auto [valueId, value] = allocValue();
-        value.mkString(span2string(memory().subspan(ptr, len)), state.mem);
+        value.mkString(span2string(memory(ptr, len)), state.mem);
         return valueId;
     }
 
@@ -301,7 +1241,7 @@ struct NixWasmInstance
     {
         auto s = state.forceString(*values.at(valueId), noPos, "while evaluating a value from WASM");
         if (s.size() <= maxLen) {
-            auto buf = memory().subspan(ptr, maxLen);
+            auto buf = memory(ptr, maxLen);
             memcpy(buf.data(), s.data(), s.size());
         }
         return s.size();
@@ -324,7 +1264,7 @@ struct NixWasmInstance
 
     ValueId make_list(uint32_t ptr, uint32_t len)
     {
-        auto vs = subspan<ValueId>(memory().subspan(ptr), len);
+        auto vs = memoryArray<ValueId>(ptr, len);
 
         auto [valueId, value] = allocValue();
 
@@ -342,7 +1282,7 @@ struct NixWasmInstance
         state.forceList(value, noPos, "while getting a list from WASM");
 
         if (value.listSize() <= maxLen) {
-            auto out = subspan<ValueId>(memory().subspan(ptr), value.listSize());
+            auto out = memoryArray<ValueId>(ptr, value.listSize());
 
             for (const auto & [n, elem] : enumerate(value.listView()))
                 out[n] = addValue(elem);
@@ -353,8 +1293,6 @@ struct NixWasmInstance
 
     ValueId make_attrset(uint32_t ptr, uint32_t len)
     {
-        auto mem = memory();
-
         struct Attr
         {
             // FIXME: endianness
@@ -363,13 +1301,13 @@ struct NixWasmInstance
             ValueId value;
         };
 
-        auto attrs = subspan<Attr>(mem.subspan(ptr), len);
+        auto attrs = memoryArray<Attr>(ptr, len);
 
         auto [valueId, value] = allocValue();
         auto builder = state.buildBindings(len);
         for (auto & attr : attrs)
             builder.insert(
-                state.symbols.create(span2string(mem.subspan(attr.attrNamePtr, attr.attrNameLen))),
+                state.symbols.create(span2string(memory(attr.attrNamePtr, attr.attrNameLen))),
                 values.at(attr.value));
         value.mkAttrs(builder);
 
@@ -389,7 +1327,7 @@ struct NixWasmInstance
                 uint32_t nameLen;
             };
 
-            auto buf = subspan<Attr>(memory().subspan(ptr), maxLen);
+            auto buf = memoryArray<Attr>(ptr, maxLen);
 
             // FIXME: for determinism, we should return attributes in lexicographically sorted order.
             for (const auto & [n, attr] : enumerate(*value.attrs())) {
@@ -408,13 +1346,19 @@ struct NixWasmInstance
 
         auto & attrs = *value.attrs();
 
-        assert((size_t) attrIdx < attrs.size());
+        if ((size_t) attrIdx >= attrs.size())
+            state.error<EvalError>("attribute index %d out of bounds (size %d) in WASM call", attrIdx, attrs.size())
+                .debugThrow();
 
         std::string_view name = state.symbols[attrs[attrIdx].name];
 
-        assert((size_t) len == name.size());
+        if ((size_t) len != name.size())
+            state
+                .error<EvalError>(
+                    "WASM module passed a buffer of %d bytes for an attribute name of %d bytes", len, name.size())
+                .debugThrow();
 
-        memcpy(memory().subspan(ptr, len).data(), name.data(), name.size());
+        memcpy(memory(ptr, len).data(), name.data(), name.size());
 
         return {};
     }
@@ -425,7 +1369,7 @@ struct NixWasmInstance
         state.forceFunction(fun, noPos, "while calling a function from WASM");
 
         ValueVector args;
-        for (auto argId : subspan<ValueId>(memory().subspan(ptr), len))
+        for (auto argId : memoryArray<ValueId>(ptr, len))
             args.push_back(values.at(argId));
 
         auto [valueId, value] = allocValue();
@@ -467,7 +1411,7 @@ struct NixWasmInstance
     {
         auto & value = *values.at(valueId);
         state.forceAttrs(value, noPos, "while checking attr in WASM");
-        auto name = state.symbols.create(span2string(memory().subspan(namePtr, nameLen)));
+        auto name = state.symbols.create(span2string(memory(namePtr, nameLen)));
         return value.attrs()->get(name) != nullptr ? 1 : 0;
     }
 
@@ -476,7 +1420,7 @@ struct NixWasmInstance
     {
         auto & value = *values.at(valueId);
         state.forceAttrs(value, noPos, "while getting attr from WASM");
-        auto name = state.symbols.create(span2string(memory().subspan(namePtr, nameLen)));
+        auto name = state.symbols.create(span2string(memory(namePtr, nameLen)));
         auto attr = value.attrs()->get(name);
         if (!attr)
             return 0xFFFFFFFF; // sentinel for "not found"
@@ -487,7 +1431,7 @@ struct NixWasmInstance
     ValueId make_path(uint32_t ptr, uint32_t len)
     {
         auto [valueId, value] = allocValue();
-        auto pathStr = span2string(memory().subspan(ptr, len));
+        auto pathStr = span2string(memory(ptr, len));
         value.mkPath(state.rootPath(CanonPath(pathStr)), state.mem);
         return valueId;
     }
@@ -500,7 +1444,7 @@ struct NixWasmInstance
         auto path = state.coerceToPath(noPos, value, context, "while copying path from WASM");
         auto pathStr = path.path.abs();
         if (pathStr.size() <= maxLen) {
-            auto buf = memory().subspan(ptr, maxLen);
+            auto buf = memory(ptr, maxLen);
             memcpy(buf.data(), pathStr.data(), pathStr.size());
         }
         return pathStr.size();
@@ -513,6 +1457,99 @@ struct NixWasmInstance
         return s.size();
     }
 
+    // =========================================================================
+    // WASI functions that return different results on every call. These
+    // replace wasmtime's implementations so that calls using them can be
+    // marked as impure.
+    // =========================================================================
+
+    static constexpr uint32_t wasiSuccess = 0, wasiFault = 21, wasiInval = 28;
+
+    /**
+     * Return the `len` bytes of linear memory at `ptr`, or an empty
+     * span if the range is out of bounds.
+     */
+    std::span<uint8_t> wasiBuffer(uint32_t ptr, uint32_t len)
+    {
+        auto mem = memory();
+        if (len > mem.size() || ptr > mem.size() - len)
+            return {};
+        return mem.subspan(ptr, len);
+    }
+
+    uint32_t clock_res_get(uint32_t clockId, uint32_t resPtr)
+    {
+        impure = true;
+        if (clockId > 1)
+            return wasiInval;
+        auto buf = wasiBuffer(resPtr, sizeof(uint64_t));
+        if (buf.empty())
+            return wasiFault;
+        uint64_t res = 1;
+        memcpy(buf.data(), &res, sizeof(res));
+        return wasiSuccess;
+    }
+
+    uint32_t clock_time_get(uint32_t clockId, uint64_t precision, uint32_t timePtr)
+    {
+        impure = true;
+        std::chrono::nanoseconds time;
+        /* Like wasmtime, don't support the CPU time clocks. */
+        if (clockId == 0)
+            time = std::chrono::system_clock::now().time_since_epoch();
+        else if (clockId == 1)
+            time = std::chrono::steady_clock::now().time_since_epoch();
+        else
+            return wasiInval;
+        auto buf = wasiBuffer(timePtr, sizeof(uint64_t));
+        if (buf.empty())
+            return wasiFault;
+        uint64_t ns = time.count();
+        memcpy(buf.data(), &ns, sizeof(ns));
+        return wasiSuccess;
+    }
+
+    uint32_t random_get(uint32_t ptr, uint32_t len)
+    {
+        impure = true;
+        auto buf = wasiBuffer(ptr, len);
+        if (buf.empty() && len)
+            return wasiFault;
+        thread_local std::random_device rd;
+        for (size_t i = 0; i < buf.size(); i += sizeof(unsigned int)) {
+            auto r = rd();
+            memcpy(buf.data() + i, &r, std::min(sizeof(r), buf.size() - i));
+        }
+        return wasiSuccess;
+    }
+
+    // =========================================================================
+    // Bulk value marshalling (ABI v2), see `BulkTag`
+    // =========================================================================
+
+    // Serialize a value and everything reachable from it into a buffer
+    // (forcing it deeply). Returns the size of the encoding; if it is
+    // larger than maxLen, the buffer contents are unspecified and the
+    // caller should retry with a larger buffer.
+    uint32_t serialize_value(ValueId valueId, uint32_t ptr, uint32_t maxLen)
+    {
+        BulkWriter out{memory(ptr, maxLen)};
+        BulkCodec{state, values}.serializeValue(out, *values.at(valueId), 0);
+        if (out.pos > std::numeric_limits<uint32_t>::max())
+            throw Error("value passed to WASM is too large");
+        return out.pos;
+    }
+
+    // Build a value from its encoding in a buffer.
+    ValueId deserialize_value(uint32_t ptr, uint32_t len)
+    {
+        BulkReader in{memory(ptr, len)};
+        auto v = BulkCodec{state, values}.deserializeValue(in, 0);
+        if (in.pos != len)
+            throw Error("trailing data in value buffer from WASM");
+        return addValue(v);
+    }
+
     // =========================================================================
     // Aleph FFI: Fetch operations
     // =========================================================================
@@ -521,7 +1558,7 @@ struct NixWasmInstance
     uint32_t copyToWasm(std::string_view s, uint32_t ptr, uint32_t maxLen)
     {
         if (s.size() <= maxLen) {
-            auto buf = memory().subspan(ptr, maxLen);
+            auto buf = memory(ptr, maxLen);
             memcpy(buf.data(), s.data(), s.size());
         }
         return s.size();
@@ -537,11 +1574,12 @@ struct NixWasmInstance
         uint32_t hashPtr, uint32_t hashLen,
         uint32_t outPtr, uint32_t outLen)
     {
-        auto mem = memory();
-        auto owner = std::string(span2string(mem.subspan(ownerPtr, ownerLen)));
-        auto repo = std::string(span2string(mem.subspan(repoPtr, repoLen)));
-        auto rev = std::string(span2string(mem.subspan(revPtr, revLen)));
-        auto hash = std::string(span2string(mem.subspan(hashPtr, hashLen)));
+        auto owner = std::string(span2string(memory(ownerPtr, ownerLen)));
+        auto repo = std::string(span2string(memory(repoPtr, repoLen)));
+        auto rev = std::string(span2string(memory(revPtr, revLen)));
+        auto hash = std::string(span2string(memory(hashPtr, hashLen)));
+
+        impure = true;
 
         debug("nix_fetch_github: %s/%s @ %s", owner, repo, rev);
 
@@ -582,9 +1620,10 @@ struct NixWasmInstance
         uint32_t hashPtr, uint32_t hashLen,
         uint32_t outPtr, uint32_t outLen)
     {
-        auto mem = memory();
-        auto url = std::string(span2string(mem.subspan(urlPtr, urlLen)));
-        auto hash = std::string(span2string(mem.subspan(hashPtr, hashLen)));
+        auto url = std::string(span2string(memory(urlPtr, urlLen)));
+        auto hash = std::string(span2string(memory(hashPtr, hashLen)));
+
+        impure = true;
 
         debug("nix_fetch_url: %s", url);
 
@@ -613,10 +1652,11 @@ struct NixWasmInstance
         uint32_t hashPtr, uint32_t hashLen,
         uint32_t outPtr, uint32_t outLen)
     {
-        auto mem = memory();
-        auto url = std::string(span2string(mem.subspan(urlPtr, urlLen)));
-        auto rev = std::string(span2string(mem.subspan(revPtr, revLen)));
-        auto hash = std::string(span2string(mem.subspan(hashPtr, hashLen)));
+        auto url = std::string(span2string(memory(urlPtr, urlLen)));
+        auto rev = std::string(span2string(memory(revPtr, revLen)));
+        auto hash = std::string(span2string(memory(hashPtr, hashLen)));
+
+        impure = true;
 
         debug("nix_fetch_git: %s @ %s", url, rev);
 
@@ -666,7 +1706,7 @@ struct NixWasmInstance
         uint32_t namePtr, uint32_t nameLen,
         uint32_t outPtr, uint32_t outLen)
     {
-        auto name = std::string(span2string(memory().subspan(namePtr, nameLen)));
+        auto name = std::string(span2string(memory(namePtr, nameLen)));
 
         debug("nix_resolve_dep: %s", name);
 
@@ -703,10 +1743,12 @@ struct NixWasmInstance
         uint32_t pathPtr, uint32_t pathLen,
         uint32_t outPtr, uint32_t outLen)
     {
-        auto pathStr = std::string(span2string(memory().subspan(pathPtr, pathLen)));
+        auto pathStr = std::string(span2string(memory(pathPtr, pathLen)));
 
         debug("nix_add_to_store: %s", pathStr);
 
+        impure = true;
+
         try {
             auto path = state.rootPath(CanonPath(pathStr));
             auto storePath = fetchToStore(
@@ -739,6 +1781,7 @@ struct NixWasmInstance
     // Returns: number of cores
     uint32_t nix_get_cores()
     {
+        impure = true;
         auto cores = std::thread::hardware_concurrency();
         if (cores == 0) cores = 1;  // fallback
         debug("nix_get_cores: %d", cores);
@@ -753,7 +1796,7 @@ struct NixWasmInstance
         uint32_t namePtr, uint32_t nameLen,
         uint32_t outPtr, uint32_t outLen)
     {
-        auto name = std::string(span2string(memory().subspan(namePtr, nameLen)));
+        auto name = std::string(span2string(memory(namePtr, nameLen)));
 
         debug("nix_get_out_path: %s", name);
 
@@ -774,6 +1817,393 @@ struct NixWasmInstance
     }
 };
 
+static void setPendingException(NixWasmInstance * instance, std::exception_ptr ex)
+{
+    instance->ex = ex;
+}
+
+NixWasmModule::NixWasmModule(SourcePath _wasmPath, const Hash & _hash, bool _fuel, std::string_view contents)
+    : NixWasmModule(_wasmPath, _hash, _fuel, exportMutableState(contents))
+{
+}
+
+NixWasmModule::NixWasmModule(
+    SourcePath _wasmPath,
+    const Hash & _hash,
+    bool _fuel,
+    std::pair<std::string, std::optional<WasmPoolRefusal>> prepared)
+    : engine(getEngine(_fuel))
+    , fuel(_fuel)
+    , wasmPath(_wasmPath)
+    , hash(_hash)
+    , module(compileWasmModule(*engine, engineConfig(fuel), prepared.first))
+    , poolRefusal(prepared.second)
+{
+    debug("WASM module '%s' is %s", wasmPath, poolRefusal ? "not poolable" : "poolable");
+
+    Linker linker(*engine);
+
+    // Link WASI functions. The WASI context itself is per instance.
+    auto * error = wasmtime_linker_define_wasi(linker.capi());
+    if (error != nullptr) {
+        auto msg = wasmtime::Error(error);
+        throw nix::Error("failed to define WASI: %s", msg.message());
+    }
+
+    // Replace the WASI clock and randomness functions, see
+    // `NixWasmInstance::clock_time_get()`.
+    linker.allow_shadowing(true);
+    regFun(linker, "clock_res_get", &NixWasmInstance::clock_res_get, "wasi_snapshot_preview1");
+    regFun(linker, "clock_time_get", &NixWasmInstance::clock_time_get, "wasi_snapshot_preview1");
+    regFun(linker, "random_get", &NixWasmInstance::random_get, "wasi_snapshot_preview1");
+    linker.allow_shadowing(false);
+
+    // Register Nix FFI functions - value marshalling
+    regFun(linker, "panic", &NixWasmInstance::panic);
+    regFun(linker, "warn", &NixWasmInstance::warn);
+    regFun(linker, "get_type", &NixWasmInstance::get_type);
+    regFun(linker, "make_int", &NixWasmInstance::make_int);
+    regFun(linker, "get_int", &NixWasmInstance::get_int);
+    regFun(linker, "make_float", &NixWasmInstance::make_float);
+    regFun(linker, "get_float", &NixWasmInstance::get_float);
+    regFun(linker, "make_string", &NixWasmInstance::make_string);
+    regFun(linker, "copy_string", &NixWasmInstance::copy_string);
+    regFun(linker, "get_string_len", &NixWasmInstance::get_string_len);
+    regFun(linker, "make_bool", &NixWasmInstance::make_bool);
+    regFun(linker, "get_bool", &NixWasmInstance::get_bool);
+    regFun(linker, "make_null", &NixWasmInstance::make_null);
+    regFun(linker, "make_path", &NixWasmInstance::make_path);
+    regFun(linker, "copy_path", &NixWasmInstance::copy_path);
+    regFun(linker, "make_list", &NixWasmInstance::make_list);
+    regFun(linker, "copy_list", &NixWasmInstance::copy_list);
+    regFun(linker, "get_list_len", &NixWasmInstance::get_list_len);
+    regFun(linker, "get_list_elem", &NixWasmInstance::get_list_elem);
+    regFun(linker, "make_attrset", &NixWasmInstance::make_attrset);
+    regFun(linker, "copy_attrset", &NixWasmInstance::copy_attrset);
+    regFun(linker, "copy_attrname", &NixWasmInstance::copy_attrname);
+    regFun(linker, "get_attrs_len", &NixWasmInstance::get_attrs_len);
+    regFun(linker, "has_attr", &NixWasmInstance::has_attr);
+    regFun(linker, "get_attr", &NixWasmInstance::get_attr);
+    regFun(linker, "call_function", &NixWasmInstance::call_function);
+
+    // Register Nix FFI functions - bulk value marshalling (ABI v2)
+    regFun(linker, "serialize_value", &NixWasmInstance::serialize_value);
+    regFun(linker, "deserialize_value", &NixWasmInstance::deserialize_value);
+
+    // Register Aleph FFI functions - fetch operations
+    regFun(linker, "nix_fetch_github", &NixWasmInstance::nix_fetch_github);
+    regFun(linker, "nix_fetch_url", &NixWasmInstance::nix_fetch_url);
+    regFun(linker, "nix_fetch_git", &NixWasmInstance::nix_fetch_git);
+
+    // Register Aleph FFI functions - store operations
+    regFun(linker, "nix_resolve_dep", &NixWasmInstance::nix_resolve_dep);
+    regFun(linker, "nix_add_to_store", &NixWasmInstance::nix_add_to_store);
+
+    // Register Aleph FFI functions - build context
+    regFun(linker, "nix_get_system", &NixWasmInstance::nix_get_system);
+    regFun(linker, "nix_get_cores", &NixWasmInstance::nix_get_cores);
+    regFun(linker, "nix_get_out_path", &NixWasmInstance::nix_get_out_path);
+
+    if (auto error = wasmtime_linker_instantiate_pre(linker.capi(), module.capi(), &pre))
+        throw Error("cannot link WASM module '%s': %s", wasmPath, wasmtime::Error(error).message());
+}
+
+NixWasmModule::~NixWasmModule()
+{
+    if (pre)
+        wasmtime_instance_pre_delete(pre);
+}
+
+Instance NixWasmModule::instantiate(wasmtime::Store::Context ctx)
+{
+    wasmtime_instance_t instance;
+    wasm_trap_t * trap = nullptr;
+    if (auto error = wasmtime_instance_pre_instantiate(pre, ctx.capi(), &instance, &trap))
+        throw Error("cannot instantiate WASM module '%s': %s", wasmPath, wasmtime::Error(error).message());
+    if (trap)
+        throw Error("cannot instantiate WASM module '%s': %s", wasmPath, wasmtime::Trap(trap).message());
+    return Instance(instance);
+}
+
+std::unique_ptr<NixWasmInstance> NixWasmModule::acquireInstance(EvalState & state)
+{
+    {
+        auto idle(idleInstances.lock());
+        if (!idle->empty()) {
+            auto instance = std::move(idle->back());
+            idle->pop_back();
+            assert(&instance->state == &state);
+            state.nrWasmInstancesReused++;
+            return instance;
+        }
+    }
+
+    auto instance = std::make_unique<NixWasmInstance>(state, *this);
+    instance->initialize();
+    state.nrWasmInstancesCreated++;
+    return instance;
+}
+
+void NixWasmModule::releaseInstance(std::unique_ptr<NixWasmInstance> instance)
+{
+    if (auto refusal = instance->reset()) {
+        auto & state = instance->state;
+        switch (*refusal) {
+        case WasmPoolRefusal::InvalidModule:
+            state.nrWasmPoolRefusedInvalid++;
+            break;
+        case WasmPoolRefusal::MultipleMemories:
+            state.nrWasmPoolRefusedMemories++;
+            break;
+        case WasmPoolRefusal::PassiveSegments:
+            state.nrWasmPoolRefusedSegments++;
+            break;
+        case WasmPoolRefusal::Grown:
+            state.nrWasmPoolRefusedGrown++;
+            break;
+        }
+        return;
+    }
+    auto idle(idleInstances.lock());
+    if (idle->size() < maxIdleWasmInstances)
+        idle->push_back(std::move(instance));
+}
+
+/**
+ * Cache of compiled WASM modules, keyed by the hash of the module's
+ * contents so that identical modules at different paths share one
+ * compilation. Concurrent requests for a module that is still being
+ * compiled wait for that compilation rather than starting their own.
+ *
+ * With Boehm GC, modules that were not used during an entire GC cycle
+ * are evicted (together with their pooled instances) the next time the
+ * cache is consulted, so that memory pressure on the evaluator also
+ * releases WASM code and linear memories.
+ */
+struct WasmModuleCache
+{
+    /**
+     * Content hashes of the WASM files seen so far, so that repeated
+     * calls don't re-read and re-hash the file.
+     */
+    boost::concurrent_flat_map<SourcePath, Hash> pathToHash;
+
+    struct Entry
+    {
+        std::shared_future<ref<NixWasmModule>> module;
+        size_t lastUsed = 0;
+    };
+
+    struct State
+    {
+        /**
+         * Keyed by the hash of the module and whether it was loaded
+         * into the engine that meters fuel.
+         */
+        std::map<std::pair<Hash, bool>, Entry> modules;
+        size_t lastSweep = 0;
+    };
+
+    Sync<State> state_;
+
+    static size_t currentGCCycle()
+    {
+#if NIX_USE_BOEHMGC
+        return getGCCycles();
+#else
+        return 0;
+#endif
+    }
+
+    /**
+     * Evict modules that were not used since the previous GC cycle.
+     */
+    void sweep(State & state, size_t now)
+    {
+        if (now == state.lastSweep)
+            return;
+        std::erase_if(state.modules, [&](const auto & i) {
+            return i.second.lastUsed < state.lastSweep
+                   && i.second.module.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        });
+        state.lastSweep = now;
+    }
+
+    ref<NixWasmModule> get(const SourcePath & wasmPath, bool fuel)
+    {
+        std::optional<std::string> contents;
+
+        std::optional<Hash> hash;
+        pathToHash.cvisit(wasmPath, [&](auto & i) { hash = i.second; });
+        if (!hash) {
+            contents = wasmPath.readFile();
+            hash = hashString(HashAlgorithm::SHA256, *contents);
+            pathToHash.emplace(wasmPath, *hash);
+        }
+
+        std::promise<ref<NixWasmModule>> promise;
+        std::shared_future<ref<NixWasmModule>> future;
+
+        {
+            auto now = currentGCCycle();
+            auto state(state_.lock());
+            sweep(*state, now);
+            auto [i, inserted] = state->modules.try_emplace({*hash, fuel});
+            i->second.lastUsed = now;
+            if (!inserted)
+                future = i->second.module;
+            else
+                i->second.module = promise.get_future().share();
+        }
+
+        if (future.valid())
+            return future.get();
+
+        try {
+            if (!contents)
+                contents = wasmPath.readFile();
+            auto mod = make_ref<NixWasmModule>(wasmPath, *hash, fuel, *contents);
+            promise.set_value(mod);
+            return mod;
+        } catch (...) {
+            /* Let waiters see the error, but don't cache it. */
+            promise.set_exception(std::current_exception());
+            state_.lock()->modules.erase({*hash, fuel});
+            throw;
+        }
+    }
+};
+
+ref<WasmModuleCache> makeWasmModuleCache()
+{
+    return make_ref<WasmModuleCache>();
+}
+
+static const char * wasmCallCacheSchema = R"sql(
+create table if not exists Calls (
+    module      text not null,
+    function    text not null,
+    system      text not null,
+    limits      text not null,
+    argument    text not null,
+    result      blob not null,
+    primary key (module, function, system, limits, argument)
+);
+)sql";
+
+/**
+ * Maximum size of the bulk encoding of an argument or result of a
+ * memoized `builtins.wasm` call.
+ */
+static constexpr size_t maxMemoizedValueSize = 1 << 20;
+
+/**
+ * Persistent cache of the results of `builtins.wasm` calls, used if
+ * `wasm-memoize` is enabled. Calls are identified by the hash of the
+ * module's contents, the function name, the current system (which
+ * the module can query), the fuel, time and memory limits (which
+ * determine whether the call succeeds) and the hash of the bulk
+ * encoding of the argument. Results are stored in their bulk
+ * encoding.
+ */
+struct WasmCallDb
+{
+    std::atomic_bool failed{false};
+
+    struct State
+    {
+        SQLite db;
+        SQLiteStmt insertCall;
+        SQLiteStmt queryCall;
+    };
+
+    Sync<State> _state;
+
+    WasmCallDb()
+    {
+        auto state(_state.lock());
+
+        auto cacheDir = std::filesystem::path(getCacheDir());
+        createDirs(cacheDir);
+
+        state->db = SQLite(cacheDir / "wasm-calls-v2.sqlite");
+        state->db.isCache();
+        state->db.exec(wasmCallCacheSchema);
+
+        state->insertCall.create(
+            state->db,
+            "insert or replace into Calls(module, function, system, limits, argument, result) values (?, ?, ?, ?, ?, ?)");
+
+        state->queryCall.create(
+            state->db,
+            "select result from Calls where module = ? and function = ? and system = ? and limits = ? and argument = ?");
+    }
+
+    template<typename T, typename F>
+    std::optional<T> doSQLite(F && fun)
+    {
+        if (failed)
+            return std::nullopt;
+        try {
+            return fun();
+        } catch (SQLiteError &) {
+            ignoreExceptionExceptInterrupt();
+            failed = true;
+            return std::nullopt;
+        }
+    }
+
+    std::optional<std::string> lookup(
+        const Hash & module,
+        std::string_view function,
+        std::string_view system,
+        std::string_view limits,
+        std::string_view argument)
+    {
+        return doSQLite<std::string>([&]() -> std::optional<std::string> {
+            auto state(_state.lock());
+            auto query(state->queryCall.use()(module.to_string(HashFormat::Base16, false))(function)(system)(limits)(
+                argument));
+            if (!query.next())
+                return std::nullopt;
+            return query.getBlob(0);
+        });
+    }
+
+    void insert(
+        const Hash & module,
+        std::string_view function,
+        std::string_view system,
+        std::string_view limits,
+        std::string_view argument,
+        std::string_view result)
+    {
+        doSQLite<bool>([&]() {
+            auto state(_state.lock());
+            state->insertCall.use()(module.to_string(HashFormat::Base16, false))(function)(system)(limits)(argument)(
+                    (const unsigned char *) result.data(), result.size())
+                .exec();
+            return true;
+        });
+    }
+};
+
+/**
+ * Return the call cache, or `nullptr` if it cannot be opened.
+ */
+static std::shared_ptr<WasmCallDb> getWasmCallDb()
+{
+    static std::shared_ptr<WasmCallDb> db = []() -> std::shared_ptr<WasmCallDb> {
+        try {
+            return std::make_shared<WasmCallDb>();
+        } catch (SQLiteError &) {
+            ignoreExceptionExceptInterrupt();
+            return nullptr;
+        }
+    }();
+    return db;
+}
+
 void prim_wasm(EvalState & state, const PosIdx pos, Value ** args, Value & v)
 {
     auto wasmPath = realisePath(state, pos, *args[0]);
@@ -781,41 +2211,54 @@ void prim_wasm(EvalState & state, const PosIdx pos, Value ** args, Value & v)
         std::string(state.forceStringNoCtx(*args[1], pos, "while evaluating the second argument of `builtins.wasm`"));
 
     try {
-        // Cache compiled modules (but not instances, since WASI state is per-instance)
-        // FIXME: make thread-safe.
-        // FIXME: make this a weak Boehm GC pointer so that it can be freed during GC.
-        static std::unordered_map<SourcePath, ref<NixWasmModule>> modules;
-
-        auto mod = modules.find(wasmPath);
-        if (mod == modules.end())
-            mod = modules.emplace(wasmPath, make_ref<NixWasmModule>(wasmPath)).first;
+        auto mod = state.wasmModuleCache->get(wasmPath, state.settings.wasmFuel.get() != 0);
+
+        /* Look for the result of a previous call with a structurally
+           equal argument. Only arguments that are fully evaluated
+           already are memoized, so that memoization doesn't force
+           parts of the argument that the module never looks at.
+           Arguments containing functions or string contexts are not
+           memoized either. */
+        std::shared_ptr<WasmCallDb> callDb;
+        std::optional<std::string> argHash;
+        std::string system, limits;
+        if (state.settings.wasmMemoize && (callDb = getWasmCallDb())) {
+            system = state.settings.getCurrentSystem();
+            limits =
+                fmt("fuel=%d;timeout=%d;memory=%d",
+                    state.settings.wasmFuel.get(),
+                    state.settings.wasmTimeout.get(),
+                    state.settings.wasmMaxMemory.get());
+            ValueVector handles;
+            if (auto arg = BulkCodec{state, handles}.encodeEvaluated(*args[2], maxMemoizedValueSize)) {
+                argHash = hashString(HashAlgorithm::SHA256, *arg).to_string(HashFormat::Base16, false);
+                if (auto res = callDb->lookup(mod->hash, functionName, system, limits, *argHash)) {
+                    state.nrWasmCallCacheHits++;
+                    v = *BulkCodec{state, handles}.decode(*res);
+                    return;
+                }
+            }
+            state.nrWasmCallCacheMisses++;
+        }
 
         debug("calling wasm module");
 
-        NixWasmInstance instance{state, mod->second};
+        auto instance = mod->acquireInstance(state);
 
-        // Initialize the WASM module (GHC RTS setup, etc.)
-        debug("calling _initialize");
-        auto initResult = instance.runFunction("_initialize", {});
-        debug("_initialize returned with %d results", initResult.size());
-        
-        // Check if hs_init is exported and call it (GHC WASM RTS init)
-        // hs_init(int *argc, char ***argv) - we pass NULL for both
-        auto hsInitExt = instance.instance->get(instance.wasmCtx, "hs_init");
-        if (hsInitExt) {
-            auto hsInit = std::get_if<Func>(&*hsInitExt);
-            if (hsInit) {
-                debug("calling hs_init");
-                unwrap(hsInit->call(instance.wasmCtx, {(int32_t) 0, (int32_t) 0}));
-                debug("hs_init complete");
-            }
-        }
-        
-        debug("calling nix_wasm_init_v1");
-        instance.runFunction("nix_wasm_init_v1", {});
-        debug("initialization complete");
+        // If the call throws, the instance is in an unknown state and
+        // is dropped rather than returned to the pool.
+        v = *instance->values.at(
+            instance->runFunction(functionName, {(int32_t) instance->addValue(args[2])}).at(0).i32());
+
+        if (argHash && !instance->impure)
+            if (auto res = BulkCodec{state, instance->values}.encodeEvaluated(v, maxMemoizedValueSize))
+                callDb->insert(mod->hash, functionName, system, limits, *argHash, *res);
+
+        state.nrWasmCalls++;
+        if (state.profiler.getNeededHooks().test(EvalProfiler::wasmCall))
+            state.profiler.wasmCallHook(state, wasmPath, functionName, instance->fuelConsumed);
 
-        v = *instance.values.at(instance.runFunction(functionName, {(int32_t) instance.addValue(args[2])}).at(0).i32());
+        mod->releaseInstance(std::move(instance));
     } catch (Error & e) {
         e.addTrace(state.positions[pos], "while executing the WASM function '%s' from '%s'", functionName, wasmPath);
         throw;
@@ -1,10 +1,16 @@
 #include "nix/expr/value-to-json.hh"
 #include "nix/expr/eval-inline.hh"
 #include "nix/store/store-api.hh"
+#include "nix/util/serialise.hh"
 #include "nix/util/signals.hh"
 #include "nix/expr/parallel-eval.hh"
 
+#include "json-scan.hh"
+
+#include <charconv>
+#include <cmath>
 #include <cstdlib>
+#include <deque>
 #include <iomanip>
 #include <nlohmann/json.hpp>
 
@@ -14,6 +20,366 @@ using json = nlohmann::json;
 
 #pragma GCC diagnostic ignored "-Wswitch-enum"
 
+namespace {
+
+using json_scan::findSpecial;
+
+/* The output of `toJSON` ends up in derivations, so it must stay
+   byte-for-byte what `nlohmann::json::dump()` produced, including the
+   messages for invalid UTF-8. */
+
+[[noreturn]] void throwUTF8Error(std::string_view msg, unsigned char c)
+{
+    throw JSONSerializationError(
+        "JSON serialization error: %s", fmt("[json.exception.type_error.316] %s: 0x%02X", msg, (unsigned int) c));
+}
+
+/**
+ * Return the length of the UTF-8 sequence at `s[i]`, or throw if it's
+ * invalid.
+ */
+size_t utf8Length(std::string_view s, size_t i)
+{
+    auto c = (unsigned char) s[i];
+    unsigned char lo = 0x80, hi = 0xbf;
+    size_t len;
+    if (c >= 0xc2 && c <= 0xdf)
+        len = 2;
+    else if (c >= 0xe0 && c <= 0xef) {
+        len = 3;
+        if (c == 0xe0)
+            lo = 0xa0;
+        else if (c == 0xed)
+            hi = 0x9f;
+    } else if (c >= 0xf0 && c <= 0xf4) {
+        len = 4;
+        if (c == 0xf0)
+            lo = 0x90;
+        else if (c == 0xf4)
+            hi = 0x8f;
+    } else
+        throwUTF8Error(fmt("invalid UTF-8 byte at index %d", i), c);
+    for (size_t j = i + 1; j < i + len; ++j) {
+        if (j == s.size())
+            throwUTF8Error("incomplete UTF-8 string; last byte", s.back());
+        auto d = (unsigned char) s[j];
+        if (d < lo || d > hi)
+            throwUTF8Error(fmt("invalid UTF-8 byte at index %d", j), d);
+        lo = 0x80;
+        hi = 0xbf;
+    }
+    return len;
+}
+
+void writeString(std::string & out, std::string_view s)
+{
+    out.reserve(out.size() + s.size() + 2);
+    out += '"';
+    auto p = s.data(), end = p + s.size();
+    while (true) {
+        auto q = findSpecial(p, end);
+        out.append(p, q);
+        p = q;
+        if (p == end)
+            break;
+        auto c = (unsigned char) *p;
+        if (c >= 0x80) {
+            auto len = utf8Length(s, p - s.data());
+            out.append(p, len);
+            p += len;
+            continue;
+        }
+        switch (c) {
+        case '"':
+            out += "\\\"";
+            break;
+        case '\\':
+            out += "\\\\";
+            break;
+        case '\b':
+            out += "\\b";
+            break;
+        case '\f':
+            out += "\\f";
+            break;
+        case '\n':
+            out += "\\n";
+            break;
+        case '\r':
+            out += "\\r";
+            break;
+        case '\t':
+            out += "\\t";
+            break;
+        default:
+            constexpr char hex[] = "0123456789abcdef";
+            out += "\\u00";
+            out += hex[c >> 4];
+            out += hex[c & 0xf];
+        }
+        p++;
+    }
+    out += '"';
+}
+
+void writeInt(std::string & out, NixInt::Inner n)
+{
+    char buf[24];
+    auto [end, ec] = std::to_chars(buf, buf + sizeof(buf), n);
+    out.append(buf, end);
+}
+
+/**
+ * Write `f` exactly like `nlohmann::json::dump()` does. This is the
+ * only use of nlohmann's internal API: its Grisu2 implementation, which
+ * doesn't always pick the same digits as `std::to_chars()`. The unit
+ * tests compare the result against `dump()`.
+ */
+void writeFloat(std::string & out, NixFloat f)
+{
+    if (!std::isfinite(f)) {
+        out += "null";
+        return;
+    }
+    char buf[64];
+    auto end = nlohmann::detail::to_chars(buf, buf + sizeof(buf), f);
+    out.append(buf, end);
+}
+
+/**
+ * Writes the JSON representation of values into `out` without
+ * building an intermediate `nlohmann::json`. `out` is flushed to
+ * `sink`, if any, whenever it gets large.
+ *
+ * When `parallel` is set, lists and attrsets with at least as many
+ * elements as there are evaluator threads are split into chunks of
+ * consecutive elements that are forced and serialized by the
+ * executor, each into its own buffer. The chunks are written to the
+ * output in order as they complete, and only a bounded number of them
+ * is in flight at any time, so the output doesn't have to be held in
+ * memory. Narrower values are serialized by the calling thread so
+ * that their elements can be split instead.
+ */
+class JSONWriter
+{
+    EvalState & state;
+    const bool strict;
+    const bool copyToStore;
+    NixStringContext & context;
+    Sink * const sink;
+    const bool parallel;
+
+    static constexpr size_t flushSize = 64 * 1024;
+
+    /**
+     * A chunk of elements serialized by a worker thread.
+     */
+    struct Chunk
+    {
+        std::string out;
+        NixStringContext context;
+        std::future<void> future;
+    };
+
+public:
+
+    std::string out;
+
+    JSONWriter(
+        EvalState & state, bool strict, bool copyToStore, NixStringContext & context, Sink * sink, bool parallel)
+        : state(state)
+        , strict(strict)
+        , copyToStore(copyToStore)
+        , context(context)
+        , sink(sink)
+        , parallel(parallel)
+    {
+    }
+
+    void flush()
+    {
+        if (sink && !out.empty()) {
+            (*sink)(out);
+            out.clear();
+        }
+    }
+
+    void write(Value & v, PosIdx pos)
+    {
+        checkInterrupt();
+
+        auto _level = state.addCallDepth(pos);
+
+        if (strict)
+            state.forceValue(v, pos);
+
+        switch (v.type()) {
+
+        case nInt:
+            writeInt(out, v.integer().value);
+            break;
+
+        case nBool:
+            out += v.boolean() ? "true" : "false";
+            break;
+
+        case nString:
+            copyContext(v, context);
+            writeString(out, v.string_view());
+            break;
+
+        case nPath:
+            if (copyToStore)
+                writeString(
+                    out, state.store->printStorePath(state.copyPathToStore(context, v.path(), v.determinePos(pos))));
+            else
+                writeString(out, v.path().path.abs());
+            break;
+
+        case nNull:
+            out += "null";
+            break;
+
+        case nAttrs: {
+            if (auto maybeString = state.tryAttrsToString(pos, v, context, false, false)) {
+                writeString(out, *maybeString);
+                break;
+            }
+            if (auto i = v.attrs()->get(state.s.outPath))
+                return write(*i->value, i->pos);
+            auto attrs = v.attrs()->lexicographicOrder(state.symbols);
+            out += '{';
+            writeElems(attrs.size(), [&](JSONWriter & w, size_t n) {
+                auto a = attrs[n];
+                writeString(w.out, state.symbols[a->name]);
+                w.out += ':';
+                try {
+                    w.write(*a->value, a->pos);
+                } catch (Error & e) {
+                    e.addTrace(
+                        state.positions[a->pos], HintFmt("while evaluating attribute '%1%'", state.symbols[a->name]));
+                    throw;
+                }
+            });
+            out += '}';
+            break;
+        }
+
+        case nList: {
+            auto list = v.listView();
+            out += '[';
+            writeElems(list.size(), [&](JSONWriter & w, size_t n) {
+                try {
+                    w.write(*list[n], pos);
+                } catch (Error & e) {
+                    e.addTrace(state.positions[pos], HintFmt("while evaluating list element at index %1%", n));
+                    throw;
+                }
+            });
+            out += ']';
+            break;
+        }
+
+        case nExternal:
+            try {
+                out += v.external()->printValueAsJSON(state, strict, context, copyToStore).dump();
+            } catch (nlohmann::json::exception & e) {
+                throw JSONSerializationError("JSON serialization error: %s", e.what());
+            }
+            break;
+
+        case nFloat:
+            writeFloat(out, v.fpoint());
+            break;
+
+        case nThunk:
+        case nFailed:
+        case nFunction:
+            state.error<TypeError>("cannot convert %1% to JSON", showType(v)).atPos(v.determinePos(pos)).debugThrow();
+        }
+    }
+
+private:
+
+    /**
+     * Write `n` comma-separated elements, where `writeElem(w, i)`
+     * writes element `i` to `w`.
+     */
+    template<typename F>
+    void writeElems(size_t n, const F & writeElem)
+    {
+        if (parallel && n >= state.executor->evalCores) {
+            writeElemsParallel(n, writeElem);
+            return;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            if (i)
+                out += ',';
+            writeElem(*this, i);
+            if (sink && out.size() >= flushSize)
+                flush();
+        }
+    }
+
+    template<typename F>
+    void writeElemsParallel(size_t n, const F & writeElem)
+    {
+        auto nrChunks = 4 * (size_t) state.executor->evalCores;
+        auto chunkSize = (n + nrChunks - 1) / nrChunks;
+        auto maxInFlight = 2 * (size_t) state.executor->evalCores;
+
+        std::deque<std::unique_ptr<Chunk>> inFlight;
+        std::atomic_bool failed{false};
+        size_t next = 0;
+
+        auto spawn = [&]() {
+            auto chunk = std::make_unique<Chunk>();
+            auto begin = next;
+            next = std::min(n, next + chunkSize);
+            auto futures = state.executor->spawn(
+                {{[this, &writeElem, &failed, chunk(chunk.get()), begin, end(next)]() {
+                      JSONWriter w(state, strict, copyToStore, chunk->context, nullptr, false);
+                      for (auto i = begin; i < end && !failed; ++i) {
+                          if (i > begin)
+                              w.out += ',';
+                          writeElem(w, i);
+                      }
+                      chunk->out = std::move(w.out);
+                  },
+                  0}});
+            chunk->future = std::move(futures.at(0));
+            inFlight.push_back(std::move(chunk));
+        };
+
+        try {
+            for (bool first = true; next < n || !inFlight.empty(); first = false) {
+                while (next < n && inFlight.size() < maxInFlight)
+                    spawn();
+                auto chunk = std::move(inFlight.front());
+                inFlight.pop_front();
+                chunk->future.get();
+                if (!first)
+                    out += ',';
+                if (sink) {
+                    flush();
+                    (*sink)(chunk->out);
+                } else
+                    out += chunk->out;
+                context.insert(chunk->context.begin(), chunk->context.end());
+            }
+        } catch (...) {
+            /* The remaining chunks refer to our stack, so wait for
+               them, but tell them to stop early. */
+            failed = true;
+            for (auto & chunk : inFlight)
+                chunk->future.wait();
+            throw;
+        }
+    }
+};
+
+} // namespace
+
 static void parallelForceDeep(EvalState & state, Value & v, PosIdx pos)
 {
     state.forceValue(v, pos);
@@ -145,6 +511,26 @@ json printValueAsJSON(
     return res;
 }
 
+void printValueAsJSON(
+    EvalState & state,
+    bool strict,
+    Value & v,
+    const PosIdx pos,
+    Sink & sink,
+    NixStringContext & context,
+    bool copyToStore)
+{
+    JSONWriter writer(
+        state,
+        strict,
+        copyToStore,
+        context,
+        &sink,
+        strict && state.executor->enabled && !Executor::amWorkerThread);
+    writer.write(v, pos);
+    writer.flush();
+}
+
 void printValueAsJSON(
     EvalState & state,
     bool strict,
@@ -154,11 +540,8 @@ void printValueAsJSON(
     NixStringContext & context,
     bool copyToStore)
 {
-    try {
-        str << printValueAsJSON(state, strict, v, pos, context, copyToStore);
-    } catch (nlohmann::json::exception & e) {
-        throw JSONSerializationError("JSON serialization error: %s", e.what());
-    }
+    LambdaSink sink([&](std::string_view data) { str << data; });
+    printValueAsJSON(state, strict, v, pos, sink, context, copyToStore);
 }
 
 json ExternalValueBase::printValueAsJSON(
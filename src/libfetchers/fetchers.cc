@@ -8,6 +8,7 @@
 #include "nix/util/url.hh"
 #include "nix/util/forwarding-source-accessor.hh"
 #include "nix/util/archive.hh"
+#include "nix/util/trace-events.hh"
 
 #include <nlohmann/json.hpp>
 
@@ -282,6 +283,8 @@ void Input::checkLocks(Input specified, Input & result)
 
 std::pair<ref<SourceAccessor>, Input> Input::getAccessor(const Settings & settings, Store & store) const
 {
+    TraceSpan span("fetch", traceEventsEnabled.load(std::memory_order_relaxed) ? to_string() : "");
+
     try {
         auto [accessor, result] = getAccessorUnchecked(settings, store);
 
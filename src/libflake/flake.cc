@@ -25,6 +25,7 @@
 #include "nix/flake/flake.hh"
 #include "nix/expr/eval.hh"
 #include "nix/expr/eval-cache.hh"
+#include "nix/expr/eval-dependencies.hh"
 #include "nix/expr/eval-settings.hh"
 #include "nix/flake/lockfile.hh"
 #include "nix/expr/eval-inline.hh"
@@ -972,10 +973,41 @@ static Value * requireInternalFile(EvalState & state, CanonPath path)
     return v;
 }
 
+/**
+ * Return the identity of a flake for the `eval-cache-dependencies`
+ * cache, i.e. something that doesn't change between versions of the
+ * flake.
+ */
+static std::string getDependencyIdentity(const LockedFlake & lockedFlake)
+{
+    return hashString(
+               HashAlgorithm::SHA256,
+               fmt("%s;%s", lockedFlake.flake.originalRef.to_string(), lockedFlake.flake.lockedRef.subdir))
+        .to_string(HashFormat::Base16, false);
+}
+
+/**
+ * Return the value of the `fingerprint` dependency, i.e. of the
+ * revision and other metadata of the flake.
+ */
+static std::string getDependencyFingerprint(EvalState & state, const LockedFlake & lockedFlake)
+{
+    auto fingerprint = lockedFlake.getFingerprint(*state.store, state.fetchSettings);
+    return fingerprint ? fingerprint->to_string(HashFormat::Base16, false) : "";
+}
+
 void callFlake(EvalState & state, const LockedFlake & lockedFlake, Value & vRes)
 {
     auto [lockFileStr, keyMap] = lockedFlake.lockFile.to_string();
 
+    std::string identity;
+    if (state.dependencies) {
+        identity = getDependencyIdentity(lockedFlake);
+        state.dependencies->add(
+            fmt("flake:%s:lock", identity),
+            hashString(HashAlgorithm::SHA256, lockFileStr).to_string(HashFormat::Base16, false));
+    }
+
     auto overrides = state.buildBindings(lockedFlake.nodePaths.size());
 
     for (auto & [node, sourcePath] : lockedFlake.nodePaths) {
@@ -995,6 +1027,26 @@ void callFlake(EvalState & state, const LockedFlake & lockedFlake, Value & vRes)
             false,
             !lockedNode && lockedFlake.flake.forceDirty);
 
+        /* Files of the flake are tracked individually, but its
+           revision and other metadata change with every version. */
+        if (state.dependencies && !lockedNode) {
+            state.dependencies->addRoot(identity, state.store->printStorePath(storePath));
+            auto fingerprint = getDependencyFingerprint(state, lockedFlake);
+            auto sourceInfo = state.buildBindings(vSourceInfo.attrs()->size());
+            for (auto & attr : *vSourceInfo.attrs()) {
+                if (attr.name == state.s.outPath)
+                    sourceInfo.insert(attr);
+                else
+                    mkDependentValue(
+                        state,
+                        sourceInfo.alloc(attr.name, attr.pos),
+                        attr.value,
+                        fmt("flake:%s:fingerprint", identity),
+                        fingerprint);
+            }
+            vSourceInfo.mkAttrs(sourceInfo);
+        }
+
         auto key = keyMap.find(node);
         assert(key != keyMap.end());
 
@@ -1066,8 +1118,27 @@ ref<eval_cache::EvalCache> openEvalCache(EvalState & state, ref<const LockedFlak
     if (fingerprint) {
         auto search = state.evalCaches.find(fingerprint.value());
         if (search == state.evalCaches.end()) {
+            std::optional<eval_cache::DependencyRoot> dependencyRoot;
+            if (state.dependencies) {
+                auto identity = getDependencyIdentity(*lockedFlake);
+                auto [storePath, subdir] = state.store->toStorePath(
+                    lockedFlake->nodePaths.at(lockedFlake->lockFile.root).path.abs());
+                dependencyRoot = eval_cache::DependencyRoot{
+                    .identity = identity,
+                    .sourcePath = storePath,
+                    .constants =
+                        {
+                            {"lock",
+                             hashString(HashAlgorithm::SHA256, lockedFlake->lockFile.to_string().first)
+                                 .to_string(HashFormat::Base16, false)},
+                            {"fingerprint", getDependencyFingerprint(state, *lockedFlake)},
+                        },
+                };
+            }
             search = state.evalCaches
-                         .emplace(fingerprint.value(), make_ref<eval_cache::EvalCache>(fingerprint, state, rootLoader))
+                         .emplace(
+                             fingerprint.value(),
+                             make_ref<eval_cache::EvalCache>(fingerprint, state, rootLoader, std::move(dependencyRoot)))
                          .first;
         }
         return search->second;
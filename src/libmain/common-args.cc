@@ -5,6 +5,7 @@
 #include "nix/util/config-global.hh"
 #include "nix/store/globals.hh"
 #include "nix/util/logging.hh"
+#include "nix/util/trace-events.hh"
 #include "nix/main/loggers.hh"
 #include "nix/util/util.hh"
 #include "nix/main/plugin.hh"
@@ -71,6 +72,15 @@ MixCommonArgs::MixCommonArgs(const std::string & programName)
         .handler = {[](std::string format) { setLogFormat(format); }},
     });
 
+    addFlag({
+        .longName = "trace-events",
+        .description =
+            "Write a timeline of evaluation, builds, substitutions and fetches to *file* in the Chrome trace event format, which can be viewed with [Perfetto](https://ui.perfetto.dev).",
+        .category = miscCategory,
+        .labels = {"file"},
+        .handler = {[](std::string file) { startTraceEvents(file); }},
+    });
+
     addFlag({
         .longName = "max-jobs",
         .shortName = 'j',
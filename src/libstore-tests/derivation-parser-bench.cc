@@ -4,6 +4,7 @@
 #include "nix/util/experimental-features.hh"
 #include "nix/util/environment-variables.hh"
 #include "nix/store/store-open.hh"
+#include "nix/util/hash.hh"
 #include <fstream>
 #include <sstream>
 
@@ -22,7 +23,57 @@ static void BM_ParseRealDerivationFile(benchmark::State & state, const std::stri
     ExperimentalFeatureSettings xpSettings;
 
     for (auto _ : state) {
-        auto drv = parseDerivation(*store, std::string(content), "test", xpSettings);
+        auto drv = parseDerivation(*store, std::string_view{content}, "test", xpSettings);
+        benchmark::DoNotOptimize(drv);
+    }
+    state.SetBytesProcessed(state.iterations() * content.size());
+}
+
+/**
+ * Generate a derivation shaped like a NixOS system closure or a large
+ * language package set, with `range(0)` input derivations, as many
+ * input sources, and environment variables holding long lists of store
+ * paths and multi-line scripts that need escaping.
+ */
+static std::string makeLargeDerivation(const Store & store, size_t inputs)
+{
+    auto makePath = [](std::string_view kind, size_t i, std::string_view suffix) {
+        return StorePath(hashString(HashAlgorithm::SHA1, fmt("%s-%d", kind, i)), fmt("%s-%d%s", kind, i, suffix));
+    };
+
+    Derivation drv;
+    drv.name = "large";
+    drv.platform = "x86_64-linux";
+    drv.builder = store.printStorePath(makePath("bash", 0, "")) + "/bin/bash";
+    drv.args = {"-e", store.printStorePath(makePath("builder", 0, ".sh"))};
+    drv.outputs.insert_or_assign("out", DerivationOutput::InputAddressed{.path = makePath("large", 0, "")});
+
+    std::string paths, script;
+    for (size_t i = 0; i < inputs; ++i) {
+        auto drvPath = makePath("dep", i, ".drv");
+        drv.inputDrvs.map[drvPath].value = {"out", "dev"};
+        auto src = makePath("src", i, "");
+        drv.inputSrcs.insert(src);
+        paths += store.printStorePath(src) + " ";
+        script += fmt("echo \"building %s\"\n\tcp -r $src/%d $out\n", drvPath.to_string(), i);
+        if (i % 16 == 0)
+            drv.env.insert_or_assign(fmt("var%d", i), fmt("value of variable %d", i));
+    }
+    drv.env.insert_or_assign("paths", paths);
+    drv.env.insert_or_assign("buildCommand", script);
+
+    return drv.unparse(store, /*maskOutputs=*/false);
+}
+
+// Benchmark parsing large derivations
+static void BM_ParseLargeDerivation(benchmark::State & state)
+{
+    auto store = openStore("dummy://");
+    ExperimentalFeatureSettings xpSettings;
+    auto content = makeLargeDerivation(*store, state.range(0));
+
+    for (auto _ : state) {
+        auto drv = parseDerivation(*store, std::string_view{content}, "large", xpSettings);
         benchmark::DoNotOptimize(drv);
     }
     state.SetBytesProcessed(state.iterations() * content.size());
@@ -58,3 +109,4 @@ BENCHMARK_CAPTURE(
     BM_UnparseRealDerivationFile, hello, getEnvNonEmpty("_NIX_TEST_UNIT_DATA").value() + "/derivation/hello.drv");
 BENCHMARK_CAPTURE(
     BM_UnparseRealDerivationFile, firefox, getEnvNonEmpty("_NIX_TEST_UNIT_DATA").value() + "/derivation/firefox.drv");
+BENCHMARK(BM_ParseLargeDerivation)->Arg(100)->Arg(1000)->Arg(10000);
@@ -23,6 +23,24 @@ TEST_F(DynDerivationTest, BadATerm_oldVersionDynDeps)
         FormatError);
 }
 
+TEST_F(DerivationTest, BadATerm_unterminatedString)
+{
+    ASSERT_THROW(parseDerivation(*store, std::string{"Derive([(\"out"}, "whatever", mockXpSettings), FormatError);
+    ASSERT_THROW(parseDerivation(*store, std::string{"Derive([(\"out\\"}, "whatever", mockXpSettings), FormatError);
+    ASSERT_THROW(parseDerivation(*store, std::string{"Derive([(\"out\\\""}, "whatever", mockXpSettings), FormatError);
+}
+
+TEST_F(DerivationTest, ATerm_escapes)
+{
+    auto drv = parseDerivation(
+        *store,
+        std::string{R"(Derive([],[],[],"x86_64-linux","/bin/sh",["a\"b","c\\","\n\t\r\x"],[("plain","value")]))"},
+        "whatever",
+        mockXpSettings);
+    ASSERT_EQ(drv.args, (Strings{"a\"b", "c\\", "\n\t\rx"}));
+    ASSERT_EQ(drv.env, (StringPairs{{"plain", "value"}}));
+}
+
 #define MAKE_OUTPUT_JSON_TEST_P(FIXTURE)                                \
     TEST_P(FIXTURE, from_json)                                          \
     {                                                                   \
@@ -0,0 +1,70 @@
+#include "nix/store/drv-hash-disk-cache.hh"
+#include "nix/store/store-dir-config.hh"
+#include "nix/util/file-system.hh"
+
+#include <gtest/gtest.h>
+
+namespace nix {
+
+TEST(DrvHashDiskCacheImpl, create_and_read)
+{
+    auto tmpDir = createTempDir();
+    AutoDelete delTmpDir(tmpDir);
+    auto dbPath(tmpDir / "test-drv-hash-disk-cache.sqlite");
+
+    Path storeDir = "/nix/store", otherStoreDir = "/other/store";
+    StoreDirConfig store{storeDir}, otherStore{otherStoreDir};
+
+    StorePath regular{"g1w7hy3qg1w7hy3qg1w7hy3qg1w7hy3q-regular.drv"};
+    StorePath deferred{"g1w7hy3qg1w7hy3qg1w7hy3qg1w7hy3q-deferred.drv"};
+
+    DrvHash regularHash{
+        .hashes =
+            {
+                {"out", hashString(HashAlgorithm::SHA256, "out")},
+                {"dev", hashString(HashAlgorithm::SHA256, "dev")},
+            },
+        .kind = DrvHash::Kind::Regular,
+    };
+
+    DrvHash deferredHash{
+        .hashes = {{"out", hashString(HashAlgorithm::SHA256, "out")}},
+        .kind = DrvHash::Kind::Deferred,
+    };
+
+    {
+        auto cache = getTestDrvHashDiskCache(dbPath.string());
+        ASSERT_FALSE(cache->lookup(store, regular));
+        cache->upsert(store, regular, regularHash);
+        cache->upsert(store, deferred, deferredHash);
+
+        // Pending writes are visible to this process before they're flushed.
+        ASSERT_TRUE(cache->lookup(store, regular));
+    }
+
+    // Pending writes are not flushed when the cache is destroyed.
+    {
+        auto cache = getTestDrvHashDiskCache(dbPath.string());
+        ASSERT_FALSE(cache->lookup(store, regular));
+        cache->upsert(store, regular, regularHash);
+        cache->upsert(store, deferred, deferredHash);
+        cache->flush();
+    }
+
+    {
+        auto cache = getTestDrvHashDiskCache(dbPath.string());
+
+        auto hash = cache->lookup(store, regular);
+        ASSERT_TRUE(hash);
+        ASSERT_EQ(hash->kind, DrvHash::Kind::Regular);
+        ASSERT_EQ(hash->hashes, regularHash.hashes);
+
+        // Deferred hashes are never cached.
+        ASSERT_FALSE(cache->lookup(store, deferred));
+
+        // Entries are specific to a store directory.
+        ASSERT_FALSE(cache->lookup(otherStore, regular));
+    }
+}
+
+} // namespace nix
@@ -13,6 +13,7 @@
   rapidcheck,
   gtest,
   gbenchmark,
+  wasmtime,
   runCommand,
 
   # Configuration Options
@@ -52,6 +53,7 @@ mkMesonExecutable (finalAttrs: {
   ]
   ++ lib.optionals withBenchmarks [
     gbenchmark
+    wasmtime
   ];
 
   mesonFlags = [
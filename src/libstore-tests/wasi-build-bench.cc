@@ -0,0 +1,92 @@
+#include <benchmark/benchmark.h>
+#include "nix/store/derivations.hh"
+#include "nix/store/globals.hh"
+#include "nix/store/store-open.hh"
+#include "nix/store/wasm.hh"
+#include "nix/util/file-system.hh"
+
+#include <thread>
+
+using namespace nix;
+
+/**
+ * A wasm32-wasip1 builder that only writes the file given as its first
+ * argument, relative to the preopened store directory.
+ */
+static constexpr std::string_view tinyBuilderWat = R"(
+(module
+  (import "wasi_snapshot_preview1" "args_get" (func $args_get (param i32 i32) (result i32)))
+  (import "wasi_snapshot_preview1" "path_open"
+    (func $path_open (param i32 i32 i32 i32 i32 i64 i64 i32 i32) (result i32)))
+  (import "wasi_snapshot_preview1" "proc_exit" (func $proc_exit (param i32)))
+
+  (memory (export "memory") 1)
+
+  (func (export "_start")
+    (local $i i32) (local $name i32) (local $c i32)
+    (drop (call $args_get (i32.const 64) (i32.const 1024)))
+    (local.set $name (local.tee $i (i32.load (i32.const 68))))
+    (block $done
+      (loop $next
+        (br_if $done (i32.eqz (local.tee $c (i32.load8_u (local.get $i)))))
+        (if (i32.eq (local.get $c) (i32.const 47))
+          (then (local.set $name (i32.add (local.get $i) (i32.const 1)))))
+        (local.set $i (i32.add (local.get $i) (i32.const 1)))
+        (br $next)))
+    (if (call $path_open (i32.const 3) (i32.const 0) (local.get $name) (i32.sub (local.get $i) (local.get $name))
+          (i32.const 9) (i64.const 0x40) (i64.const 0) (i32.const 0) (i32.const 16))
+      (then (call $proc_exit (i32.const 1))))))
+)";
+
+/**
+ * Build `nrBuilds` distinct derivations that share one WASI builder,
+ * measuring the per-build overhead of the WASI derivation builder.
+ */
+static void BM_WasiTinyBuilds(benchmark::State & bstate)
+{
+    auto nrBuilds = bstate.range(0);
+
+    auto tmpDir = createTempDir();
+    AutoDelete delTmpDir(tmpDir);
+
+    settings.buildUsersGroup = "";
+    settings.maxBuildJobs = std::max(1u, std::thread::hardware_concurrency());
+
+    auto store = openStore(fmt("local?root=%s", (tmpDir / "root").string()));
+
+    auto wasm = unwrap(wasmtime::wat2wasm(tinyBuilderWat));
+    StringSource wasmSource(std::string_view((const char *) wasm.data(), wasm.size()));
+    auto builderPath = store->addToStoreFromDump(
+        wasmSource, "builder.wasm", FileSerialisationMethod::Flat, ContentAddressMethod::Raw::Flat);
+
+    size_t round = 0;
+
+    for (auto _ : bstate) {
+        bstate.PauseTiming();
+        std::vector<DerivedPath> paths;
+        for (int64_t n = 0; n < nrBuilds; ++n) {
+            Derivation drv;
+            drv.name = fmt("tiny-%d-%d", round, n);
+            drv.platform = "wasm32-wasip1";
+            drv.builder = store->printStorePath(builderPath);
+            drv.args = {hashPlaceholder("out")};
+            drv.inputSrcs = {builderPath};
+            drv.outputs.insert_or_assign("out", DerivationOutput::Deferred{});
+            drv.env.insert_or_assign("out", "");
+            drv.fillInOutputPaths(*store);
+            paths.push_back(
+                DerivedPath::Built{
+                    .drvPath = makeConstantStorePathRef(writeDerivation(*store, drv)),
+                    .outputs = OutputsSpec::All{},
+                });
+        }
+        ++round;
+        bstate.ResumeTiming();
+
+        store->buildPaths(paths);
+    }
+
+    bstate.SetItemsProcessed(bstate.iterations() * nrBuilds);
+}
+
+BENCHMARK(BM_WasiTinyBuilds)->Arg(100)->Unit(benchmark::kMillisecond)->UseRealTime();
@@ -544,13 +544,17 @@ Goal::Co DerivationBuildingGoal::tryToBuild()
 
     Descriptor builderOut;
 
+    /* Builds that run inside this process (rather than in a child
+       process) are limited by `max-wasi-jobs` instead of `max-jobs`. */
+    bool inProcess = !externalBuilder && buildsInProcess(*drv);
+
     // Will continue here while waiting for a build user below
     while (true) {
 
-        unsigned int curBuilds = worker.getNrLocalBuilds();
-        if (curBuilds >= settings.maxBuildJobs) {
+        if (inProcess ? worker.getNrInProcessBuilds() >= settings.maxWasiJobs
+                      : worker.getNrLocalBuilds() >= settings.maxBuildJobs) {
             outputLocks.unlock();
-            co_await waitForBuildSlot();
+            co_await waitForBuildSlot(inProcess);
             co_return tryToBuild();
         }
 
@@ -662,7 +666,7 @@ Goal::Co DerivationBuildingGoal::tryToBuild()
 
     actLock.reset();
 
-    worker.childStarted(shared_from_this(), {builderOut}, true, true);
+    worker.childStarted(shared_from_this(), {builderOut}, !inProcess, true, inProcess);
 
     started();
     co_await Suspend{};
@@ -220,9 +220,9 @@ Goal::Co Goal::waitForAWhile()
     co_return Return{};
 }
 
-Goal::Co Goal::waitForBuildSlot()
+Goal::Co Goal::waitForBuildSlot(bool inProcess)
 {
-    worker.waitForBuildSlot(shared_from_this());
+    worker.waitForBuildSlot(shared_from_this(), inProcess);
     co_await Suspend{};
     co_return Return{};
 }
@@ -24,6 +24,7 @@ Worker::Worker(Store & store, Store & evalStore)
 {
     nrLocalBuilds = 0;
     nrSubstitutions = 0;
+    nrInProcessBuilds = 0;
     lastWokenUp = steady_time_point::min();
     permanentFailure = false;
     timedOut = false;
@@ -214,8 +215,17 @@ size_t Worker::getNrSubstitutions()
     return nrSubstitutions;
 }
 
+size_t Worker::getNrInProcessBuilds()
+{
+    return nrInProcessBuilds;
+}
+
 void Worker::childStarted(
-    GoalPtr goal, const std::set<MuxablePipePollState::CommChannel> & channels, bool inBuildSlot, bool respectTimeouts)
+    GoalPtr goal,
+    const std::set<MuxablePipePollState::CommChannel> & channels,
+    bool inBuildSlot,
+    bool respectTimeouts,
+    bool inProcess)
 {
     Child child;
     child.goal = goal;
@@ -224,7 +234,10 @@ void Worker::childStarted(
     child.timeStarted = child.lastOutput = steady_time_point::clock::now();
     child.inBuildSlot = inBuildSlot;
     child.respectTimeouts = respectTimeouts;
+    child.inProcess = inProcess;
     children.emplace_back(child);
+    if (inProcess)
+        nrInProcessBuilds++;
     if (inBuildSlot) {
         switch (goal->jobCategory()) {
         case JobCategory::Substitution:
@@ -266,6 +279,11 @@ void Worker::childTerminated(Goal * goal, bool wakeSleepers)
         }
     }
 
+    if (i->inProcess) {
+        assert(nrInProcessBuilds > 0);
+        nrInProcessBuilds--;
+    }
+
     children.erase(i);
 
     if (wakeSleepers) {
@@ -281,11 +299,12 @@ void Worker::childTerminated(Goal * goal, bool wakeSleepers)
     }
 }
 
-void Worker::waitForBuildSlot(GoalPtr goal)
+void Worker::waitForBuildSlot(GoalPtr goal, bool inProcess)
 {
     goal->trace("wait for build slot");
     bool isSubstitutionGoal = goal->jobCategory() == JobCategory::Substitution;
-    if ((!isSubstitutionGoal && getNrLocalBuilds() < settings.maxBuildJobs)
+    if ((inProcess && getNrInProcessBuilds() < settings.maxWasiJobs)
+        || (!inProcess && !isSubstitutionGoal && getNrLocalBuilds() < settings.maxBuildJobs)
         || (isSubstitutionGoal && getNrSubstitutions() < settings.maxSubstitutionJobs))
         wakeUp(goal); /* we can do it right away */
     else
@@ -1,5 +1,6 @@
 #include "nix/store/derivations.hh"
 #include "nix/store/downstream-placeholder.hh"
+#include "nix/store/drv-hash-disk-cache.hh"
 #include "nix/store/store-api.hh"
 #include "nix/store/globals.hh"
 #include "nix/util/types.hh"
@@ -230,53 +231,46 @@ static void expect(StringViewStream & str, char c)
     str.remaining.remove_prefix(1);
 }
 
-/* Read a C-style string from stream `str'. */
+/* Read a C-style string from stream `str'. Strings without escapes,
+   which are nearly all of them, are returned as a view into the input
+   rather than copied. */
 static BackedStringView parseString(StringViewStream & str)
 {
     expect(str, '"');
-    size_t start = 0;
-    size_t end = str.remaining.size();
-    const auto data = str.remaining.data();
-    while (start < end) {
-        auto idx = str.remaining.find('"', start);
-        if (idx == std::string_view::npos) {
-            break;
-        }
-        size_t pos = idx;
-        for (; pos > 0 && data[pos - 1] == '\\'; pos--)
-            ;
-        if ((idx - pos) % 2 == 0) { // even number of backslashes
-            end = idx;
-            break;
-        }
-        start = idx + 1;
-    }
+    const auto s = str.remaining;
 
-    start = 0;
-    const auto content = str.remaining.substr(start, end);
-    str.remaining.remove_prefix(end + 1);
+    /* Find the closing quote and check for escapes before it. Both
+       are `memchr()` searches, which libc vectorises. */
+    auto quote = s.find('"');
+    auto backslash = s.substr(0, quote).find('\\');
 
-    auto nextBackslash = content.find('\\', start);
-    if (nextBackslash == std::string_view::npos) {
-        return content;
+    if (backslash == s.npos) {
+        if (quote == s.npos)
+            throw FormatError("unterminated string in derivation");
+        str.remaining.remove_prefix(quote + 1);
+        return s.substr(0, quote);
     }
 
     std::string res;
-    res.reserve(end);
+    if (quote != s.npos)
+        res.reserve(quote);
+    size_t start = 0;
     do {
-        if (nextBackslash == end - 1) {
+        if (backslash + 1 == s.size())
             throw FormatError("unterminated string in derivation");
-        }
-        if (nextBackslash > start) {
-            res.append(&data[start], nextBackslash - start);
-        }
-        res.push_back(escapes[data[nextBackslash + 1]]);
-        start = nextBackslash + 2;
-        nextBackslash = content.find('\\', start);
-    } while (nextBackslash != std::string_view::npos);
-    if (end > start) {
-        res.append(&data[start], end - start);
-    }
+        res.append(s, start, backslash - start);
+        res.push_back(escapes[s[backslash + 1]]);
+        start = backslash + 2;
+        /* The quote we found was escaped, so look for the next one. */
+        if (start > quote)
+            quote = s.find('"', start);
+        backslash = s.substr(0, quote).find('\\', start);
+    } while (backslash != s.npos);
+
+    if (quote == s.npos)
+        throw FormatError("unterminated string in derivation");
+    res.append(s, start, quote - start);
+    str.remaining.remove_prefix(quote + 1);
     return res;
 }
 
@@ -306,12 +300,22 @@ static bool endOfList(StringViewStream & str)
     return false;
 }
 
-static StringSet parseStrings(StringViewStream & str, bool arePaths)
+static StringSet parseStrings(StringViewStream & str)
 {
     StringSet res;
     expect(str, '[');
+    /* Lists are written in sorted order, so hint the insertion. */
     while (!endOfList(str))
-        res.insert((arePaths ? parsePath(str) : parseString(str)).toOwned());
+        res.insert(res.end(), parseString(str).toOwned());
+    return res;
+}
+
+static StorePathSet parseStorePaths(const StoreDirConfig & store, StringViewStream & str)
+{
+    StorePathSet res;
+    expect(str, '[');
+    while (!endOfList(str))
+        res.insert(res.end(), store.parseStorePath(*parsePath(str)));
     return res;
 }
 
@@ -403,7 +407,7 @@ parseDerivedPathMapNode(const StoreDirConfig & store, StringViewStream & str, De
 {
     DerivedPathMap<StringSet>::ChildNode node;
 
-    auto parseNonDynamic = [&]() { node.value = parseStrings(str, false); };
+    auto parseNonDynamic = [&]() { node.value = parseStrings(str); };
 
     // Older derivation should never use new form, but newer
     // derivaiton can use old form.
@@ -418,7 +422,7 @@ parseDerivedPathMapNode(const StoreDirConfig & store, StringViewStream & str, De
             break;
         case '(':
             expect(str, '(');
-            node.value = parseStrings(str, false);
+            node.value = parseStrings(str);
             expect(str, ",["sv);
             while (!endOfList(str)) {
                 expect(str, '(');
@@ -445,6 +449,15 @@ Derivation parseDerivation(
     std::string && s,
     std::string_view name,
     const ExperimentalFeatureSettings & xpSettings)
+{
+    return parseDerivation(store, std::string_view{s}, name, xpSettings);
+}
+
+Derivation parseDerivation(
+    const StoreDirConfig & store,
+    std::string_view s,
+    std::string_view name,
+    const ExperimentalFeatureSettings & xpSettings)
 {
     Derivation drv;
     drv.name = name;
@@ -476,13 +489,15 @@ Derivation parseDerivation(
         throw Error("derivation does not start with 'Derive' or 'DrvWithVersion'");
     }
 
-    /* Parse the list of outputs. */
+    /* Parse the list of outputs. The ATerm writer emits outputs, input
+       derivations and environment variables in sorted order, so the
+       insertions below are hinted to append in constant time. */
     expect(str, '[');
     while (!endOfList(str)) {
         expect(str, '(');
         std::string id = parseString(str).toOwned();
         auto output = parseDerivationOutput(store, str, xpSettings);
-        drv.outputs.emplace(std::move(id), std::move(output));
+        drv.outputs.emplace_hint(drv.outputs.end(), std::move(id), std::move(output));
     }
 
     /* Parse the list of input derivations. */
@@ -492,12 +507,12 @@ Derivation parseDerivation(
         auto drvPath = parsePath(str);
         expect(str, ',');
         drv.inputDrvs.map.insert_or_assign(
-            store.parseStorePath(*drvPath), parseDerivedPathMapNode(store, str, version));
+            drv.inputDrvs.map.end(), store.parseStorePath(*drvPath), parseDerivedPathMapNode(store, str, version));
         expect(str, ')');
     }
 
     expect(str, ',');
-    drv.inputSrcs = store.parseStorePathSet(parseStrings(str, true));
+    drv.inputSrcs = parseStorePaths(store, str);
     expect(str, ',');
     drv.platform = parseString(str).toOwned();
     expect(str, ',');
@@ -518,7 +533,7 @@ Derivation parseDerivation(
         if (name == StructuredAttrs::envVarName) {
             drv.structuredAttrs = StructuredAttrs::parse(*std::move(value));
         } else {
-            drv.env.insert_or_assign(std::move(name), std::move(value).toOwned());
+            drv.env.insert_or_assign(drv.env.end(), std::move(name), std::move(value).toOwned());
         }
         expect(str, ')');
     }
@@ -872,18 +887,41 @@ DrvHashes drvHashes;
  */
 
 /* Look up the derivation by value and memoize the
-   `hashDerivationModulo` call.
+   `hashDerivationModulo` call, both in `drvHashes` and, for the
+   evaluator, in the persistent cache, which saves reading and hashing
+   the closure of the derivation again in later evaluations.
  */
-static const DrvHash pathDerivationModulo(Store & store, const StorePath & drvPath)
+static const DrvHash pathDerivationModulo(
+    Store & store, const StorePath & drvPath, DrvHashDiskCache * diskCache, const Derivation * drv = nullptr)
 {
     std::optional<DrvHash> hash;
     if (drvHashes.cvisit(drvPath, [&hash](const auto & kv) { hash.emplace(kv.second); })) {
         return *hash;
     }
-    auto h = hashDerivationModulo(store, store.readInvalidDerivation(drvPath), false);
+    /* A hit in the persistent cache skips reading the derivation, so
+       only trust it if the derivation is in the store. Such hits are
+       not recorded in `drvHashes`, which is also used when checking
+       and building derivations. */
+    if (diskCache && !drv) {
+        hash = diskCache->lookup(store, drvPath);
+        if (hash && store.isValidPath(drvPath)) {
+            drvHashDiskCacheStats.hits++;
+            return *hash;
+        }
+        drvHashDiskCacheStats.misses++;
+    }
+    hash = hashDerivationModulo(store, drv ? *drv : store.readInvalidDerivation(drvPath), false, diskCache);
+    if (diskCache)
+        diskCache->upsert(store, drvPath, *hash);
     // Cache it
-    drvHashes.insert_or_assign(drvPath, h);
-    return h;
+    drvHashes.insert_or_assign(drvPath, *hash);
+    return *hash;
+}
+
+DrvHash
+hashStoreDerivationModulo(Store & store, const StorePath & drvPath, const Derivation & drv, DrvHashDiskCache * diskCache)
+{
+    return pathDerivationModulo(store, drvPath, diskCache, &drv);
 }
 
 /* See the header for interface details. These are the implementation details.
@@ -903,7 +941,7 @@ static const DrvHash pathDerivationModulo(Store & store, const StorePath & drvPa
    don't leak the provenance of fixed outputs, reducing pointless cache
    misses as the build itself won't know this.
  */
-DrvHash hashDerivationModulo(Store & store, const Derivation & drv, bool maskOutputs)
+DrvHash hashDerivationModulo(Store & store, const Derivation & drv, bool maskOutputs, DrvHashDiskCache * diskCache)
 {
     auto type = drv.type();
 
@@ -939,7 +977,7 @@ DrvHash hashDerivationModulo(Store & store, const Derivation & drv, bool maskOut
 
     DerivedPathMap<StringSet>::ChildNode::Map inputs2;
     for (auto & [drvPath, node] : drv.inputDrvs.map) {
-        const auto & res = pathDerivationModulo(store, drvPath);
+        const auto & res = pathDerivationModulo(store, drvPath, diskCache);
         if (res.kind == DrvHash::Kind::Deferred)
             kind = DrvHash::Kind::Deferred;
         for (auto & outputName : node.value) {
@@ -1240,7 +1278,8 @@ std::optional<BasicDerivation> Derivation::tryResolve(
  * mismatch).
  */
 template<bool fillIn>
-static void processDerivationOutputPaths(Store & store, auto && drv, std::string_view drvName)
+static void processDerivationOutputPaths(
+    Store & store, auto && drv, std::string_view drvName, DrvHashDiskCache * diskCache = nullptr)
 {
     std::optional<DrvHash> hashesModulo;
 
@@ -1281,7 +1320,7 @@ static void processDerivationOutputPaths(Store & store, auto && drv, std::string
         auto hash = [&]<typename Output>(const Output & outputVariant) {
             if (!hashesModulo) {
                 // somewhat expensive so we do lazily
-                hashesModulo = hashDerivationModulo(store, drv, true);
+                hashesModulo = hashDerivationModulo(store, drv, true, diskCache);
             }
             switch (hashesModulo->kind) {
             case DrvHash::Kind::Regular: {
@@ -1380,9 +1419,9 @@ void Derivation::checkInvariants(Store & store) const
     processDerivationOutputPaths<false>(store, *this, name);
 }
 
-void Derivation::fillInOutputPaths(Store & store)
+void Derivation::fillInOutputPaths(Store & store, DrvHashDiskCache * diskCache)
 {
-    processDerivationOutputPaths<true>(store, *this, name);
+    processDerivationOutputPaths<true>(store, *this, name, diskCache);
 }
 
 Derivation Derivation::parseJsonAndValidate(Store & store, const nlohmann::json & json)
@@ -0,0 +1,277 @@
+#include "nix/store/drv-hash-disk-cache.hh"
+#include "nix/util/users.hh"
+#include "nix/util/sync.hh"
+#include "nix/store/sqlite.hh"
+#include "nix/store/store-dir-config.hh"
+
+#include <sqlite3.h>
+
+#include <boost/unordered/unordered_flat_map.hpp>
+
+#include "nix/util/strings.hh"
+
+namespace nix {
+
+DrvHashDiskCacheStats drvHashDiskCacheStats;
+
+static const char * schema = R"sql(
+
+create table if not exists DrvHashes (
+    storeDir  text not null,
+    drvPath   text not null,
+    hashes    text not null, -- space-separated list of <output>:<algo>:<base16 hash>
+    timestamp integer not null,
+    primary key (storeDir, drvPath)
+);
+
+create table if not exists LastPurge (
+    dummy            text primary key,
+    value            integer
+);
+
+)sql";
+
+class DrvHashDiskCacheImpl : public DrvHashDiskCache
+{
+public:
+
+    /* How often to purge old entries from the cache. */
+    const int purgeInterval = 24 * 3600;
+
+    /* How long to keep entries. Since entries never become stale,
+       this only limits the size of the cache. */
+    const int maxAge = 90 * 24 * 3600;
+
+    /* How many entries to insert per transaction. */
+    const size_t batchSize = 1024;
+
+    /* The number of shards of the lookup state. Each shard has its
+       own database connection, so that lookups from different
+       evaluator threads don't wait for each other. */
+    static constexpr size_t nrShards = 16;
+
+    std::atomic_bool failed{false};
+
+    Path dbPath;
+
+    struct Entry
+    {
+        std::string storeDir, drvPath, hashes;
+    };
+
+    struct Shard
+    {
+        /* Opened on first use, since most evaluations only look up
+           a few derivations. */
+        std::optional<SQLite> db;
+        SQLiteStmt queryHash;
+
+        /* Entries read from the database or added by this process,
+           keyed on `key()`. */
+        boost::unordered_flat_map<std::string, std::string> hashes;
+    };
+
+    std::array<Sync<Shard>, nrShards> shards;
+
+    struct State
+    {
+        SQLite db;
+        SQLiteStmt insertHash;
+        std::vector<Entry> pending;
+    };
+
+    Sync<State> _state;
+
+    DrvHashDiskCacheImpl(Path dbPath = (getCacheDir() / "drv-hashes-v1.sqlite").string())
+        : dbPath(dbPath)
+    {
+        try {
+            auto state(_state.lock());
+
+            createDirs(dirOf(dbPath));
+
+            state->db = SQLite(dbPath);
+
+            state->db.isCache();
+
+            state->db.exec(schema);
+
+            state->insertHash.create(
+                state->db,
+                "insert or replace into DrvHashes(storeDir, drvPath, hashes, timestamp) values (?, ?, ?, ?)");
+
+            /* Periodically purge old entries from the database. */
+            retrySQLite<void>([&]() {
+                auto now = time(0);
+
+                SQLiteStmt queryLastPurge(state->db, "select value from LastPurge");
+                auto queryLastPurge_(queryLastPurge.use());
+
+                if (!queryLastPurge_.next() || queryLastPurge_.getInt(0) < now - purgeInterval) {
+                    SQLiteStmt(state->db, "delete from DrvHashes where timestamp < ?").use()(now - maxAge).exec();
+
+                    debug("deleted %d entries from the derivation hash cache", sqlite3_changes(state->db));
+
+                    SQLiteStmt(state->db, "insert or replace into LastPurge(dummy, value) values ('', ?)")
+                        .use()(now)
+                        .exec();
+                }
+            });
+        } catch (Error &) {
+            /* The cache is only an optimisation, so carry on without it. */
+            ignoreExceptionExceptInterrupt(lvlWarn);
+            failed = true;
+        }
+    }
+
+    /**
+     * Run `fun`, disabling the cache for the rest of the process if
+     * the database can't be used.
+     */
+    template<typename F>
+    void doSQLite(F && fun)
+    {
+        if (failed)
+            return;
+        try {
+            fun();
+        } catch (SQLiteError &) {
+            ignoreExceptionExceptInterrupt(lvlWarn);
+            failed = true;
+        }
+    }
+
+    static std::string key(const StoreDirConfig & store, const StorePath & drvPath)
+    {
+        return store.storeDir + "/" + drvPath.to_string();
+    }
+
+    Sync<Shard> & getShard(const std::string & key)
+    {
+        return shards[std::hash<std::string>{}(key) % nrShards];
+    }
+
+    void flush(State & state)
+    {
+        if (state.pending.empty())
+            return;
+        retrySQLite<void>([&]() {
+            SQLiteTxn txn(state.db);
+            auto now = time(0);
+            for (auto & entry : state.pending)
+                state.insertHash.use()(entry.storeDir)(entry.drvPath)(entry.hashes)(now).exec();
+            txn.commit();
+        });
+        state.pending.clear();
+    }
+
+    void flush() override
+    {
+        doSQLite([&]() { flush(*_state.lock()); });
+    }
+
+    std::optional<DrvHash> lookup(const StoreDirConfig & store, const StorePath & drvPath) override
+    {
+        auto k = key(store, drvPath);
+        std::optional<std::string> hashes;
+
+        doSQLite([&]() {
+            auto shard(getShard(k).lock());
+
+            if (auto i = shard->hashes.find(k); i != shard->hashes.end()) {
+                hashes = i->second;
+                return;
+            }
+
+            if (!shard->db) {
+                shard->db.emplace(dbPath);
+                shard->queryHash.create(*shard->db, "select hashes from DrvHashes where storeDir = ? and drvPath = ?");
+            }
+
+            retrySQLite<void>([&]() {
+                auto queryHash(shard->queryHash.use()(store.storeDir)(std::string(drvPath.to_string())));
+                if (queryHash.next())
+                    hashes = queryHash.getStr(0);
+            });
+
+            if (hashes)
+                shard->hashes.insert_or_assign(std::move(k), *hashes);
+        });
+
+        if (!hashes)
+            return std::nullopt;
+
+        try {
+            DrvHash res{.kind = DrvHash::Kind::Regular};
+            for (auto & s : tokenizeString<Strings>(*hashes, " ")) {
+                auto colon = s.find(':');
+                if (colon == s.npos)
+                    throw Error("invalid entry '%s'", s);
+                res.hashes.insert_or_assign(s.substr(0, colon), Hash::parseAnyPrefixed(s.substr(colon + 1)));
+            }
+            return res;
+        } catch (Error & e) {
+            warn(
+                "ignoring invalid derivation hash cache entry for '%s': %s",
+                store.printStorePath(drvPath),
+                e.msg());
+            return std::nullopt;
+        }
+    }
+
+    void upsert(const StoreDirConfig & store, const StorePath & drvPath, const DrvHash & hash) override
+    {
+        /* Deferred hashes depend on content-addressed or impure
+           derivations, which are gated behind experimental features
+           that are checked when reading the derivation, so always
+           compute those. */
+        if (hash.kind != DrvHash::Kind::Regular)
+            return;
+
+        Strings hashes;
+        for (auto & [outputName, h] : hash.hashes)
+            hashes.push_back(outputName + ":" + h.to_string(HashFormat::Base16, true));
+
+        Entry entry{
+            .storeDir = store.storeDir,
+            .drvPath = std::string(drvPath.to_string()),
+            .hashes = concatStringsSep(" ", hashes),
+        };
+
+        {
+            auto k = key(store, drvPath);
+            getShard(k).lock()->hashes.insert_or_assign(std::move(k), entry.hashes);
+        }
+
+        doSQLite([&]() {
+            auto state(_state.lock());
+            state->pending.push_back(std::move(entry));
+            if (state->pending.size() >= batchSize)
+                flush(*state);
+        });
+    }
+};
+
+static std::atomic_bool drvHashDiskCacheCreated{false};
+
+ref<DrvHashDiskCache> getDrvHashDiskCache()
+{
+    static ref<DrvHashDiskCache> cache = []() {
+        drvHashDiskCacheCreated = true;
+        return make_ref<DrvHashDiskCacheImpl>();
+    }();
+    return cache;
+}
+
+void flushDrvHashDiskCache()
+{
+    if (drvHashDiskCacheCreated)
+        getDrvHashDiskCache()->flush();
+}
+
+ref<DrvHashDiskCache> getTestDrvHashDiskCache(Path dbPath)
+{
+    return make_ref<DrvHashDiskCacheImpl>(dbPath);
+}
+
+} // namespace nix
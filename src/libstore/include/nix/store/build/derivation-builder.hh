@@ -195,6 +195,13 @@ struct ExternalBuilder
 };
 
 #ifndef _WIN32 // TODO enable `DerivationBuilder` on Windows
+/**
+ * Whether `makeDerivationBuilder()` runs builds of `drv` on a thread
+ * in this process rather than in a child process. Such builds are
+ * limited by `max-wasi-jobs` rather than `max-jobs`.
+ */
+bool buildsInProcess(const BasicDerivation & drv);
+
 std::unique_ptr<DerivationBuilder> makeDerivationBuilder(
     LocalStore & store, std::unique_ptr<DerivationBuilderCallbacks> miscMethods, DerivationBuilderParams params);
 
@@ -480,7 +480,7 @@ protected:
     Co await(Goals waitees);
 
     Co waitForAWhile();
-    Co waitForBuildSlot();
+    Co waitForBuildSlot(bool inProcess = false);
     Co yield();
 };
 
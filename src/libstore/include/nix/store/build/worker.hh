@@ -51,6 +51,7 @@ struct Child
     std::set<MuxablePipePollState::CommChannel> channels;
     bool respectTimeouts;
     bool inBuildSlot;
+    bool inProcess;
     /**
      * Time we last got output on stdout/stderr
      */
@@ -104,6 +105,12 @@ private:
      */
     size_t nrSubstitutions;
 
+    /**
+     * Number of builds running on a thread of this process, see
+     * `max-wasi-jobs`.
+     */
+    size_t nrInProcessBuilds;
+
     /**
      * Maps used to prevent multiple instantiations of a goal for the
      * same derivation / path.
@@ -271,15 +278,23 @@ public:
      */
     size_t getNrSubstitutions();
 
+    /**
+     * Return the number of builds currently running in this process.
+     */
+    size_t getNrInProcessBuilds();
+
     /**
      * Registers a running child process.  `inBuildSlot` means that
-     * the process counts towards the jobs limit.
+     * the process counts towards the jobs limit.  `inProcess` means
+     * that the "child" is a build on a thread of this process, which
+     * counts towards the `max-wasi-jobs` limit instead.
      */
     void childStarted(
         GoalPtr goal,
         const std::set<MuxablePipePollState::CommChannel> & channels,
         bool inBuildSlot,
-        bool respectTimeouts);
+        bool respectTimeouts,
+        bool inProcess = false);
 
     /**
      * Unregisters a running child process.  `wakeSleepers` should be
@@ -291,9 +306,10 @@ public:
 
     /**
      * Put `goal` to sleep until a build slot becomes available (which
-     * might be right away).
+     * might be right away).  `inProcess` selects the slots of builds
+     * that run in this process.
      */
-    void waitForBuildSlot(GoalPtr goal);
+    void waitForBuildSlot(GoalPtr goal, bool inProcess = false);
 
     /**
      * Wait for any goal to finish.  Pretty indiscriminate way to
@@ -18,6 +18,7 @@ namespace nix {
 
 struct StoreDirConfig;
 struct AsyncPathWriter;
+class DrvHashDiskCache;
 
 /* Abstract syntax of derivations. */
 
@@ -407,9 +408,11 @@ struct Derivation : BasicDerivation
      * updates output paths in env vars.
      *
      * @param store The store to use for path computation
-     * @param drvName The derivation name (without .drv extension)
+     * @param diskCache If given, the hashes of input derivations are
+     *   looked up in and recorded to this persistent cache, see
+     *   `hashDerivationModulo()`.
      */
-    void fillInOutputPaths(Store & store);
+    void fillInOutputPaths(Store & store, DrvHashDiskCache * diskCache = nullptr);
 
     Derivation() = default;
 
@@ -477,6 +480,16 @@ Derivation parseDerivation(
     std::string_view name,
     const ExperimentalFeatureSettings & xpSettings = experimentalFeatureSettings);
 
+/**
+ * Read a derivation from a buffer the caller keeps alive for the
+ * duration of the call, such as a memory-mapped file.
+ */
+Derivation parseDerivation(
+    const StoreDirConfig & store,
+    std::string_view s,
+    std::string_view name,
+    const ExperimentalFeatureSettings & xpSettings = experimentalFeatureSettings);
+
 /**
  * \todo Remove.
  *
@@ -552,8 +565,23 @@ void operator|=(DrvHash::Kind & self, const DrvHash::Kind & other) noexcept;
  * For regular derivations, it returns a single hash of the derivation
  * ATerm, after subderivations have been likewise expunged from that
  * derivation.
+ *
+ * If `diskCache` is given, the hashes of input derivations are looked
+ * up in and recorded to that persistent cache. Only the evaluator
+ * passes one: a cache hit skips reading the input derivation, which
+ * is not acceptable when checking a derivation's invariants or
+ * building it.
+ */
+DrvHash hashDerivationModulo(
+    Store & store, const Derivation & drv, bool maskOutputs, DrvHashDiskCache * diskCache = nullptr);
+
+/**
+ * `hashDerivationModulo(store, drv, false)` for the store derivation
+ * `drvPath` with contents `drv`, memoised in `drvHashes` and, if
+ * given, in `diskCache`.
  */
-DrvHash hashDerivationModulo(Store & store, const Derivation & drv, bool maskOutputs);
+DrvHash hashStoreDerivationModulo(
+    Store & store, const StorePath & drvPath, const Derivation & drv, DrvHashDiskCache * diskCache = nullptr);
 
 /**
  * Return a map associating each output to a hash that uniquely identifies its
@@ -0,0 +1,69 @@
+#pragma once
+///@file
+
+#include "nix/util/ref.hh"
+#include "nix/store/derivations.hh"
+
+#include <atomic>
+
+namespace nix {
+
+struct DrvHashDiskCacheStats
+{
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+};
+
+/**
+ * Counts the lookups of input derivations in the persistent cache in
+ * this process that saved reading the derivation, and those that
+ * didn't.
+ */
+extern DrvHashDiskCacheStats drvHashDiskCacheStats;
+
+/**
+ * A persistent cache of `hashDerivationModulo()` results, so that
+ * evaluations don't have to read and hash every derivation in the
+ * closure of the ones they create.
+ *
+ * Entries are keyed on the store directory and the path of the store
+ * derivation. That path is a content address of the derivation,
+ * including the paths of its input derivations, so the hash modulo is
+ * a function of the key and entries never become stale. Old entries
+ * are purged only to bound the size of the cache.
+ */
+class DrvHashDiskCache
+{
+public:
+
+    virtual ~DrvHashDiskCache() {}
+
+    virtual std::optional<DrvHash> lookup(const StoreDirConfig & store, const StorePath & drvPath) = 0;
+
+    /**
+     * Record the hash of `drvPath`. Writes are batched, so they may
+     * not be visible to other processes until `flush()` is called.
+     */
+    virtual void upsert(const StoreDirConfig & store, const StorePath & drvPath, const DrvHash & hash) = 0;
+
+    /**
+     * Write pending entries to the database. This is not done on
+     * destruction, since the singleton outlives the logger.
+     */
+    virtual void flush() = 0;
+};
+
+/**
+ * Return a singleton cache object that can be used concurrently by
+ * multiple threads.
+ */
+ref<DrvHashDiskCache> getDrvHashDiskCache();
+
+/**
+ * Flush the singleton cache, if it has been used.
+ */
+void flushDrvHashDiskCache();
+
+ref<DrvHashDiskCache> getTestDrvHashDiskCache(Path dbPath);
+
+} // namespace nix
@@ -184,6 +184,18 @@ public:
         )",
         {"substitution-max-jobs"}};
 
+    Setting<unsigned int> maxWasiJobs{
+        this,
+        256,
+        "max-wasi-jobs",
+        R"(
+          Maximum number of `wasm32-wasip1` builds that Nix runs in-process in parallel.
+          These builds run on a pool of threads rather than in a child process, so they don't take up one of the [`max-jobs`](#conf-max-jobs) build slots.
+          At most one build per CPU runs at a time; the others wait in the pool's queue.
+
+          This doesn't apply when [`build-users-group`](#conf-build-users-group) is set: WASI builds then run in a child process as a build user and count towards `max-jobs`.
+        )"};
+
     Setting<unsigned int> buildCores{
         this,
         0,
@@ -1058,6 +1070,28 @@ public:
           mismatch if the build isn't reproducible.
         )"};
 
+    Setting<bool> useDrvHashCache{
+        this,
+        true,
+        "derivation-hash-cache",
+        R"(
+          Whether to cache the hashes of store derivations that are used to
+          compute output paths in a local disk cache database, so that later
+          evaluations don't have to read and hash every derivation in the
+          closure of the derivations they instantiate again.
+
+          The cache is only used by evaluation. Checking a derivation when
+          it is added to the store, and building it, always hash its inputs
+          from the store derivations.
+
+          Since a store derivation's path determines its contents, entries
+          never become stale. To wipe the cache:
+
+          ```shell-session
+          $ rm $HOME/.cache/nix/drv-hashes-v*.sqlite*
+          ```
+        )"};
+
     Setting<bool> printMissing{
         this, true, "print-missing", "Whether to print what paths need to be built or downloaded."};
 
@@ -0,0 +1,61 @@
+#pragma once
+///@file
+
+#include "nix/util/error.hh"
+
+#include <wasmtime.hh>
+
+#include <atomic>
+#include <span>
+
+namespace nix {
+
+/**
+ * Return the value of a successful wasmtime result, or throw an
+ * `Error` carrying the wasmtime error message.
+ */
+template<typename T, typename E = Error>
+T unwrap(wasmtime::Result<T, E> && res)
+{
+    if (res)
+        return res.ok();
+    throw Error(res.err().message());
+}
+
+inline std::span<uint8_t> string2span(std::string_view s)
+{
+    return std::span<uint8_t>((uint8_t *) s.data(), s.size());
+}
+
+struct WasmCompileCacheStats
+{
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+};
+
+/**
+ * Hit/miss counters for `compileWasmModule()` in this process.
+ */
+extern WasmCompileCacheStats wasmCompileCacheStats;
+
+/**
+ * Compile a WASM module, using a persistent on-disk cache of
+ * precompiled artifacts in `~/.cache/nix/wasm-modules-v1`.
+ *
+ * Cache entries are keyed by the hash of the module's contents, the
+ * wasmtime version and `engineConfig`, which must uniquely identify
+ * the configuration of `engine` (wasmtime refuses to deserialize
+ * artifacts produced by an incompatible engine, but different
+ * configurations may still be compatible while performing
+ * differently).
+ *
+ * Errors reading or writing the cache are not fatal; the module is
+ * then simply compiled from scratch.
+ *
+ * @note Deserializing a precompiled artifact is only safe if it was
+ * produced by wasmtime, so the cache directory must not be writable by
+ * untrusted users.
+ */
+wasmtime::Module compileWasmModule(wasmtime::Engine & engine, std::string_view engineConfig, std::string_view wasm);
+
+} // namespace nix
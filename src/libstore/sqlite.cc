@@ -240,6 +240,12 @@ std::string SQLiteStmt::Use::getStr(int col)
     return s;
 }
 
+std::string SQLiteStmt::Use::getBlob(int col)
+{
+    auto data = (const char *) sqlite3_column_blob(stmt, col);
+    return std::string(data ? data : "", sqlite3_column_bytes(stmt, col));
+}
+
 int64_t SQLiteStmt::Use::getInt(int col)
 {
     // FIXME: detect nulls?
@@ -1165,11 +1165,37 @@ Derivation Store::derivationFromPath(const StorePath & drvPath)
     return readDerivation(drvPath);
 }
 
+/**
+ * Derivations at least this large are memory-mapped and parsed in
+ * place rather than read into a string. Below this, setting up the
+ * mapping costs more than copying the file.
+ */
+static constexpr uint64_t mmapDerivationThreshold = 128 * 1024;
+
 static Derivation readDerivationCommon(Store & store, const StorePath & drvPath, bool requireValidPath)
 {
     auto accessor = store.requireStoreObjectAccessor(drvPath, requireValidPath);
+    auto name = Derivation::nameFromPath(drvPath);
     try {
-        return parseDerivation(store, accessor->readFile(CanonPath::root), Derivation::nameFromPath(drvPath));
+        if (auto physicalPath = accessor->getPhysicalPath(CanonPath::root)) {
+            auto st = accessor->maybeLstat(CanonPath::root);
+            if (st && st->fileSize && *st->fileSize >= mmapDerivationThreshold) {
+                /* `readFile()` hands the whole mapping to the sink in
+                   one call, or the contents in chunks if the file
+                   can't be mapped. */
+                std::optional<Derivation> drv;
+                std::string contents;
+                LambdaSink sink([&](std::string_view data) {
+                    if (!drv && contents.empty() && data.size() == *st->fileSize)
+                        drv = parseDerivation(store, data, name);
+                    else
+                        contents.append(data);
+                });
+                readFile(physicalPath->string(), sink);
+                return drv ? std::move(*drv) : parseDerivation(store, std::move(contents), name);
+            }
+        }
+        return parseDerivation(store, accessor->readFile(CanonPath::root), name);
     } catch (FormatError & e) {
         throw Error("error parsing derivation '%s': %s", store.printStorePath(drvPath), e.msg());
     }
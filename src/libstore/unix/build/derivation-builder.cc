@@ -233,6 +233,14 @@ public:
 
 protected:
 
+    /**
+     * Whether the builder must run as a build user.
+     */
+    virtual bool needsBuildUser()
+    {
+        return useBuildUsers();
+    }
+
     /**
      * Acquire a build user lock. Return nullptr if no lock is available.
      */
@@ -307,6 +315,16 @@ protected:
      */
     virtual void startChild();
 
+    /**
+     * Called by unprepareBuild() after the builder has closed its end
+     * of the log pipe. Make sure the builder is gone and return its
+     * wait status.
+     */
+    virtual int reapChild()
+    {
+        return pid.kill();
+    }
+
 #if NIX_WITH_AWS_AUTH
     /**
      * Pre-resolve AWS credentials for S3 URLs in builtin:fetchurl.
@@ -513,7 +531,7 @@ SingleDrvOutputs DerivationBuilderImpl::unprepareBuild()
        to have terminated.  In fact, the builder could also have
        simply have closed its end of the pipe, so just to be sure,
        kill it. */
-    int status = pid.kill();
+    int status = reapChild();
 
     debug("builder process for '%s' finished", store.printStorePath(drvPath));
 
@@ -708,7 +726,7 @@ static void checkNotWorldWritable(std::filesystem::path path)
 
 std::optional<Descriptor> DerivationBuilderImpl::startBuild()
 {
-    if (useBuildUsers()) {
+    if (needsBuildUser()) {
         if (!buildUser)
             buildUser = getBuildUser();
 
@@ -2000,6 +2018,13 @@ StorePath DerivationBuilderImpl::makeFallbackPath(const StorePath & path)
 
 namespace nix {
 
+bool buildsInProcess(const BasicDerivation & drv)
+{
+    /* A thread can't switch to a build user, so where build users
+       are configured, WASI builders run in a child process. */
+    return drv.platform == "wasm32-wasip1" && !useBuildUsers();
+}
+
 std::unique_ptr<DerivationBuilder> makeDerivationBuilder(
     LocalStore & store, std::unique_ptr<DerivationBuilderCallbacks> miscMethods, DerivationBuilderParams params)
 {
@@ -2028,9 +2053,12 @@ std::unique_ptr<DerivationBuilder> makeDerivationBuilder(
             useSandbox = params.drv.type().isSandboxed() && !params.drvOptions.noChroot;
     }
 
-    if (params.drv.platform == "wasm32-wasip1")
+    if (buildsInProcess(params.drv))
         return std::make_unique<WasiDerivationBuilder>(store, std::move(miscMethods), std::move(params));
 
+    if (params.drv.platform == "wasm32-wasip1")
+        return std::make_unique<ForkingWasiDerivationBuilder>(store, std::move(miscMethods), std::move(params));
+
     if (store.storeDir != store.config->realStoreDir.get()) {
 #ifdef __linux__
         useSandbox = true;
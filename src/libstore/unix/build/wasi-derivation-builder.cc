@@ -1,24 +1,348 @@
-#include <wasmtime.hh>
+#include "nix/store/wasm.hh"
+#include "nix/util/lru-cache.hh"
+#include "nix/util/sync.hh"
+
+#include <future>
+#include <queue>
+#include <thread>
+
+#include <sys/stat.h>
 
 namespace nix {
 
-// FIXME: cut&paste
-template<typename T, typename E = Error>
-T unwrap(wasmtime::Result<T, E> && res)
+/**
+ * Identifies the configuration of the engine returned by
+ * `getWasiBuilderEngine()` in the persistent compilation cache.
+ */
+static constexpr std::string_view wasiBuilderEngineConfig = "wasi-builder;pooling;cow;epoch";
+
+/**
+ * The engine shared by all WASI builds in this process, so that
+ * compiled builders and the pooling allocator's slots are reused
+ * across builds. Epoch interruption is only used to cancel builds:
+ * the epoch is advanced by `WasiBuildJob::cancel()`.
+ */
+static wasmtime::Engine & getWasiBuilderEngine()
+{
+    static wasmtime::Engine engine = []() {
+        wasmtime::Config config;
+        config.pooling_allocation_strategy(wasmtime::PoolAllocationConfig());
+        config.memory_init_cow(true);
+        config.epoch_interruption(true);
+        return wasmtime::Engine(std::move(config));
+    }();
+    return engine;
+}
+
+/**
+ * A builder module that has been compiled and type-checked against
+ * the WASI imports, so that starting a build only needs to instantiate
+ * it.
+ */
+struct WasiBuilderPre
+{
+    wasmtime_instance_pre_t * pre = nullptr;
+
+    WasiBuilderPre(std::string_view wasm)
+    {
+        auto & engine = getWasiBuilderEngine();
+
+        auto module = compileWasmModule(engine, wasiBuilderEngineConfig, wasm);
+
+        wasmtime::Linker linker(engine);
+        unwrap(linker.define_wasi());
+
+        if (auto error = wasmtime_linker_instantiate_pre(linker.capi(), module.capi(), &pre))
+            throw Error("cannot link WASI builder: %s", wasmtime::Error(error).message());
+    }
+
+    WasiBuilderPre(const WasiBuilderPre &) = delete;
+
+    ~WasiBuilderPre()
+    {
+        if (pre)
+            wasmtime_instance_pre_delete(pre);
+    }
+
+    wasmtime::Instance instantiate(wasmtime::Store::Context ctx) const
+    {
+        wasmtime_instance_t instance;
+        wasm_trap_t * trap = nullptr;
+        if (auto error = wasmtime_instance_pre_instantiate(pre, ctx.capi(), &instance, &trap))
+            throw Error("cannot instantiate WASI builder: %s", wasmtime::Error(error).message());
+        if (trap)
+            throw Error("cannot instantiate WASI builder: %s", wasmtime::Trap(trap).message());
+        return wasmtime::Instance(instance);
+    }
+};
+
+/**
+ * Maximum number of pre-linked builders kept for reuse by later
+ * builds, so that a long-running daemon doesn't accumulate every
+ * builder it has ever run.
+ */
+static constexpr size_t maxCachedWasiBuilders = 32;
+
+/**
+ * Return the pre-linked builder for the module `wasm`, compiling it
+ * if no recent build in this process has used it. Builders are keyed
+ * by the hash of their contents. Evicting a builder doesn't affect
+ * builds that are still using it.
+ */
+static std::shared_ptr<WasiBuilderPre> getWasiBuilderPre(std::string_view wasm)
 {
-    if (res)
-        return res.ok();
-    throw Error(res.err().message());
+    using Builders = LRUCache<Hash, std::shared_ptr<WasiBuilderPre>>;
+    static Sync<Builders> builders{Builders(maxCachedWasiBuilders)};
+
+    auto hash = hashString(HashAlgorithm::SHA256, wasm);
+
+    if (auto builder = builders.lock()->get(hash))
+        return *builder;
+
+    auto builder = std::make_shared<WasiBuilderPre>(wasm);
+    builders.lock()->upsert(hash, builder);
+    return builder;
 }
 
-// FIXME: cut&paste
-static std::span<uint8_t> string2span(std::string_view s)
+/**
+ * A WASI build that runs on a thread of `WasiBuildPool` rather than
+ * in a child process. It is shared between the `WasiDerivationBuilder`
+ * that started it and the pool, so it outlives whichever goes away
+ * first.
+ */
+struct WasiBuildJob
+{
+    std::shared_ptr<WasiBuilderPre> builderPre;
+
+    /**
+     * The store path of the builder, for error messages.
+     */
+    std::string builder;
+
+    std::vector<std::string> args;
+    std::vector<std::pair<std::string, std::string>> env;
+
+    struct Preopen
+    {
+        Path hostPath;
+        std::string guestPath;
+        bool writable;
+    };
+
+    /**
+     * The directories visible to the builder. The first two are
+     * always its view of the store and its temporary directory,
+     * which the builder sees as file descriptors 3 and 4.
+     */
+    std::vector<Preopen> preopens;
+
+    /**
+     * A named pipe that the builder's stdout and stderr are
+     * redirected to.
+     */
+    Path logPipe;
+
+    /**
+     * Our own write side of `logPipe`. The reader sees EOF once this
+     * is closed and the builder has exited.
+     */
+    AutoCloseFD logFd;
+
+    std::atomic<bool> cancelled{false};
+
+    /**
+     * The wait status of the build, as returned by `waitpid()` for
+     * builders that run in a child process.
+     */
+    std::promise<int> status;
+
+    /**
+     * Make the builder trap as soon as possible, or not start at all
+     * if it is still queued. Advancing the epoch makes every running
+     * builder call `epochDeadlineCallback()` at its next function
+     * entry or loop back-edge, which traps if its job was cancelled.
+     */
+    void cancel()
+    {
+        cancelled = true;
+        getWasiBuilderEngine().increment_epoch();
+    }
+
+    static wasmtime_error_t * epochDeadlineCallback(
+        wasmtime_context_t *, void * data, uint64_t * epochDeadlineDelta, wasmtime_update_deadline_kind_t * updateKind)
+    {
+        if (static_cast<WasiBuildJob *>(data)->cancelled)
+            return wasmtime_error_new("build cancelled");
+        *epochDeadlineDelta = 1;
+        *updateKind = WASMTIME_UPDATE_DEADLINE_CONTINUE;
+        return nullptr;
+    }
+
+    int execute()
+    {
+        using namespace wasmtime;
+
+        WasiConfig wasiConfig;
+        wasiConfig.argv(args);
+        wasiConfig.env(env);
+        if (!wasiConfig.stdout_file(logPipe) || !wasiConfig.stderr_file(logPipe))
+            throw Error("cannot redirect the output of WASI builder '%s'", builder);
+        for (auto & preopen : preopens) {
+            auto dirPerms = WASMTIME_WASI_DIR_PERMS_READ | (preopen.writable ? WASMTIME_WASI_DIR_PERMS_WRITE : 0);
+            auto filePerms = WASMTIME_WASI_FILE_PERMS_READ | (preopen.writable ? WASMTIME_WASI_FILE_PERMS_WRITE : 0);
+            if (!wasiConfig.preopen_dir(preopen.hostPath, preopen.guestPath, dirPerms, filePerms))
+                throw Error("cannot make '%s' available to WASI builder '%s'", preopen.hostPath, builder);
+        }
+
+        wasmtime::Store wasmStore(getWasiBuilderEngine());
+        unwrap(wasmStore.context().set_wasi(std::move(wasiConfig)));
+        wasmtime_store_epoch_deadline_callback(wasmStore.capi(), epochDeadlineCallback, this, nullptr);
+        wasmStore.context().set_epoch_deadline(1);
+
+        /* A cancellation that advanced the epoch before the deadline
+           was set wouldn't make the builder trap. */
+        if (cancelled)
+            return W_EXITCODE(0, SIGKILL);
+
+        auto instance = builderPre->instantiate(wasmStore.context());
+
+        auto startName = "_start";
+        auto ext = instance.get(wasmStore, startName);
+        if (!ext)
+            throw Error("WASM module '%s' does not export function '%s'", builder, startName);
+        auto fun = std::get_if<Func>(&*ext);
+        if (!fun)
+            throw Error("export '%s' of WASM module '%s' is not a function", startName, builder);
+
+        wasm_trap_t * trap = nullptr;
+        if (auto error =
+                wasmtime_func_call(wasmStore.context().capi(), &fun->capi(), nullptr, 0, nullptr, 0, &trap)) {
+            /* `proc_exit()` is reported as an error carrying the exit
+               status. */
+            int exitCode;
+            if (wasmtime_error_exit_status(error, &exitCode)) {
+                wasmtime_error_delete(error);
+                return W_EXITCODE(exitCode & 0xff, 0);
+            }
+            auto msg = wasmtime::Error(error).message();
+            if (cancelled)
+                return W_EXITCODE(0, SIGKILL);
+            throw Error("WASI builder '%s' failed: %s", builder, msg);
+        }
+        if (trap) {
+            auto msg = Trap(trap).message();
+            if (cancelled)
+                return W_EXITCODE(0, SIGKILL);
+            throw Error("WASI builder '%s' trapped: %s", builder, msg);
+        }
+
+        return W_EXITCODE(0, 0);
+    }
+
+    void run() noexcept
+    {
+        int res;
+        try {
+            res = cancelled ? W_EXITCODE(0, SIGKILL) : execute();
+        } catch (std::exception & e) {
+            try {
+                writeFull(logFd.get(), std::string(e.what()) + "\n", false);
+            } catch (...) {
+            }
+            res = W_EXITCODE(1, 0);
+        }
+
+        status.set_value(res);
+
+        /* Only signal EOF to the worker once the status is available,
+           so that `WasiDerivationBuilder::reapChild()` doesn't
+           block. */
+        try {
+            logFd.close();
+        } catch (...) {
+            ignoreExceptionExceptInterrupt();
+        }
+    }
+};
+
+/**
+ * The threads that run WASI builds. Since builds are CPU-bound, there
+ * are at most as many threads as cores; any further builds wait in
+ * the queue. The pool is never destroyed, so its threads are simply
+ * detached.
+ */
+struct WasiBuildPool
+{
+    struct State
+    {
+        std::queue<std::shared_ptr<WasiBuildJob>> pending;
+        size_t threads = 0;
+        size_t idle = 0;
+    };
+
+    Sync<State> state_;
+
+    std::condition_variable wakeup;
+
+    const size_t maxThreads = std::max(1u, std::thread::hardware_concurrency());
+
+    void enqueue(std::shared_ptr<WasiBuildJob> job)
+    {
+        auto state(state_.lock());
+        state->pending.push(std::move(job));
+        if (state->idle)
+            wakeup.notify_one();
+        else if (state->threads < maxThreads) {
+            state->threads++;
+            std::thread([this]() { runWorker(); }).detach();
+        }
+    }
+
+    void runWorker()
+    {
+        while (true) {
+            std::shared_ptr<WasiBuildJob> job;
+
+            {
+                auto state(state_.lock());
+                while (state->pending.empty()) {
+                    state->idle++;
+                    state.wait(wakeup);
+                    state->idle--;
+                }
+                job = std::move(state->pending.front());
+                state->pending.pop();
+            }
+
+            job->run();
+        }
+    }
+};
+
+static WasiBuildPool & getWasiBuildPool()
 {
-    return std::span<uint8_t>((uint8_t *) s.data(), s.size());
+    static auto pool = new WasiBuildPool;
+    return *pool;
 }
 
+/**
+ * Runs `wasm32-wasip1` builders on a `WasiBuildPool` thread in this
+ * process instead of forking. Wasmtime is the sandbox: the builder
+ * can only reach its preopened directories, i.e. a private directory
+ * standing in for the store (where it creates its outputs), its
+ * temporary directory and, read-only, its inputs.
+ */
 struct WasiDerivationBuilder : DerivationBuilderImpl
 {
+    std::shared_ptr<WasiBuildJob> job;
+
+    std::future<int> jobStatus;
+
+    /**
+     * The directory standing in for the store, see `storeView()`.
+     */
+    std::shared_ptr<AutoDelete> autoDelStoreView;
+
     WasiDerivationBuilder(
         LocalStore & store, std::unique_ptr<DerivationBuilderCallbacks> miscMethods, DerivationBuilderParams params)
         : DerivationBuilderImpl(store, std::move(miscMethods), std::move(params))
@@ -26,14 +350,185 @@ struct WasiDerivationBuilder : DerivationBuilderImpl
         // experimentalFeatureSettings.require(Xp::WasiBuilders);
     }
 
+    ~WasiDerivationBuilder()
+    {
+        /* The base class destructor only gets to call its own
+           `killChild()`. */
+        try {
+            killChild();
+        } catch (...) {
+            ignoreExceptionInDestructor();
+        }
+    }
+
+    bool needsBuildUser() override
+    {
+        /* The builder runs on a thread of this process, so it can't
+           run as a build user. Where build users are configured,
+           `makeDerivationBuilder()` uses `ForkingWasiDerivationBuilder`
+           instead. */
+        return false;
+    }
+
+    void setBuildTmpDir() override
+    {
+        /* Keep the store view and the log pipe out of the builder's
+           temporary directory. */
+        tmpDir = topTmpDir + "/build";
+        createDir(tmpDir, 0700);
+    }
+
+    Path tmpDirInSandbox() override
+    {
+        return settings.sandboxBuildDir;
+    }
+
+    /**
+     * The private directory that the builder sees as the store. Like
+     * the chroot of sandboxed builds, it lives in the store so that
+     * outputs can be renamed into place rather than copied.
+     */
+    Path storeView()
+    {
+        return store.toRealPath(drvPath) + ".wasi";
+    }
+
+    void startChild() override
+    {
+        auto job = std::make_shared<WasiBuildJob>();
+
+        job->builderPre = getWasiBuilderPre(readFile(realPathInHost(drv.builder)));
+        job->builder = drv.builder;
+
+        job->args.push_back(std::string(baseNameOf(drv.builder)));
+        for (auto & i : drv.args)
+            job->args.push_back(rewriteStrings(i, inputRewrites));
+
+        for (auto & [k, v] : env)
+            job->env.emplace_back(k, rewriteStrings(v, inputRewrites));
+
+        deletePath(storeView());
+        autoDelStoreView = std::make_shared<AutoDelete>(storeView());
+        createDir(storeView(), 0700);
+        job->preopens.push_back({storeView(), store.storeDir, true});
+        job->preopens.push_back({tmpDir, tmpDirInSandbox(), true});
+
+        /* WASI can only preopen directories, so inputs that are
+           files are copied into the store view. They are not
+           hardlinked, since the builder can write to the store
+           view. */
+        for (auto & path : inputPaths) {
+            auto realPath = store.toRealPath(path);
+            if (std::filesystem::symlink_status(realPath).type() == std::filesystem::file_type::directory)
+                job->preopens.push_back({realPath, store.printStorePath(path), false});
+            else
+                copyFile(realPath, storeView() + "/" + std::string(path.to_string()), false);
+        }
+
+        /* Capture the builder's output through a named pipe rather
+           than the pseudoterminal set up by startBuild(): wasmtime
+           opens it by name, which for a terminal could make it our
+           controlling terminal. */
+        job->logPipe = topTmpDir + "/log";
+        if (mkfifo(job->logPipe.c_str(), 0600) == -1)
+            throw SysError("creating log pipe '%s'", job->logPipe);
+
+        AutoCloseFD logReadSide = open(job->logPipe.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (!logReadSide)
+            throw SysError("opening log pipe '%s'", job->logPipe);
+
+        job->logFd = open(job->logPipe.c_str(), O_WRONLY | O_CLOEXEC);
+        if (!job->logFd)
+            throw SysError("opening log pipe '%s'", job->logPipe);
+
+        builderOut = std::move(logReadSide);
+
+        /* There is no sandbox to set up, so report that right away. */
+        writeFull(job->logFd.get(), "\2\n");
+
+        jobStatus = job->status.get_future();
+        this->job = job;
+
+        getWasiBuildPool().enqueue(std::move(job));
+    }
+
+    int reapChild() override
+    {
+        assert(job);
+
+        int status = jobStatus.get();
+        job.reset();
+
+        if (statusOk(status)) {
+            /* Move the outputs from the store view into the actual
+               store, where registerOutputs() expects them. */
+            for (auto & [_, scratchPath] : scratchOutputs) {
+                auto src = storeView() + "/" + std::string(scratchPath.to_string());
+                if (!pathExists(src))
+                    continue;
+                auto dst = store.toRealPath(scratchPath);
+                deletePath(dst);
+                std::filesystem::rename(src, dst);
+            }
+        }
+
+        autoDelStoreView.reset();
+
+        return status;
+    }
+
+    bool killChild() override
+    {
+        if (!job)
+            return false;
+
+        /* Don't wait for the job: the worker would block until it is
+           dequeued or, if it is running, until the builder traps. A
+           queued job is skipped by the pool, and a running one only
+           holds on to its own state. The running builder traps in
+           its epoch deadline callback as soon as it executes any WASM
+           code, so it can only overlap with whatever the worker does
+           next (like retrying the build) for the rest of the WASI
+           call it is in, if any. */
+        job->cancel();
+        job.reset();
+
+        activeBuildHandle.reset();
+
+        return true;
+    }
+};
+
+/**
+ * Runs `wasm32-wasip1` builders in a child process, so that they can
+ * run as a build user. This is used instead of `WasiDerivationBuilder`
+ * where build users are configured. The builder is compiled and
+ * linked in the parent, so that it is cached for subsequent builds.
+ */
+struct ForkingWasiDerivationBuilder : DerivationBuilderImpl
+{
+    std::shared_ptr<WasiBuilderPre> builderPre;
+
+    ForkingWasiDerivationBuilder(
+        LocalStore & store, std::unique_ptr<DerivationBuilderCallbacks> miscMethods, DerivationBuilderParams params)
+        : DerivationBuilderImpl(store, std::move(miscMethods), std::move(params))
+    {
+        // experimentalFeatureSettings.require(Xp::WasiBuilders);
+    }
+
+    void startChild() override
+    {
+        /* This also keeps wasmtime's compilation threads out of the
+           forked child. */
+        builderPre = getWasiBuilderPre(readFile(realPathInHost(drv.builder)));
+
+        DerivationBuilderImpl::startChild();
+    }
+
     void execBuilder(const Strings & args, const Strings & envStrs) override
     {
         using namespace wasmtime;
 
-        Engine engine;
-        Linker linker(engine);
-        unwrap(linker.define_wasi());
-
         WasiConfig wasiConfig;
         wasiConfig.inherit_stdin();
         wasiConfig.inherit_stdout();
@@ -51,12 +546,19 @@ struct WasiDerivationBuilder : DerivationBuilderImpl
                 WASMTIME_WASI_DIR_PERMS_READ | WASMTIME_WASI_DIR_PERMS_WRITE,
                 WASMTIME_WASI_FILE_PERMS_READ | WASMTIME_WASI_FILE_PERMS_WRITE))
             throw Error("cannot add store directory to WASI config");
-        // FIXME: add temp dir
+        if (!wasiConfig.preopen_dir(
+                tmpDir,
+                tmpDirInSandbox(),
+                WASMTIME_WASI_DIR_PERMS_READ | WASMTIME_WASI_DIR_PERMS_WRITE,
+                WASMTIME_WASI_FILE_PERMS_READ | WASMTIME_WASI_FILE_PERMS_WRITE))
+            throw Error("cannot add temporary directory to WASI config");
 
-        auto module = unwrap(Module::compile(engine, string2span(readFile(realPathInHost(drv.builder)))));
-        wasmtime::Store wasmStore(engine);
+        /* The child has its own copy of the engine's epoch, which
+           nothing advances: it is killed like any other builder. */
+        wasmtime::Store wasmStore(getWasiBuilderEngine());
         unwrap(wasmStore.context().set_wasi(std::move(wasiConfig)));
-        auto instance = unwrap(linker.instantiate(wasmStore, module));
+        wasmStore.context().set_epoch_deadline(1);
+        auto instance = builderPre->instantiate(wasmStore.context());
 
         auto startName = "_start";
         auto ext = instance.get(wasmStore, startName);
@@ -66,7 +568,16 @@ struct WasiDerivationBuilder : DerivationBuilderImpl
         if (!fun)
             throw Error("export '%s' of WASM module '%s' is not a function", startName, drv.builder);
 
-        unwrap(fun->call(wasmStore.context(), {}));
+        wasm_trap_t * trap = nullptr;
+        if (auto error =
+                wasmtime_func_call(wasmStore.context().capi(), &fun->capi(), nullptr, 0, nullptr, 0, &trap)) {
+            int exitCode;
+            if (wasmtime_error_exit_status(error, &exitCode))
+                _exit(exitCode);
+            throw Error("WASI builder '%s' failed: %s", drv.builder, wasmtime::Error(error).message());
+        }
+        if (trap)
+            throw Error("WASI builder '%s' trapped: %s", drv.builder, Trap(trap).message());
 
         _exit(0);
     }
@@ -0,0 +1,58 @@
+#include "nix/store/wasm.hh"
+#include "nix/util/file-system.hh"
+#include "nix/util/hash.hh"
+#include "nix/util/logging.hh"
+#include "nix/util/users.hh"
+
+namespace nix {
+
+WasmCompileCacheStats wasmCompileCacheStats;
+
+static std::filesystem::path getWasmCacheDir()
+{
+    return getCacheDir() / "wasm-modules-v1";
+}
+
+wasmtime::Module compileWasmModule(wasmtime::Engine & engine, std::string_view engineConfig, std::string_view wasm)
+{
+    auto contentHash = hashString(HashAlgorithm::SHA256, wasm);
+
+    auto key = hashString(
+        HashAlgorithm::SHA256,
+        fmt("wasmtime-%s\n%s\n%s", WASMTIME_VERSION, engineConfig, contentHash.to_string(HashFormat::Nix32, false)));
+
+    auto cacheFile = getWasmCacheDir() / (key.to_string(HashFormat::Nix32, false) + ".cwasm");
+
+    try {
+        if (pathExists(cacheFile)) {
+            auto data = readFile(cacheFile);
+            auto res = wasmtime::Module::deserialize(engine, string2span(data));
+            if (res) {
+                wasmCompileCacheStats.hits++;
+                debug("loaded precompiled WASM module from '%s'", cacheFile.string());
+                return res.ok();
+            }
+            debug("cannot deserialize '%s': %s", cacheFile.string(), res.err().message());
+        }
+    } catch (SystemError & e) {
+        debug("cannot read WASM cache entry '%s': %s", cacheFile.string(), e.what());
+    }
+
+    wasmCompileCacheStats.misses++;
+
+    auto module = unwrap(wasmtime::Module::compile(engine, string2span(wasm)));
+
+    try {
+        auto data = unwrap(module.serialize());
+        createDirs(cacheFile.parent_path());
+        auto tmpFile = makeTempPath(cacheFile);
+        writeFile(tmpFile, std::string_view((const char *) data.data(), data.size()));
+        std::filesystem::rename(tmpFile, cacheFile);
+    } catch (std::exception & e) {
+        debug("cannot write WASM cache entry '%s': %s", cacheFile.string(), e.what());
+    }
+
+    return module;
+}
+
+} // namespace nix
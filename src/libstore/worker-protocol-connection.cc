@@ -85,10 +85,12 @@ WorkerProto::BasicClientConnection::processStderrReturn(Sink * sink, Source * so
             auto fields = readFields(from);
             auto parent = readNum<ActivityId>(from);
             logger->startActivity(act, lvl, type, s, fields, parent);
+            traceActivityStart(act, type, s);
         }
 
         else if (msg == STDERR_STOP_ACTIVITY) {
             auto act = readNum<ActivityId>(from);
+            traceActivityStop(act);
             logger->stopActivity(act);
         }
 
@@ -97,6 +99,7 @@ WorkerProto::BasicClientConnection::processStderrReturn(Sink * sink, Source * so
             auto type = (ResultType) readInt(from);
             auto fields = readFields(from);
             logger->result(act, type, fields);
+            traceActivityResult(act, type, fields);
         }
 
         else if (msg == STDERR_LAST) {
@@ -239,14 +239,21 @@ struct Activity
         result(type, fields);
     }
 
-    void result(ResultType type, const Logger::Fields & fields) const
-    {
-        logger.result(id, type, fields);
-    }
+    void result(ResultType type, const Logger::Fields & fields) const;
 
     friend class Logger;
 };
 
+/**
+ * Record the start, results and end of an activity in the trace
+ * events, if `--trace-events` is enabled. `Activity` calls these
+ * itself; code that passes on activities from elsewhere to `logger`,
+ * like the daemon client, must call them too.
+ */
+void traceActivityStart(ActivityId act, ActivityType type, std::string_view s);
+void traceActivityResult(ActivityId act, ResultType type, const Logger::Fields & fields);
+void traceActivityStop(ActivityId act);
+
 struct PushActivity
 {
     const ActivityId prevAct;
@@ -0,0 +1,83 @@
+#pragma once
+/**
+ * @file
+ *
+ * Timeline tracing in the [Chrome trace event
+ * format](https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU),
+ * which can be viewed with [Perfetto](https://ui.perfetto.dev) or
+ * `chrome://tracing`.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+
+namespace nix {
+
+/**
+ * Whether trace events are being recorded. Checked before doing any
+ * work to record an event.
+ */
+extern std::atomic<bool> traceEventsEnabled;
+
+/**
+ * Start writing trace events to `path`. The file is finished when
+ * the process exits, and events recorded after that are dropped.
+ */
+void startTraceEvents(const std::filesystem::path & path);
+
+/**
+ * Name the current thread in the trace.
+ */
+void setTraceThreadName(std::string_view name);
+
+/**
+ * Record the start of an asynchronous event, i.e. one that doesn't
+ * nest with the other events of a thread, such as a build or a
+ * substitution.
+ */
+void traceAsyncBegin(uint64_t id, std::string_view category, std::string_view name);
+
+/**
+ * Record the end of an asynchronous event started with
+ * `traceAsyncBegin()`.
+ */
+void traceAsyncEnd(uint64_t id);
+
+/**
+ * Record a named point in time within the asynchronous event `id`,
+ * such as the start of a build phase.
+ */
+void traceAsyncInstant(uint64_t id, std::string_view name);
+
+/**
+ * A span of time on the current thread, recorded when it is
+ * destroyed.
+ */
+class TraceSpan
+{
+    const char * category;
+    std::string name;
+    std::chrono::steady_clock::time_point start;
+
+public:
+
+    TraceSpan(const char * category, std::string_view name)
+        : category(traceEventsEnabled.load(std::memory_order_relaxed) ? category : nullptr)
+    {
+        if (this->category) [[unlikely]] {
+            this->name = name;
+            start = std::chrono::steady_clock::now();
+        }
+    }
+
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan & operator=(const TraceSpan &) = delete;
+
+    ~TraceSpan();
+};
+
+} // namespace nix
@@ -8,6 +8,7 @@
 #include "nix/util/position.hh"
 #include "nix/util/sync.hh"
 #include "nix/util/unix-domain-socket.hh"
+#include "nix/util/trace-events.hh"
 
 #include <atomic>
 #include <sstream>
@@ -169,6 +170,42 @@ std::unique_ptr<Logger> makeSimpleLogger(bool printBuildLogs)
 
 std::atomic<uint64_t> nextId{0};
 
+static std::string_view showActivityType(ActivityType type)
+{
+    switch (type) {
+    case actUnknown:
+        return "unknown";
+    case actCopyPath:
+        return "copy-path";
+    case actFileTransfer:
+        return "file-transfer";
+    case actRealise:
+        return "realise";
+    case actCopyPaths:
+        return "copy-paths";
+    case actBuilds:
+        return "builds";
+    case actBuild:
+        return "build";
+    case actOptimiseStore:
+        return "optimise-store";
+    case actVerifyPaths:
+        return "verify-paths";
+    case actSubstitute:
+        return "substitute";
+    case actQueryPathInfo:
+        return "query-path-info";
+    case actPostBuildHook:
+        return "post-build-hook";
+    case actBuildWaiting:
+        return "build-waiting";
+    case actFetchTree:
+        return "fetch-tree";
+    }
+    /* Activity types from a remote daemon may be newer than ours. */
+    return "unknown";
+}
+
 static uint64_t getPid()
 {
 #ifndef _WIN32
@@ -189,6 +226,32 @@ Activity::Activity(
     , id(nextId++ + (((uint64_t) getPid()) << 32))
 {
     logger.startActivity(id, lvl, type, s, fields, parent);
+    traceActivityStart(id, type, s);
+}
+
+void Activity::result(ResultType type, const Logger::Fields & fields) const
+{
+    logger.result(id, type, fields);
+    traceActivityResult(id, type, fields);
+}
+
+void traceActivityStart(ActivityId act, ActivityType type, std::string_view s)
+{
+    if (traceEventsEnabled.load(std::memory_order_relaxed)) [[unlikely]]
+        traceAsyncBegin(act, showActivityType(type), s);
+}
+
+void traceActivityResult(ActivityId act, ResultType type, const Logger::Fields & fields)
+{
+    if (traceEventsEnabled.load(std::memory_order_relaxed) && type == resSetPhase && !fields.empty()
+        && fields[0].type == Logger::Field::tString) [[unlikely]]
+        traceAsyncInstant(act, fields[0].s);
+}
+
+void traceActivityStop(ActivityId act)
+{
+    if (traceEventsEnabled.load(std::memory_order_relaxed)) [[unlikely]]
+        traceAsyncEnd(act);
 }
 
 void to_json(nlohmann::json & json, std::shared_ptr<const Pos> pos)
@@ -482,6 +545,7 @@ bool handleJSONLogMessage(
 Activity::~Activity()
 {
     try {
+        traceActivityStop(id);
         logger.stopActivity(id);
     } catch (...) {
         ignoreExceptionInDestructor();
@@ -0,0 +1,237 @@
+#include "nix/util/trace-events.hh"
+#include "nix/util/file-descriptor.hh"
+#include "nix/util/sync.hh"
+#include "nix/util/error.hh"
+#include "nix/util/util.hh"
+
+#include <map>
+#include <memory>
+
+#include <fcntl.h>
+#ifndef _WIN32
+#  include <unistd.h>
+#endif
+
+#include <nlohmann/json.hpp>
+
+namespace nix {
+
+std::atomic<bool> traceEventsEnabled{false};
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct TraceEventsFile
+{
+    /* Write to the file in chunks of this size. */
+    static constexpr size_t bufferSize = 1 << 20;
+
+    struct State
+    {
+        AutoCloseFD fd;
+        std::string buffer;
+        bool first = true;
+
+        /**
+         * The category and name of the asynchronous events in
+         * progress.
+         */
+        std::map<uint64_t, std::pair<std::string, std::string>> async;
+    };
+
+    Sync<State> state_;
+
+    const Clock::time_point epoch = Clock::now();
+
+#ifndef _WIN32
+    const uint64_t pid = getpid();
+#else
+    const uint64_t pid = GetCurrentProcessId();
+#endif
+
+    TraceEventsFile(const std::filesystem::path & path)
+    {
+        auto state(state_.lock());
+        state->fd = toDescriptor(open(path.string().c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644));
+        if (!state->fd)
+            throw SysError("opening file %s", path);
+        state->buffer = "[\n";
+    }
+
+    /**
+     * Write the end of the file and close it. Events recorded
+     * afterwards are dropped.
+     */
+    void finish()
+    {
+        auto state(state_.lock());
+        if (!state->fd)
+            return;
+        state->buffer += "\n]\n";
+        writeFull(state->fd.get(), state->buffer, false);
+        state->buffer.clear();
+        state->fd.close();
+    }
+
+    double timestamp(Clock::time_point t) const
+    {
+        return std::chrono::duration<double, std::micro>(t - epoch).count();
+    }
+
+    void add(State & state, nlohmann::json && event)
+    {
+        if (!state.fd)
+            return;
+        event["pid"] = pid;
+        if (!state.first)
+            state.buffer += ",\n";
+        state.first = false;
+        /* Names can come from arbitrary input (like store paths or
+           activity descriptions), so don't throw on invalid UTF-8. */
+        state.buffer += event.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+        if (state.buffer.size() >= bufferSize) {
+            writeFull(state.fd.get(), state.buffer, false);
+            state.buffer.clear();
+        }
+    }
+};
+
+/* Never freed, since other threads may still record events while the
+   process exits. */
+std::atomic<TraceEventsFile *> traceEventsFile{nullptr};
+
+std::atomic<uint64_t> nextThreadId{1};
+
+thread_local uint64_t traceThreadId = nextThreadId++;
+
+} // namespace
+
+void startTraceEvents(const std::filesystem::path & path)
+{
+    if (auto previous = traceEventsFile.exchange(new TraceEventsFile(path)))
+        previous->finish();
+    traceEventsEnabled = true;
+    setTraceThreadName("main");
+
+    /* Make sure that the file is finished before the other static
+       objects are destroyed. This takes the same lock as writing an
+       event, so it's safe even if other threads are still running. */
+    static bool registered = false;
+    if (!registered) {
+        registered = true;
+        std::atexit([]() {
+            traceEventsEnabled = false;
+            try {
+                traceEventsFile.load()->finish();
+            } catch (...) {
+                ignoreExceptionInDestructor();
+            }
+        });
+    }
+}
+
+void setTraceThreadName(std::string_view name)
+{
+    if (!traceEventsEnabled.load(std::memory_order_relaxed))
+        return;
+    auto & file = *traceEventsFile.load();
+    file.add(
+        *file.state_.lock(),
+        {
+            {"name", "thread_name"},
+            {"ph", "M"},
+            {"tid", traceThreadId},
+            {"args", {{"name", name}}},
+        });
+}
+
+void traceAsyncBegin(uint64_t id, std::string_view category, std::string_view name)
+{
+    if (!traceEventsEnabled.load(std::memory_order_relaxed))
+        return;
+    auto & file = *traceEventsFile.load();
+    auto now = Clock::now();
+    auto state(file.state_.lock());
+    state->async.insert_or_assign(id, std::pair{std::string(category), std::string(name)});
+    file.add(
+        *state,
+        {
+            {"name", name},
+            {"cat", category},
+            {"ph", "b"},
+            {"id", id},
+            {"ts", file.timestamp(now)},
+            {"tid", traceThreadId},
+        });
+}
+
+void traceAsyncEnd(uint64_t id)
+{
+    if (!traceEventsEnabled.load(std::memory_order_relaxed))
+        return;
+    auto & file = *traceEventsFile.load();
+    auto now = Clock::now();
+    auto state(file.state_.lock());
+    auto i = state->async.find(id);
+    if (i == state->async.end())
+        return;
+    auto [category, name] = std::move(i->second);
+    state->async.erase(i);
+    file.add(
+        *state,
+        {
+            {"name", name},
+            {"cat", category},
+            {"ph", "e"},
+            {"id", id},
+            {"ts", file.timestamp(now)},
+            {"tid", traceThreadId},
+        });
+}
+
+void traceAsyncInstant(uint64_t id, std::string_view name)
+{
+    if (!traceEventsEnabled.load(std::memory_order_relaxed))
+        return;
+    auto & file = *traceEventsFile.load();
+    auto now = Clock::now();
+    auto state(file.state_.lock());
+    auto i = state->async.find(id);
+    if (i == state->async.end())
+        return;
+    file.add(
+        *state,
+        {
+            {"name", name},
+            {"cat", i->second.first},
+            {"ph", "n"},
+            {"id", id},
+            {"ts", file.timestamp(now)},
+            {"tid", traceThreadId},
+        });
+}
+
+TraceSpan::~TraceSpan()
+{
+    if (!category || !traceEventsEnabled.load(std::memory_order_relaxed)) [[likely]]
+        return;
+    try {
+        auto & file = *traceEventsFile.load();
+        auto end = Clock::now();
+        file.add(
+            *file.state_.lock(),
+            {
+                {"name", name},
+                {"cat", category},
+                {"ph", "X"},
+                {"ts", file.timestamp(start)},
+                {"dur", std::chrono::duration<double, std::micro>(end - start).count()},
+                {"tid", traceThreadId},
+            });
+    } catch (...) {
+        ignoreExceptionInDestructor();
+    }
+}
+
+} // namespace nix
@@ -2,6 +2,7 @@
 #include "nix/main/common-args.hh"
 #include "nix/main/shared.hh"
 #include "nix/store/store-api.hh"
+#include "nix/util/serialise.hh"
 #include "nix/expr/eval.hh"
 #include "nix/expr/eval-inline.hh"
 #include "nix/expr/value-to-json.hh"
@@ -122,8 +123,16 @@ struct CmdEval : MixJSON, InstallableValueCommand, MixReadOnlyOption
 
         else if (json) {
             // FIXME: use printJSON
-            auto j = printValueAsJSON(*state, true, *v, pos, context, false);
-            logger->cout("%s", state->devirtualize(outputPretty ? j.dump(2) : j.dump(), context));
+            if (outputPretty) {
+                auto j = printValueAsJSON(*state, true, *v, pos, context, false);
+                logger->cout("%s", state->devirtualize(j.dump(2), context));
+            } else {
+                /* Devirtualization needs the complete context, so
+                   buffer the output rather than streaming it. */
+                StringSink sink;
+                printValueAsJSON(*state, true, *v, pos, sink, context, false);
+                logger->cout("%s", state->devirtualize(sink.s, context));
+            }
         }
 
         else {
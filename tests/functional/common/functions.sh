@@ -382,4 +382,21 @@ createGitRepo() {
     initGitRepo "$repo" $extraArgs
 }
 
+# Evaluate `nix-instantiate "$@"` with the setting $1 enabled and then
+# disabled, check that both give the same output and print it. The
+# statistics of the two evaluations are written to $2-on.json and
+# $2-off.json.
+evalWithSettingOnOff() {
+    local setting="$1"
+    local stats="$2"
+    shift 2
+    local on off
+    on=$(NIX_SHOW_STATS=1 NIX_SHOW_STATS_PATH="$stats-on.json" nix-instantiate --option "$setting" true "$@") \
+        || fail "evaluation with '$setting' enabled failed"
+    off=$(NIX_SHOW_STATS=1 NIX_SHOW_STATS_PATH="$stats-off.json" nix-instantiate --option "$setting" false "$@") \
+        || fail "evaluation with '$setting' disabled failed"
+    [[ "$on" == "$off" ]] || fail "output with '$setting' enabled differs from the output with it disabled"
+    echo "$on"
+}
+
 fi # COMMON_FUNCTIONS_SH_SOURCED
@@ -0,0 +1,42 @@
+#!/usr/bin/env bash
+
+source common.sh
+
+TODO_NixOS
+
+clearStore
+
+cacheFile="$TEST_HOME/.cache/nix/drv-hashes-v1.sqlite"
+rm -f "$cacheFile"*
+
+drvPath=$(nix-instantiate dependencies.nix)
+[[ -e "$cacheFile" ]]
+if [[ -n "$(type -p sqlite3)" ]]; then
+    [[ $(sqlite3 "$cacheFile" 'select count(*) from DrvHashes') -gt 0 ]]
+fi
+
+# A later evaluation that depends on the derivation without creating
+# it gets its hash from the cache instead of reading its closure.
+expr="derivation {
+  name = \"uses-dependencies\";
+  system = builtins.currentSystem;
+  builder = \"/bin/sh\";
+  dep = builtins.appendContext \"\" { \"$drvPath\" = { outputs = [ \"out\" ]; }; };
+}"
+NIX_SHOW_STATS=1 NIX_SHOW_STATS_PATH="$TEST_ROOT/stats.json" nix-instantiate --expr "$expr" > /dev/null
+[[ $(jq .drvHashCache.hits "$TEST_ROOT/stats.json") -gt 0 ]]
+[[ $(jq .drvHashCache.misses "$TEST_ROOT/stats.json") = 0 ]]
+
+nix derivation show "$drvPath" | jq '.derivations[]' > "$TEST_ROOT/dependencies.json"
+
+# Adding the derivation checks its invariants, which hashes its input
+# derivations without the cache. That must agree with the hashes the
+# evaluator got from the cache.
+[[ "$(nix-instantiate dependencies.nix)" = "$drvPath" ]]
+drvPath2=$(nix derivation add < "$TEST_ROOT/dependencies.json")
+[[ "$drvPath" = "$drvPath2" ]]
+
+# Cached hashes of derivations that were removed from the store are
+# only used once the evaluator has written them again.
+clearStore
+[[ "$(nix-instantiate dependencies.nix)" = "$drvPath" ]]
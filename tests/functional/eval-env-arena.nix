@@ -0,0 +1,19 @@
+let
+  # Doesn't capture its environment.
+  inc = x: x + 1;
+  # Captures it in the thunk for the argument of the outer call.
+  twice = x: inc (inc x);
+  # The outer function captures it in a closure; the inner one doesn't.
+  adder = x: y: x + y;
+  # Captures it in the thunks for the list elements.
+  pair = { a, b ? a }: { first = a; second = [ b (a + b) ]; };
+  # Captures it in a `with` environment.
+  withArg = x: with x; a;
+in [
+  (builtins.foldl' (acc: x: acc + inc x) 0 (builtins.genList (x: x) 1000))
+  (twice 1)
+  (adder 1 2)
+  (builtins.map (adder 10) [ 1 2 3 ])
+  (pair { a = 1; })
+  (withArg { a = 2; })
+]
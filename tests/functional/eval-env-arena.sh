@@ -0,0 +1,26 @@
+#!/usr/bin/env bash
+
+source common.sh
+
+expected='[500500,3,3,[11,12,13],{"first":1,"second":[1,2]},2]'
+
+[[ $(evalWithSettingOnOff eval-env-arena "$TEST_ROOT/stats" --eval --strict --json eval-env-arena.nix) = "$expected" ]]
+[[ $(jq .envs.arena "$TEST_ROOT/stats-on.json") -gt 1000 ]]
+[[ $(jq .envs.arenaBytes "$TEST_ROOT/stats-on.json") -gt 0 ]]
+[[ $(jq .envs.arena "$TEST_ROOT/stats-off.json") = 0 ]]
+
+# Environments that are freed early don't show up in the heap statistics.
+[[ $(jq .envs.number "$TEST_ROOT/stats-on.json") -lt $(jq .envs.number "$TEST_ROOT/stats-off.json") ]]
+
+# The arena is disabled by default.
+[[ $(NIX_SHOW_STATS=1 NIX_SHOW_STATS_PATH="$TEST_ROOT/stats-default.json" \
+    nix-instantiate --eval --strict --json eval-env-arena.nix) = "$expected" ]]
+[[ $(jq .envs.arena "$TEST_ROOT/stats-default.json") = 0 ]]
+
+# A default that refers to a later formal is a thunk over the call
+# environment, which escapes here through `g`.
+expr='let g = x: { inherit x; }; in (({ a ? b, b ? 1 }: g a) {}).x'
+[[ $(nix-instantiate --option eval-env-arena true --eval --expr "$expr") = 1 ]]
+# Reuse the frame between calls to catch a stale thunk.
+expr='let g = x: { inherit x; }; f = { a ? b, b ? 1 }: g a; in builtins.map (i: (f {}).x + i) [ 1 2 3 ]'
+[[ $(nix-instantiate --option eval-env-arena true --eval --strict --json --expr "$expr") = '[2,3,4]' ]]
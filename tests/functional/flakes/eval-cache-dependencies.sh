@@ -0,0 +1,67 @@
+#!/usr/bin/env bash
+
+source ./common.sh
+
+requireGit
+
+flakeDir="$TEST_ROOT/eval-cache-dependencies"
+
+createGitRepo "$flakeDir" ""
+cp "${config_nix}" "$flakeDir/"
+
+cat >"$flakeDir/flake.nix" <<EOF
+{
+  outputs = { self }: let inherit (import ./config.nix) mkDerivation; in {
+    foo = mkDerivation {
+      name = "foo";
+      buildCommand = ''
+        echo \${toString (import ./a.nix)} > \$out
+      '';
+    };
+    bar = mkDerivation {
+      name = "bar";
+      buildCommand = ''
+        echo \${toString (import ./b.nix)} > \$out
+      '';
+    };
+    withSelf = mkDerivation {
+      name = "with-self";
+      buildCommand = ''
+        cat \${self}/a.nix > \$out
+      '';
+    };
+  };
+}
+EOF
+
+echo 1 > "$flakeDir/a.nix"
+echo 2 > "$flakeDir/b.nix"
+
+git -C "$flakeDir" add flake.nix config.nix a.nix b.nix
+git -C "$flakeDir" commit -m "Init"
+
+opts=(--no-link --option eval-cache-dependencies true)
+
+nix build "${opts[@]}" "$flakeDir#foo" "$flakeDir#withSelf"
+
+# Changing a file that 'foo' doesn't depend on doesn't invalidate it.
+echo 3 > "$flakeDir/b.nix"
+git -C "$flakeDir" commit -a -m "Change b.nix"
+NIX_ALLOW_EVAL=0 nix build "${opts[@]}" "$flakeDir#foo"
+
+# But 'withSelf' refers to the flake itself, so it is invalidated.
+expect 1 env NIX_ALLOW_EVAL=0 nix build "${opts[@]}" "$flakeDir#withSelf" 2>&1 \
+  | grepQuiet 'not everything is cached'
+
+# Changing a file that 'foo' depends on invalidates it.
+echo 4 > "$flakeDir/a.nix"
+git -C "$flakeDir" commit -a -m "Change a.nix"
+expect 1 env NIX_ALLOW_EVAL=0 nix build "${opts[@]}" "$flakeDir#foo" 2>&1 \
+  | grepQuiet 'not everything is cached'
+[[ $(cat "$(nix build "${opts[@]}" --print-out-paths "$flakeDir#foo")") = 4 ]]
+
+# Without the setting, nothing is reused across versions.
+echo 5 > "$flakeDir/b.nix"
+git -C "$flakeDir" commit -a -m "Change b.nix again"
+expect 1 env NIX_ALLOW_EVAL=0 nix build --no-link "$flakeDir#foo" 2>&1 \
+  | grepQuiet 'not everything is cached'
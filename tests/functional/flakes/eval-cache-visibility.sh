@@ -0,0 +1,59 @@
+#!/usr/bin/env bash
+
+source ./common.sh
+
+requireGit
+
+flakeDir="$TEST_ROOT/eval-cache-visibility"
+
+createGitRepo "$flakeDir" ""
+cp "${config_nix}" "$flakeDir/"
+
+# Write and commit a flake with $2 packages, named after $1.
+writeFlake() {
+    cat >"$flakeDir/flake.nix" <<EOF
+{
+  outputs = { self }: let inherit (import ./config.nix) mkDerivation; in {
+    packages.$system = builtins.listToAttrs (builtins.genList (n: {
+      name = "pkg\${toString n}";
+      value = mkDerivation {
+        name = "pkg\${toString n}-$1";
+        buildCommand = "touch \$out";
+        meta.description = "package \${toString n}";
+      };
+    }) $2);
+  };
+}
+EOF
+    git -C "$flakeDir" add flake.nix config.nix
+    git -C "$flakeDir" commit -m "$1"
+}
+
+search() {
+    nix search --json "$flakeDir" ^ | jq -S .
+}
+
+writeFlake v1 20
+
+# Cache one package, so that the search below finds the package set
+# in the database, adds the other packages to it and reads them back
+# in the same process, before its writes are committed.
+nix build --dry-run "$flakeDir#pkg3"
+search > "$TEST_ROOT/search1.json"
+[[ $(jq length "$TEST_ROOT/search1.json") = 20 ]]
+
+# All of that was committed.
+NIX_ALLOW_EVAL=0 search > "$TEST_ROOT/search2.json"
+diff "$TEST_ROOT/search1.json" "$TEST_ROOT/search2.json"
+
+# Two processes that fill in a new cache at the same time agree with
+# each other, and together leave a complete cache.
+writeFlake v2 30
+search > "$TEST_ROOT/search3.json" &
+pid=$!
+search > "$TEST_ROOT/search4.json"
+wait "$pid"
+[[ $(jq length "$TEST_ROOT/search3.json") = 30 ]]
+diff "$TEST_ROOT/search3.json" "$TEST_ROOT/search4.json"
+NIX_ALLOW_EVAL=0 search > "$TEST_ROOT/search5.json"
+diff "$TEST_ROOT/search3.json" "$TEST_ROOT/search5.json"
@@ -0,0 +1,8 @@
+#!/usr/bin/env bash
+
+# Run the language tests with function bodies evaluated by the
+# bytecode interpreter. They must produce the same output.
+
+export NIX_CONFIG="eval-bytecode = true"$'\n'"${NIX_CONFIG:-}"
+
+source lang.sh
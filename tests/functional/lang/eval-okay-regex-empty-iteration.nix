@@ -0,0 +1,9 @@
+# A group inside a repetition whose iterations can be empty keeps the
+# last non-empty iteration, rather than the trailing empty one that
+# the `std::regex` matcher used by earlier versions reported.
+[
+  (builtins.match "(a*)*" "aaa")
+  (builtins.match "(a*)*" "")
+  (builtins.match "(a*)*b" "aab")
+  (builtins.match "(a*)*" "b")
+]
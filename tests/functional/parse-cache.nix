@@ -0,0 +1,11 @@
+let
+  src = { a = 1; b = "x"; };
+  /** Doc comment. */
+  f = { b, a ? 2, ... }@args: a + builtins.length (builtins.attrNames args);
+in rec {
+  inherit (src) a b;
+  c = f { inherit a b; };
+  d = "${b}-${toString c}";
+  e = toString ./parse-cache.nix;
+  g = with src; [ a b (src ? a) (src.c or 3) ];
+}
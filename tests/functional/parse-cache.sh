@@ -0,0 +1,22 @@
+#!/usr/bin/env bash
+
+source common.sh
+
+cacheDir=$TEST_HOME/.cache/nix/ast-v1
+rm -rf "$cacheDir"
+
+# The first evaluation parses the file and stores its syntax tree.
+evalWithSettingOnOff parse-cache "$TEST_ROOT/stats1" --eval --strict --json parse-cache.nix > /dev/null
+[[ $(jq .parser.filesLoaded "$TEST_ROOT/stats1-on.json") = 0 ]]
+[[ -n $(ls "$cacheDir") ]]
+
+# The second evaluation loads it from the cache.
+expected=$(evalWithSettingOnOff parse-cache "$TEST_ROOT/stats2" --eval --strict --json parse-cache.nix)
+[[ $(jq .parser.filesLoaded "$TEST_ROOT/stats2-on.json") = 1 ]]
+
+# Positions survive the round trip.
+nix eval --option parse-cache true --impure --expr 'builtins.unsafeGetAttrPos "a" (import ./parse-cache.nix)' | grepQuiet 'line = 6'
+
+# Corrupt entries are ignored.
+for f in "$cacheDir"/*; do echo garbage > "$f"; done
+[[ $(nix-instantiate --option parse-cache true --eval --strict --json parse-cache.nix) = "$expected" ]]
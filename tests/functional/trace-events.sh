@@ -0,0 +1,30 @@
+#!/usr/bin/env bash
+
+source common.sh
+
+clearStoreIfPossible
+
+traceFile="$TEST_ROOT/trace.json"
+
+# Evaluating a file records parse and eval spans for it.
+nix-instantiate --trace-events "$traceFile" --eval ./simple.nix > /dev/null
+jq -e 'map(select(.ph == "X" and .cat == "parse")) | length > 0' < "$traceFile"
+jq -e 'map(select(.ph == "X" and .cat == "eval" and (.name | endswith("simple.nix")))) | length > 0' < "$traceFile"
+jq -e 'map(select(.ph == "M" and .args.name == "main")) | length == 1' < "$traceFile"
+
+# Builds are recorded as asynchronous events that begin and end.
+nix-build --trace-events "$traceFile" --no-out-link ./simple.nix > /dev/null
+jq -e 'map(select(.cat == "build" and .ph == "b")) | length > 0' < "$traceFile"
+jq -e '(map(select(.ph == "b")) | length) == (map(select(.ph == "e")) | length)' < "$traceFile"
+
+# Activities that a daemon relays to the client, like the builds it
+# runs, are recorded as well. Their IDs start with the daemon's PID.
+if ! isTestOnNixOS; then
+    clearStore
+    startDaemon
+    nix-build --trace-events "$traceFile" --no-out-link ./simple.nix > /dev/null
+    jq -e --argjson pid "$_NIX_TEST_DAEMON_PID" \
+        'map(select(.cat == "build" and .ph == "b" and (.id / 4294967296 | floor) == $pid)) | length > 0' < "$traceFile"
+    jq -e '(map(select(.ph == "b")) | length) == (map(select(.ph == "e")) | length)' < "$traceFile"
+    killDaemon
+fi
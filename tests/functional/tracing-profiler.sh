@@ -0,0 +1,18 @@
+#!/usr/bin/env bash
+
+source common.sh
+
+profile="$TEST_ROOT/tracing.profile"
+
+nix-instantiate --eval \
+    --eval-profiler tracing \
+    --eval-profile-file "$profile" \
+    --expr 'let f = n: builtins.genList (x: { inherit x; }) n; in builtins.length (f 1000)'
+
+# Every call is recorded, with the time spent in it in nanoseconds.
+grepQuiet '^«string»:1:[0-9]*:f [0-9][0-9]*$' "$profile"
+grepQuiet '^«string»:1:[0-9]*:f;«string»:1:[0-9]*:primop genList [0-9][0-9]*$' "$profile"
+
+# Allocations are attributed to the call that made them.
+grepQuiet '^«string»:1:[0-9]*:f;«string»:1:[0-9]*:primop genList;«lists» [0-9][0-9]*$' "$profile.alloc"
+grepQuiet '^«string»:1:[0-9]*:f;«string»:1:[0-9]*:primop genList;«values» [0-9][0-9]*$' "$profile.alloc"
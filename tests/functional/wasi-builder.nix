@@ -0,0 +1,46 @@
+with import ./config.nix;
+
+let
+  mkWasiDerivation =
+    name:
+    derivation {
+      inherit name;
+      system = "wasm32-wasip1";
+      builder = ./wasi-builder.wasm;
+      args = [ (builtins.placeholder "out") ];
+    };
+in
+
+{
+  single = mkWasiDerivation "wasi-hello";
+
+  # Many tiny builds that share the same builder module.
+  many = builtins.genList (n: mkWasiDerivation "wasi-hello-${toString n}") 50;
+
+  # A regular build that only finishes once some WASI builds have
+  # finished, without depending on them. With a single max-jobs slot,
+  # it can only succeed if the WASI builds run alongside it.
+  overlap =
+    let
+      wasiDrvs = builtins.genList (n: mkWasiDerivation "wasi-overlap-${toString n}") 10;
+    in
+    [
+      (mkDerivation {
+        name = "wait-for-wasi";
+        wasiOutputs = map (drv: builtins.unsafeDiscardStringContext drv.outPath) wasiDrvs;
+        buildCommand = ''
+          for i in $(seq 600); do
+            ready=1
+            for p in $wasiOutputs; do
+              [ -e "$p" ] || ready=
+            done
+            [ -z "$ready" ] || break
+            sleep 0.1
+          done
+          [ -n "$ready" ]
+          touch $out
+        '';
+      })
+    ]
+    ++ wasiDrvs;
+}
@@ -0,0 +1,27 @@
+#!/usr/bin/env bash
+
+source common.sh
+
+clearStoreIfPossible
+
+# The builder writes its output through the preopened store directory
+# and needs the preopened temporary directory to succeed.
+outPath=$(nix-build --no-out-link wasi-builder.nix -A single)
+[[ $(cat "$outPath") = "hello from wasi" ]]
+
+# Builds that share a builder reuse the compiled module.
+nix-build --no-out-link -j8 wasi-builder.nix -A many | while read -r outPath; do
+    [[ $(cat "$outPath") = "hello from wasi" ]]
+done
+
+# WASI builds run in-process and don't take up a max-jobs slot; they
+# are limited by max-wasi-jobs instead.
+clearStore
+nix-build --no-out-link -j1 --option max-wasi-jobs 2 wasi-builder.nix -A many | while read -r outPath; do
+    [[ $(cat "$outPath") = "hello from wasi" ]]
+done
+
+# A regular build that waits for WASI builds holds the only max-jobs
+# slot while they run.
+clearStore
+nix-build --no-out-link -j1 wasi-builder.nix -A overlap > /dev/null
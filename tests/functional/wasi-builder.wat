@@ -0,0 +1,50 @@
+;; A minimal wasm32-wasip1 builder. It creates a file in the build's
+;; temporary directory and writes "hello from wasi" to the path given
+;; as its first argument. It expects the store directory to be
+;; preopened as fd 3 and the temporary directory as fd 4.
+;;
+;; wasi-builder.wasm is the binary encoding of this file. It can be
+;; regenerated with `wasm-tools parse wasi-builder.wat -o wasi-builder.wasm`.
+(module
+  (import "wasi_snapshot_preview1" "args_sizes_get" (func $args_sizes_get (param i32 i32) (result i32)))
+  (import "wasi_snapshot_preview1" "args_get" (func $args_get (param i32 i32) (result i32)))
+  (import "wasi_snapshot_preview1" "path_open"
+    (func $path_open (param i32 i32 i32 i32 i32 i64 i64 i32 i32) (result i32)))
+  (import "wasi_snapshot_preview1" "fd_write" (func $fd_write (param i32 i32 i32 i32) (result i32)))
+  (import "wasi_snapshot_preview1" "proc_exit" (func $proc_exit (param i32)))
+
+  (memory (export "memory") 1)
+
+  ;; 8: iovec for the output contents, 16: opened fd, 20: bytes written
+  (data (i32.const 8) "\20\00\00\00\10\00\00\00")
+  (data (i32.const 32) "hello from wasi\n")
+  (data (i32.const 48) "scratch")
+
+  (func (export "_start")
+    (local $p i32) (local $i i32) (local $name i32) (local $c i32)
+
+    ;; argv pointers at 64, argument strings at 1024
+    (drop (call $args_sizes_get (i32.const 0) (i32.const 4)))
+    (drop (call $args_get (i32.const 64) (i32.const 1024)))
+
+    ;; Find the last path component of argv[1].
+    (local.set $name (local.tee $i (local.tee $p (i32.load (i32.const 68)))))
+    (block $done
+      (loop $next
+        (br_if $done (i32.eqz (local.tee $c (i32.load8_u (local.get $i)))))
+        (if (i32.eq (local.get $c) (i32.const 47))
+          (then (local.set $name (i32.add (local.get $i) (i32.const 1)))))
+        (local.set $i (i32.add (local.get $i) (i32.const 1)))
+        (br $next)))
+
+    ;; O_CREAT | O_TRUNC, rights: fd_write
+    (if (call $path_open (i32.const 4) (i32.const 0) (i32.const 48) (i32.const 7)
+          (i32.const 9) (i64.const 0x40) (i64.const 0) (i32.const 0) (i32.const 16))
+      (then (call $proc_exit (i32.const 1))))
+
+    (if (call $path_open (i32.const 3) (i32.const 0) (local.get $name) (i32.sub (local.get $i) (local.get $name))
+          (i32.const 9) (i64.const 0x40) (i64.const 0) (i32.const 0) (i32.const 16))
+      (then (call $proc_exit (i32.const 2))))
+
+    (if (call $fd_write (i32.load (i32.const 16)) (i32.const 8) (i32.const 1) (i32.const 20))
+      (then (call $proc_exit (i32.const 3))))))